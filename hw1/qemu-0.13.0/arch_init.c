@@ -111,19 +111,33 @@ static int ram_save_block(QEMUFile *f)
 {
     RAMBlock *block = last_block;
     ram_addr_t offset = last_offset;
-    ram_addr_t current_addr;
+    RAMBlock *start_block;
+    ram_addr_t start_offset;
+    ram_addr_t current_addr, end;
+    int wrapped = 0;
     int bytes_sent = 0;
 
     if (!block)
         block = QLIST_FIRST(&ram_list.blocks);
 
-    current_addr = block->offset + offset;
+    start_block = block;
+    start_offset = offset;
 
-    do {
-        if (cpu_physical_memory_get_dirty(current_addr, MIGRATION_DIRTY_FLAG)) {
+    for (;;) {
+        /* once we are back at the starting block, only its head is left */
+        if (wrapped && block == start_block) {
+            end = block->offset + start_offset;
+        } else {
+            end = block->offset + block->length;
+        }
+        current_addr = cpu_physical_memory_find_next_dirty(block->offset +
+                                                           offset, end,
+                                                           MIGRATION_DIRTY_FLAG);
+        if (current_addr < end) {
             uint8_t *p;
             int cont = (block == last_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
 
+            offset = current_addr - block->offset;
             cpu_physical_memory_reset_dirty(current_addr,
                                             current_addr + TARGET_PAGE_SIZE,
                                             MIGRATION_DIRTY_FLAG);
@@ -153,17 +167,19 @@ static int ram_save_block(QEMUFile *f)
             break;
         }
 
-        offset += TARGET_PAGE_SIZE;
-        if (offset >= block->length) {
-            offset = 0;
-            block = QLIST_NEXT(block, next);
-            if (!block)
-                block = QLIST_FIRST(&ram_list.blocks);
+        if (wrapped && block == start_block) {
+            /* no dirty page left anywhere */
+            offset = start_offset;
+            break;
         }
 
-        current_addr = block->offset + offset;
-
-    } while (current_addr != last_block->offset + last_offset);
+        offset = 0;
+        block = QLIST_NEXT(block, next);
+        if (!block)
+            block = QLIST_FIRST(&ram_list.blocks);
+        if (block == start_block)
+            wrapped = 1;
+    }
 
     last_block = block;
     last_offset = offset;
@@ -179,13 +195,8 @@ static ram_addr_t ram_save_remaining(void)
     ram_addr_t count = 0;
 
     QLIST_FOREACH(block, &ram_list.blocks, next) {
-        ram_addr_t addr;
-        for (addr = block->offset; addr < block->offset + block->length;
-             addr += TARGET_PAGE_SIZE) {
-            if (cpu_physical_memory_get_dirty(addr, MIGRATION_DIRTY_FLAG)) {
-                count++;
-            }
-        }
+        count += cpu_physical_memory_count_dirty(block->offset, block->length,
+                                                 MIGRATION_DIRTY_FLAG);
     }
 
     return count;
@@ -214,7 +225,6 @@ uint64_t ram_bytes_total(void)
 
 int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
 {
-    ram_addr_t addr;
     uint64_t bytes_transferred_last;
     double bwidth = 0;
     uint64_t expected_time = 0;
@@ -237,13 +247,8 @@ int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
 
         /* Make sure all dirty bits are set */
         QLIST_FOREACH(block, &ram_list.blocks, next) {
-            for (addr = block->offset; addr < block->offset + block->length;
-                 addr += TARGET_PAGE_SIZE) {
-                if (!cpu_physical_memory_get_dirty(addr,
-                                                   MIGRATION_DIRTY_FLAG)) {
-                    cpu_physical_memory_set_dirty(addr);
-                }
-            }
+            cpu_physical_memory_set_dirty_range(block->offset, block->length,
+                                                MIGRATION_DIRTY_FLAG);
         }
 
         /* Enable dirty memory tracking */
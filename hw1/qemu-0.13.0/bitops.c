@@ -0,0 +1,144 @@
+/*
+ * Bit operations on arrays of unsigned longs
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "qemu-common.h"
+#include "host-utils.h"
+#include "bitops.h"
+
+/* number of trailing zeroes; undefined for word == 0 */
+static inline unsigned long bitops_ctzl(unsigned long word)
+{
+    if (sizeof(unsigned long) == 4) {
+        return ctz32(word);
+    }
+    return ctz64(word);
+}
+
+static inline unsigned long bitops_ctpopl(unsigned long word)
+{
+    if (sizeof(unsigned long) == 4) {
+        return ctpop32(word);
+    }
+    return ctpop64(word);
+}
+
+unsigned long find_next_bit(const unsigned long *addr, unsigned long size,
+                            unsigned long offset)
+{
+    const unsigned long *p;
+    unsigned long word;
+
+    if (offset >= size) {
+        return size;
+    }
+    p = addr + BIT_WORD(offset);
+    /* mask off the bits below offset in the first word */
+    word = *p & (~0UL << (offset % BITS_PER_LONG));
+    offset -= offset % BITS_PER_LONG;
+    for (;;) {
+        if (word) {
+            offset += bitops_ctzl(word);
+            return offset < size ? offset : size;
+        }
+        offset += BITS_PER_LONG;
+        if (offset >= size) {
+            return size;
+        }
+        word = *++p;
+    }
+}
+
+void bitmap_set(unsigned long *map, unsigned long start, unsigned long nr)
+{
+    unsigned long *p = map + BIT_WORD(start);
+    unsigned long end = start + nr;
+    unsigned long mask = ~0UL << (start % BITS_PER_LONG);
+
+    if (nr == 0) {
+        return;
+    }
+    if (BIT_WORD(start) == BIT_WORD(end - 1)) {
+        mask &= ~0UL >> (BITS_PER_LONG - 1 - ((end - 1) % BITS_PER_LONG));
+        *p |= mask;
+        return;
+    }
+    *p++ |= mask;
+    start += BITS_PER_LONG - start % BITS_PER_LONG;
+    while (end - start >= BITS_PER_LONG) {
+        *p++ = ~0UL;
+        start += BITS_PER_LONG;
+    }
+    if (start < end) {
+        *p |= ~0UL >> (BITS_PER_LONG - (end - start));
+    }
+}
+
+void bitmap_clear(unsigned long *map, unsigned long start, unsigned long nr)
+{
+    unsigned long *p = map + BIT_WORD(start);
+    unsigned long end = start + nr;
+    unsigned long mask = ~0UL << (start % BITS_PER_LONG);
+
+    if (nr == 0) {
+        return;
+    }
+    if (BIT_WORD(start) == BIT_WORD(end - 1)) {
+        mask &= ~0UL >> (BITS_PER_LONG - 1 - ((end - 1) % BITS_PER_LONG));
+        *p &= ~mask;
+        return;
+    }
+    *p++ &= ~mask;
+    start += BITS_PER_LONG - start % BITS_PER_LONG;
+    while (end - start >= BITS_PER_LONG) {
+        *p++ = 0;
+        start += BITS_PER_LONG;
+    }
+    if (start < end) {
+        *p &= ~(~0UL >> (BITS_PER_LONG - (end - start)));
+    }
+}
+
+unsigned long bitmap_count_one(const unsigned long *map, unsigned long start,
+                               unsigned long nr)
+{
+    const unsigned long *p = map + BIT_WORD(start);
+    unsigned long end = start + nr;
+    unsigned long mask = ~0UL << (start % BITS_PER_LONG);
+    unsigned long count;
+
+    if (nr == 0) {
+        return 0;
+    }
+    if (BIT_WORD(start) == BIT_WORD(end - 1)) {
+        mask &= ~0UL >> (BITS_PER_LONG - 1 - ((end - 1) % BITS_PER_LONG));
+        return bitops_ctpopl(*p & mask);
+    }
+    count = bitops_ctpopl(*p++ & mask);
+    start += BITS_PER_LONG - start % BITS_PER_LONG;
+    while (end - start >= BITS_PER_LONG) {
+        count += bitops_ctpopl(*p++);
+        start += BITS_PER_LONG;
+    }
+    if (start < end) {
+        count += bitops_ctpopl(*p & (~0UL >> (BITS_PER_LONG - (end - start))));
+    }
+    return count;
+}
@@ -56,6 +56,8 @@ static int bdrv_read_em(BlockDriverState *bs, int64_t sector_num,
                         uint8_t *buf, int nb_sectors);
 static int bdrv_write_em(BlockDriverState *bs, int64_t sector_num,
                          const uint8_t *buf, int nb_sectors);
+static int bdrv_file_open_hints(BlockDriverState **pbs, const char *filename,
+    int flags, BlockDriverState *parent);
 
 static QTAILQ_HEAD(, BlockDriverState) bdrv_states =
     QTAILQ_HEAD_INITIALIZER(bdrv_states);
@@ -456,7 +458,7 @@ static int bdrv_open_common(BlockDriverState *bs, const char *filename,
     if (drv->bdrv_file_open) {
         ret = drv->bdrv_file_open(bs, filename, open_flags);
     } else {
-        ret = bdrv_file_open(&bs->file, filename, open_flags);
+        ret = bdrv_file_open_hints(&bs->file, filename, open_flags, bs);
         if (ret >= 0) {
             ret = drv->bdrv_open(bs, open_flags);
         }
@@ -494,7 +496,8 @@ free_and_fail:
 /*
  * Opens a file using a protocol (file, host_device, nbd, ...)
  */
-int bdrv_file_open(BlockDriverState **pbs, const char *filename, int flags)
+static int bdrv_file_open_hints(BlockDriverState **pbs, const char *filename,
+    int flags, BlockDriverState *parent)
 {
     BlockDriverState *bs;
     BlockDriver *drv;
@@ -506,6 +509,9 @@ int bdrv_file_open(BlockDriverState **pbs, const char *filename, int flags)
     }
 
     bs = bdrv_new("");
+    if (parent) {
+        bdrv_set_aio_hint(bs, parent->aio_max_events, parent->aio_poll);
+    }
     ret = bdrv_open_common(bs, filename, flags, drv);
     if (ret < 0) {
         bdrv_delete(bs);
@@ -516,6 +522,11 @@ int bdrv_file_open(BlockDriverState **pbs, const char *filename, int flags)
     return 0;
 }
 
+int bdrv_file_open(BlockDriverState **pbs, const char *filename, int flags)
+{
+    return bdrv_file_open_hints(pbs, filename, flags, NULL);
+}
+
 /*
  * Opens a disk image (raw, qcow2, vmdk, ...)
  */
@@ -1276,6 +1287,19 @@ void bdrv_set_geometry_hint(BlockDriverState *bs,
     bs->secs = secs;
 }
 
+void bdrv_set_aio_hint(BlockDriverState *bs, int queue_depth, int poll)
+{
+    bs->aio_max_events = queue_depth;
+    bs->aio_poll = poll;
+}
+
+void bdrv_set_cache_size_hint(BlockDriverState *bs, int64_t l2_cache_size,
+                              int64_t refcount_cache_size)
+{
+    bs->l2_cache_size = l2_cache_size;
+    bs->refcount_cache_size = refcount_cache_size;
+}
+
 void bdrv_set_type_hint(BlockDriverState *bs, int type)
 {
     bs->type = type;
@@ -1511,6 +1535,53 @@ int bdrv_is_allocated(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
     return bs->drv->bdrv_is_allocated(bs, sector_num, nb_sectors, pnum);
 }
 
+/*
+ * Returns true if the given sectors may contain non-zero data, and false if
+ * they are known to read as zeroes: either they are unallocated all the way
+ * down the backing chain, or they are a hole in the underlying file.
+ *
+ * 'pnum' is set to the number of sectors (including and immediately following
+ * the specified sector) that are known to be in the same state.
+ *
+ * 'nb_sectors' is the max value 'pnum' should be set to.
+ */
+int bdrv_has_data(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
+                  int *pnum)
+{
+    BlockDriver *drv = bs->drv;
+    int64_t n;
+
+    if (!drv) {
+        *pnum = nb_sectors;
+        return 1;
+    }
+
+    /* anything beyond the end of a backing file reads as zeroes */
+    if (sector_num >= bs->total_sectors) {
+        *pnum = nb_sectors;
+        return 0;
+    }
+    n = bs->total_sectors - sector_num;
+    if (n < nb_sectors) {
+        nb_sectors = n;
+    }
+
+    if (drv->bdrv_has_data) {
+        return drv->bdrv_has_data(bs, sector_num, nb_sectors, pnum);
+    }
+    if (!drv->bdrv_is_allocated) {
+        *pnum = nb_sectors;
+        return 1;
+    }
+    if (drv->bdrv_is_allocated(bs, sector_num, nb_sectors, pnum)) {
+        return 1;
+    }
+    if (!bs->backing_hd) {
+        return 0;
+    }
+    return bdrv_has_data(bs->backing_hd, sector_num, *pnum, pnum);
+}
+
 void bdrv_mon_event(const BlockDriverState *bdrv,
                     BlockMonEventAction action, int is_read)
 {
@@ -1634,22 +1705,61 @@ void bdrv_info(Monitor *mon, QObject **ret_data)
 
 static void bdrv_stats_iter(QObject *data, void *opaque)
 {
-    QDict *qdict;
+    QDict *qdict, *parent = NULL;
     Monitor *mon = opaque;
 
     qdict = qobject_to_qdict(data);
     monitor_printf(mon, "%s:", qdict_get_str(qdict, "device"));
 
+    if (qdict_haskey(qdict, "parent")) {
+        parent = qobject_to_qdict(qdict_get(qdict, "parent"));
+        parent = qobject_to_qdict(qdict_get(parent, "stats"));
+    }
+
     qdict = qobject_to_qdict(qdict_get(qdict, "stats"));
     monitor_printf(mon, " rd_bytes=%" PRId64
                         " wr_bytes=%" PRId64
                         " rd_operations=%" PRId64
-                        " wr_operations=%" PRId64
-                        "\n",
+                        " wr_operations=%" PRId64,
                         qdict_get_int(qdict, "rd_bytes"),
                         qdict_get_int(qdict, "wr_bytes"),
                         qdict_get_int(qdict, "rd_operations"),
                         qdict_get_int(qdict, "wr_operations"));
+    if (qdict_haskey(qdict, "rd_merged")) {
+        monitor_printf(mon, " rd_merged=%" PRId64
+                            " wr_merged=%" PRId64,
+                            qdict_get_int(qdict, "rd_merged"),
+                            qdict_get_int(qdict, "wr_merged"));
+    }
+    if (qdict_haskey(qdict, "l2_cache_hits")) {
+        monitor_printf(mon, " l2_cache_hits=%" PRId64
+                            " l2_cache_misses=%" PRId64
+                            " refcount_cache_hits=%" PRId64
+                            " refcount_cache_misses=%" PRId64,
+                            qdict_get_int(qdict, "l2_cache_hits"),
+                            qdict_get_int(qdict, "l2_cache_misses"),
+                            qdict_get_int(qdict, "refcount_cache_hits"),
+                            qdict_get_int(qdict, "refcount_cache_misses"));
+    }
+    /* the host AIO queue belongs to the protocol, e.g. the image file */
+    if (parent && qdict_haskey(parent, "aio_requests")) {
+        int64_t requests = qdict_get_int(parent, "aio_requests");
+
+        monitor_printf(mon, " aio_requests=%" PRId64
+                            " aio_merged=%" PRId64
+                            " aio_avg_latency_us=%" PRId64
+                            " aio_max_latency_us=%" PRId64
+                            " aio_queue_depth=%" PRId64
+                            " aio_max_queue_depth=%" PRId64,
+                            requests,
+                            qdict_get_int(parent, "aio_merged"),
+                            requests ? qdict_get_int(parent,
+                                "aio_total_latency_ns") / requests / 1000 : 0,
+                            qdict_get_int(parent, "aio_max_latency_ns") / 1000,
+                            qdict_get_int(parent, "aio_queue_depth"),
+                            qdict_get_int(parent, "aio_max_queue_depth"));
+    }
+    monitor_printf(mon, "\n");
 }
 
 void bdrv_stats_print(Monitor *mon, const QObject *data)
@@ -1661,6 +1771,7 @@ static QObject* bdrv_info_stats_bs(BlockDriverState *bs)
 {
     QObject *res;
     QDict *dict;
+    BlockDriverInfo bdi;
 
     res = qobject_from_jsonf("{ 'stats': {"
                              "'rd_bytes': %" PRId64 ","
@@ -1675,6 +1786,40 @@ static QObject* bdrv_info_stats_bs(BlockDriverState *bs)
                              (uint64_t)BDRV_SECTOR_SIZE);
     dict  = qobject_to_qdict(res);
 
+    if (bdrv_get_info(bs, &bdi) >= 0 &&
+        (bdi.l2_cache_hits || bdi.l2_cache_misses)) {
+        QDict *stats = qobject_to_qdict(qdict_get(dict, "stats"));
+
+        qdict_put(stats, "l2_cache_hits", qint_from_int(bdi.l2_cache_hits));
+        qdict_put(stats, "l2_cache_misses",
+                  qint_from_int(bdi.l2_cache_misses));
+        qdict_put(stats, "refcount_cache_hits",
+                  qint_from_int(bdi.refcount_cache_hits));
+        qdict_put(stats, "refcount_cache_misses",
+                  qint_from_int(bdi.refcount_cache_misses));
+    }
+
+    if (bs->rd_merged || bs->wr_merged) {
+        QDict *stats = qobject_to_qdict(qdict_get(dict, "stats"));
+
+        qdict_put(stats, "rd_merged", qint_from_int(bs->rd_merged));
+        qdict_put(stats, "wr_merged", qint_from_int(bs->wr_merged));
+    }
+
+    if (bs->aio_requests || bs->aio_queue_depth) {
+        QDict *stats = qobject_to_qdict(qdict_get(dict, "stats"));
+
+        qdict_put(stats, "aio_requests", qint_from_int(bs->aio_requests));
+        qdict_put(stats, "aio_merged", qint_from_int(bs->aio_merged));
+        qdict_put(stats, "aio_total_latency_ns",
+                  qint_from_int(bs->aio_total_latency_ns));
+        qdict_put(stats, "aio_max_latency_ns",
+                  qint_from_int(bs->aio_max_latency_ns));
+        qdict_put(stats, "aio_queue_depth", qint_from_int(bs->aio_queue_depth));
+        qdict_put(stats, "aio_max_queue_depth",
+                  qint_from_int(bs->aio_max_queue_depth));
+    }
+
     if (*bs->device_name) {
         qdict_put(dict, "device", qstring_from_str(bs->device_name));
     }
@@ -1741,6 +1886,44 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
     return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
 }
 
+/*
+ * Compresses one cluster of buf into out_buf (cluster_size bytes) the way
+ * bdrv_write_compressed would.  Drivers may only read state that is fixed
+ * once the image is open, so this can be called from any thread.  Returns
+ * the compressed length, or -ENOSPC if the data doesn't compress.
+ */
+int bdrv_compress_cluster(BlockDriverState *bs, const uint8_t *buf,
+                          uint8_t *out_buf)
+{
+    BlockDriver *drv = bs->drv;
+    if (!drv)
+        return -ENOMEDIUM;
+    if (!drv->bdrv_compress_cluster)
+        return -ENOTSUP;
+
+    return drv->bdrv_compress_cluster(bs, buf, out_buf);
+}
+
+/* Writes a cluster compressed by bdrv_compress_cluster */
+int bdrv_write_compressed_cluster(BlockDriverState *bs, int64_t sector_num,
+                                  int nb_sectors, const uint8_t *out_buf,
+                                  int out_len)
+{
+    BlockDriver *drv = bs->drv;
+    if (!drv)
+        return -ENOMEDIUM;
+    if (!drv->bdrv_write_compressed_cluster)
+        return -ENOTSUP;
+    if (bdrv_check_request(bs, sector_num, nb_sectors))
+        return -EIO;
+
+    if (bs->dirty_bitmap) {
+        set_dirty_bitmap(bs, sector_num, nb_sectors, 1);
+    }
+
+    return drv->bdrv_write_compressed_cluster(bs, sector_num, out_buf, out_len);
+}
+
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
     BlockDriver *drv = bs->drv;
@@ -2093,9 +2276,13 @@ static int multiwrite_req_compare(const void *a, const void *b)
 /*
  * Takes a bunch of requests and tries to merge them. Returns the number of
  * requests that remain after merging.
+ *
+ * Reads are only merged if they are exactly sequential: overlapping reads
+ * would leave the end of the first request unfilled, and gaps can't be
+ * filled with zeros like for writes.
  */
 static int multiwrite_merge(BlockDriverState *bs, BlockRequest *reqs,
-    int num_reqs, MultiwriteCB *mcb)
+    int num_reqs, MultiwriteCB *mcb, int is_write)
 {
     int i, outidx;
 
@@ -2111,7 +2298,9 @@ static int multiwrite_merge(BlockDriverState *bs, BlockRequest *reqs,
 
         // This handles the cases that are valid for all block drivers, namely
         // exactly sequential writes and overlapping writes.
-        if (reqs[i].sector <= oldreq_last) {
+        if (!is_write) {
+            merge = (reqs[i].sector == oldreq_last);
+        } else if (reqs[i].sector <= oldreq_last) {
             merge = 1;
         }
 
@@ -2119,7 +2308,7 @@ static int multiwrite_merge(BlockDriverState *bs, BlockRequest *reqs,
         // even if there is a gap of some sectors between them. In this case,
         // the gap is filled with zeros (therefore only applicable for yet
         // unused space in format like qcow2).
-        if (!merge && bs->drv->bdrv_merge_requests) {
+        if (is_write && !merge && bs->drv->bdrv_merge_requests) {
             merge = bs->drv->bdrv_merge_requests(bs, &reqs[outidx], &reqs[i]);
         }
 
@@ -2154,6 +2343,12 @@ static int multiwrite_merge(BlockDriverState *bs, BlockRequest *reqs,
             reqs[outidx].qiov = qiov;
 
             mcb->callbacks[i].free_qiov = reqs[outidx].qiov;
+
+            if (is_write) {
+                bs->wr_merged++;
+            } else {
+                bs->rd_merged++;
+            }
         } else {
             outidx++;
             reqs[outidx].sector     = reqs[i].sector;
@@ -2165,21 +2360,9 @@ static int multiwrite_merge(BlockDriverState *bs, BlockRequest *reqs,
     return outidx + 1;
 }
 
-/*
- * Submit multiple AIO write requests at once.
- *
- * On success, the function returns 0 and all requests in the reqs array have
- * been submitted. In error case this function returns -1, and any of the
- * requests may or may not be submitted yet. In particular, this means that the
- * callback will be called for some of the requests, for others it won't. The
- * caller must check the error field of the BlockRequest to wait for the right
- * callbacks (if error != 0, no callback will be called).
- *
- * The implementation may modify the contents of the reqs array, e.g. to merge
- * requests. However, the fields opaque and error are left unmodified as they
- * are used to signal failure for a single request to the caller.
- */
-int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
+/* Common part of bdrv_aio_multiwrite() and bdrv_aio_multiread() */
+static int bdrv_aio_multi(BlockDriverState *bs, BlockRequest *reqs,
+    int num_reqs, int is_write)
 {
     BlockDriverAIOCB *acb;
     MultiwriteCB *mcb;
@@ -2200,7 +2383,7 @@ int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
     }
 
     // Check for mergable requests
-    num_reqs = multiwrite_merge(bs, reqs, num_reqs, mcb);
+    num_reqs = multiwrite_merge(bs, reqs, num_reqs, mcb, is_write);
 
     /*
      * Run the aio requests. As soon as one request can't be submitted
@@ -2208,8 +2391,8 @@ int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
      * return failure for all requests anyway)
      *
      * num_requests cannot be set to the right value immediately: If
-     * bdrv_aio_writev fails for some request, num_requests would be too high
-     * and therefore multiwrite_cb() would never recognize the multiwrite
+     * bdrv_aio_writev/readv fails for some request, num_requests would be too
+     * high and therefore multiwrite_cb() would never recognize the multiwrite
      * request as completed. We also cannot use the loop variable i to set it
      * when the first request fails because the callback may already have been
      * called for previously submitted requests. Thus, num_requests must be
@@ -2225,8 +2408,13 @@ int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
 
     for (i = 0; i < num_reqs; i++) {
         mcb->num_requests++;
-        acb = bdrv_aio_writev(bs, reqs[i].sector, reqs[i].qiov,
-            reqs[i].nb_sectors, multiwrite_cb, mcb);
+        if (is_write) {
+            acb = bdrv_aio_writev(bs, reqs[i].sector, reqs[i].qiov,
+                reqs[i].nb_sectors, multiwrite_cb, mcb);
+        } else {
+            acb = bdrv_aio_readv(bs, reqs[i].sector, reqs[i].qiov,
+                reqs[i].nb_sectors, multiwrite_cb, mcb);
+        }
 
         if (acb == NULL) {
             // We can only fail the whole thing if no request has been
@@ -2254,6 +2442,36 @@ fail:
     return -1;
 }
 
+/*
+ * Submit multiple AIO write requests at once.
+ *
+ * On success, the function returns 0 and all requests in the reqs array have
+ * been submitted. In error case this function returns -1, and any of the
+ * requests may or may not be submitted yet. In particular, this means that the
+ * callback will be called for some of the requests, for others it won't. The
+ * caller must check the error field of the BlockRequest to wait for the right
+ * callbacks (if error != 0, no callback will be called).
+ *
+ * The implementation may modify the contents of the reqs array, e.g. to merge
+ * requests. However, the fields opaque and error are left unmodified as they
+ * are used to signal failure for a single request to the caller.
+ */
+int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
+{
+    return bdrv_aio_multi(bs, reqs, num_reqs, 1);
+}
+
+/*
+ * Submit multiple AIO read requests at once, merging sequential ones.
+ *
+ * Same calling conventions as bdrv_aio_multiwrite().  The callbacks are only
+ * called once all reads have completed.
+ */
+int bdrv_aio_multiread(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
+{
+    return bdrv_aio_multi(bs, reqs, num_reqs, 0);
+}
+
 BlockDriverAIOCB *bdrv_aio_flush(BlockDriverState *bs,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
@@ -2273,6 +2491,32 @@ void bdrv_aio_cancel(BlockDriverAIOCB *acb)
     acb->pool->cancel(acb);
 }
 
+/*
+ * Requests issued between bdrv_io_plug() and bdrv_io_unplug() may be held
+ * back and submitted together.  Format drivers pass this on to their file.
+ */
+void bdrv_io_plug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_plug) {
+        drv->bdrv_io_plug(bs);
+    } else if (bs->file) {
+        bdrv_io_plug(bs->file);
+    }
+}
+
+void bdrv_io_unplug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_unplug) {
+        drv->bdrv_io_unplug(bs);
+    } else if (bs->file) {
+        bdrv_io_unplug(bs->file);
+    }
+}
+
 
 /**************************************************************/
 /* async block device emulation */
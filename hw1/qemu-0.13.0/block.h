@@ -14,6 +14,11 @@ typedef struct BlockDriverInfo {
     int cluster_size;
     /* offset at which the VM state can be saved (0 if not possible) */
     int64_t vm_state_offset;
+    /* metadata cache lookups, 0 if the format has no such cache */
+    uint64_t l2_cache_hits;
+    uint64_t l2_cache_misses;
+    uint64_t refcount_cache_hits;
+    uint64_t refcount_cache_misses;
 } BlockDriverInfo;
 
 typedef struct QEMUSnapshotInfo {
@@ -119,21 +124,25 @@ BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
 BlockDriverAIOCB *bdrv_aio_flush(BlockDriverState *bs,
 				 BlockDriverCompletionFunc *cb, void *opaque);
 void bdrv_aio_cancel(BlockDriverAIOCB *acb);
+void bdrv_io_plug(BlockDriverState *bs);
+void bdrv_io_unplug(BlockDriverState *bs);
 
 typedef struct BlockRequest {
-    /* Fields to be filled by multiwrite caller */
+    /* Fields to be filled by multiwrite/multiread caller */
     int64_t sector;
     int nb_sectors;
     QEMUIOVector *qiov;
     BlockDriverCompletionFunc *cb;
     void *opaque;
 
-    /* Filled by multiwrite implementation */
+    /* Filled by multiwrite/multiread implementation */
     int error;
 } BlockRequest;
 
 int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs,
     int num_reqs);
+int bdrv_aio_multiread(BlockDriverState *bs, BlockRequest *reqs,
+    int num_reqs);
 
 /* sg packet commands */
 int bdrv_ioctl(BlockDriverState *bs, unsigned long int req, void *buf);
@@ -149,6 +158,8 @@ void bdrv_close_all(void);
 int bdrv_has_zero_init(BlockDriverState *bs);
 int bdrv_is_allocated(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
 	int *pnum);
+int bdrv_has_data(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
+                  int *pnum);
 
 #define BDRV_TYPE_HD     0
 #define BDRV_TYPE_CDROM  1
@@ -162,6 +173,9 @@ int bdrv_is_allocated(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
 void bdrv_set_geometry_hint(BlockDriverState *bs,
                             int cyls, int heads, int secs);
 void bdrv_set_type_hint(BlockDriverState *bs, int type);
+void bdrv_set_aio_hint(BlockDriverState *bs, int queue_depth, int poll);
+void bdrv_set_cache_size_hint(BlockDriverState *bs, int64_t l2_cache_size,
+                              int64_t refcount_cache_size);
 void bdrv_set_translation_hint(BlockDriverState *bs, int translation);
 void bdrv_get_geometry_hint(BlockDriverState *bs,
                             int *pcyls, int *pheads, int *psecs);
@@ -196,6 +210,11 @@ void bdrv_iterate_format(void (*it)(void *opaque, const char *name),
 const char *bdrv_get_device_name(BlockDriverState *bs);
 int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
                           const uint8_t *buf, int nb_sectors);
+int bdrv_compress_cluster(BlockDriverState *bs, const uint8_t *buf,
+                          uint8_t *out_buf);
+int bdrv_write_compressed_cluster(BlockDriverState *bs, int64_t sector_num,
+                                  int nb_sectors, const uint8_t *out_buf,
+                                  int out_len);
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi);
 
 const char *bdrv_get_encrypted_filename(BlockDriverState *bs);
@@ -850,23 +850,13 @@ static int qcow_make_empty(BlockDriverState *bs)
     return 0;
 }
 
-/* XXX: put compressed sectors first, then all the cluster aligned
-   tables to avoid losing bytes in alignment */
-static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                                 const uint8_t *buf, int nb_sectors)
+/* See bdrv_compress_cluster() */
+static int qcow_compress_cluster(BlockDriverState *bs, const uint8_t *buf,
+                                 uint8_t *out_buf)
 {
     BDRVQcowState *s = bs->opaque;
     z_stream strm;
     int ret, out_len;
-    uint8_t *out_buf;
-    uint64_t cluster_offset;
-
-    if (nb_sectors != s->cluster_sectors)
-        return -EINVAL;
-
-    out_buf = qemu_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
-    if (!out_buf)
-        return -1;
 
     /* best compression, small window, no zlib header */
     memset(&strm, 0, sizeof(strm));
@@ -874,8 +864,7 @@ static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
                        Z_DEFLATED, -12,
                        9, Z_DEFAULT_STRATEGY);
     if (ret != 0) {
-        qemu_free(out_buf);
-        return -1;
+        return -EIO;
     }
 
     strm.avail_in = s->cluster_size;
@@ -885,29 +874,58 @@ static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     ret = deflate(&strm, Z_FINISH);
     if (ret != Z_STREAM_END && ret != Z_OK) {
-        qemu_free(out_buf);
         deflateEnd(&strm);
-        return -1;
+        return -EIO;
     }
     out_len = strm.next_out - out_buf;
 
     deflateEnd(&strm);
 
     if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+        return -ENOSPC;
+    }
+    return out_len;
+}
+
+/* XXX: put compressed sectors first, then all the cluster aligned
+   tables to avoid losing bytes in alignment */
+static int qcow_write_compressed_cluster(BlockDriverState *bs,
+    int64_t sector_num, const uint8_t *out_buf, int out_len)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t cluster_offset;
+
+    cluster_offset = get_cluster_offset(bs, sector_num << 9, 2,
+                                        out_len, 0, 0);
+    cluster_offset &= s->cluster_offset_mask;
+    if (bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len) != out_len) {
+        return -1;
+    }
+    return 0;
+}
+
+static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
+                                 const uint8_t *buf, int nb_sectors)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+    uint8_t *out_buf;
+
+    if (nb_sectors != s->cluster_sectors)
+        return -EINVAL;
+
+    out_buf = qemu_malloc(s->cluster_size);
+
+    ret = qcow_compress_cluster(bs, buf, out_buf);
+    if (ret == -ENOSPC) {
         /* could not compress: write normal cluster */
-        bdrv_write(bs, sector_num, buf, s->cluster_sectors);
-    } else {
-        cluster_offset = get_cluster_offset(bs, sector_num << 9, 2,
-                                            out_len, 0, 0);
-        cluster_offset &= s->cluster_offset_mask;
-        if (bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len) != out_len) {
-            qemu_free(out_buf);
-            return -1;
-        }
+        ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
+    } else if (ret >= 0) {
+        ret = qcow_write_compressed_cluster(bs, sector_num, out_buf, ret);
     }
 
     qemu_free(out_buf);
-    return 0;
+    return ret < 0 ? -1 : 0;
 }
 
 static void qcow_flush(BlockDriverState *bs)
@@ -963,6 +981,8 @@ static BlockDriver bdrv_qcow = {
     .bdrv_aio_writev	= qcow_aio_writev,
     .bdrv_aio_flush	= qcow_aio_flush,
     .bdrv_write_compressed = qcow_write_compressed,
+    .bdrv_compress_cluster = qcow_compress_cluster,
+    .bdrv_write_compressed_cluster = qcow_write_compressed_cluster,
     .bdrv_get_info	= qcow_get_info,
 
     .create_options = qcow_create_options,
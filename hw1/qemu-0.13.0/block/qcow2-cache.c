@@ -0,0 +1,1016 @@
+/*
+ * L2/refcount table cache for the QCOW version 2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu-common.h"
+#include "block_int.h"
+#include "block/qcow2.h"
+
+/*
+ * Each cache holds a fixed number of cluster sized tables.  Tables are found
+ * through a hash on their offset in the image file and replaced in least
+ * recently used order.  An unused entry has offset 0, which is the image
+ * header and never a table.
+ */
+typedef struct Qcow2CachedTable {
+    void *table;
+    int64_t offset;
+    int dirty;
+    int hash_next;      /* next entry in the same bucket, -1 at the end */
+    int lru_prev;       /* more recently used entry, -1 for the head */
+    int lru_next;       /* less recently used entry, -1 for the tail */
+    int writing;        /* qcow2_cache_flush_aio() is writing it back */
+} Qcow2CachedTable;
+
+/*
+ * A table being read in the background by qcow2_cache_load_aio().  It is
+ * only installed in the cache when the read completes, and not at all if a
+ * synchronous lookup got to it first or the cache was reset meanwhile.
+ */
+typedef struct Qcow2CacheWaiter {
+    BlockDriverCompletionFunc *cb;
+    void *opaque;
+    QLIST_ENTRY(Qcow2CacheWaiter) next;
+} Qcow2CacheWaiter;
+
+typedef struct Qcow2CacheLoad {
+    BlockDriverState *bs;
+    Qcow2Cache *c;
+    int64_t offset;
+    void *table;
+    int stale;
+    int flushed;        /* waited for a write-back to make room */
+    struct iovec iov;
+    QEMUIOVector qiov;
+    QLIST_HEAD(Qcow2CacheWaiters, Qcow2CacheWaiter) waiters;
+    QLIST_ENTRY(Qcow2CacheLoad) next;
+} Qcow2CacheLoad;
+
+/*
+ * One round of qcow2_cache_flush_aio().  The dirty tables are copied when the
+ * round starts, so they may be modified (and become dirty again) while they
+ * are written.  Until the write completes an entry is not evicted, so that
+ * nothing reads the table back from the disk in the meantime.
+ */
+typedef struct Qcow2CacheFlushWrite {
+    struct Qcow2CacheFlush *flush;
+    int index;
+    int64_t offset;
+    void *table;
+    struct iovec iov;
+    QEMUIOVector qiov;
+} Qcow2CacheFlushWrite;
+
+enum {
+    QCOW2_FLUSH_DEPENDENCY,
+    QCOW2_FLUSH_BARRIER,
+    QCOW2_FLUSH_WRITE,
+    QCOW2_FLUSH_SYNC,
+    QCOW2_FLUSH_DONE,
+};
+
+typedef struct Qcow2CacheFlush {
+    BlockDriverState *bs;
+    Qcow2Cache *c;
+    int step;
+    int ret;
+    int barrier;        /* flush bs->file before writing the tables */
+    int pending;        /* table writes in flight */
+    int nb_writes;
+    Qcow2CacheFlushWrite *writes;
+    struct Qcow2CacheWaiters waiters;
+} Qcow2CacheFlush;
+
+struct Qcow2Cache {
+    Qcow2CachedTable *entries;
+    uint8_t *tables;
+    int size;
+    int *buckets;
+    int hash_bits;
+    int lru_head;
+    int lru_tail;
+    int nb_dirty;
+    int writethrough;
+    /* don't write through now, the caller uses qcow2_cache_flush_aio() */
+    int deferred;
+    /* tables were written to bs->file since it was last flushed */
+    int written;
+    /* bs->file must be flushed before any table of this cache is written */
+    int depends_on_flush;
+    /* flushed to disk before any table of this cache is written back */
+    Qcow2Cache *depends;
+    uint64_t hits;
+    uint64_t misses;
+    QLIST_HEAD(, Qcow2CacheLoad) loads;
+    /* the qcow2_cache_flush_aio() round in progress, and the next one */
+    Qcow2CacheFlush *flush;
+    struct Qcow2CacheWaiters flush_waiters;
+    /* waiting in qcow2_cache_wait_idle() for the write-back to finish */
+    struct Qcow2CacheWaiters idle_waiters;
+};
+
+static int qcow2_cache_hash(BlockDriverState *bs, Qcow2Cache *c,
+                            int64_t offset)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t n = offset >> s->cluster_bits;
+
+    return (n ^ (n >> c->hash_bits)) & ((1 << c->hash_bits) - 1);
+}
+
+static void lru_unlink(Qcow2Cache *c, int i)
+{
+    Qcow2CachedTable *e = &c->entries[i];
+
+    if (e->lru_prev >= 0) {
+        c->entries[e->lru_prev].lru_next = e->lru_next;
+    } else {
+        c->lru_head = e->lru_next;
+    }
+    if (e->lru_next >= 0) {
+        c->entries[e->lru_next].lru_prev = e->lru_prev;
+    } else {
+        c->lru_tail = e->lru_prev;
+    }
+}
+
+static void lru_push_head(Qcow2Cache *c, int i)
+{
+    Qcow2CachedTable *e = &c->entries[i];
+
+    e->lru_prev = -1;
+    e->lru_next = c->lru_head;
+    if (c->lru_head >= 0) {
+        c->entries[c->lru_head].lru_prev = i;
+    } else {
+        c->lru_tail = i;
+    }
+    c->lru_head = i;
+}
+
+static void hash_insert(BlockDriverState *bs, Qcow2Cache *c, int i)
+{
+    int h = qcow2_cache_hash(bs, c, c->entries[i].offset);
+
+    c->entries[i].hash_next = c->buckets[h];
+    c->buckets[h] = i;
+}
+
+static void hash_remove(BlockDriverState *bs, Qcow2Cache *c, int i)
+{
+    int *p = &c->buckets[qcow2_cache_hash(bs, c, c->entries[i].offset)];
+
+    while (*p != i) {
+        p = &c->entries[*p].hash_next;
+    }
+    *p = c->entries[i].hash_next;
+}
+
+static int qcow2_cache_find(BlockDriverState *bs, Qcow2Cache *c,
+                            int64_t offset)
+{
+    int i;
+
+    for (i = c->buckets[qcow2_cache_hash(bs, c, offset)]; i >= 0;
+         i = c->entries[i].hash_next) {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int writethrough)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Cache *c;
+    int i;
+
+    c = qemu_mallocz(sizeof(*c));
+    c->size = num_tables;
+    c->writethrough = writethrough;
+    c->entries = qemu_mallocz(sizeof(*c->entries) * num_tables);
+    c->tables = qemu_malloc((size_t)num_tables * s->cluster_size);
+
+    /* about two entries per bucket */
+    c->hash_bits = 0;
+    while ((2 << c->hash_bits) < num_tables) {
+        c->hash_bits++;
+    }
+    c->buckets = qemu_malloc(sizeof(int) << c->hash_bits);
+    for (i = 0; i < (1 << c->hash_bits); i++) {
+        c->buckets[i] = -1;
+    }
+
+    QLIST_INIT(&c->loads);
+    QLIST_INIT(&c->flush_waiters);
+    QLIST_INIT(&c->idle_waiters);
+    c->lru_head = c->lru_tail = -1;
+    for (i = 0; i < num_tables; i++) {
+        c->entries[i].table = c->tables + (size_t)i * s->cluster_size;
+        c->entries[i].hash_next = -1;
+        lru_push_head(c, i);
+    }
+    return c;
+}
+
+void qcow2_cache_destroy(BlockDriverState *bs, Qcow2Cache *c)
+{
+    qemu_free(c->buckets);
+    qemu_free(c->tables);
+    qemu_free(c->entries);
+    qemu_free(c);
+}
+
+/*
+ * Makes sure that the tables of c->depends are on the disk, not just written
+ * to bs->file, before a table of c is written.
+ */
+static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
+{
+    Qcow2Cache *d = c->depends;
+    int ret;
+
+    if (d && d->nb_dirty) {
+        ret = qcow2_cache_flush(bs, d);
+        if (ret < 0) {
+            return ret;
+        }
+        c->depends_on_flush = 0;
+    }
+    if (c->depends_on_flush || (d && d->written)) {
+        bdrv_flush(bs->file);
+        c->depends_on_flush = 0;
+        if (d) {
+            d->written = 0;
+        }
+    }
+    return 0;
+}
+
+static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CachedTable *e = &c->entries[i];
+    int ret;
+
+    /*
+     * An older copy of the table may still be on its way to the disk, and
+     * qcow2_cache_flush_aio() may take the table while we wait for the
+     * dependency, so check again after each wait.
+     */
+    for (;;) {
+        while (e->writing) {
+            qemu_aio_wait();
+        }
+        if (!e->dirty) {
+            return 0;
+        }
+
+        ret = qcow2_cache_flush_dependency(bs, c);
+        if (ret < 0) {
+            return ret;
+        }
+        if (!e->writing && e->dirty) {
+            break;
+        }
+    }
+
+    if (c == s->l2_table_cache) {
+        BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
+    } else {
+        BLKDBG_EVENT(bs->file, BLKDBG_REFBLOCK_UPDATE);
+    }
+    ret = bdrv_pwrite(bs->file, e->offset, e->table, s->cluster_size);
+    if (ret < 0) {
+        return ret;
+    }
+    c->written = 1;
+
+    e->dirty = 0;
+    c->nb_dirty--;
+    return 0;
+}
+
+/*
+ * Write all dirty tables back to the image file.  If anything was written,
+ * now or by an earlier eviction, bs->file is flushed as well, so that the
+ * flush acts as a barrier for the metadata updates that follow.
+ */
+int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
+{
+    int i, ret, result = 0;
+
+    /* tables that qcow2_cache_flush_aio() is writing aren't dirty any more */
+    while (c->flush) {
+        qemu_aio_wait();
+    }
+
+    if (c->nb_dirty == 0 && !c->written) {
+        return 0;
+    }
+
+    for (i = 0; i < c->size && c->nb_dirty; i++) {
+        ret = qcow2_cache_entry_flush(bs, c, i);
+        if (ret < 0 && result == 0) {
+            result = ret;
+        }
+    }
+
+    if (result == 0) {
+        bdrv_flush(bs->file);
+        c->written = 0;
+    }
+    return result;
+}
+
+static void qcow2_cache_flush_step(void *opaque, int ret);
+
+static void qcow2_cache_flush_write_cb(void *opaque, int ret)
+{
+    Qcow2CacheFlushWrite *w = opaque;
+    Qcow2CacheFlush *f = w->flush;
+
+    if (ret < 0 && f->ret == 0) {
+        f->ret = ret;
+    }
+    if (--f->pending == 0) {
+        qcow2_cache_flush_step(f, 0);
+    }
+}
+
+/* Takes a copy of the dirty tables and starts writing them back */
+static void qcow2_cache_flush_start(BlockDriverState *bs, Qcow2Cache *c)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CacheFlush *f;
+    Qcow2CacheFlushWrite *w;
+    Qcow2CachedTable *e;
+    int i;
+
+    f = qemu_mallocz(sizeof(*f));
+    f->bs = bs;
+    f->c = c;
+    f->step = QCOW2_FLUSH_DEPENDENCY;
+    f->writes = qemu_mallocz(sizeof(*f->writes) * (c->nb_dirty + 1));
+    QLIST_INIT(&f->waiters);
+    while (!QLIST_EMPTY(&c->flush_waiters)) {
+        Qcow2CacheWaiter *waiter = QLIST_FIRST(&c->flush_waiters);
+        QLIST_REMOVE(waiter, next);
+        QLIST_INSERT_HEAD(&f->waiters, waiter, next);
+    }
+
+    for (i = 0; i < c->size && c->nb_dirty; i++) {
+        e = &c->entries[i];
+        if (!e->dirty) {
+            continue;
+        }
+        w = &f->writes[f->nb_writes++];
+        w->flush = f;
+        w->index = i;
+        w->offset = e->offset;
+        w->table = qemu_blockalign(bs->file, s->cluster_size);
+        memcpy(w->table, e->table, s->cluster_size);
+        w->iov.iov_base = w->table;
+        w->iov.iov_len = s->cluster_size;
+        qemu_iovec_init_external(&w->qiov, &w->iov, 1);
+        e->writing++;
+        e->dirty = 0;
+        c->nb_dirty--;
+    }
+
+    f->barrier = c->depends_on_flush;
+    c->depends_on_flush = 0;
+    c->flush = f;
+
+    qcow2_cache_flush_step(f, 0);
+}
+
+static void qcow2_cache_flush_step(void *opaque, int ret)
+{
+    Qcow2CacheFlush *f = opaque;
+    BlockDriverState *bs = f->bs;
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Cache *c = f->c;
+    Qcow2CacheFlushWrite *w;
+    Qcow2CacheWaiter *waiter;
+    Qcow2CachedTable *e;
+    int i;
+
+    if (ret < 0 && f->ret == 0) {
+        f->ret = ret;
+    }
+
+    switch (f->step) {
+    case QCOW2_FLUSH_DEPENDENCY:
+        f->step = QCOW2_FLUSH_BARRIER;
+        if (c->depends) {
+            /* its final flush of bs->file serves as our barrier as well */
+            ret = qcow2_cache_flush_aio(bs, c->depends, qcow2_cache_flush_step,
+                                        f);
+            if (ret > 0) {
+                f->barrier = 0;
+                return;
+            } else if (ret < 0) {
+                f->ret = ret;
+            }
+        }
+        /* fall through */
+    case QCOW2_FLUSH_BARRIER:
+        f->step = QCOW2_FLUSH_WRITE;
+        if (f->barrier && f->ret == 0) {
+            if (bdrv_aio_flush(bs->file, qcow2_cache_flush_step, f)) {
+                return;
+            }
+            f->ret = -EIO;
+        }
+        /* fall through */
+    case QCOW2_FLUSH_WRITE:
+        f->step = QCOW2_FLUSH_SYNC;
+        if (f->ret == 0 && f->nb_writes) {
+            f->pending = 1;
+            for (i = 0; i < f->nb_writes; i++) {
+                w = &f->writes[i];
+                if (c == s->l2_table_cache) {
+                    BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
+                } else {
+                    BLKDBG_EVENT(bs->file, BLKDBG_REFBLOCK_UPDATE);
+                }
+                f->pending++;
+                if (!bdrv_aio_writev(bs->file, w->offset >> 9, &w->qiov,
+                                     s->cluster_sectors,
+                                     qcow2_cache_flush_write_cb, w)) {
+                    f->pending--;
+                    f->ret = -EIO;
+                }
+            }
+            c->written = 1;
+            if (--f->pending > 0) {
+                return;
+            }
+        }
+        /* fall through */
+    case QCOW2_FLUSH_SYNC:
+        f->step = QCOW2_FLUSH_DONE;
+        if (f->ret == 0 && c->written) {
+            c->written = 0;
+            if (bdrv_aio_flush(bs->file, qcow2_cache_flush_step, f)) {
+                return;
+            }
+            f->ret = -EIO;
+        }
+        /* fall through */
+    case QCOW2_FLUSH_DONE:
+        break;
+    }
+
+    for (i = 0; i < f->nb_writes; i++) {
+        w = &f->writes[i];
+        e = &c->entries[w->index];
+        e->writing--;
+        if (f->ret < 0 && e->offset == w->offset && !e->dirty) {
+            /* try again next time */
+            e->dirty = 1;
+            c->nb_dirty++;
+        }
+        qemu_vfree(w->table);
+    }
+    qemu_free(f->writes);
+    c->flush = NULL;
+
+    while ((waiter = QLIST_FIRST(&f->waiters)) != NULL) {
+        QLIST_REMOVE(waiter, next);
+        waiter->cb(waiter->opaque, f->ret);
+        qemu_free(waiter);
+    }
+    qemu_free(f);
+
+    if (!c->flush && !QLIST_EMPTY(&c->flush_waiters)) {
+        qcow2_cache_flush_start(bs, c);
+    }
+
+    /* those that wait for the next round too are still waiting for it */
+    while (!c->flush && (waiter = QLIST_FIRST(&c->idle_waiters)) != NULL) {
+        QLIST_REMOVE(waiter, next);
+        waiter->cb(waiter->opaque, 0);
+        qemu_free(waiter);
+    }
+}
+
+/*
+ * Like qcow2_cache_flush(), but writes the tables back asynchronously.
+ * Returns 0 if there is nothing to write, 1 if cb will be called once the
+ * tables (and those of the cache c depends on) are on the disk, or -errno.
+ *
+ * Tables that are modified after this call are not necessarily written, so
+ * a caller must have made its own updates before calling it.
+ */
+int qcow2_cache_flush_aio(BlockDriverState *bs, Qcow2Cache *c,
+    BlockDriverCompletionFunc *cb, void *opaque)
+{
+    Qcow2Cache *d = c->depends;
+    Qcow2CacheWaiter *w;
+
+    if (!c->nb_dirty && !c->written && !c->depends_on_flush &&
+        !(d && (d->nb_dirty || d->written))) {
+        return 0;
+    }
+
+    w = qemu_malloc(sizeof(*w));
+    w->cb = cb;
+    w->opaque = opaque;
+    QLIST_INSERT_HEAD(&c->flush_waiters, w, next);
+
+    /* a round that is already running may have missed our updates */
+    if (!c->flush) {
+        qcow2_cache_flush_start(bs, c);
+    }
+    return 1;
+}
+
+/*
+ * The AIO paths must not change tables while qcow2_cache_flush_aio() writes
+ * them back: a table that is being written can't be written again or evicted
+ * until the write has completed, and waiting for that with qemu_aio_wait()
+ * from a completion callback would run other requests' metadata updates in
+ * the middle of this one.
+ *
+ * Returns 0 if no write-back is in progress, or 1 if cb will be called once
+ * it has finished.
+ */
+int qcow2_cache_wait_idle(Qcow2Cache *c, BlockDriverCompletionFunc *cb,
+    void *opaque)
+{
+    Qcow2CacheWaiter *w;
+
+    if (!c->flush) {
+        return 0;
+    }
+
+    w = qemu_malloc(sizeof(*w));
+    w->cb = cb;
+    w->opaque = opaque;
+    QLIST_INSERT_HEAD(&c->idle_waiters, w, next);
+    return 1;
+}
+
+/* Like qcow2_cache_wait_idle(), for both the L2 and the refcount cache */
+int qcow2_cache_wait_idle_all(BlockDriverState *bs,
+    BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    ret = qcow2_cache_wait_idle(s->l2_table_cache, cb, opaque);
+    if (ret == 0) {
+        ret = qcow2_cache_wait_idle(s->refcount_block_cache, cb, opaque);
+    }
+    return ret;
+}
+
+/*
+ * While set, qcow2_cache_entry_mark_dirty() leaves updates in the cache even
+ * in writethrough mode; the caller writes them with qcow2_cache_flush_aio()
+ * before it completes the request.  Calls nest.
+ */
+void qcow2_cache_set_deferred(Qcow2Cache *c, int deferred)
+{
+    c->deferred += deferred ? 1 : -1;
+}
+
+/*
+ * Make sure 'dependency' reaches the disk before any table of 'c' does, e.g.
+ * refcount updates before the L2 entries that point to the new clusters.
+ */
+void qcow2_cache_set_dependency(Qcow2Cache *c, Qcow2Cache *dependency)
+{
+    c->depends = dependency;
+}
+
+/*
+ * Data was written to bs->file that must be on the disk before the next
+ * table of 'c' is, e.g. copy on write data before the L2 entry pointing
+ * to it.
+ */
+void qcow2_cache_depends_on_flush(Qcow2Cache *c)
+{
+    c->depends_on_flush = 1;
+}
+
+/*
+ * Switch between writing each update at once and leaving it in the cache
+ * until it is evicted or flushed.  Returns the previous mode.
+ */
+int qcow2_cache_set_writethrough(BlockDriverState *bs, Qcow2Cache *c,
+                                 int writethrough)
+{
+    int old = c->writethrough;
+
+    if (writethrough && !old) {
+        qcow2_cache_flush(bs, c);
+    }
+    c->writethrough = writethrough;
+    return old;
+}
+
+/* Makes sure that a background read of 'offset' doesn't end up in the cache */
+static void qcow2_cache_load_invalidate(Qcow2Cache *c, int64_t offset)
+{
+    Qcow2CacheLoad *load;
+
+    QLIST_FOREACH(load, &c->loads, next) {
+        if (offset < 0 || load->offset == offset) {
+            load->stale = 1;
+        }
+    }
+}
+
+/* Drop all tables.  Dirty tables must have been flushed by the caller. */
+void qcow2_cache_reset(BlockDriverState *bs, Qcow2Cache *c)
+{
+    int i;
+
+    qcow2_cache_load_invalidate(c, -1);
+
+    /* the tables must not be read back before they are written */
+    while (c->flush) {
+        qemu_aio_wait();
+    }
+
+    for (i = 0; i < (1 << c->hash_bits); i++) {
+        c->buckets[i] = -1;
+    }
+    for (i = 0; i < c->size; i++) {
+        c->entries[i].offset = 0;
+        c->entries[i].dirty = 0;
+        c->entries[i].hash_next = -1;
+    }
+    c->nb_dirty = 0;
+}
+
+/* Forget the table at 'offset' if it is cached, dirty or not */
+void qcow2_cache_discard(BlockDriverState *bs, Qcow2Cache *c, int64_t offset)
+{
+    int i = qcow2_cache_find(bs, c, offset);
+
+    qcow2_cache_load_invalidate(c, offset);
+
+    if (i < 0) {
+        return;
+    }
+    hash_remove(bs, c, i);
+    if (c->entries[i].dirty) {
+        c->entries[i].dirty = 0;
+        c->nb_dirty--;
+    }
+    c->entries[i].offset = 0;
+    /* reuse it first */
+    lru_unlink(c, i);
+    c->entries[i].lru_next = -1;
+    c->entries[i].lru_prev = c->lru_tail;
+    if (c->lru_tail >= 0) {
+        c->entries[c->lru_tail].lru_next = i;
+    } else {
+        c->lru_head = i;
+    }
+    c->lru_tail = i;
+}
+
+/*
+ * Like qcow2_cache_evict(), but only takes a clean entry so that nothing is
+ * written to the image file.  Returns -1 if every entry is dirty.
+ */
+static int qcow2_cache_evict_clean(BlockDriverState *bs, Qcow2Cache *c)
+{
+    int i;
+
+    for (i = c->lru_tail; i >= 0; i = c->entries[i].lru_prev) {
+        if (!c->entries[i].dirty && !c->entries[i].writing) {
+            if (c->entries[i].offset) {
+                hash_remove(bs, c, i);
+                c->entries[i].offset = 0;
+            }
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Frees the least recently used clean entry, or if there is none the least
+ * recently used dirty one, and returns its index, or -errno.
+ */
+static int qcow2_cache_evict(BlockDriverState *bs, Qcow2Cache *c)
+{
+    int i, ret;
+
+    i = qcow2_cache_evict_clean(bs, c);
+    if (i >= 0) {
+        return i;
+    }
+
+    for (;;) {
+        for (i = c->lru_tail; i >= 0; i = c->entries[i].lru_prev) {
+            if (!c->entries[i].writing) {
+                break;
+            }
+        }
+        if (i >= 0) {
+            break;
+        }
+        /* every table is being written back */
+        qemu_aio_wait();
+    }
+
+    ret = qcow2_cache_entry_flush(bs, c, i);
+    if (ret < 0) {
+        return ret;
+    }
+    if (c->entries[i].offset) {
+        hash_remove(bs, c, i);
+        c->entries[i].offset = 0;
+    }
+    return i;
+}
+
+static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
+    int64_t offset, void **table, int read_from_disk)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CachedTable *e;
+    int i, ret;
+
+    i = qcow2_cache_find(bs, c, offset);
+    if (i >= 0) {
+        c->hits++;
+        goto found;
+    }
+    c->misses++;
+
+    /* The table may be modified before a background read completes */
+    qcow2_cache_load_invalidate(c, offset);
+
+    /* Replace the least recently used table */
+    i = qcow2_cache_evict(bs, c);
+    if (i < 0) {
+        return i;
+    }
+    e = &c->entries[i];
+
+    if (read_from_disk) {
+        if (c == s->l2_table_cache) {
+            BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
+        } else {
+            BLKDBG_EVENT(bs->file, BLKDBG_REFBLOCK_LOAD);
+        }
+        ret = bdrv_pread(bs->file, offset, e->table, s->cluster_size);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    e->offset = offset;
+    hash_insert(bs, c, i);
+
+found:
+    if (c->lru_head != i) {
+        lru_unlink(c, i);
+        lru_push_head(c, i);
+    }
+    *table = c->entries[i].table;
+    return 0;
+}
+
+/*
+ * Returns the table at 'offset', reading it from the image file if it is not
+ * cached.  The pointer stays valid until the next qcow2_cache_get*() call on
+ * the same cache, so callers must not hold it across anything that may load
+ * another table.
+ */
+int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, int64_t offset,
+    void **table)
+{
+    return qcow2_cache_do_get(bs, c, offset, table, 1);
+}
+
+/* Like qcow2_cache_get() for a new table the caller is about to fill */
+int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, int64_t offset,
+    void **table)
+{
+    return qcow2_cache_do_get(bs, c, offset, table, 0);
+}
+
+/*
+ * Records that bytes [start, start + len) of a cached table were modified.
+ * In writethrough mode the sectors covering them are written immediately,
+ * otherwise the whole table is written back on eviction or flush.
+ */
+int qcow2_cache_entry_mark_dirty(BlockDriverState *bs, Qcow2Cache *c,
+    void *table, int start, int len)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i = ((uint8_t *)table - c->tables) / s->cluster_size;
+    Qcow2CachedTable *e = &c->entries[i];
+    int end, ret;
+
+    assert(i >= 0 && i < c->size && e->offset != 0);
+
+    if (c->writethrough && !c->deferred) {
+        while (e->writing) {
+            qemu_aio_wait();
+        }
+        end = (start + len + 511) & ~511;
+        start &= ~511;
+        if (end > s->cluster_size) {
+            end = s->cluster_size;
+        }
+        ret = qcow2_cache_flush_dependency(bs, c);
+        if (ret < 0) {
+            return ret;
+        }
+        if (c == s->l2_table_cache) {
+            BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
+        } else {
+            BLKDBG_EVENT(bs->file, BLKDBG_REFBLOCK_UPDATE_PART);
+        }
+        ret = bdrv_pwrite(bs->file, e->offset + start,
+                          (uint8_t *)e->table + start, end - start);
+        if (ret < 0) {
+            return ret;
+        }
+        c->written = 1;
+        return 0;
+    }
+
+    if (!e->dirty) {
+        e->dirty = 1;
+        c->nb_dirty++;
+    }
+    return 0;
+}
+
+static void qcow2_cache_load_cb(void *opaque, int ret)
+{
+    Qcow2CacheLoad *load = opaque;
+    BlockDriverState *bs = load->bs;
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Cache *c = load->c;
+    Qcow2CacheWaiter *w;
+    int i;
+
+    /*
+     * This runs in an AIO completion, so don't write back a dirty table
+     * synchronously to make room.  If all are dirty, write them back in the
+     * background and install the table after that; the waiters would only
+     * read it again otherwise.  The load stays listed meanwhile, so that
+     * others wait for it rather than starting their own read.
+     */
+    if (ret >= 0 && !load->stale && qcow2_cache_find(bs, c, load->offset) < 0) {
+        i = qcow2_cache_evict_clean(bs, c);
+        if (i >= 0) {
+            memcpy(c->entries[i].table, load->table, s->cluster_size);
+            c->entries[i].offset = load->offset;
+            hash_insert(bs, c, i);
+            lru_unlink(c, i);
+            lru_push_head(c, i);
+        } else if (!load->flushed) {
+            load->flushed = 1;
+            if (qcow2_cache_flush_aio(bs, c, qcow2_cache_load_cb, load) > 0 ||
+                qcow2_cache_wait_idle(c, qcow2_cache_load_cb, load) > 0) {
+                return;
+            }
+        }
+    }
+
+    QLIST_REMOVE(load, next);
+
+    /*
+     * Waiters that find the table gone again (or the read failed) simply
+     * fall back to qcow2_cache_get(), so only pass on real I/O errors.
+     */
+    while ((w = QLIST_FIRST(&load->waiters)) != NULL) {
+        QLIST_REMOVE(w, next);
+        w->cb(w->opaque, ret < 0 ? ret : 0);
+        qemu_free(w);
+    }
+
+    qemu_vfree(load->table);
+    qemu_free(load);
+}
+
+/*
+ * Starts reading the table at 'offset' without blocking if it is not cached.
+ * Returns 0 if the table is cached already, 1 if cb will be called once the
+ * read has completed, or -errno if the read couldn't be started.
+ *
+ * The table is not pinned: callers are expected to look it up again with
+ * qcow2_cache_get() from cb, which reads it synchronously if it has been
+ * evicted in between.
+ */
+int qcow2_cache_load_aio(BlockDriverState *bs, Qcow2Cache *c, int64_t offset,
+    BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CacheLoad *load;
+    Qcow2CacheWaiter *w;
+
+    if (qcow2_cache_find(bs, c, offset) >= 0) {
+        return 0;
+    }
+
+    w = qemu_malloc(sizeof(*w));
+    w->cb = cb;
+    w->opaque = opaque;
+
+    QLIST_FOREACH(load, &c->loads, next) {
+        if (load->offset == offset && !load->stale) {
+            QLIST_INSERT_HEAD(&load->waiters, w, next);
+            return 1;
+        }
+    }
+
+    c->misses++;
+
+    load = qemu_mallocz(sizeof(*load));
+    load->bs = bs;
+    load->c = c;
+    load->offset = offset;
+    load->table = qemu_blockalign(bs->file, s->cluster_size);
+    load->iov.iov_base = load->table;
+    load->iov.iov_len = s->cluster_size;
+    qemu_iovec_init_external(&load->qiov, &load->iov, 1);
+    QLIST_INIT(&load->waiters);
+    QLIST_INSERT_HEAD(&load->waiters, w, next);
+    QLIST_INSERT_HEAD(&c->loads, load, next);
+
+    if (c == s->l2_table_cache) {
+        BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
+    } else {
+        BLKDBG_EVENT(bs->file, BLKDBG_REFBLOCK_LOAD);
+    }
+    if (bdrv_aio_readv(bs->file, offset >> 9, &load->qiov,
+                       s->cluster_size >> 9, qcow2_cache_load_cb, load) == NULL) {
+        QLIST_REMOVE(load, next);
+        qemu_vfree(load->table);
+        qemu_free(load);
+        qemu_free(w);
+        return -EIO;
+    }
+    return 1;
+}
+
+static void qcow2_cache_remove_waiters(struct Qcow2CacheWaiters *list,
+                                       void *opaque)
+{
+    Qcow2CacheWaiter *w, *next_w;
+
+    QLIST_FOREACH_SAFE(w, list, next, next_w) {
+        if (w->opaque == opaque) {
+            QLIST_REMOVE(w, next);
+            qemu_free(w);
+        }
+    }
+}
+
+/*
+ * Forgets about a request waiting in qcow2_cache_load_aio(),
+ * qcow2_cache_flush_aio() or qcow2_cache_wait_idle()
+ */
+void qcow2_cache_cancel(Qcow2Cache *c, void *opaque)
+{
+    Qcow2CacheLoad *load;
+
+    QLIST_FOREACH(load, &c->loads, next) {
+        qcow2_cache_remove_waiters(&load->waiters, opaque);
+    }
+    if (c->flush) {
+        qcow2_cache_remove_waiters(&c->flush->waiters, opaque);
+    }
+    qcow2_cache_remove_waiters(&c->flush_waiters, opaque);
+    qcow2_cache_remove_waiters(&c->idle_waiters, opaque);
+}
+
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses)
+{
+    *hits = c->hits;
+    *misses = c->misses;
+}
@@ -39,6 +39,12 @@ int qcow2_grow_l1_table(BlockDriverState *bs, int min_size)
     new_l1_size = s->l1_size;
     if (min_size <= new_l1_size)
         return 0;
+
+    /* the L1 updates of qcow2_l2_alloc_aio() go to the old table */
+    while (!QLIST_EMPTY(&s->l2_allocs)) {
+        qemu_aio_wait();
+    }
+
     if (new_l1_size == 0) {
         new_l1_size = 1;
     }
@@ -94,99 +100,57 @@ void qcow2_l2_cache_reset(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
 
-    memset(s->l2_cache, 0, s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t));
-    memset(s->l2_cache_offsets, 0, L2_CACHE_SIZE * sizeof(uint64_t));
-    memset(s->l2_cache_counts, 0, L2_CACHE_SIZE * sizeof(uint32_t));
-}
-
-static inline int l2_cache_new_entry(BlockDriverState *bs)
-{
-    BDRVQcowState *s = bs->opaque;
-    uint32_t min_count;
-    int min_index, i;
-
-    /* find a new entry in the least used one */
-    min_index = 0;
-    min_count = 0xffffffff;
-    for(i = 0; i < L2_CACHE_SIZE; i++) {
-        if (s->l2_cache_counts[i] < min_count) {
-            min_count = s->l2_cache_counts[i];
-            min_index = i;
-        }
-    }
-    return min_index;
+    qcow2_cache_flush(bs, s->l2_table_cache);
+    qcow2_cache_reset(bs, s->l2_table_cache);
 }
 
 /*
- * seek_l2_table
+ * l2_load
  *
- * seek l2_offset in the l2_cache table
- * if not found, return NULL,
- * if found,
- *   increments the l2 cache hit count of the entry,
- *   if counter overflow, divide by two all counters
- *   return the pointer to the l2 cache entry
+ * Loads a L2 table into memory. If the table is in the cache, the cache
+ * is used; otherwise the L2 table is loaded from the image file.
  *
+ * Returns 0 and a pointer to the cached L2 table on success, or -errno if
+ * the read from the image file failed.
  */
 
-static uint64_t *seek_l2_table(BDRVQcowState *s, uint64_t l2_offset)
+static int l2_load(BlockDriverState *bs, uint64_t l2_offset,
+    uint64_t **l2_table)
 {
-    int i, j;
-
-    for(i = 0; i < L2_CACHE_SIZE; i++) {
-        if (l2_offset == s->l2_cache_offsets[i]) {
-            /* increment the hit count */
-            if (++s->l2_cache_counts[i] == 0xffffffff) {
-                for(j = 0; j < L2_CACHE_SIZE; j++) {
-                    s->l2_cache_counts[j] >>= 1;
-                }
-            }
-            return s->l2_cache + (i << s->l2_bits);
-        }
-    }
-    return NULL;
+    BDRVQcowState *s = bs->opaque;
+
+    return qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
+        (void **) l2_table);
 }
 
 /*
- * l2_load
+ * l2_load_aio
  *
- * Loads a L2 table into memory. If the table is in the cache, the cache
- * is used; otherwise the L2 table is loaded from the image file.
+ * Starts loading the L2 table that maps the given disk offset, so that the
+ * AIO paths don't have to block on the read in l2_load().
  *
- * Returns a pointer to the L2 table on success, or NULL if the read from
- * the image file failed.
+ * Returns 0 if there is nothing to wait for (the table is cached or doesn't
+ * exist yet), 1 if cb will be called once it has been loaded, or -errno.
  */
 
-static int l2_load(BlockDriverState *bs, uint64_t l2_offset,
-    uint64_t **l2_table)
+int qcow2_l2_load_aio(BlockDriverState *bs, uint64_t offset,
+    BlockDriverCompletionFunc *cb, void *opaque)
 {
     BDRVQcowState *s = bs->opaque;
-    int min_index;
-    int ret;
-
-    /* seek if the table for the given offset is in the cache */
+    unsigned int l1_index;
+    uint64_t l2_offset;
 
-    *l2_table = seek_l2_table(s, l2_offset);
-    if (*l2_table != NULL) {
+    l1_index = offset >> (s->l2_bits + s->cluster_bits);
+    if (l1_index >= s->l1_size) {
         return 0;
     }
 
-    /* not found: load a new entry in the least used one */
-
-    min_index = l2_cache_new_entry(bs);
-    *l2_table = s->l2_cache + (min_index << s->l2_bits);
-
-    BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
-    ret = bdrv_pread(bs->file, l2_offset, *l2_table,
-        s->l2_size * sizeof(uint64_t));
-    if (ret < 0) {
-        return ret;
+    l2_offset = s->l1_table[l1_index] & ~QCOW_OFLAG_COPIED;
+    if (!l2_offset) {
+        return 0;
     }
 
-    s->l2_cache_offsets[min_index] = l2_offset;
-    s->l2_cache_counts[min_index] = 1;
-
-    return 0;
+    return qcow2_cache_load_aio(bs, s->l2_table_cache, l2_offset, cb, opaque);
 }
 
 /*
@@ -194,6 +158,8 @@ static int l2_load(BlockDriverState *bs, uint64_t l2_offset,
  * and we really don't want bdrv_pread to perform a read-modify-write)
  */
 #define L1_ENTRIES_PER_SECTOR (512 / 8)
+static void l2_alloc_kick(BDRVQcowState *s);
+
 static int write_l1_entry(BlockDriverState *bs, int l1_index)
 {
     BDRVQcowState *s = bs->opaque;
@@ -201,6 +167,12 @@ static int write_l1_entry(BlockDriverState *bs, int l1_index)
     int l1_start_index;
     int i, ret;
 
+    /* an L1 update of qcow2_l2_alloc_aio() may be writing the same sector */
+    while (s->l1_writing) {
+        qemu_aio_wait();
+    }
+    s->l1_writing = 1;
+
     l1_start_index = l1_index & ~(L1_ENTRIES_PER_SECTOR - 1);
     for (i = 0; i < L1_ENTRIES_PER_SECTOR; i++) {
         buf[i] = cpu_to_be64(s->l1_table[l1_start_index + i]);
@@ -209,6 +181,8 @@ static int write_l1_entry(BlockDriverState *bs, int l1_index)
     BLKDBG_EVENT(bs->file, BLKDBG_L1_UPDATE);
     ret = bdrv_pwrite_sync(bs->file, s->l1_table_offset + 8 * l1_start_index,
         buf, sizeof(buf));
+    s->l1_writing = 0;
+    l2_alloc_kick(s);
     if (ret < 0) {
         return ret;
     }
@@ -229,9 +203,8 @@ static int write_l1_entry(BlockDriverState *bs, int l1_index)
 static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 {
     BDRVQcowState *s = bs->opaque;
-    int min_index;
     uint64_t old_l2_offset;
-    uint64_t *l2_table;
+    uint64_t *old_table = NULL, *l2_table;
     int64_t l2_offset;
     int ret;
 
@@ -244,52 +217,357 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         return l2_offset;
     }
 
+    /* if there was an old l2 table, load it before taking the new entry */
+    if (old_l2_offset != 0) {
+        BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_COW_READ);
+        ret = l2_load(bs, old_l2_offset & ~QCOW_OFLAG_COPIED, &old_table);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
     /* allocate a new entry in the l2 cache */
 
-    min_index = l2_cache_new_entry(bs);
-    l2_table = s->l2_cache + (min_index << s->l2_bits);
+    ret = qcow2_cache_get_empty(bs, s->l2_table_cache, l2_offset,
+        (void **) &l2_table);
+    if (ret < 0) {
+        goto fail;
+    }
 
-    if (old_l2_offset == 0) {
+    if (old_table == NULL) {
         /* if there was no old l2 table, clear the new table */
         memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
     } else {
-        /* if there was an old l2 table, read it from the disk */
-        BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_COW_READ);
-        ret = bdrv_pread(bs->file, old_l2_offset, l2_table,
-            s->l2_size * sizeof(uint64_t));
-        if (ret < 0) {
-            goto fail;
-        }
+        memcpy(l2_table, old_table, s->l2_size * sizeof(uint64_t));
     }
-    /* write the l2 table to the file */
+
+    /* write the l2 table to the file before the L1 entry points to it */
     BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_WRITE);
-    ret = bdrv_pwrite_sync(bs->file, l2_offset, l2_table,
-        s->l2_size * sizeof(uint64_t));
+    ret = qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table,
+        0, s->l2_size * sizeof(uint64_t));
     if (ret < 0) {
-        goto fail;
+        goto fail_discard;
+    }
+    ret = qcow2_cache_flush(bs, s->l2_table_cache);
+    if (ret < 0) {
+        goto fail_discard;
     }
 
     /* update the L1 entry */
     s->l1_table[l1_index] = l2_offset | QCOW_OFLAG_COPIED;
     ret = write_l1_entry(bs, l1_index);
     if (ret < 0) {
-        goto fail;
+        goto fail_discard;
     }
 
-    /* update the l2 cache entry */
-
-    s->l2_cache_offsets[min_index] = l2_offset;
-    s->l2_cache_counts[min_index] = 1;
-
     *table = l2_table;
     return 0;
 
+fail_discard:
+    qcow2_cache_discard(bs, s->l2_table_cache, l2_offset);
 fail:
     s->l1_table[l1_index] = old_l2_offset;
-    qcow2_l2_cache_reset(bs);
     return ret;
 }
 
+/*
+ * An L2 table being allocated by qcow2_l2_alloc_aio().  The L1 entry in memory
+ * keeps its old value until both the new table and the L1 sector pointing to
+ * it are on the disk, so reads go on using the old mapping in the meantime;
+ * writes to the same L1 entry wait for the allocation.
+ */
+typedef struct QCowL2AllocWaiter {
+    BlockDriverCompletionFunc *cb;
+    void *opaque;
+    QLIST_ENTRY(QCowL2AllocWaiter) next;
+} QCowL2AllocWaiter;
+
+enum {
+    QCOW_L2_ALLOC_START,
+    QCOW_L2_ALLOC_FLUSH,        /* the new table is being written */
+    QCOW_L2_ALLOC_L1_QUEUED,    /* waiting for another L1 update */
+    QCOW_L2_ALLOC_L1_WRITE,
+    QCOW_L2_ALLOC_L1_SYNC,
+};
+
+struct QCowL2Alloc {
+    BlockDriverState *bs;
+    int l1_index;
+    int step;
+    uint64_t old_l2_offset;     /* the table shared with a snapshot, if any */
+    int64_t l2_offset;
+    QEMUBH *bh;
+    uint64_t l1_buf[L1_ENTRIES_PER_SECTOR];
+    struct iovec iov;
+    QEMUIOVector qiov;
+    QLIST_HEAD(, QCowL2AllocWaiter) waiters;
+    QLIST_ENTRY(QCowL2Alloc) next;
+};
+
+/* Fills a new L2 table in the cache, copying the old one if there is one */
+static int l2_alloc_table(QCowL2Alloc *a)
+{
+    BlockDriverState *bs = a->bs;
+    BDRVQcowState *s = bs->opaque;
+    uint64_t *old_table = NULL, *l2_table;
+    int ret;
+
+    a->l2_offset = qcow2_alloc_clusters(bs, s->l2_size * sizeof(uint64_t));
+    if (a->l2_offset < 0) {
+        return a->l2_offset;
+    }
+
+    if (a->old_l2_offset != 0) {
+        BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_COW_READ);
+        ret = l2_load(bs, a->old_l2_offset, &old_table);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    ret = qcow2_cache_get_empty(bs, s->l2_table_cache, a->l2_offset,
+        (void **) &l2_table);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (old_table == NULL) {
+        memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
+    } else {
+        memcpy(l2_table, old_table, s->l2_size * sizeof(uint64_t));
+    }
+
+    BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_WRITE);
+    return qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table,
+        0, s->l2_size * sizeof(uint64_t));
+}
+
+static void l2_alloc_cb(void *opaque, int ret)
+{
+    QCowL2Alloc *a = opaque;
+    BlockDriverState *bs = a->bs;
+    BDRVQcowState *s = bs->opaque;
+    QCowL2AllocWaiter *w;
+    int i, l1_start_index, l1_locked = 0;
+
+    if (a->bh) {
+        qemu_bh_delete(a->bh);
+        a->bh = NULL;
+    }
+    if (ret < 0) {
+        goto done;
+    }
+
+    switch (a->step) {
+    case QCOW_L2_ALLOC_START:
+        /* the old table must be cached, and it may be evicted while we wait */
+        ret = 0;
+        if (a->old_l2_offset) {
+            ret = qcow2_cache_load_aio(bs, s->l2_table_cache,
+                                       a->old_l2_offset, l2_alloc_cb, a);
+        }
+        if (ret == 0) {
+            ret = qcow2_refcount_load_aio(bs, l2_alloc_cb, a);
+        }
+        if (ret == 0) {
+            ret = qcow2_cache_wait_idle_all(bs, l2_alloc_cb, a);
+        }
+        if (ret > 0) {
+            return;
+        } else if (ret < 0) {
+            goto done;
+        }
+
+        qcow2_cache_set_deferred(s->l2_table_cache, 1);
+        qcow2_cache_set_deferred(s->refcount_block_cache, 1);
+        ret = l2_alloc_table(a);
+        qcow2_cache_set_deferred(s->refcount_block_cache, 0);
+        qcow2_cache_set_deferred(s->l2_table_cache, 0);
+        if (ret < 0) {
+            goto done;
+        }
+
+        /* write the L2 table (and the refcounts) before the L1 entry */
+        a->step = QCOW_L2_ALLOC_FLUSH;
+        ret = qcow2_cache_flush_aio(bs, s->l2_table_cache, l2_alloc_cb, a);
+        if (ret > 0) {
+            return;
+        } else if (ret < 0) {
+            goto done;
+        }
+        /* fall through */
+    case QCOW_L2_ALLOC_FLUSH:
+    case QCOW_L2_ALLOC_L1_QUEUED:
+        /* each L1 update writes its sector as left by the previous one */
+        if (s->l1_writing) {
+            a->step = QCOW_L2_ALLOC_L1_QUEUED;
+            return;
+        }
+        s->l1_writing = 1;
+        a->step = QCOW_L2_ALLOC_L1_WRITE;
+
+        l1_start_index = a->l1_index & ~(L1_ENTRIES_PER_SECTOR - 1);
+        for (i = 0; i < L1_ENTRIES_PER_SECTOR; i++) {
+            a->l1_buf[i] = cpu_to_be64(s->l1_table[l1_start_index + i]);
+        }
+        a->l1_buf[a->l1_index - l1_start_index] =
+            cpu_to_be64(a->l2_offset | QCOW_OFLAG_COPIED);
+
+        BLKDBG_EVENT(bs->file, BLKDBG_L1_UPDATE);
+        if (bdrv_aio_writev(bs->file,
+                            (s->l1_table_offset >> 9) + l1_start_index /
+                            L1_ENTRIES_PER_SECTOR, &a->qiov, 1,
+                            l2_alloc_cb, a)) {
+            return;
+        }
+        l1_locked = 1;
+        ret = -EIO;
+        goto done;
+    case QCOW_L2_ALLOC_L1_WRITE:
+        a->step = QCOW_L2_ALLOC_L1_SYNC;
+        if (bdrv_aio_flush(bs->file, l2_alloc_cb, a)) {
+            return;
+        }
+        l1_locked = 1;
+        ret = -EIO;
+        goto done;
+    case QCOW_L2_ALLOC_L1_SYNC:
+        s->l1_table[a->l1_index] = a->l2_offset | QCOW_OFLAG_COPIED;
+        if (a->old_l2_offset) {
+            /* the L1 sector stays locked until the old table is freed */
+            ret = qcow2_cache_wait_idle_all(bs, l2_alloc_cb, a);
+            if (ret > 0) {
+                return;
+            }
+            qcow2_cache_set_deferred(s->refcount_block_cache, 1);
+            qcow2_free_clusters(bs, a->old_l2_offset,
+                s->l2_size * sizeof(uint64_t));
+            qcow2_cache_set_deferred(s->refcount_block_cache, 0);
+        }
+        break;
+    }
+
+done:
+    if (a->step >= QCOW_L2_ALLOC_L1_WRITE) {
+        l1_locked = 1;
+    }
+    if (ret < 0 && a->l2_offset > 0) {
+        qcow2_cache_discard(bs, s->l2_table_cache, a->l2_offset);
+    }
+    QLIST_REMOVE(a, next);
+
+    if (l1_locked) {
+        s->l1_writing = 0;
+        l2_alloc_kick(s);
+    }
+
+    while ((w = QLIST_FIRST(&a->waiters)) != NULL) {
+        QLIST_REMOVE(w, next);
+        w->cb(w->opaque, ret);
+        qemu_free(w);
+    }
+    qemu_free(a);
+}
+
+/* Starts the next L1 update that waits for the sector to be written */
+static void l2_alloc_kick(BDRVQcowState *s)
+{
+    QCowL2Alloc *a;
+
+    QLIST_FOREACH(a, &s->l2_allocs, next) {
+        if (a->step == QCOW_L2_ALLOC_L1_QUEUED) {
+            l2_alloc_cb(a, 0);
+            break;
+        }
+    }
+}
+
+static void l2_alloc_bh(void *opaque)
+{
+    l2_alloc_cb(opaque, 0);
+}
+
+/*
+ * l2_alloc_aio
+ *
+ * Allocates the L2 table that maps the given disk offset without blocking if
+ * the L1 entry has none of its own yet, so that the AIO write path doesn't
+ * have to call l2_allocate(), which writes the table and the L1 entry
+ * synchronously.
+ *
+ * Returns 0 if there is nothing to wait for, or 1 if cb will be called once
+ * the table is allocated.
+ */
+int qcow2_l2_alloc_aio(BlockDriverState *bs, uint64_t offset,
+    BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BDRVQcowState *s = bs->opaque;
+    unsigned int l1_index;
+    QCowL2Alloc *a;
+    QCowL2AllocWaiter *w;
+
+    l1_index = offset >> (s->l2_bits + s->cluster_bits);
+    if (l1_index >= s->l1_size && QLIST_EMPTY(&s->l2_allocs)) {
+        /* growing the L1 table is left to get_cluster_table() */
+        return 0;
+    }
+    if (l1_index < s->l1_size && (s->l1_table[l1_index] & QCOW_OFLAG_COPIED)) {
+        return 0;
+    }
+
+    w = qemu_malloc(sizeof(*w));
+    w->cb = cb;
+    w->opaque = opaque;
+
+    /* get_cluster_table() must not wait for the allocations to grow L1 */
+    if (l1_index >= s->l1_size) {
+        a = QLIST_FIRST(&s->l2_allocs);
+        QLIST_INSERT_HEAD(&a->waiters, w, next);
+        return 1;
+    }
+
+    QLIST_FOREACH(a, &s->l2_allocs, next) {
+        if (a->l1_index == l1_index) {
+            QLIST_INSERT_HEAD(&a->waiters, w, next);
+            return 1;
+        }
+    }
+
+    a = qemu_mallocz(sizeof(*a));
+    a->bs = bs;
+    a->l1_index = l1_index;
+    a->step = QCOW_L2_ALLOC_START;
+    a->old_l2_offset = s->l1_table[l1_index];
+    a->iov.iov_base = a->l1_buf;
+    a->iov.iov_len = sizeof(a->l1_buf);
+    qemu_iovec_init_external(&a->qiov, &a->iov, 1);
+    QLIST_INIT(&a->waiters);
+    QLIST_INSERT_HEAD(&a->waiters, w, next);
+
+    a->bh = qemu_bh_new(l2_alloc_bh, a);
+    qemu_bh_schedule(a->bh);
+
+    QLIST_INSERT_HEAD(&s->l2_allocs, a, next);
+    return 1;
+}
+
+/* Forgets about a request waiting in qcow2_l2_alloc_aio() */
+void qcow2_l2_alloc_cancel(BlockDriverState *bs, void *opaque)
+{
+    BDRVQcowState *s = bs->opaque;
+    QCowL2Alloc *a;
+    QCowL2AllocWaiter *w, *next_w;
+
+    QLIST_FOREACH(a, &s->l2_allocs, next) {
+        QLIST_FOREACH_SAFE(w, &a->waiters, next, next_w) {
+            if (w->opaque == opaque) {
+                QLIST_REMOVE(w, next);
+                qemu_free(w);
+            }
+        }
+    }
+}
+
 static int count_contiguous_clusters(uint64_t nb_clusters, int cluster_size,
         uint64_t *l2_table, uint64_t start, uint64_t mask)
 {
@@ -348,6 +626,8 @@ static int qcow_read(BlockDriverState *bs, int64_t sector_num,
     BDRVQcowState *s = bs->opaque;
     int ret, index_in_cluster, n, n1;
     uint64_t cluster_offset;
+    struct iovec iov;
+    QEMUIOVector qiov;
 
     while (nb_sectors > 0) {
         n = nb_sectors;
@@ -362,7 +642,10 @@ static int qcow_read(BlockDriverState *bs, int64_t sector_num,
         if (!cluster_offset) {
             if (bs->backing_hd) {
                 /* read from the base image */
-                n1 = qcow2_backing_read1(bs->backing_hd, sector_num, buf, n);
+                iov.iov_base = buf;
+                iov.iov_len = n * 512;
+                qemu_iovec_init_external(&qiov, &iov, 1);
+                n1 = qcow2_backing_read1(bs->backing_hd, &qiov, sector_num, n);
                 if (n1 > 0) {
                     BLKDBG_EVENT(bs->file, BLKDBG_READ_BACKING);
                     ret = bdrv_read(bs->backing_hd, sector_num, buf, n1);
@@ -559,6 +842,15 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
             return ret;
         }
     } else {
+        /* don't race with qcow2_l2_alloc_aio() for the entry or its sector */
+        while (!QLIST_EMPTY(&s->l2_allocs)) {
+            qemu_aio_wait();
+        }
+        l2_offset = s->l1_table[l1_index];
+        if (l2_offset & QCOW_OFLAG_COPIED) {
+            return get_cluster_table(bs, offset, new_l2_table, new_l2_offset,
+                                     new_l2_index);
+        }
         if (l2_offset)
             qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t));
         ret = l2_allocate(bs, l1_index, &l2_table);
@@ -631,67 +923,77 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE_COMPRESSED);
     l2_table[l2_index] = cpu_to_be64(cluster_offset);
-    if (bdrv_pwrite_sync(bs->file,
-                    l2_offset + l2_index * sizeof(uint64_t),
-                    l2_table + l2_index,
-                    sizeof(uint64_t)) < 0)
+    if (qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table,
+                    l2_index * sizeof(uint64_t), sizeof(uint64_t)) < 0)
         return 0;
 
     return cluster_offset;
 }
 
 /*
- * Write L2 table updates to disk, writing whole sectors to avoid a
- * read-modify-write in bdrv_pwrite
+ * alloc_cluster_next_cow
+ *
+ * Returns the next part of the clusters allocated for m that the request
+ * doesn't write and that must be copied from the old contents (backing file,
+ * compressed or shared cluster), and removes it from m.  *n_start counts
+ * sectors from the start of the first allocated cluster.
+ *
+ * Returns 1 if a part was returned, 0 if nothing is left to copy.
  */
-#define L2_ENTRIES_PER_SECTOR (512 / 8)
-static int write_l2_entries(BlockDriverState *bs, uint64_t *l2_table,
-    uint64_t l2_offset, int l2_index, int num)
+int qcow2_alloc_cluster_next_cow(BlockDriverState *bs, QCowL2Meta *m,
+    int *n_start, int *nb_sectors)
 {
-    int l2_start_index = l2_index & ~(L1_ENTRIES_PER_SECTOR - 1);
-    int start_offset = (8 * l2_index) & ~511;
-    int end_offset = (8 * (l2_index + num) + 511) & ~511;
-    size_t len = end_offset - start_offset;
-    int ret;
+    BDRVQcowState *s = bs->opaque;
+    int end;
 
-    BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
-    ret = bdrv_pwrite(bs->file, l2_offset + start_offset,
-        &l2_table[l2_start_index], len);
-    if (ret < 0) {
-        return ret;
+    if (m->nb_clusters == 0) {
+        return 0;
+    }
+
+    if (m->n_start) {
+        *n_start = 0;
+        *nb_sectors = m->n_start;
+        m->n_start = 0;
+        return 1;
+    }
+
+    if (m->nb_available & (s->cluster_sectors - 1)) {
+        end = (m->nb_available + s->cluster_sectors - 1) &
+            ~(s->cluster_sectors - 1);
+        *n_start = m->nb_available;
+        *nb_sectors = end - m->nb_available;
+        m->nb_available = end;
+        return 1;
     }
 
     return 0;
 }
 
-int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
+/*
+ * alloc_cluster_update_l2
+ *
+ * Points the L2 entries of m at its newly allocated clusters, whose contents
+ * must have been written.  The clusters that the entries pointed to before
+ * are returned in *old_clusters, which the caller frees with qemu_free(), for
+ * the caller to release once the L2 table is on the disk.
+ *
+ * Returns 0 on success, -errno in error case.
+ */
+int qcow2_alloc_cluster_update_l2(BlockDriverState *bs, QCowL2Meta *m,
+    uint64_t **old_clusters, int *nb_old_clusters)
 {
     BDRVQcowState *s = bs->opaque;
     int i, j = 0, l2_index, ret;
-    uint64_t *old_cluster, start_sect, l2_offset, *l2_table;
+    uint64_t *old_cluster, l2_offset, *l2_table;
     uint64_t cluster_offset = m->cluster_offset;
 
+    *old_clusters = NULL;
+    *nb_old_clusters = 0;
     if (m->nb_clusters == 0)
         return 0;
 
     old_cluster = qemu_malloc(m->nb_clusters * sizeof(uint64_t));
 
-    /* copy content of unmodified sectors */
-    start_sect = (m->offset & ~(s->cluster_size - 1)) >> 9;
-    if (m->n_start) {
-        ret = copy_sectors(bs, start_sect, cluster_offset, 0, m->n_start);
-        if (ret < 0)
-            goto err;
-    }
-
-    if (m->nb_available & (s->cluster_sectors - 1)) {
-        uint64_t end = m->nb_available & ~(uint64_t)(s->cluster_sectors - 1);
-        ret = copy_sectors(bs, start_sect + end, cluster_offset + (end << 9),
-                m->nb_available - end, s->cluster_sectors);
-        if (ret < 0)
-            goto err;
-    }
-
     /* update L2 table */
     ret = get_cluster_table(bs, m->offset, &l2_table, &l2_offset, &l2_index);
     if (ret < 0) {
@@ -706,27 +1008,64 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 	 * copy_sectors()), update l2 table with its cluster pointer and free
 	 * old cluster. This is what this loop does */
         if(l2_table[l2_index + i] != 0)
-            old_cluster[j++] = l2_table[l2_index + i];
+            old_cluster[j++] = be64_to_cpu(l2_table[l2_index + i]) &
+                ~QCOW_OFLAG_COPIED;
 
         l2_table[l2_index + i] = cpu_to_be64((cluster_offset +
                     (i << s->cluster_bits)) | QCOW_OFLAG_COPIED);
      }
 
-    ret = write_l2_entries(bs, l2_table, l2_offset, l2_index, m->nb_clusters);
+    ret = qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table,
+        l2_index * sizeof(uint64_t), m->nb_clusters * sizeof(uint64_t));
     if (ret < 0) {
-        qcow2_l2_cache_reset(bs);
+        qcow2_cache_discard(bs, s->l2_table_cache, l2_offset);
         goto err;
     }
 
+    *old_clusters = old_cluster;
+    *nb_old_clusters = j;
+    return 0;
+
+err:
+    qemu_free(old_cluster);
+    return ret;
+}
+
+int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i, j, ret, n_start, n;
+    uint64_t *old_cluster, start_sect;
+
+    if (m->nb_clusters == 0)
+        return 0;
+
+    /* copy content of unmodified sectors, unless the caller has done so */
+    start_sect = (m->offset & ~(s->cluster_size - 1)) >> 9;
+    while (qcow2_alloc_cluster_next_cow(bs, m, &n_start, &n)) {
+        ret = copy_sectors(bs, start_sect, m->cluster_offset, n_start,
+                n_start + n);
+        if (ret < 0)
+            return ret;
+    }
+
+    ret = qcow2_alloc_cluster_update_l2(bs, m, &old_cluster, &j);
+    if (ret < 0) {
+        return ret;
+    }
+
     /*
      * If this was a COW, we need to decrease the refcount of the old cluster.
-     * Also flush bs->file to get the right order for L2 and refcount update.
+     * Also flush the L2 table to get the right order for L2 and refcount
+     * update.
      */
     if (j != 0) {
-        bdrv_flush(bs->file);
+        ret = qcow2_cache_flush(bs, s->l2_table_cache);
+        if (ret < 0) {
+            goto err;
+        }
         for (i = 0; i < j; i++) {
-            qcow2_free_any_clusters(bs,
-                be64_to_cpu(old_cluster[i]) & ~QCOW_OFLAG_COPIED, 1);
+            qcow2_free_any_clusters(bs, old_cluster[i], 1);
         }
     }
 
@@ -734,7 +1073,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 err:
     qemu_free(old_cluster);
     return ret;
- }
+}
 
 /*
  * alloc_cluster_offset
@@ -759,7 +1098,7 @@ int qcow2_alloc_cluster_offset(BlockDriverState *bs, uint64_t offset,
     int n_start, int n_end, int *num, QCowL2Meta *m)
 {
     BDRVQcowState *s = bs->opaque;
-    int l2_index, ret;
+    int l2_index, ret, n;
     uint64_t l2_offset, *l2_table;
     int64_t cluster_offset;
     unsigned int nb_clusters, i = 0;
@@ -858,11 +1197,13 @@ int qcow2_alloc_cluster_offset(BlockDriverState *bs, uint64_t offset,
 
     /* allocate a new cluster */
 
-    cluster_offset = qcow2_alloc_clusters(bs, nb_clusters * s->cluster_size);
+    n = nb_clusters;
+    cluster_offset = qcow2_alloc_data_clusters(bs, &n);
     if (cluster_offset < 0) {
         QLIST_REMOVE(m, next_in_flight);
         return cluster_offset;
     }
+    nb_clusters = n;
 
     /* save info needed for meta data update */
     m->offset = offset;
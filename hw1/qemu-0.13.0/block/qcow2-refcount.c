@@ -32,27 +32,6 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
                             int addend);
 
 
-static int cache_refcount_updates = 0;
-
-static int write_refcount_block(BlockDriverState *bs)
-{
-    BDRVQcowState *s = bs->opaque;
-    size_t size = s->cluster_size;
-
-    if (s->refcount_block_cache_offset == 0) {
-        return 0;
-    }
-
-    BLKDBG_EVENT(bs->file, BLKDBG_REFBLOCK_UPDATE);
-    if (bdrv_pwrite_sync(bs->file, s->refcount_block_cache_offset,
-            s->refcount_block_cache, size) < 0)
-    {
-        return -EIO;
-    }
-
-    return 0;
-}
-
 /*********************************************************/
 /* refcount handling */
 
@@ -61,7 +40,6 @@ int qcow2_refcount_init(BlockDriverState *bs)
     BDRVQcowState *s = bs->opaque;
     int ret, refcount_table_size2, i;
 
-    s->refcount_block_cache = qemu_malloc(s->cluster_size);
     refcount_table_size2 = s->refcount_table_size * sizeof(uint64_t);
     s->refcount_table = qemu_malloc(refcount_table_size2);
     if (s->refcount_table_size > 0) {
@@ -81,33 +59,18 @@ int qcow2_refcount_init(BlockDriverState *bs)
 void qcow2_refcount_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
-    qemu_free(s->refcount_block_cache);
     qemu_free(s->refcount_table);
 }
 
 
 static int load_refcount_block(BlockDriverState *bs,
-                               int64_t refcount_block_offset)
+                               int64_t refcount_block_offset,
+                               uint16_t **refcount_block)
 {
     BDRVQcowState *s = bs->opaque;
-    int ret;
 
-    if (cache_refcount_updates) {
-        ret = write_refcount_block(bs);
-        if (ret < 0) {
-            return ret;
-        }
-    }
-
-    BLKDBG_EVENT(bs->file, BLKDBG_REFBLOCK_LOAD);
-    ret = bdrv_pread(bs->file, refcount_block_offset, s->refcount_block_cache,
-                     s->cluster_size);
-    if (ret < 0) {
-        return ret;
-    }
-
-    s->refcount_block_cache_offset = refcount_block_offset;
-    return 0;
+    return qcow2_cache_get(bs, s->refcount_block_cache, refcount_block_offset,
+        (void **) refcount_block);
 }
 
 /*
@@ -120,6 +83,7 @@ static int get_refcount(BlockDriverState *bs, int64_t cluster_index)
     BDRVQcowState *s = bs->opaque;
     int refcount_table_index, block_index;
     int64_t refcount_block_offset;
+    uint16_t *refcount_block;
     int ret;
 
     refcount_table_index = cluster_index >> (s->cluster_bits - REFCOUNT_SHIFT);
@@ -128,16 +92,15 @@ static int get_refcount(BlockDriverState *bs, int64_t cluster_index)
     refcount_block_offset = s->refcount_table[refcount_table_index];
     if (!refcount_block_offset)
         return 0;
-    if (refcount_block_offset != s->refcount_block_cache_offset) {
-        /* better than nothing: return allocated if read error */
-        ret = load_refcount_block(bs, refcount_block_offset);
-        if (ret < 0) {
-            return ret;
-        }
+
+    ret = load_refcount_block(bs, refcount_block_offset, &refcount_block);
+    if (ret < 0) {
+        return ret;
     }
+
     block_index = cluster_index &
         ((1 << (s->cluster_bits - REFCOUNT_SHIFT)) - 1);
-    return be16_to_cpu(s->refcount_block_cache[block_index]);
+    return be16_to_cpu(refcount_block[block_index]);
 }
 
 /*
@@ -173,9 +136,11 @@ static int in_same_refcount_block(BDRVQcowState *s, uint64_t offset_a,
  * Loads a refcount block. If it doesn't exist yet, it is allocated first
  * (including growing the refcount table if needed).
  *
- * Returns the offset of the refcount block on success or -errno in error case
+ * Returns the offset of the refcount block on success or -errno in error case.
+ * On success, *refcount_block points to the cached block.
  */
-static int64_t alloc_refcount_block(BlockDriverState *bs, int64_t cluster_index)
+static int64_t alloc_refcount_block(BlockDriverState *bs,
+    int64_t cluster_index, uint16_t **refcount_block)
 {
     BDRVQcowState *s = bs->opaque;
     unsigned int refcount_table_index;
@@ -193,11 +158,10 @@ static int64_t alloc_refcount_block(BlockDriverState *bs, int64_t cluster_index)
 
         /* If it's already there, we're done */
         if (refcount_block_offset) {
-            if (refcount_block_offset != s->refcount_block_cache_offset) {
-                ret = load_refcount_block(bs, refcount_block_offset);
-                if (ret < 0) {
-                    return ret;
-                }
+            ret = load_refcount_block(bs, refcount_block_offset,
+                refcount_block);
+            if (ret < 0) {
+                return ret;
             }
             return refcount_block_offset;
         }
@@ -221,17 +185,11 @@ static int64_t alloc_refcount_block(BlockDriverState *bs, int64_t cluster_index)
      *   accurate yet. free_cluster_index tells us where this allocation ends
      *   as long as we don't overwrite it by freeing clusters.
      *
-     * - alloc_clusters_noref and qcow2_free_clusters may load a different
-     *   refcount block into the cache
+     * - alloc_clusters_noref and qcow2_free_clusters may load different
+     *   refcount blocks into the cache, so *refcount_block must only be
+     *   set once they are done
      */
 
-    if (cache_refcount_updates) {
-        ret = write_refcount_block(bs);
-        if (ret < 0) {
-            return ret;
-        }
-    }
-
     /* Allocate the refcount block itself and mark it as used */
     int64_t new_block = alloc_clusters_noref(bs, s->cluster_size);
     if (new_block < 0) {
@@ -246,13 +204,17 @@ static int64_t alloc_refcount_block(BlockDriverState *bs, int64_t cluster_index)
 
     if (in_same_refcount_block(s, new_block, cluster_index << s->cluster_bits)) {
         /* Zero the new refcount block before updating it */
-        memset(s->refcount_block_cache, 0, s->cluster_size);
-        s->refcount_block_cache_offset = new_block;
+        ret = qcow2_cache_get_empty(bs, s->refcount_block_cache, new_block,
+            (void **) refcount_block);
+        if (ret < 0) {
+            goto fail_block;
+        }
+        memset(*refcount_block, 0, s->cluster_size);
 
         /* The block describes itself, need to update the cache */
         int block_index = (new_block >> s->cluster_bits) &
             ((1 << (s->cluster_bits - REFCOUNT_SHIFT)) - 1);
-        s->refcount_block_cache[block_index] = cpu_to_be16(1);
+        (*refcount_block)[block_index] = cpu_to_be16(1);
     } else {
         /* Described somewhere else. This can recurse at most twice before we
          * arrive at a block that describes itself. */
@@ -263,14 +225,22 @@ static int64_t alloc_refcount_block(BlockDriverState *bs, int64_t cluster_index)
 
         /* Initialize the new refcount block only after updating its refcount,
          * update_refcount uses the refcount cache itself */
-        memset(s->refcount_block_cache, 0, s->cluster_size);
-        s->refcount_block_cache_offset = new_block;
+        ret = qcow2_cache_get_empty(bs, s->refcount_block_cache, new_block,
+            (void **) refcount_block);
+        if (ret < 0) {
+            goto fail_block;
+        }
+        memset(*refcount_block, 0, s->cluster_size);
     }
 
     /* Now the new refcount block needs to be written to disk */
     BLKDBG_EVENT(bs->file, BLKDBG_REFBLOCK_ALLOC_WRITE);
-    ret = bdrv_pwrite_sync(bs->file, new_block, s->refcount_block_cache,
-        s->cluster_size);
+    ret = qcow2_cache_entry_mark_dirty(bs, s->refcount_block_cache,
+        *refcount_block, 0, s->cluster_size);
+    if (ret < 0) {
+        goto fail_block;
+    }
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
     if (ret < 0) {
         goto fail_block;
     }
@@ -407,9 +377,9 @@ static int64_t alloc_refcount_block(BlockDriverState *bs, int64_t cluster_index)
     qcow2_free_clusters(bs, old_table_offset, old_table_size * sizeof(uint64_t));
     s->free_cluster_index = old_free_cluster_index;
 
-    ret = load_refcount_block(bs, new_block);
+    ret = load_refcount_block(bs, new_block, refcount_block);
     if (ret < 0) {
-        goto fail_block;
+        return ret;
     }
 
     return new_block;
@@ -417,50 +387,30 @@ static int64_t alloc_refcount_block(BlockDriverState *bs, int64_t cluster_index)
 fail_table:
     qemu_free(new_table);
 fail_block:
-    s->refcount_block_cache_offset = 0;
+    qcow2_cache_discard(bs, s->refcount_block_cache, new_block);
     return ret;
 }
 
-#define REFCOUNTS_PER_SECTOR (512 >> REFCOUNT_SHIFT)
 static int write_refcount_block_entries(BlockDriverState *bs,
-    int64_t refcount_block_offset, int first_index, int last_index)
+    uint16_t *refcount_block, int first_index, int last_index)
 {
     BDRVQcowState *s = bs->opaque;
-    size_t size;
-    int ret;
-
-    if (cache_refcount_updates) {
-        return 0;
-    }
 
     if (first_index < 0) {
         return 0;
     }
 
-    first_index &= ~(REFCOUNTS_PER_SECTOR - 1);
-    last_index = (last_index + REFCOUNTS_PER_SECTOR)
-        & ~(REFCOUNTS_PER_SECTOR - 1);
-
-    size = (last_index - first_index) << REFCOUNT_SHIFT;
-
-    BLKDBG_EVENT(bs->file, BLKDBG_REFBLOCK_UPDATE_PART);
-    ret = bdrv_pwrite_sync(bs->file,
-        refcount_block_offset + (first_index << REFCOUNT_SHIFT),
-        &s->refcount_block_cache[first_index], size);
-    if (ret < 0) {
-        return ret;
-    }
-
-    return 0;
+    return qcow2_cache_entry_mark_dirty(bs, s->refcount_block_cache,
+        refcount_block, first_index << REFCOUNT_SHIFT,
+        (last_index - first_index + 1) << REFCOUNT_SHIFT);
 }
 
-/* XXX: cache several refcount block clusters ? */
 static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
     int64_t offset, int64_t length, int addend)
 {
     BDRVQcowState *s = bs->opaque;
     int64_t start, last, cluster_offset;
-    int64_t refcount_block_offset = 0;
+    uint16_t *refcount_block = NULL;
     int64_t table_index = -1, old_table_index;
     int first_index = -1, last_index = -1;
     int ret;
@@ -489,7 +439,7 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
         table_index = cluster_index >> (s->cluster_bits - REFCOUNT_SHIFT);
         if ((old_table_index >= 0) && (table_index != old_table_index)) {
 
-            ret = write_refcount_block_entries(bs, refcount_block_offset,
+            ret = write_refcount_block_entries(bs, refcount_block,
                 first_index, last_index);
             if (ret < 0) {
                 return ret;
@@ -500,12 +450,12 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
         }
 
         /* Load the refcount block and allocate it if needed */
-        new_block = alloc_refcount_block(bs, cluster_index);
+        new_block = alloc_refcount_block(bs, cluster_index, &refcount_block);
         if (new_block < 0) {
+            refcount_block = NULL;
             ret = new_block;
             goto fail;
         }
-        refcount_block_offset = new_block;
 
         /* we can update the count and save it */
         block_index = cluster_index &
@@ -517,7 +467,7 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
             last_index = block_index;
         }
 
-        refcount = be16_to_cpu(s->refcount_block_cache[block_index]);
+        refcount = be16_to_cpu(refcount_block[block_index]);
         refcount += addend;
         if (refcount < 0 || refcount > 0xffff) {
             ret = -EINVAL;
@@ -526,16 +476,16 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
         if (refcount == 0 && cluster_index < s->free_cluster_index) {
             s->free_cluster_index = cluster_index;
         }
-        s->refcount_block_cache[block_index] = cpu_to_be16(refcount);
+        refcount_block[block_index] = cpu_to_be16(refcount);
     }
 
     ret = 0;
 fail:
 
     /* Write last changed block to disk */
-    if (refcount_block_offset != 0) {
+    if (refcount_block != NULL) {
         int wret;
-        wret = write_refcount_block_entries(bs, refcount_block_offset,
+        wret = write_refcount_block_entries(bs, refcount_block,
             first_index, last_index);
         if (wret < 0) {
             return ret < 0 ? ret : wret;
@@ -609,12 +559,64 @@ retry:
     return (s->free_cluster_index - nb_clusters) << s->cluster_bits;
 }
 
+/*
+ * Starts loading the refcount block that the next cluster allocation looks
+ * at, so that the AIO write path doesn't have to block on the read in
+ * get_refcount().
+ *
+ * Returns 0 if there is nothing to wait for (clusters are taken from the
+ * data cluster extent, or the block is cached or doesn't exist yet), 1 if cb
+ * will be called once it has been loaded, or -errno.
+ */
+int qcow2_refcount_load_aio(BlockDriverState *bs,
+    BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t refcount_table_index;
+    int64_t refcount_block_offset;
+
+    if (s->prealloc_clusters > 0) {
+        return 0;
+    }
+
+    refcount_table_index =
+        s->free_cluster_index >> (s->cluster_bits - REFCOUNT_SHIFT);
+    if (refcount_table_index >= s->refcount_table_size) {
+        return 0;
+    }
+    refcount_block_offset = s->refcount_table[refcount_table_index];
+    if (!refcount_block_offset) {
+        return 0;
+    }
+
+    return qcow2_cache_load_aio(bs, s->refcount_block_cache,
+        refcount_block_offset, cb, opaque);
+}
+
+/* Takes nb_clusters clusters from the start of the data cluster extent */
+static int64_t alloc_prealloc(BDRVQcowState *s, int nb_clusters)
+{
+    int64_t offset = s->prealloc_offset;
+
+    assert(nb_clusters <= s->prealloc_clusters);
+    s->prealloc_offset += (int64_t) nb_clusters << s->cluster_bits;
+    s->prealloc_clusters -= nb_clusters;
+    return offset;
+}
+
 int64_t qcow2_alloc_clusters(BlockDriverState *bs, int64_t size)
 {
+    BDRVQcowState *s = bs->opaque;
     int64_t offset;
     int ret;
 
     BLKDBG_EVENT(bs->file, BLKDBG_CLUSTER_ALLOC);
+
+    /* Metadata goes next to the data, as if there was no extent */
+    if (size_to_clusters(s, size) <= s->prealloc_clusters) {
+        return alloc_prealloc(s, size_to_clusters(s, size));
+    }
+
     offset = alloc_clusters_noref(bs, size);
     if (offset < 0) {
         return offset;
@@ -627,6 +629,62 @@ int64_t qcow2_alloc_clusters(BlockDriverState *bs, int64_t size)
     return offset;
 }
 
+/*
+ * Allocates up to *nb_clusters contiguous clusters for guest data and sets
+ * *nb_clusters to the number actually allocated.
+ *
+ * Data clusters are taken from an extent that is allocated in one go and
+ * grows up to QCOW_MAX_PREALLOC_SIZE while the image is being filled, so
+ * that there is only one refcount update per extent rather than one per
+ * write request. Clusters of the extent that aren't used yet have a
+ * refcount of 1 without being referenced; if qemu doesn't get to release
+ * them, they are leaked, which is harmless.
+ */
+int64_t qcow2_alloc_data_clusters(BlockDriverState *bs, int *nb_clusters)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t offset;
+    int n, block_clusters, max_extent;
+
+    if (s->prealloc_clusters == 0) {
+        /*
+         * Don't let the extent run into the next refcount block, which would
+         * have to be allocated behind it and leave a gap in the image file
+         * if the extent isn't used up.
+         */
+        block_clusters = 1 << (s->cluster_bits - REFCOUNT_SHIFT);
+        n = block_clusters - (s->free_cluster_index & (block_clusters - 1));
+        n = MAX(*nb_clusters, MIN(s->prealloc_extent, n));
+
+        offset = qcow2_alloc_clusters(bs, (int64_t) n << s->cluster_bits);
+        if (offset < 0) {
+            return offset;
+        }
+        s->prealloc_offset = offset;
+        s->prealloc_clusters = n;
+
+        max_extent = MAX(QCOW_MAX_PREALLOC_SIZE >> s->cluster_bits, 1);
+        s->prealloc_extent = MIN(MAX(s->prealloc_extent, n) * 2, max_extent);
+    }
+
+    *nb_clusters = MIN(*nb_clusters, s->prealloc_clusters);
+    return alloc_prealloc(s, *nb_clusters);
+}
+
+/* Frees the part of the data cluster extent that hasn't been used */
+void qcow2_release_prealloc(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->prealloc_clusters == 0) {
+        return;
+    }
+
+    qcow2_free_clusters(bs, s->prealloc_offset,
+        (int64_t) s->prealloc_clusters << s->cluster_bits);
+    s->prealloc_clusters = 0;
+}
+
 /* only used to allocate compressed sectors. We try to allocate
    contiguous sectors. size must be <= cluster_size */
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
@@ -749,9 +807,10 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     uint64_t *l1_table, *l2_table, l2_offset, offset, l1_size2, l1_allocated;
     int64_t old_offset, old_l2_offset;
     int l2_size, i, j, l1_modified, l2_modified, nb_csectors, refcount;
+    int writethrough;
 
     qcow2_l2_cache_reset(bs);
-    cache_refcount_updates = 1;
+    writethrough = qcow2_cache_set_writethrough(bs, s->refcount_block_cache, 0);
 
     l2_table = NULL;
     l1_table = NULL;
@@ -859,15 +918,15 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     if (l1_allocated)
         qemu_free(l1_table);
     qemu_free(l2_table);
-    cache_refcount_updates = 0;
-    write_refcount_block(bs);
+    qcow2_cache_flush(bs, s->refcount_block_cache);
+    qcow2_cache_set_writethrough(bs, s->refcount_block_cache, writethrough);
     return 0;
  fail:
     if (l1_allocated)
         qemu_free(l1_table);
     qemu_free(l2_table);
-    cache_refcount_updates = 0;
-    write_refcount_block(bs);
+    qcow2_cache_flush(bs, s->refcount_block_cache);
+    qcow2_cache_set_writethrough(bs, s->refcount_block_cache, writethrough);
     return -EIO;
 }
 
@@ -1110,6 +1169,12 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res)
     uint16_t *refcount_table;
     int ret;
 
+    /* L2 tables are read directly from the image file below */
+    ret = qcow2_cache_flush(bs, s->l2_table_cache);
+    if (ret < 0) {
+        return ret;
+    }
+
     size = bdrv_getlength(bs->file);
     nb_clusters = size_to_clusters(s, size);
     refcount_table = qemu_mallocz(nb_clusters * sizeof(uint16_t));
@@ -139,7 +139,7 @@ static int qcow_read_extensions(BlockDriverState *bs, uint64_t start_offset,
 static int qcow_open(BlockDriverState *bs, int flags)
 {
     BDRVQcowState *s = bs->opaque;
-    int len, i;
+    int len, i, l2_cache_tables, refcount_cache_tables, writethrough;
     QCowHeader header;
     uint64_t ext_end;
 
@@ -203,8 +203,23 @@ static int qcow_open(BlockDriverState *bs, int flags)
             be64_to_cpus(&s->l1_table[i]);
         }
     }
-    /* alloc L2 cache */
-    s->l2_cache = qemu_malloc(s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t));
+    /* alloc L2 table/refcount block caches */
+    l2_cache_tables = DEFAULT_L2_CACHE_TABLES;
+    if (bs->l2_cache_size > 0) {
+        l2_cache_tables = MAX(2, bs->l2_cache_size >> s->cluster_bits);
+    }
+    refcount_cache_tables = DEFAULT_REFCOUNT_CACHE_TABLES;
+    if (bs->refcount_cache_size > 0) {
+        refcount_cache_tables =
+            MAX(4, bs->refcount_cache_size >> s->cluster_bits);
+    }
+    writethrough = !(flags & BDRV_O_CACHE_MASK);
+    s->writethrough = writethrough;
+    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_tables, writethrough);
+    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_tables,
+        writethrough);
+    /* new clusters must be accounted for before L2 entries point to them */
+    qcow2_cache_set_dependency(s->l2_table_cache, s->refcount_block_cache);
     s->cluster_cache = qemu_malloc(s->cluster_size);
     /* one more sector for decompressed data alignment */
     s->cluster_data = qemu_malloc(QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size
@@ -215,6 +230,7 @@ static int qcow_open(BlockDriverState *bs, int flags)
         goto fail;
 
     QLIST_INIT(&s->cluster_allocs);
+    QLIST_INIT(&s->l2_allocs);
 
     /* read qcow2 extensions */
     if (header.backing_file_offset)
@@ -245,7 +261,12 @@ static int qcow_open(BlockDriverState *bs, int flags)
     qcow2_free_snapshots(bs);
     qcow2_refcount_close(bs);
     qemu_free(s->l1_table);
-    qemu_free(s->l2_cache);
+    if (s->l2_table_cache) {
+        qcow2_cache_destroy(bs, s->l2_table_cache);
+    }
+    if (s->refcount_block_cache) {
+        qcow2_cache_destroy(bs, s->refcount_block_cache);
+    }
     qemu_free(s->cluster_cache);
     qemu_free(s->cluster_data);
     return -1;
@@ -311,8 +332,8 @@ static int qcow_is_allocated(BlockDriverState *bs, int64_t sector_num,
 }
 
 /* handle reading after the end of the backing file */
-int qcow2_backing_read1(BlockDriverState *bs,
-                  int64_t sector_num, uint8_t *buf, int nb_sectors)
+int qcow2_backing_read1(BlockDriverState *bs, QEMUIOVector *qiov,
+                  int64_t sector_num, int nb_sectors)
 {
     int n1;
     if ((sector_num + nb_sectors) <= bs->total_sectors)
@@ -321,7 +342,9 @@ int qcow2_backing_read1(BlockDriverState *bs,
         n1 = 0;
     else
         n1 = bs->total_sectors - sector_num;
-    memset(buf + n1 * 512, 0, 512 * (nb_sectors - n1));
+
+    qemu_iovec_memset_skip(qiov, 0, 512 * (nb_sectors - n1), 512 * n1);
+
     return n1;
 }
 
@@ -329,25 +352,48 @@ typedef struct QCowAIOCB {
     BlockDriverAIOCB common;
     int64_t sector_num;
     QEMUIOVector *qiov;
-    uint8_t *buf;
-    void *orig_buf;
     int remaining_sectors;
     int cur_nr_sectors;	/* number of sectors in current iteration */
+    uint64_t bytes_done; /* offset of the current iteration in qiov */
     uint64_t cluster_offset;
-    uint8_t *cluster_data;
+    uint8_t *cluster_data; /* bounce buffer for encryption */
     BlockDriverAIOCB *hd_aiocb;
-    struct iovec hd_iov;
-    QEMUIOVector hd_qiov;
+    QEMUIOVector hd_qiov;  /* part of qiov (or a bounce buffer) for hd_aiocb */
     QEMUBH *bh;
     QCowL2Meta l2meta;
     QLIST_ENTRY(QCowAIOCB) next_depend;
+    uint8_t *cow_buf;   /* old data being copied into new clusters */
+    int cow_start;      /* in sectors from the first new cluster */
+    int cow_sectors;
+    int cow_writing;
+    int link_step;      /* how far the L2 update for l2meta has got */
+    uint64_t *old_clusters; /* released once the L2 update is on the disk */
+    int nb_old_clusters;
 } QCowAIOCB;
 
+enum {
+    QCOW_LINK_UPDATE,
+    QCOW_LINK_FLUSH_L2,
+    QCOW_LINK_FLUSH_REFCOUNT,
+};
+
 static void qcow_aio_cancel(BlockDriverAIOCB *blockacb)
 {
     QCowAIOCB *acb = container_of(blockacb, QCowAIOCB, common);
+    BDRVQcowState *s = blockacb->bs->opaque;
+
+    qcow2_cache_cancel(s->l2_table_cache, acb);
+    qcow2_cache_cancel(s->refcount_block_cache, acb);
+    qcow2_l2_alloc_cancel(blockacb->bs, acb);
     if (acb->hd_aiocb)
         bdrv_aio_cancel(acb->hd_aiocb);
+    if (acb->cow_buf) {
+        qemu_vfree(acb->cow_buf);
+        acb->cow_buf = NULL;
+    }
+    qemu_free(acb->old_clusters);
+    qemu_iovec_destroy(&acb->hd_qiov);
+    qemu_free(acb->cluster_data);
     qemu_aio_release(acb);
 }
 
@@ -397,15 +443,21 @@ static void qcow_aio_read_cb(void *opaque, int ret)
         /* nothing to do */
     } else {
         if (s->crypt_method) {
-            qcow2_encrypt_sectors(s, acb->sector_num, acb->buf, acb->buf,
-                            acb->cur_nr_sectors, 0,
+            /* decrypt the bounce buffer into the guest buffer */
+            qcow2_encrypt_sectors(s, acb->sector_num, acb->cluster_data,
+                            acb->cluster_data, acb->cur_nr_sectors, 0,
                             &s->aes_decrypt_key);
+            qemu_iovec_reset(&acb->hd_qiov);
+            qemu_iovec_copy(&acb->hd_qiov, acb->qiov, acb->bytes_done,
+                acb->cur_nr_sectors * 512);
+            qemu_iovec_from_buffer(&acb->hd_qiov, acb->cluster_data,
+                512 * acb->cur_nr_sectors);
         }
     }
 
     acb->remaining_sectors -= acb->cur_nr_sectors;
     acb->sector_num += acb->cur_nr_sectors;
-    acb->buf += acb->cur_nr_sectors * 512;
+    acb->bytes_done += acb->cur_nr_sectors * 512;
 
     if (acb->remaining_sectors == 0) {
         /* request completed */
@@ -414,7 +466,21 @@ static void qcow_aio_read_cb(void *opaque, int ret)
     }
 
     /* prepare next AIO request */
+    ret = qcow2_l2_load_aio(bs, acb->sector_num << 9, qcow_aio_read_cb, acb);
+    if (ret < 0) {
+        goto done;
+    } else if (ret > 0) {
+        /* come back when the L2 table is cached */
+        acb->cur_nr_sectors = 0;
+        return;
+    }
+
     acb->cur_nr_sectors = acb->remaining_sectors;
+    if (s->crypt_method) {
+        acb->cur_nr_sectors = MIN(acb->cur_nr_sectors,
+            QCOW_MAX_CRYPT_CLUSTERS * s->cluster_sectors);
+    }
+
     ret = qcow2_get_cluster_offset(bs, acb->sector_num << 9,
         &acb->cur_nr_sectors, &acb->cluster_offset);
     if (ret < 0) {
@@ -423,18 +489,24 @@ static void qcow_aio_read_cb(void *opaque, int ret)
 
     index_in_cluster = acb->sector_num & (s->cluster_sectors - 1);
 
+    /* the part of the guest buffer that this iteration fills */
+    qemu_iovec_reset(&acb->hd_qiov);
+    qemu_iovec_copy(&acb->hd_qiov, acb->qiov, acb->bytes_done,
+        acb->cur_nr_sectors * 512);
+
     if (!acb->cluster_offset) {
         if (bs->backing_hd) {
             /* read from the base image */
-            n1 = qcow2_backing_read1(bs->backing_hd, acb->sector_num,
-                               acb->buf, acb->cur_nr_sectors);
+            n1 = qcow2_backing_read1(bs->backing_hd, &acb->hd_qiov,
+                acb->sector_num, acb->cur_nr_sectors);
             if (n1 > 0) {
-                acb->hd_iov.iov_base = (void *)acb->buf;
-                acb->hd_iov.iov_len = acb->cur_nr_sectors * 512;
-                qemu_iovec_init_external(&acb->hd_qiov, &acb->hd_iov, 1);
+                /* the part beyond the end of the base image is zeroed */
+                qemu_iovec_reset(&acb->hd_qiov);
+                qemu_iovec_copy(&acb->hd_qiov, acb->qiov, acb->bytes_done,
+                    n1 * 512);
                 BLKDBG_EVENT(bs->file, BLKDBG_READ_BACKING_AIO);
                 acb->hd_aiocb = bdrv_aio_readv(bs->backing_hd, acb->sector_num,
-                                    &acb->hd_qiov, acb->cur_nr_sectors,
+                                    &acb->hd_qiov, n1,
 				    qcow_aio_read_cb, acb);
                 if (acb->hd_aiocb == NULL)
                     goto done;
@@ -445,7 +517,8 @@ static void qcow_aio_read_cb(void *opaque, int ret)
             }
         } else {
             /* Note: in this case, no need to wait */
-            memset(acb->buf, 0, 512 * acb->cur_nr_sectors);
+            qemu_iovec_memset_skip(&acb->hd_qiov, 0,
+                512 * acb->cur_nr_sectors, 0);
             ret = qcow_schedule_bh(qcow_aio_read_bh, acb);
             if (ret < 0)
                 goto done;
@@ -454,8 +527,9 @@ static void qcow_aio_read_cb(void *opaque, int ret)
         /* add AIO support for compressed blocks ? */
         if (qcow2_decompress_cluster(bs, acb->cluster_offset) < 0)
             goto done;
-        memcpy(acb->buf, s->cluster_cache + index_in_cluster * 512,
-               512 * acb->cur_nr_sectors);
+        qemu_iovec_from_buffer(&acb->hd_qiov,
+            s->cluster_cache + index_in_cluster * 512,
+            512 * acb->cur_nr_sectors);
         ret = qcow_schedule_bh(qcow_aio_read_bh, acb);
         if (ret < 0)
             goto done;
@@ -465,9 +539,20 @@ static void qcow_aio_read_cb(void *opaque, int ret)
             goto done;
         }
 
-        acb->hd_iov.iov_base = (void *)acb->buf;
-        acb->hd_iov.iov_len = acb->cur_nr_sectors * 512;
-        qemu_iovec_init_external(&acb->hd_qiov, &acb->hd_iov, 1);
+        if (s->crypt_method) {
+            /*
+             * For encrypted images, read everything into a temporary
+             * contiguous buffer on which the AES functions can work.
+             */
+            if (!acb->cluster_data) {
+                acb->cluster_data = qemu_mallocz(QCOW_MAX_CRYPT_CLUSTERS *
+                                                 s->cluster_size);
+            }
+            qemu_iovec_reset(&acb->hd_qiov);
+            qemu_iovec_add(&acb->hd_qiov, acb->cluster_data,
+                512 * acb->cur_nr_sectors);
+        }
+
         BLKDBG_EVENT(bs->file, BLKDBG_READ_AIO);
         acb->hd_aiocb = bdrv_aio_readv(bs->file,
                             (acb->cluster_offset >> 9) + index_in_cluster,
@@ -481,17 +566,15 @@ static void qcow_aio_read_cb(void *opaque, int ret)
 
     return;
 done:
-    if (acb->qiov->niov > 1) {
-        qemu_iovec_from_buffer(acb->qiov, acb->orig_buf, acb->qiov->size);
-        qemu_vfree(acb->orig_buf);
-    }
+    qemu_iovec_destroy(&acb->hd_qiov);
+    qemu_free(acb->cluster_data);
     acb->common.cb(acb->common.opaque, ret);
     qemu_aio_release(acb);
 }
 
 static QCowAIOCB *qcow_aio_setup(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
-        BlockDriverCompletionFunc *cb, void *opaque, int is_write)
+        BlockDriverCompletionFunc *cb, void *opaque)
 {
     QCowAIOCB *acb;
 
@@ -501,16 +584,18 @@ static QCowAIOCB *qcow_aio_setup(BlockDriverState *bs,
     acb->hd_aiocb = NULL;
     acb->sector_num = sector_num;
     acb->qiov = qiov;
-    if (qiov->niov > 1) {
-        acb->buf = acb->orig_buf = qemu_blockalign(bs, qiov->size);
-        if (is_write)
-            qemu_iovec_to_buffer(qiov, acb->buf);
-    } else {
-        acb->buf = (uint8_t *)qiov->iov->iov_base;
-    }
+
+    qemu_iovec_init(&acb->hd_qiov, qiov->niov);
+
+    acb->bytes_done = 0;
     acb->remaining_sectors = nb_sectors;
     acb->cur_nr_sectors = 0;
     acb->cluster_offset = 0;
+    acb->cluster_data = NULL;
+    acb->cow_buf = NULL;
+    acb->link_step = QCOW_LINK_UPDATE;
+    acb->old_clusters = NULL;
+    acb->nb_old_clusters = 0;
     acb->l2meta.nb_clusters = 0;
     QLIST_INIT(&acb->l2meta.dependent_requests);
     return acb;
@@ -522,7 +607,7 @@ static BlockDriverAIOCB *qcow_aio_readv(BlockDriverState *bs,
 {
     QCowAIOCB *acb;
 
-    acb = qcow_aio_setup(bs, sector_num, qiov, nb_sectors, cb, opaque, 0);
+    acb = qcow_aio_setup(bs, sector_num, qiov, nb_sectors, cb, opaque);
     if (!acb)
         return NULL;
 
@@ -551,20 +636,186 @@ static void run_dependent_requests(QCowL2Meta *m)
     QLIST_INIT(&m->dependent_requests);
 }
 
+static void qcow_aio_cow_cb(void *opaque, int ret)
+{
+    QCowAIOCB *acb = opaque;
+    BlockDriverState *bs = acb->common.bs;
+    BDRVQcowState *s = bs->opaque;
+    uint64_t start_sect;
+
+    acb->hd_aiocb = NULL;
+    if (ret < 0) {
+        goto done;
+    }
+
+    if (!acb->cow_writing) {
+        /* the old data has been read, write it into the new cluster */
+        if (s->crypt_method) {
+            start_sect = (acb->l2meta.offset & ~(s->cluster_size - 1)) >> 9;
+            qcow2_encrypt_sectors(s, start_sect + acb->cow_start,
+                            acb->cow_buf, acb->cow_buf, acb->cow_sectors, 1,
+                            &s->aes_encrypt_key);
+        }
+        acb->cow_writing = 1;
+        BLKDBG_EVENT(bs->file, BLKDBG_COW_WRITE);
+        acb->hd_aiocb = bdrv_aio_writev(bs->file,
+            (acb->l2meta.cluster_offset >> 9) + acb->cow_start,
+            &acb->hd_qiov, acb->cow_sectors, qcow_aio_cow_cb, acb);
+        if (acb->hd_aiocb == NULL) {
+            ret = -EIO;
+            goto done;
+        }
+        return;
+    }
+
+    /* the copied data must be on the disk before the L2 update */
+    qcow2_cache_depends_on_flush(s->l2_table_cache);
+
+done:
+    qemu_vfree(acb->cow_buf);
+    acb->cow_buf = NULL;
+    qcow_aio_write_cb(acb, ret);
+}
+
+/*
+ * Starts the copy on write for the next part of the newly allocated clusters
+ * that the request doesn't overwrite.  The old data is read through the image
+ * itself, which takes care of backing files and compressed clusters, as the
+ * L2 table doesn't point to the new clusters yet.
+ *
+ * Returns 1 if qcow_aio_cow_cb() continues the request, 0 if there is nothing
+ * left to copy, or -errno.
+ */
+static int qcow_aio_cow_next(QCowAIOCB *acb)
+{
+    BlockDriverState *bs = acb->common.bs;
+    BDRVQcowState *s = bs->opaque;
+    uint64_t start_sect;
+
+    if (!qcow2_alloc_cluster_next_cow(bs, &acb->l2meta, &acb->cow_start,
+                                      &acb->cow_sectors)) {
+        return 0;
+    }
+
+    start_sect = (acb->l2meta.offset & ~(s->cluster_size - 1)) >> 9;
+    acb->cow_buf = qemu_blockalign(bs, acb->cow_sectors * 512);
+    acb->cow_writing = 0;
+    qemu_iovec_reset(&acb->hd_qiov);
+    qemu_iovec_add(&acb->hd_qiov, acb->cow_buf, acb->cow_sectors * 512);
+
+    BLKDBG_EVENT(bs->file, BLKDBG_COW_READ);
+    acb->hd_aiocb = qcow_aio_readv(bs, start_sect + acb->cow_start,
+                                   &acb->hd_qiov, acb->cow_sectors,
+                                   qcow_aio_cow_cb, acb);
+    if (acb->hd_aiocb == NULL) {
+        qemu_vfree(acb->cow_buf);
+        acb->cow_buf = NULL;
+        return -EIO;
+    }
+    return 1;
+}
+
+/*
+ * Points the L2 table at the clusters that the request has just written, the
+ * AIO counterpart of qcow2_alloc_cluster_link_l2().  The metadata caches only
+ * write back what the request has changed when it must be on the disk: before
+ * the old clusters of a COW are freed, and in writethrough mode, before the
+ * request completes.
+ *
+ * Returns 1 if qcow_aio_write_cb() continues the request, 0 once the L2
+ * update is done, or -errno.
+ */
+static int qcow_aio_link_l2(QCowAIOCB *acb)
+{
+    BlockDriverState *bs = acb->common.bs;
+    BDRVQcowState *s = bs->opaque;
+    int i, ret;
+
+    switch (acb->link_step) {
+    case QCOW_LINK_UPDATE:
+        if (acb->l2meta.nb_clusters == 0) {
+            return 0;
+        }
+        ret = qcow2_cache_wait_idle_all(bs, qcow_aio_write_cb, acb);
+        if (ret > 0) {
+            return ret;
+        }
+
+        qcow2_cache_set_deferred(s->l2_table_cache, 1);
+        qcow2_cache_set_deferred(s->refcount_block_cache, 1);
+        ret = qcow2_alloc_cluster_update_l2(bs, &acb->l2meta,
+            &acb->old_clusters, &acb->nb_old_clusters);
+        qcow2_cache_set_deferred(s->refcount_block_cache, 0);
+        qcow2_cache_set_deferred(s->l2_table_cache, 0);
+        if (ret < 0) {
+            return ret;
+        }
+
+        acb->link_step = QCOW_LINK_FLUSH_L2;
+        if (s->writethrough || acb->nb_old_clusters != 0) {
+            ret = qcow2_cache_flush_aio(bs, s->l2_table_cache,
+                                        qcow_aio_write_cb, acb);
+            if (ret != 0) {
+                return ret;
+            }
+        }
+        /* fall through */
+    case QCOW_LINK_FLUSH_L2:
+        if (acb->nb_old_clusters != 0) {
+            ret = qcow2_cache_wait_idle_all(bs, qcow_aio_write_cb, acb);
+            if (ret > 0) {
+                return ret;
+            }
+        }
+        acb->link_step = QCOW_LINK_FLUSH_REFCOUNT;
+        qcow2_cache_set_deferred(s->refcount_block_cache, 1);
+        for (i = 0; i < acb->nb_old_clusters; i++) {
+            qcow2_free_any_clusters(bs, acb->old_clusters[i], 1);
+        }
+        qcow2_cache_set_deferred(s->refcount_block_cache, 0);
+        qemu_free(acb->old_clusters);
+        acb->old_clusters = NULL;
+        acb->nb_old_clusters = 0;
+
+        if (s->writethrough) {
+            ret = qcow2_cache_flush_aio(bs, s->refcount_block_cache,
+                                        qcow_aio_write_cb, acb);
+            if (ret != 0) {
+                return ret;
+            }
+        }
+        /* fall through */
+    case QCOW_LINK_FLUSH_REFCOUNT:
+        break;
+    }
+
+    return 0;
+}
+
 static void qcow_aio_write_cb(void *opaque, int ret)
 {
     QCowAIOCB *acb = opaque;
     BlockDriverState *bs = acb->common.bs;
     BDRVQcowState *s = bs->opaque;
     int index_in_cluster;
-    const uint8_t *src_buf;
     int n_end;
 
     acb->hd_aiocb = NULL;
 
+    if (ret >= 0 && acb->link_step == QCOW_LINK_UPDATE) {
+        ret = qcow_aio_cow_next(acb);
+        if (ret > 0) {
+            return;
+        }
+    }
+
     if (ret >= 0) {
-        ret = qcow2_alloc_cluster_link_l2(bs, &acb->l2meta);
+        ret = qcow_aio_link_l2(acb);
+        if (ret > 0) {
+            return;
+        }
     }
+    acb->link_step = QCOW_LINK_UPDATE;
 
     run_dependent_requests(&acb->l2meta);
 
@@ -573,7 +824,7 @@ static void qcow_aio_write_cb(void *opaque, int ret)
 
     acb->remaining_sectors -= acb->cur_nr_sectors;
     acb->sector_num += acb->cur_nr_sectors;
-    acb->buf += acb->cur_nr_sectors * 512;
+    acb->bytes_done += acb->cur_nr_sectors * 512;
 
     if (acb->remaining_sectors == 0) {
         /* request completed */
@@ -581,14 +832,43 @@ static void qcow_aio_write_cb(void *opaque, int ret)
         goto done;
     }
 
+    /*
+     * Come back when the L2 table has been allocated, it and the refcount
+     * block for new clusters are cached and no metadata is being written back,
+     * so that the allocation below doesn't have to block on the image file.
+     */
+    acb->cur_nr_sectors = 0;
+    acb->l2meta.nb_clusters = 0;
+    ret = qcow2_l2_alloc_aio(bs, acb->sector_num << 9, qcow_aio_write_cb, acb);
+    if (ret == 0) {
+        ret = qcow2_l2_load_aio(bs, acb->sector_num << 9,
+                                qcow_aio_write_cb, acb);
+    }
+    if (ret == 0) {
+        ret = qcow2_refcount_load_aio(bs, qcow_aio_write_cb, acb);
+    }
+    if (ret == 0) {
+        ret = qcow2_cache_wait_idle_all(bs, qcow_aio_write_cb, acb);
+    }
+    if (ret < 0) {
+        goto done;
+    } else if (ret > 0) {
+        return;
+    }
+
     index_in_cluster = acb->sector_num & (s->cluster_sectors - 1);
     n_end = index_in_cluster + acb->remaining_sectors;
     if (s->crypt_method &&
         n_end > QCOW_MAX_CRYPT_CLUSTERS * s->cluster_sectors)
         n_end = QCOW_MAX_CRYPT_CLUSTERS * s->cluster_sectors;
 
+    /* the refcount updates go out with the L2 update in qcow_aio_link_l2() */
+    qcow2_cache_set_deferred(s->l2_table_cache, 1);
+    qcow2_cache_set_deferred(s->refcount_block_cache, 1);
     ret = qcow2_alloc_cluster_offset(bs, acb->sector_num << 9,
         index_in_cluster, n_end, &acb->cur_nr_sectors, &acb->l2meta);
+    qcow2_cache_set_deferred(s->refcount_block_cache, 0);
+    qcow2_cache_set_deferred(s->l2_table_cache, 0);
     if (ret < 0) {
         goto done;
     }
@@ -604,20 +884,28 @@ static void qcow_aio_write_cb(void *opaque, int ret)
 
     assert((acb->cluster_offset & 511) == 0);
 
+    qemu_iovec_reset(&acb->hd_qiov);
+    qemu_iovec_copy(&acb->hd_qiov, acb->qiov, acb->bytes_done,
+        acb->cur_nr_sectors * 512);
+
     if (s->crypt_method) {
         if (!acb->cluster_data) {
             acb->cluster_data = qemu_mallocz(QCOW_MAX_CRYPT_CLUSTERS *
                                              s->cluster_size);
         }
-        qcow2_encrypt_sectors(s, acb->sector_num, acb->cluster_data, acb->buf,
-                        acb->cur_nr_sectors, 1, &s->aes_encrypt_key);
-        src_buf = acb->cluster_data;
-    } else {
-        src_buf = acb->buf;
+
+        assert(acb->hd_qiov.size <=
+            QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
+        qemu_iovec_to_buffer(&acb->hd_qiov, acb->cluster_data);
+
+        qcow2_encrypt_sectors(s, acb->sector_num, acb->cluster_data,
+            acb->cluster_data, acb->cur_nr_sectors, 1, &s->aes_encrypt_key);
+
+        qemu_iovec_reset(&acb->hd_qiov);
+        qemu_iovec_add(&acb->hd_qiov, acb->cluster_data,
+            acb->cur_nr_sectors * 512);
     }
-    acb->hd_iov.iov_base = (void *)src_buf;
-    acb->hd_iov.iov_len = acb->cur_nr_sectors * 512;
-    qemu_iovec_init_external(&acb->hd_qiov, &acb->hd_iov, 1);
+
     BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
     acb->hd_aiocb = bdrv_aio_writev(bs->file,
                                     (acb->cluster_offset >> 9) + index_in_cluster,
@@ -635,8 +923,9 @@ fail:
         QLIST_REMOVE(&acb->l2meta, next_in_flight);
     }
 done:
-    if (acb->qiov->niov > 1)
-        qemu_vfree(acb->orig_buf);
+    qemu_iovec_destroy(&acb->hd_qiov);
+    qemu_free(acb->cluster_data);
+    qemu_free(acb->old_clusters);
     acb->common.cb(acb->common.opaque, ret);
     qemu_aio_release(acb);
 }
@@ -650,7 +939,7 @@ static BlockDriverAIOCB *qcow_aio_writev(BlockDriverState *bs,
 
     s->cluster_cache_offset = -1; /* disable compressed cache */
 
-    acb = qcow_aio_setup(bs, sector_num, qiov, nb_sectors, cb, opaque, 1);
+    acb = qcow_aio_setup(bs, sector_num, qiov, nb_sectors, cb, opaque);
     if (!acb)
         return NULL;
 
@@ -661,8 +950,15 @@ static BlockDriverAIOCB *qcow_aio_writev(BlockDriverState *bs,
 static void qcow_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+
+    qcow2_release_prealloc(bs);
     qemu_free(s->l1_table);
-    qemu_free(s->l2_cache);
+
+    qcow2_cache_flush(bs, s->l2_table_cache);
+    qcow2_cache_flush(bs, s->refcount_block_cache);
+    qcow2_cache_destroy(bs, s->l2_table_cache);
+    qcow2_cache_destroy(bs, s->refcount_block_cache);
+
     qemu_free(s->cluster_cache);
     qemu_free(s->cluster_data);
     qcow2_refcount_close(bs);
@@ -1144,30 +1440,13 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
     return 0;
 }
 
-/* XXX: put compressed sectors first, then all the cluster aligned
-   tables to avoid losing bytes in alignment */
-static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                                 const uint8_t *buf, int nb_sectors)
+/* See bdrv_compress_cluster() */
+static int qcow_compress_cluster(BlockDriverState *bs, const uint8_t *buf,
+                                 uint8_t *out_buf)
 {
     BDRVQcowState *s = bs->opaque;
     z_stream strm;
     int ret, out_len;
-    uint8_t *out_buf;
-    uint64_t cluster_offset;
-
-    if (nb_sectors == 0) {
-        /* align end of file to a sector boundary to ease reading with
-           sector based I/Os */
-        cluster_offset = bdrv_getlength(bs->file);
-        cluster_offset = (cluster_offset + 511) & ~511;
-        bdrv_truncate(bs->file, cluster_offset);
-        return 0;
-    }
-
-    if (nb_sectors != s->cluster_sectors)
-        return -EINVAL;
-
-    out_buf = qemu_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
 
     /* best compression, small window, no zlib header */
     memset(&strm, 0, sizeof(strm));
@@ -1175,8 +1454,7 @@ static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
                        Z_DEFLATED, -12,
                        9, Z_DEFAULT_STRATEGY);
     if (ret != 0) {
-        qemu_free(out_buf);
-        return -1;
+        return -EIO;
     }
 
     strm.avail_in = s->cluster_size;
@@ -1186,42 +1464,97 @@ static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     ret = deflate(&strm, Z_FINISH);
     if (ret != Z_STREAM_END && ret != Z_OK) {
-        qemu_free(out_buf);
         deflateEnd(&strm);
-        return -1;
+        return -EIO;
     }
     out_len = strm.next_out - out_buf;
 
     deflateEnd(&strm);
 
     if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+        return -ENOSPC;
+    }
+    return out_len;
+}
+
+/* XXX: put compressed sectors first, then all the cluster aligned
+   tables to avoid losing bytes in alignment */
+static int qcow_write_compressed_cluster(BlockDriverState *bs,
+    int64_t sector_num, const uint8_t *out_buf, int out_len)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t cluster_offset;
+
+    cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
+        sector_num << 9, out_len);
+    if (!cluster_offset)
+        return -1;
+    cluster_offset &= s->cluster_offset_mask;
+    BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
+    if (bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len) != out_len) {
+        return -1;
+    }
+    return 0;
+}
+
+static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
+                                 const uint8_t *buf, int nb_sectors)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+    uint8_t *out_buf;
+    uint64_t cluster_offset;
+
+    if (nb_sectors == 0) {
+        /* align end of file to a sector boundary to ease reading with
+           sector based I/Os */
+        cluster_offset = bdrv_getlength(bs->file);
+        cluster_offset = (cluster_offset + 511) & ~511;
+        bdrv_truncate(bs->file, cluster_offset);
+        return 0;
+    }
+
+    if (nb_sectors != s->cluster_sectors)
+        return -EINVAL;
+
+    out_buf = qemu_malloc(s->cluster_size);
+
+    ret = qcow_compress_cluster(bs, buf, out_buf);
+    if (ret == -ENOSPC) {
         /* could not compress: write normal cluster */
-        bdrv_write(bs, sector_num, buf, s->cluster_sectors);
-    } else {
-        cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
-            sector_num << 9, out_len);
-        if (!cluster_offset)
-            return -1;
-        cluster_offset &= s->cluster_offset_mask;
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
-        if (bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len) != out_len) {
-            qemu_free(out_buf);
-            return -1;
-        }
+        ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
+    } else if (ret >= 0) {
+        ret = qcow_write_compressed_cluster(bs, sector_num, out_buf, ret);
     }
 
     qemu_free(out_buf);
-    return 0;
+    return ret < 0 ? -1 : 0;
+}
+
+static int qcow_flush_caches(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    ret = qcow2_cache_flush(bs, s->l2_table_cache);
+    if (ret < 0) {
+        return ret;
+    }
+    return qcow2_cache_flush(bs, s->refcount_block_cache);
 }
 
 static void qcow_flush(BlockDriverState *bs)
 {
+    qcow_flush_caches(bs);
     bdrv_flush(bs->file);
 }
 
 static BlockDriverAIOCB *qcow_aio_flush(BlockDriverState *bs,
          BlockDriverCompletionFunc *cb, void *opaque)
 {
+    if (qcow_flush_caches(bs) < 0) {
+        return NULL;
+    }
     return bdrv_aio_flush(bs->file, cb, opaque);
 }
 
@@ -1235,6 +1568,10 @@ static int qcow_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     BDRVQcowState *s = bs->opaque;
     bdi->cluster_size = s->cluster_size;
     bdi->vm_state_offset = qcow_vm_state_offset(s);
+    qcow2_cache_get_stats(s->l2_table_cache,
+        &bdi->l2_cache_hits, &bdi->l2_cache_misses);
+    qcow2_cache_get_stats(s->refcount_block_cache,
+        &bdi->refcount_cache_hits, &bdi->refcount_cache_misses);
     return 0;
 }
 
@@ -1347,6 +1684,8 @@ static BlockDriver bdrv_qcow2 = {
 
     .bdrv_truncate          = qcow2_truncate,
     .bdrv_write_compressed  = qcow_write_compressed,
+    .bdrv_compress_cluster  = qcow_compress_cluster,
+    .bdrv_write_compressed_cluster = qcow_write_compressed_cluster,
 
     .bdrv_snapshot_create   = qcow2_snapshot_create,
     .bdrv_snapshot_goto     = qcow2_snapshot_goto,
@@ -49,7 +49,11 @@
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
-#define L2_CACHE_SIZE 16
+#define DEFAULT_L2_CACHE_TABLES 16
+#define DEFAULT_REFCOUNT_CACHE_TABLES 16
+
+/* upper limit for the extents in which data clusters are allocated */
+#define QCOW_MAX_PREALLOC_SIZE (8 * 1024 * 1024)
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -78,6 +82,9 @@ typedef struct QCowSnapshot {
     uint64_t vm_clock_nsec;
 } QCowSnapshot;
 
+typedef struct Qcow2Cache Qcow2Cache;
+typedef struct QCowL2Alloc QCowL2Alloc;
+
 typedef struct BDRVQcowState {
     BlockDriverState *hd;
     int cluster_bits;
@@ -92,9 +99,11 @@ typedef struct BDRVQcowState {
     uint64_t cluster_offset_mask;
     uint64_t l1_table_offset;
     uint64_t *l1_table;
-    uint64_t *l2_cache;
-    uint64_t l2_cache_offsets[L2_CACHE_SIZE];
-    uint32_t l2_cache_counts[L2_CACHE_SIZE];
+    QLIST_HEAD(QCowL2Allocs, QCowL2Alloc) l2_allocs;
+    int l1_writing;             /* an L1 sector is being written */
+    Qcow2Cache *l2_table_cache;
+    Qcow2Cache *refcount_block_cache;
+    int writethrough;           /* metadata caches are in writethrough mode */
     uint8_t *cluster_cache;
     uint8_t *cluster_data;
     uint64_t cluster_cache_offset;
@@ -103,10 +112,11 @@ typedef struct BDRVQcowState {
     uint64_t *refcount_table;
     uint64_t refcount_table_offset;
     uint32_t refcount_table_size;
-    uint64_t refcount_block_cache_offset;
-    uint16_t *refcount_block_cache;
     int64_t free_cluster_index;
     int64_t free_byte_offset;
+    int64_t prealloc_offset;    /* allocated data clusters not yet in use */
+    int prealloc_clusters;
+    int prealloc_extent;        /* size of the next extent in clusters */
 
     uint32_t crypt_method; /* current crypt method, 0 if no key yet */
     uint32_t crypt_method_header;
@@ -166,19 +176,23 @@ static inline int64_t align_offset(int64_t offset, int n)
 // FIXME Need qcow2_ prefix to global functions
 
 /* qcow2.c functions */
-int qcow2_backing_read1(BlockDriverState *bs,
-                  int64_t sector_num, uint8_t *buf, int nb_sectors);
+int qcow2_backing_read1(BlockDriverState *bs, QEMUIOVector *qiov,
+                  int64_t sector_num, int nb_sectors);
 
 /* qcow2-refcount.c functions */
 int qcow2_refcount_init(BlockDriverState *bs);
 void qcow2_refcount_close(BlockDriverState *bs);
 
 int64_t qcow2_alloc_clusters(BlockDriverState *bs, int64_t size);
+int64_t qcow2_alloc_data_clusters(BlockDriverState *bs, int *nb_clusters);
+void qcow2_release_prealloc(BlockDriverState *bs);
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size);
 void qcow2_free_clusters(BlockDriverState *bs,
     int64_t offset, int64_t size);
 void qcow2_free_any_clusters(BlockDriverState *bs,
     uint64_t cluster_offset, int nb_clusters);
+int qcow2_refcount_load_aio(BlockDriverState *bs,
+    BlockDriverCompletionFunc *cb, void *opaque);
 
 void qcow2_create_refcount_update(QCowCreateState *s, int64_t offset,
     int64_t size);
@@ -196,6 +210,11 @@ void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
                      int nb_sectors, int enc,
                      const AES_KEY *key);
 
+int qcow2_l2_load_aio(BlockDriverState *bs, uint64_t offset,
+    BlockDriverCompletionFunc *cb, void *opaque);
+int qcow2_l2_alloc_aio(BlockDriverState *bs, uint64_t offset,
+    BlockDriverCompletionFunc *cb, void *opaque);
+void qcow2_l2_alloc_cancel(BlockDriverState *bs, void *opaque);
 int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     int *num, uint64_t *cluster_offset);
 int qcow2_alloc_cluster_offset(BlockDriverState *bs, uint64_t offset,
@@ -204,8 +223,41 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
                                          uint64_t offset,
                                          int compressed_size);
 
+int qcow2_alloc_cluster_next_cow(BlockDriverState *bs, QCowL2Meta *m,
+    int *n_start, int *nb_sectors);
+int qcow2_alloc_cluster_update_l2(BlockDriverState *bs, QCowL2Meta *m,
+    uint64_t **old_clusters, int *nb_old_clusters);
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m);
 
+/* qcow2-cache.c functions */
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+    int writethrough);
+void qcow2_cache_destroy(BlockDriverState *bs, Qcow2Cache *c);
+int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c);
+int qcow2_cache_flush_aio(BlockDriverState *bs, Qcow2Cache *c,
+    BlockDriverCompletionFunc *cb, void *opaque);
+int qcow2_cache_wait_idle(Qcow2Cache *c, BlockDriverCompletionFunc *cb,
+    void *opaque);
+int qcow2_cache_wait_idle_all(BlockDriverState *bs,
+    BlockDriverCompletionFunc *cb, void *opaque);
+void qcow2_cache_set_deferred(Qcow2Cache *c, int deferred);
+void qcow2_cache_set_dependency(Qcow2Cache *c, Qcow2Cache *dependency);
+void qcow2_cache_depends_on_flush(Qcow2Cache *c);
+int qcow2_cache_set_writethrough(BlockDriverState *bs, Qcow2Cache *c,
+    int writethrough);
+void qcow2_cache_reset(BlockDriverState *bs, Qcow2Cache *c);
+void qcow2_cache_discard(BlockDriverState *bs, Qcow2Cache *c, int64_t offset);
+int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, int64_t offset,
+    void **table);
+int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, int64_t offset,
+    void **table);
+int qcow2_cache_entry_mark_dirty(BlockDriverState *bs, Qcow2Cache *c,
+    void *table, int start, int len);
+int qcow2_cache_load_aio(BlockDriverState *bs, Qcow2Cache *c, int64_t offset,
+    BlockDriverCompletionFunc *cb, void *opaque);
+void qcow2_cache_cancel(Qcow2Cache *c, void *opaque);
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses);
+
 /* qcow2-snapshot.c functions */
 int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info);
 int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id);
@@ -25,6 +25,36 @@
 #define QEMU_AIO_MISALIGNED   0x1000
 
 
+/* request accounting shared by both implementations, main thread only */
+static inline int64_t raw_aio_clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline void raw_aio_account_submit(BlockDriverState *bs)
+{
+    if (++bs->aio_queue_depth > bs->aio_max_queue_depth) {
+        bs->aio_max_queue_depth = bs->aio_queue_depth;
+    }
+}
+
+static inline void raw_aio_account_done(BlockDriverState *bs,
+    int64_t submit_ns, int merged)
+{
+    uint64_t latency = raw_aio_clock_ns() - submit_ns;
+
+    bs->aio_queue_depth--;
+    bs->aio_requests++;
+    bs->aio_merged += merged;
+    bs->aio_total_latency_ns += latency;
+    if (latency > bs->aio_max_latency_ns) {
+        bs->aio_max_latency_ns = latency;
+    }
+}
+
 /* posix-aio-compat.c - thread pool based implementation */
 int paio_init(void);
 BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
@@ -35,9 +65,11 @@ BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, int fd,
         BlockDriverCompletionFunc *cb, void *opaque);
 
 /* linux-aio.c - Linux native implementation */
-void *laio_init(void);
+void *laio_init(int queue_depth, int poll);
 BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int type);
+void laio_io_plug(void *aio_ctx);
+void laio_io_unplug(void *aio_ctx);
 
 #endif /* QEMU_RAW_POSIX_AIO_H */
@@ -173,7 +173,7 @@ static int raw_open_common(BlockDriverState *bs, const char *filename,
         /* We're falling back to POSIX AIO in some cases */
         paio_init();
 
-        s->aio_ctx = laio_init();
+        s->aio_ctx = laio_init(bs->aio_max_events, bs->aio_poll);
         if (!s->aio_ctx) {
             goto out_free_buf;
         }
@@ -544,6 +544,28 @@ static BlockDriverAIOCB *raw_aio_writev(BlockDriverState *bs,
                           cb, opaque, QEMU_AIO_WRITE);
 }
 
+static void raw_io_plug(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_aio) {
+        laio_io_plug(s->aio_ctx);
+    }
+#endif
+}
+
+static void raw_io_unplug(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_aio) {
+        laio_io_unplug(s->aio_ctx);
+    }
+#endif
+}
+
 static BlockDriverAIOCB *raw_aio_flush(BlockDriverState *bs,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
@@ -566,6 +588,52 @@ static void raw_close(BlockDriverState *bs)
     }
 }
 
+/*
+ * Holes in a sparse file read as zeroes; find them with SEEK_DATA and
+ * SEEK_HOLE where the host and file system support it.
+ */
+static int raw_has_data(BlockDriverState *bs, int64_t sector_num,
+                        int nb_sectors, int *pnum)
+{
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    BDRVRawState *s = bs->opaque;
+    off_t start, data, hole;
+    int64_t n;
+
+    *pnum = nb_sectors;
+    if (s->type != FTYPE_FILE) {
+        return 1;
+    }
+
+    start = sector_num * BDRV_SECTOR_SIZE;
+    data = lseek(s->fd, start, SEEK_DATA);
+    if (data == -1) {
+        /* ENXIO means there is only a hole up to the end of the file */
+        return errno != ENXIO;
+    }
+    if (data > start) {
+        n = (data - start) >> BDRV_SECTOR_BITS;
+        if (n < nb_sectors) {
+            *pnum = n;
+        }
+        return 0;
+    }
+
+    hole = lseek(s->fd, start, SEEK_HOLE);
+    if (hole == -1) {
+        return 1;
+    }
+    n = (hole - start + BDRV_SECTOR_SIZE - 1) >> BDRV_SECTOR_BITS;
+    if (n < nb_sectors) {
+        *pnum = n;
+    }
+    return 1;
+#else
+    *pnum = nb_sectors;
+    return 1;
+#endif
+}
+
 static int raw_truncate(BlockDriverState *bs, int64_t offset)
 {
     BDRVRawState *s = bs->opaque;
@@ -751,9 +819,12 @@ static BlockDriver bdrv_file = {
     .bdrv_aio_readv = raw_aio_readv,
     .bdrv_aio_writev = raw_aio_writev,
     .bdrv_aio_flush = raw_aio_flush,
+    .bdrv_io_plug = raw_io_plug,
+    .bdrv_io_unplug = raw_io_unplug,
 
     .bdrv_truncate = raw_truncate,
     .bdrv_getlength = raw_getlength,
+    .bdrv_has_data = raw_has_data,
 
     .create_options = raw_create_options,
 };
@@ -1128,6 +1199,8 @@ static BlockDriver bdrv_host_floppy = {
     .bdrv_aio_readv     = raw_aio_readv,
     .bdrv_aio_writev    = raw_aio_writev,
     .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_io_plug       = raw_io_plug,
+    .bdrv_io_unplug     = raw_io_unplug,
 
     .bdrv_read          = raw_read,
     .bdrv_write         = raw_write,
@@ -1225,6 +1298,8 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_aio_readv     = raw_aio_readv,
     .bdrv_aio_writev    = raw_aio_writev,
     .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_io_plug       = raw_io_plug,
+    .bdrv_io_unplug     = raw_io_unplug,
 
     .bdrv_read          = raw_read,
     .bdrv_write         = raw_write,
@@ -1348,6 +1423,8 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_aio_readv     = raw_aio_readv,
     .bdrv_aio_writev    = raw_aio_writev,
     .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_io_plug       = raw_io_plug,
+    .bdrv_io_unplug     = raw_io_unplug,
 
     .bdrv_read          = raw_read,
     .bdrv_write         = raw_write,
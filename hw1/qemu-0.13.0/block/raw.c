@@ -112,6 +112,12 @@ static int raw_has_zero_init(BlockDriverState *bs)
     return bdrv_has_zero_init(bs->file);
 }
 
+static int raw_has_data(BlockDriverState *bs, int64_t sector_num,
+                        int nb_sectors, int *pnum)
+{
+    return bdrv_has_data(bs->file, sector_num, nb_sectors, pnum);
+}
+
 static BlockDriver bdrv_raw = {
     .format_name        = "raw",
 
@@ -140,6 +146,7 @@ static BlockDriver bdrv_raw = {
     .bdrv_create        = raw_create,
     .create_options     = raw_create_options,
     .bdrv_has_zero_init = raw_has_zero_init,
+    .bdrv_has_data      = raw_has_data,
 };
 
 static void bdrv_raw_init(void)
@@ -62,6 +62,8 @@ struct BlockDriver {
     void (*bdrv_flush)(BlockDriverState *bs);
     int (*bdrv_is_allocated)(BlockDriverState *bs, int64_t sector_num,
                              int nb_sectors, int *pnum);
+    int (*bdrv_has_data)(BlockDriverState *bs, int64_t sector_num,
+                         int nb_sectors, int *pnum);
     int (*bdrv_set_key)(BlockDriverState *bs, const char *key);
     int (*bdrv_make_empty)(BlockDriverState *bs);
     /* aio */
@@ -79,12 +81,22 @@ struct BlockDriver {
     int (*bdrv_merge_requests)(BlockDriverState *bs, BlockRequest* a,
         BlockRequest *b);
 
+    /* batch submission of the requests issued between plug and unplug */
+    void (*bdrv_io_plug)(BlockDriverState *bs);
+    void (*bdrv_io_unplug)(BlockDriverState *bs);
+
 
     const char *protocol_name;
     int (*bdrv_truncate)(BlockDriverState *bs, int64_t offset);
     int64_t (*bdrv_getlength)(BlockDriverState *bs);
     int (*bdrv_write_compressed)(BlockDriverState *bs, int64_t sector_num,
                                  const uint8_t *buf, int nb_sectors);
+    /* bdrv_write_compressed split in two steps */
+    int (*bdrv_compress_cluster)(BlockDriverState *bs, const uint8_t *buf,
+                                 uint8_t *out_buf);
+    int (*bdrv_write_compressed_cluster)(BlockDriverState *bs,
+                                         int64_t sector_num,
+                                         const uint8_t *out_buf, int out_len);
 
     int (*bdrv_snapshot_create)(BlockDriverState *bs,
                                 QEMUSnapshotInfo *sn_info);
@@ -177,6 +189,16 @@ struct BlockDriverState {
     uint64_t rd_ops;
     uint64_t wr_ops;
     uint64_t wr_highest_sector;
+    uint64_t rd_merged;     /* requests merged by bdrv_aio_multiread/write */
+    uint64_t wr_merged;
+
+    /* host AIO queue stats, kept by posix-aio-compat.c and linux-aio.c */
+    uint64_t aio_requests;
+    uint64_t aio_merged;
+    uint64_t aio_total_latency_ns;
+    uint64_t aio_max_latency_ns;
+    int aio_queue_depth;
+    int aio_max_queue_depth;
 
     /* Whether the disk can expand beyond total_sectors */
     int growable;
@@ -187,6 +209,14 @@ struct BlockDriverState {
     /* do we need to tell the quest if we have a volatile write cache? */
     int enable_write_cache;
 
+    /* metadata cache sizes in bytes requested by the user, 0 for default */
+    int64_t l2_cache_size;
+    int64_t refcount_cache_size;
+
+    /* native AIO tuning requested by the user, passed on to the protocol */
+    int aio_max_events;
+    int aio_poll;
+
     /* NOTE: the following infos are only hints for real hardware
        drivers. They are not used by the block driver */
     int cyls, heads, secs, translation;
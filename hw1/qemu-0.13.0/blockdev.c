@@ -147,6 +147,7 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi, int *fatal_error)
     int index;
     int ro = 0;
     int bdrv_flags = 0;
+    int aio_queue_depth = 0, aio_poll = 0;
     int on_read_error, on_write_error;
     const char *devaddr;
     DriveInfo *dinfo;
@@ -295,6 +296,13 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi, int *fatal_error)
            return NULL;
         }
     }
+
+    aio_queue_depth = qemu_opt_get_number(opts, "aio-queue-depth", 0);
+    if (aio_queue_depth < 0 || aio_queue_depth > 65536) {
+        fprintf(stderr, "qemu: invalid aio-queue-depth option\n");
+        return NULL;
+    }
+    aio_poll = qemu_opt_get_bool(opts, "aio-poll", 0);
 #endif
 
     if ((buf = qemu_opt_get(opts, "format")) != NULL) {
@@ -422,6 +430,10 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi, int *fatal_error)
     QTAILQ_INSERT_TAIL(&drives, dinfo, next);
 
     bdrv_set_on_error(dinfo->bdrv, on_read_error, on_write_error);
+    bdrv_set_cache_size_hint(dinfo->bdrv,
+                             qemu_opt_get_size(opts, "l2-cache-size", 0),
+                             qemu_opt_get_size(opts, "refcount-cache-size", 0));
+    bdrv_set_aio_hint(dinfo->bdrv, aio_queue_depth, aio_poll);
 
     switch(type) {
     case IF_IDE:
@@ -48,6 +48,16 @@ void mmap_unlock(void)
     }
 }
 
+/* Drop every level of mmap_lock this thread holds.  Used after a
+   longjmp back to cpu_exec(), which is never entered with it held.  */
+void mmap_lock_reset(void)
+{
+    if (mmap_lock_count) {
+        mmap_lock_count = 0;
+        pthread_mutex_unlock(&mmap_mutex);
+    }
+}
+
 /* Grab lock to make sure things are in a consistent state after fork().  */
 void mmap_fork_start(void)
 {
@@ -72,6 +82,10 @@ void mmap_lock(void)
 void mmap_unlock(void)
 {
 }
+
+void mmap_lock_reset(void)
+{
+}
 #endif
 
 void *qemu_vmalloc(size_t size)
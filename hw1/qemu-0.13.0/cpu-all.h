@@ -21,6 +21,7 @@
 
 #include "qemu-common.h"
 #include "cpu-common.h"
+#include "bitops.h"
 
 /* some important defines:
  *
@@ -760,6 +761,8 @@ int walk_memory_regions(void *, walk_memory_regions_fn);
 int page_get_flags(target_ulong address);
 void page_set_flags(target_ulong start, target_ulong end, int flags);
 int page_check_range(target_ulong start, target_ulong len, int flags);
+target_ulong page_find_free(target_ulong start, target_ulong last,
+                            target_ulong size);
 #endif
 
 CPUState *cpu_copy(CPUState *env);
@@ -874,8 +877,14 @@ typedef struct RAMBlock {
 #endif
 } RAMBlock;
 
+#define DIRTY_MEMORY_VGA       0
+#define DIRTY_MEMORY_CODE      1
+#define DIRTY_MEMORY_MIGRATION 2
+#define DIRTY_MEMORY_NUM       3
+
 typedef struct RAMList {
-    uint8_t *phys_dirty;
+    unsigned long *dirty_memory[DIRTY_MEMORY_NUM];
+    ram_addr_t dirty_pages;
     QLIST_HEAD(ram, RAMBlock) blocks;
 } RAMList;
 extern RAMList ram_list;
@@ -904,47 +913,160 @@ extern int mem_prealloc;
 #define VGA_DIRTY_FLAG       0x01
 #define CODE_DIRTY_FLAG      0x02
 #define MIGRATION_DIRTY_FLAG 0x08
+#define ALL_DIRTY_FLAGS      (VGA_DIRTY_FLAG | CODE_DIRTY_FLAG | \
+                              MIGRATION_DIRTY_FLAG)
+
+/* Each dirty memory client owns one bit per target page in its own
+   bitmap, so that a client can scan or reset its pages a word at a
+   time without looking at the bits of the others.  */
+static inline unsigned long *cpu_physical_memory_dirty_bitmap(int dirty_flag)
+{
+    switch (dirty_flag) {
+    case VGA_DIRTY_FLAG:
+        return ram_list.dirty_memory[DIRTY_MEMORY_VGA];
+    case CODE_DIRTY_FLAG:
+        return ram_list.dirty_memory[DIRTY_MEMORY_CODE];
+    default:
+        return ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION];
+    }
+}
 
 /* read dirty bit (return 0 or 1) */
 static inline int cpu_physical_memory_is_dirty(ram_addr_t addr)
 {
-    return ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] == 0xff;
+    unsigned long page = addr >> TARGET_PAGE_BITS;
+
+    return test_bit(page, ram_list.dirty_memory[DIRTY_MEMORY_VGA]) &&
+           test_bit(page, ram_list.dirty_memory[DIRTY_MEMORY_CODE]) &&
+           test_bit(page, ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION]);
 }
 
 static inline int cpu_physical_memory_get_dirty_flags(ram_addr_t addr)
 {
-    return ram_list.phys_dirty[addr >> TARGET_PAGE_BITS];
+    unsigned long page = addr >> TARGET_PAGE_BITS;
+    int ret = 0;
+
+    if (test_bit(page, ram_list.dirty_memory[DIRTY_MEMORY_VGA])) {
+        ret |= VGA_DIRTY_FLAG;
+    }
+    if (test_bit(page, ram_list.dirty_memory[DIRTY_MEMORY_CODE])) {
+        ret |= CODE_DIRTY_FLAG;
+    }
+    if (test_bit(page, ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION])) {
+        ret |= MIGRATION_DIRTY_FLAG;
+    }
+    return ret;
 }
 
 static inline int cpu_physical_memory_get_dirty(ram_addr_t addr,
                                                 int dirty_flags)
 {
-    return ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] & dirty_flags;
+    return cpu_physical_memory_get_dirty_flags(addr) & dirty_flags;
 }
 
-static inline void cpu_physical_memory_set_dirty(ram_addr_t addr)
+/* Return the address of the first page in [start, end) that is dirty for
+   the client dirty_flag, or end if there is none.  */
+static inline ram_addr_t cpu_physical_memory_find_next_dirty(ram_addr_t start,
+                                                             ram_addr_t end,
+                                                             int dirty_flag)
+{
+    unsigned long page;
+
+    page = find_next_bit(cpu_physical_memory_dirty_bitmap(dirty_flag),
+                         end >> TARGET_PAGE_BITS, start >> TARGET_PAGE_BITS);
+    return (ram_addr_t)page << TARGET_PAGE_BITS;
+}
+
+/* Test whether any page in [start, start + length) is dirty for any of
+   the clients in dirty_flags.  */
+static inline int cpu_physical_memory_get_dirty_range(ram_addr_t start,
+                                                      ram_addr_t length,
+                                                      int dirty_flags)
 {
-    ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] = 0xff;
+    ram_addr_t end = TARGET_PAGE_ALIGN(start + length);
+
+    start &= TARGET_PAGE_MASK;
+    if ((dirty_flags & VGA_DIRTY_FLAG) &&
+        cpu_physical_memory_find_next_dirty(start, end, VGA_DIRTY_FLAG) < end) {
+        return 1;
+    }
+    if ((dirty_flags & CODE_DIRTY_FLAG) &&
+        cpu_physical_memory_find_next_dirty(start, end, CODE_DIRTY_FLAG) < end) {
+        return 1;
+    }
+    if ((dirty_flags & MIGRATION_DIRTY_FLAG) &&
+        cpu_physical_memory_find_next_dirty(start, end,
+                                            MIGRATION_DIRTY_FLAG) < end) {
+        return 1;
+    }
+    return 0;
+}
+
+/* Number of pages in [start, start + length) dirty for client dirty_flag */
+static inline ram_addr_t cpu_physical_memory_count_dirty(ram_addr_t start,
+                                                         ram_addr_t length,
+                                                         int dirty_flag)
+{
+    return bitmap_count_one(cpu_physical_memory_dirty_bitmap(dirty_flag),
+                            start >> TARGET_PAGE_BITS,
+                            length >> TARGET_PAGE_BITS);
 }
 
 static inline int cpu_physical_memory_set_dirty_flags(ram_addr_t addr,
                                                       int dirty_flags)
 {
-    return ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] |= dirty_flags;
+    unsigned long page = addr >> TARGET_PAGE_BITS;
+
+    if (dirty_flags & VGA_DIRTY_FLAG) {
+        set_bit(page, ram_list.dirty_memory[DIRTY_MEMORY_VGA]);
+    }
+    if (dirty_flags & CODE_DIRTY_FLAG) {
+        set_bit(page, ram_list.dirty_memory[DIRTY_MEMORY_CODE]);
+    }
+    if (dirty_flags & MIGRATION_DIRTY_FLAG) {
+        set_bit(page, ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION]);
+    }
+    return cpu_physical_memory_get_dirty_flags(addr);
+}
+
+static inline void cpu_physical_memory_set_dirty(ram_addr_t addr)
+{
+    cpu_physical_memory_set_dirty_flags(addr, ALL_DIRTY_FLAGS);
+}
+
+static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
+                                                       ram_addr_t length,
+                                                       int dirty_flags)
+{
+    unsigned long page = start >> TARGET_PAGE_BITS;
+    unsigned long nr = length >> TARGET_PAGE_BITS;
+
+    if (dirty_flags & VGA_DIRTY_FLAG) {
+        bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_VGA], page, nr);
+    }
+    if (dirty_flags & CODE_DIRTY_FLAG) {
+        bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_CODE], page, nr);
+    }
+    if (dirty_flags & MIGRATION_DIRTY_FLAG) {
+        bitmap_set(ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION], page, nr);
+    }
 }
 
 static inline void cpu_physical_memory_mask_dirty_range(ram_addr_t start,
-                                                        int length,
+                                                        ram_addr_t length,
                                                         int dirty_flags)
 {
-    int i, mask, len;
-    uint8_t *p;
+    unsigned long page = start >> TARGET_PAGE_BITS;
+    unsigned long nr = length >> TARGET_PAGE_BITS;
 
-    len = length >> TARGET_PAGE_BITS;
-    mask = ~dirty_flags;
-    p = ram_list.phys_dirty + (start >> TARGET_PAGE_BITS);
-    for (i = 0; i < len; i++) {
-        p[i] &= mask;
+    if (dirty_flags & VGA_DIRTY_FLAG) {
+        bitmap_clear(ram_list.dirty_memory[DIRTY_MEMORY_VGA], page, nr);
+    }
+    if (dirty_flags & CODE_DIRTY_FLAG) {
+        bitmap_clear(ram_list.dirty_memory[DIRTY_MEMORY_CODE], page, nr);
+    }
+    if (dirty_flags & MIGRATION_DIRTY_FLAG) {
+        bitmap_clear(ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION], page, nr);
     }
 }
 
@@ -963,6 +1085,13 @@ void dump_exec_info(FILE *f,
                     int (*cpu_fprintf)(FILE *f, const char *fmt, ...));
 #endif /* !CONFIG_USER_ONLY */
 
+void dump_tb_lock_info(FILE *f,
+                       int (*cpu_fprintf)(FILE *f, const char *fmt, ...));
+void dump_smc_info(FILE *f,
+                   int (*cpu_fprintf)(FILE *f, const char *fmt, ...));
+void dump_restore_info(FILE *f,
+                       int (*cpu_fprintf)(FILE *f, const char *fmt, ...));
+
 int cpu_memory_rw_debug(CPUState *env, target_ulong addr,
                         uint8_t *buf, int len, int is_write);
 
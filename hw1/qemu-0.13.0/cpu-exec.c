@@ -98,6 +98,7 @@ void cpu_resume_from_signal(CPUState *env1, void *puc)
     longjmp(env->jmp_env, 1);
 }
 
+#if !defined(CONFIG_USER_ONLY)
 /* Execute the code without caching the generated code. An interpreter
    could be used if available. */
 static void cpu_exec_nocache(int max_cycles, TranslationBlock *orig_tb)
@@ -125,20 +126,21 @@ static void cpu_exec_nocache(int max_cycles, TranslationBlock *orig_tb)
     tb_phys_invalidate(tb, -1);
     tb_free(tb);
 }
+#endif
 
-static TranslationBlock *tb_find_slow(target_ulong pc,
-                                      target_ulong cs_base,
-                                      uint64_t flags)
+/* Walk the physical hash chain.  This is done without tb_lock:
+   tb_link_page() only publishes fully initialized TBs, and a TB being
+   removed keeps its phys_hash_next link intact.  */
+static TranslationBlock *tb_find_physical(target_ulong pc,
+                                          target_ulong cs_base,
+                                          uint64_t flags,
+                                          tb_page_addr_t phys_pc)
 {
     TranslationBlock *tb, **ptb1;
     unsigned int h;
-    tb_page_addr_t phys_pc, phys_page1, phys_page2;
+    tb_page_addr_t phys_page1, phys_page2;
     target_ulong virt_page2;
 
-    tb_invalidated_flag = 0;
-
-    /* find translated block using physical mappings */
-    phys_pc = get_page_addr_code(env, pc);
     phys_page1 = phys_pc & TARGET_PAGE_MASK;
     phys_page2 = -1;
     h = tb_phys_hash_func(phys_pc);
@@ -146,7 +148,7 @@ static TranslationBlock *tb_find_slow(target_ulong pc,
     for(;;) {
         tb = *ptb1;
         if (!tb)
-            goto not_found;
+            return NULL;
         if (tb->pc == pc &&
             tb->page_addr[0] == phys_page1 &&
             tb->cs_base == cs_base &&
@@ -157,18 +159,38 @@ static TranslationBlock *tb_find_slow(target_ulong pc,
                     TARGET_PAGE_SIZE;
                 phys_page2 = get_page_addr_code(env, virt_page2);
                 if (tb->page_addr[1] == phys_page2)
-                    goto found;
+                    return tb;
             } else {
-                goto found;
+                return tb;
             }
         }
         ptb1 = &tb->phys_hash_next;
     }
- not_found:
-   /* if no translated code available, then translate it now */
-    tb = tb_gen_code(env, pc, cs_base, flags, 0);
+}
+
+static TranslationBlock *tb_find_slow(target_ulong pc,
+                                      target_ulong cs_base,
+                                      uint64_t flags)
+{
+    TranslationBlock *tb;
+    tb_page_addr_t phys_pc;
+
+    tb_invalidated_flag = 0;
+
+    /* find translated block using physical mappings */
+    phys_pc = get_page_addr_code(env, pc);
+    tb = tb_find_physical(pc, cs_base, flags, phys_pc);
+    if (!tb) {
+        /* if no translated code available, then translate it now.
+           Another thread may have done so since we looked.  */
+        tb_lock_enter();
+        tb = tb_find_physical(pc, cs_base, flags, phys_pc);
+        if (!tb) {
+            tb = tb_gen_code(env, pc, cs_base, flags, 0);
+        }
+        tb_lock_leave();
+    }
 
- found:
     /* we add the TB in the virtual pc hash table */
     env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
     return tb;
@@ -189,9 +211,38 @@ static inline TranslationBlock *tb_find_fast(void)
                  tb->flags != flags)) {
         tb = tb_find_slow(pc, cs_base, flags);
     }
+#if defined(CONFIG_USER_ONLY)
+    /* the code of self checking TBs may have been modified since they
+       were translated */
+    if (unlikely(tb->cflags & CF_SMC_CHECK) && !tb_smc_verify(tb)) {
+        tb = tb_find_slow(pc, cs_base, flags);
+        tb_invalidated_flag = 1;
+    }
+#endif
     return tb;
 }
 
+/* Patch jump 'n' of the TB that just exited to go straight to 'tb'.
+   Once patched, the unlocked test below keeps us off tb_lock.
+   'flush_count' is the value of tb_flush_count before the exiting TB
+   was looked up: if another thread flushed the cache since, both TBs
+   may already be gone.  */
+static inline void tb_chain(unsigned long next_tb, TranslationBlock *tb,
+                            int flush_count)
+{
+    TranslationBlock *last_tb = (TranslationBlock *)(next_tb & ~3);
+    int n = next_tb & 3;
+
+    if (last_tb->jmp_next[n]) {
+        return;
+    }
+    tb_lock_enter();
+    if (flush_count == tb_flush_count) {
+        tb_add_jump(last_tb, n, tb);
+    }
+    tb_lock_leave();
+}
+
 static CPUDebugExcpHandler *debug_excp_handler;
 
 CPUDebugExcpHandler *cpu_set_debug_excp_handler(CPUDebugExcpHandler *handler)
@@ -225,6 +276,7 @@ int cpu_exec(CPUState *env1)
     TranslationBlock *tb;
     uint8_t *tc_ptr;
     unsigned long next_tb;
+    int flush_count, last_flush_count = 0;
 
     if (cpu_halted(env1) == EXCP_HALTED)
         return EXCP_HALTED;
@@ -552,6 +604,9 @@ int cpu_exec(CPUState *env1)
                 }
                 if (unlikely(env->exit_request)) {
                     env->exit_request = 0;
+#if defined(CONFIG_USER_ONLY)
+                    env->icount_decr.u16.high = 0;
+#endif
                     env->exception_index = EXCP_INTERRUPT;
                     cpu_loop_exit();
                 }
@@ -573,7 +628,7 @@ int cpu_exec(CPUState *env1)
 #endif
                 }
 #endif /* DEBUG_DISAS || CONFIG_DEBUG_EXEC */
-                spin_lock(&tb_lock);
+                flush_count = tb_flush_count;
                 tb = tb_find_fast();
                 /* Note: we do it here to avoid a gcc bug on Mac OS X when
                    doing it in tb_find_slow */
@@ -591,11 +646,13 @@ int cpu_exec(CPUState *env1)
 #endif
                 /* see if we can patch the calling TB. When the TB
                    spans two pages, we cannot safely do a direct
-                   jump. */
-                if (next_tb != 0 && tb->page_addr[1] == -1) {
-                    tb_add_jump((TranslationBlock *)(next_tb & ~3), next_tb & 3, tb);
+                   jump.  Self checking TBs must always be entered
+                   through tb_find_fast. */
+                if (next_tb != 0 && tb->page_addr[1] == -1 &&
+                    !(tb->cflags & CF_SMC_CHECK)) {
+                    tb_chain(next_tb, tb, last_flush_count);
                 }
-                spin_unlock(&tb_lock);
+                last_flush_count = flush_count;
 
                 /* cpu_interrupt might be called while translating the
                    TB, but before it is linked into a potentially
@@ -613,11 +670,22 @@ int cpu_exec(CPUState *env1)
 #endif
 
 #ifdef ENABLE_OPTIMIZATION_IBTC
-                    update_ibtc_entry(tb);
+                    if (!(tb->cflags & CF_SMC_CHECK)) {
+                        update_ibtc_entry(tb);
+                    }
 #endif
 
                     next_tb = tcg_qemu_tb_exec(tc_ptr);
                     if ((next_tb & 3) == 2) {
+#if defined(CONFIG_USER_ONLY)
+                        /* Stopped on TB entry by cpu_exit() or
+                           cpu_interrupt(); the checks at the top of the
+                           loop pick up the request.  */
+                        tb = (TranslationBlock *)(long)(next_tb & ~3);
+                        cpu_pc_from_tb(env, tb);
+                        env->icount_decr.u16.high = 0;
+                        next_tb = 0;
+#else
                         /* Instruction counter expired.  */
                         int insns_left;
                         tb = (TranslationBlock *)(long)(next_tb & ~3);
@@ -643,12 +711,17 @@ int cpu_exec(CPUState *env1)
                             next_tb = 0;
                             cpu_loop_exit();
                         }
+#endif
                     }
                 }
                 env->current_tb = NULL;
                 /* reset soft MMU for next block (it can currently
                    only be set by a memory fault) */
             } /* for(;;) */
+        } else {
+            /* we may have jumped out of the translator or of the
+               invalidation code with tb_lock or mmap_lock held */
+            tb_lock_reset();
         }
     } /* for(;;) */
 
@@ -24,6 +24,13 @@
 #include "qemu-common.h"
 #include "host-utils.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef CONFIG_AVX2_OPT
+#include <immintrin.h>
+#endif
+
 void pstrcpy(char *buf, int buf_size, const char *str)
 {
     int c;
@@ -168,30 +175,50 @@ void qemu_iovec_add(QEMUIOVector *qiov, void *base, size_t len)
 }
 
 /*
- * Copies iovecs from src to the end dst until src is completely copied or the
- * total size of the copied iovec reaches size. The size of the last copied
- * iovec is changed in order to fit the specified total size if it isn't a
- * perfect fit already.
+ * Copies iovecs from src to the end of dst. It starts copying after skipping
+ * the given number of bytes in src and copies until src is completely copied
+ * or the total size of the copied iovec reaches size. The size of the last
+ * copied iovec is changed in order to fit the specified total size if it isn't
+ * a perfect fit already.
  */
-void qemu_iovec_concat(QEMUIOVector *dst, QEMUIOVector *src, size_t size)
+void qemu_iovec_copy(QEMUIOVector *dst, QEMUIOVector *src, uint64_t skip,
+    size_t size)
 {
     int i;
     size_t done;
+    void *iov_base;
+    uint64_t iov_len;
 
     assert(dst->nalloc != -1);
 
     done = 0;
     for (i = 0; (i < src->niov) && (done != size); i++) {
-        if (done + src->iov[i].iov_len > size) {
-            qemu_iovec_add(dst, src->iov[i].iov_base, size - done);
+        if (skip >= src->iov[i].iov_len) {
+            /* Skip the whole iov */
+            skip -= src->iov[i].iov_len;
+            continue;
+        } else {
+            /* Skip only part (or nothing) of the iov */
+            iov_base = (uint8_t*) src->iov[i].iov_base + skip;
+            iov_len = src->iov[i].iov_len - skip;
+            skip = 0;
+        }
+
+        if (done + iov_len > size) {
+            qemu_iovec_add(dst, iov_base, size - done);
             break;
         } else {
-            qemu_iovec_add(dst, src->iov[i].iov_base, src->iov[i].iov_len);
+            qemu_iovec_add(dst, iov_base, iov_len);
         }
-        done += src->iov[i].iov_len;
+        done += iov_len;
     }
 }
 
+void qemu_iovec_concat(QEMUIOVector *dst, QEMUIOVector *src, size_t size)
+{
+    qemu_iovec_copy(dst, src, 0, size);
+}
+
 void qemu_iovec_destroy(QEMUIOVector *qiov)
 {
     assert(qiov->nalloc != -1);
@@ -234,6 +261,30 @@ void qemu_iovec_from_buffer(QEMUIOVector *qiov, const void *buf, size_t count)
     }
 }
 
+/*
+ * Fills count bytes of qiov with c, starting after the first skip bytes.
+ */
+void qemu_iovec_memset_skip(QEMUIOVector *qiov, int c, size_t count,
+                            size_t skip)
+{
+    size_t n;
+    int i;
+
+    for (i = 0; i < qiov->niov && count; ++i) {
+        if (skip >= qiov->iov[i].iov_len) {
+            skip -= qiov->iov[i].iov_len;
+            continue;
+        }
+        n = qiov->iov[i].iov_len - skip;
+        if (n > count) {
+            n = count;
+        }
+        memset((uint8_t *)qiov->iov[i].iov_base + skip, c, n);
+        skip = 0;
+        count -= n;
+    }
+}
+
 #ifndef _WIN32
 /* Sets a specific flag */
 int fcntl_setfl(int fd, int flag)
@@ -251,3 +302,147 @@ int fcntl_setfl(int fd, int flag)
 }
 #endif
 
+
+/*
+ * Checks if a buffer is all zeroes, or if two buffers are equal.  These are
+ * used on every sector by qemu-img, so the bulk of the work is done 16 or 32
+ * bytes at a time; the AVX2 version is picked at startup if the host CPU
+ * supports it.
+ */
+static int buffer_is_zero_scalar(const uint8_t *p, size_t len)
+{
+    const uint8_t *end = p + len;
+    unsigned long v;
+
+    for (; p + sizeof(v) <= end; p += sizeof(v)) {
+        memcpy(&v, p, sizeof(v));
+        if (v) {
+            return 0;
+        }
+    }
+    for (; p < end; p++) {
+        if (*p) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int buffer_is_equal_scalar(const uint8_t *a, const uint8_t *b,
+                                  size_t len)
+{
+    return !memcmp(a, b, len);
+}
+
+#ifdef __SSE2__
+static int buffer_is_zero_sse2(const uint8_t *p, size_t len)
+{
+    const uint8_t *end = p + len;
+    __m128i t;
+
+    for (; p + 64 <= end; p += 64) {
+        t = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128((const __m128i *)p),
+                         _mm_loadu_si128((const __m128i *)(p + 16))),
+            _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + 32)),
+                         _mm_loadu_si128((const __m128i *)(p + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(t, _mm_setzero_si128()))
+            != 0xffff) {
+            return 0;
+        }
+    }
+    return buffer_is_zero_scalar(p, end - p);
+}
+
+static int buffer_is_equal_sse2(const uint8_t *a, const uint8_t *b,
+                                size_t len)
+{
+    const uint8_t *end = a + len;
+    __m128i t;
+
+    for (; a + 32 <= end; a += 32, b += 32) {
+        t = _mm_and_si128(
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)a),
+                           _mm_loadu_si128((const __m128i *)b)),
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + 16)),
+                           _mm_loadu_si128((const __m128i *)(b + 16))));
+        if (_mm_movemask_epi8(t) != 0xffff) {
+            return 0;
+        }
+    }
+    return buffer_is_equal_scalar(a, b, end - a);
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+static int __attribute__((target("avx2")))
+buffer_is_zero_avx2(const uint8_t *p, size_t len)
+{
+    const uint8_t *end = p + len;
+    __m256i t;
+
+    for (; p + 128 <= end; p += 128) {
+        t = _mm256_or_si256(
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i *)p),
+                            _mm256_loadu_si256((const __m256i *)(p + 32))),
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(p + 64)),
+                            _mm256_loadu_si256((const __m256i *)(p + 96))));
+        if (!_mm256_testz_si256(t, t)) {
+            return 0;
+        }
+    }
+    return buffer_is_zero_scalar(p, end - p);
+}
+
+static int __attribute__((target("avx2")))
+buffer_is_equal_avx2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    const uint8_t *end = a + len;
+    __m256i t;
+
+    for (; a + 64 <= end; a += 64, b += 64) {
+        t = _mm256_or_si256(
+            _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)a),
+                             _mm256_loadu_si256((const __m256i *)b)),
+            _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + 32)),
+                             _mm256_loadu_si256((const __m256i *)(b + 32))));
+        if (!_mm256_testz_si256(t, t)) {
+            return 0;
+        }
+    }
+    return buffer_is_equal_scalar(a, b, end - a);
+}
+#endif
+
+static int (*buffer_is_zero_accel)(const uint8_t *, size_t) =
+    buffer_is_zero_scalar;
+static int (*buffer_is_equal_accel)(const uint8_t *, const uint8_t *,
+                                    size_t) = buffer_is_equal_scalar;
+
+static void __attribute__((constructor)) buffer_accel_init(void)
+{
+#ifdef __SSE2__
+    buffer_is_zero_accel = buffer_is_zero_sse2;
+    buffer_is_equal_accel = buffer_is_equal_sse2;
+#endif
+#ifdef CONFIG_AVX2_OPT
+    /* may run before libgcc has looked at the CPU itself */
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        buffer_is_zero_accel = buffer_is_zero_avx2;
+        buffer_is_equal_accel = buffer_is_equal_avx2;
+    }
+#endif
+}
+
+/* Returns true if the len bytes at buf are all zero */
+int buffer_is_zero(const void *buf, size_t len)
+{
+    return buffer_is_zero_accel(buf, len);
+}
+
+/* Returns true if the len bytes at a and b are the same */
+int buffer_is_equal(const void *a, const void *b, size_t len)
+{
+    return buffer_is_equal_accel(a, b, len);
+}
@@ -79,6 +79,13 @@ void gen_intermediate_code(CPUState *env, struct TranslationBlock *tb);
 void gen_intermediate_code_pc(CPUState *env, struct TranslationBlock *tb);
 void gen_pc_load(CPUState *env, struct TranslationBlock *tb,
                  unsigned long searched_pc, int pc_pos, void *puc);
+#ifdef TARGET_RESTORE_WORDS
+/* Targets defining TARGET_RESTORE_WORDS split gen_pc_load() in two so
+   that cpu_restore_state() can cache the state of a search.  */
+void gen_pc_save(struct TranslationBlock *tb, int pc_pos, target_ulong *data);
+void gen_pc_restore(CPUState *env, struct TranslationBlock *tb,
+                    const target_ulong *data);
+#endif
 
 void cpu_gen_init(void);
 int cpu_gen_code(CPUState *env, struct TranslationBlock *tb,
@@ -86,6 +93,7 @@ int cpu_gen_code(CPUState *env, struct TranslationBlock *tb,
 int cpu_restore_state(struct TranslationBlock *tb,
                       CPUState *env, unsigned long searched_pc,
                       void *puc);
+void restore_cache_flush(void);
 void cpu_resume_from_signal(CPUState *env1, void *puc);
 void cpu_io_recompile(CPUState *env, void *retaddr);
 TranslationBlock *tb_gen_code(CPUState *env, 
@@ -131,9 +139,12 @@ struct TranslationBlock {
     uint64_t flags; /* flags defining in which context the code was generated */
     uint16_t size;      /* size of target code for this block (1 <=
                            size <= TARGET_PAGE_SIZE) */
-    uint16_t cflags;    /* compile flags */
+    uint32_t cflags;    /* compile flags */
 #define CF_COUNT_MASK  0x7fff
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
+#define CF_SMC_CHECK   0x10000 /* Guest code is compared with smc_copy
+                                  before each lookup.  With precise SMC,
+                                  its stores are checked against it.  */
 
     uint8_t *tc_ptr;    /* pointer to the translated code */
     /* next matching tb for physical address. */
@@ -158,6 +169,10 @@ struct TranslationBlock {
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
     uint32_t icount;
+#if defined(CONFIG_USER_ONLY)
+    /* copy of the guest code, for CF_SMC_CHECK blocks */
+    uint8_t *smc_copy;
+#endif
 };
 
 static inline unsigned int tb_jmp_cache_hash_page(target_ulong pc)
@@ -186,6 +201,9 @@ void tb_flush(CPUState *env);
 void tb_link_page(TranslationBlock *tb,
                   tb_page_addr_t phys_pc, tb_page_addr_t phys_page2);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
+#if defined(CONFIG_USER_ONLY)
+int tb_smc_verify(TranslationBlock *tb);
+#endif
 
 extern TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
 
@@ -197,8 +215,9 @@ extern void ppc_tb_set_jmp_target(unsigned long jmp_addr, unsigned long addr);
 #elif defined(__i386__) || defined(__x86_64__)
 static inline void tb_set_jmp_target1(unsigned long jmp_addr, unsigned long addr)
 {
-    /* patch the branch destination */
-    *(uint32_t *)jmp_addr = addr - (jmp_addr + 4);
+    /* patch the branch destination; the displacement is 4-byte aligned
+       (see goto_tb in tcg/i386) so the store is atomic */
+    *(volatile uint32_t *)jmp_addr = addr - (jmp_addr + 4);
     /* no need to flush icache explicitly */
 }
 #elif defined(__arm__)
@@ -269,7 +288,12 @@ TranslationBlock *tb_find_pc(unsigned long pc_ptr);
 
 extern spinlock_t tb_lock;
 
+void tb_lock_enter(void);
+void tb_lock_leave(void);
+void tb_lock_reset(void);
+
 extern int tb_invalidated_flag;
+extern int tb_flush_count;
 
 #if !defined(CONFIG_USER_ONLY)
 
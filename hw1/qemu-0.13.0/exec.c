@@ -40,6 +40,7 @@
 #include "osdep.h"
 #include "kvm.h"
 #include "qemu-timer.h"
+#include "qemu-barrier.h"
 #if defined(CONFIG_USER_ONLY)
 #include <qemu.h>
 #include <signal.h>
@@ -78,13 +79,23 @@
 #endif
 
 #define SMC_BITMAP_USE_THRESHOLD 10
+/* number of code invalidations after which a user mode page stops being
+   write protected and its TBs check their own code instead */
+#define SMC_CHECK_THRESHOLD 4
 
 static TranslationBlock *tbs;
 static int code_gen_max_blocks;
 TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
 static int nb_tbs;
-/* any access to the tbs or the page table must use this lock */
+/* Translation, chaining and invalidation of TBs must hold this lock
+   (see tb_lock_enter()).  Lookups in tb_phys_hash and tb_jmp_cache do
+   not: TBs are published there only once fully initialized.  */
 spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
+#if defined(CONFIG_USE_NPTL)
+static __thread int tb_lock_count;
+#else
+static int tb_lock_count;
+#endif
 
 #if defined(__arm__) || defined(__sparc_v9__)
 /* The prologue must be reachable with a direct jump. ARM and Sparc64
@@ -135,8 +146,15 @@ typedef struct PageDesc {
        of lookups we do to a given page to use a bitmap */
     unsigned int code_write_count;
     uint8_t *code_bitmap;
+    /* number of guest writes that invalidated code on this page */
+    unsigned int smc_count;
 #if defined(CONFIG_USER_ONLY)
-    unsigned long flags;
+    /* PAGE_WRITE has been removed from the host page because it holds
+       translated code.  The guest protection itself is kept per region
+       in the VMA tree, see page_set_flags.  */
+    int write_protected;
+    /* the page is never write protected; its TBs are CF_SMC_CHECK */
+    int smc_check;
 #endif
 } PageDesc;
 
@@ -225,8 +243,14 @@ static int log_append = 0;
 #if !defined(CONFIG_USER_ONLY)
 static int tlb_flush_count;
 #endif
-static int tb_flush_count;
+int tb_flush_count;
 static int tb_phys_invalidate_count;
+/* TBs invalidated because the guest wrote to their code */
+static int smc_invalidate_count;
+/* tb_lock acquisitions, and how many of them had to wait for another
+   thread.  Both are only updated with the lock held.  */
+static int64_t tb_lock_acquire_count;
+static int64_t tb_lock_contended_count;
 
 #ifdef _WIN32
 static void map_exec(void *addr, long size)
@@ -398,6 +422,329 @@ static inline PageDesc *page_find(tb_page_addr_t index)
     return page_find_alloc(index, 0);
 }
 
+#if defined(CONFIG_USER_ONLY)
+/* Guest memory regions.  The protection of the guest address space is
+   kept as a set of disjoint [start, last] intervals in an AVL tree, so
+   that updating or checking a range costs O(log n) per region touched
+   rather than one l1_map lookup per page.  Each node also records, for
+   its subtree, the span it covers and the largest hole between two of
+   its regions; this lets page_find_free skip whole subtrees that have
+   no room.  The tree is modified under mmap_lock; vma_lookup_unlocked
+   reads it without.  */
+typedef struct VMANode {
+    target_ulong start, last;
+    int flags;
+    int height;
+    target_ulong min_start, max_last, max_gap;
+    struct VMANode *left, *right;
+} VMANode;
+
+static VMANode *vma_root;
+static VMANode *vma_free_list;
+/* Odd while vma_set_flags is changing the tree */
+static volatile unsigned int vma_seq;
+
+/* Nodes are carved out of mmap()ed chunks for the same reason as the
+   page tables: qemu_malloc may end up back in page_set_flags.  */
+static VMANode *vma_node_new(target_ulong start, target_ulong last, int flags)
+{
+    VMANode *n;
+
+    if (!vma_free_list) {
+        size_t i, count = qemu_real_host_page_size / sizeof(VMANode);
+
+        n = mmap(NULL, count * sizeof(VMANode), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (n == MAP_FAILED) {
+            perror("vma_node_new");
+            abort();
+        }
+        for (i = 0; i < count; i++) {
+            n[i].right = vma_free_list;
+            vma_free_list = &n[i];
+        }
+    }
+    n = vma_free_list;
+    vma_free_list = n->right;
+    memset(n, 0, sizeof(*n));
+    n->start = start;
+    n->last = last;
+    n->flags = flags;
+    return n;
+}
+
+static void vma_node_free(VMANode *n)
+{
+    n->right = vma_free_list;
+    vma_free_list = n;
+}
+
+static inline int vma_height(VMANode *n)
+{
+    return n ? n->height : 0;
+}
+
+static void vma_update(VMANode *n)
+{
+    VMANode *l = n->left, *r = n->right;
+    target_ulong gap = 0;
+
+    n->height = 1 + MAX(vma_height(l), vma_height(r));
+    n->min_start = l ? l->min_start : n->start;
+    n->max_last = r ? r->max_last : n->last;
+    if (l) {
+        gap = MAX(l->max_gap, n->start - l->max_last - 1);
+    }
+    if (r) {
+        gap = MAX(gap, r->max_gap);
+        gap = MAX(gap, r->min_start - n->last - 1);
+    }
+    n->max_gap = gap;
+}
+
+static VMANode *vma_rotate_right(VMANode *n)
+{
+    VMANode *l = n->left;
+
+    n->left = l->right;
+    l->right = n;
+    vma_update(n);
+    vma_update(l);
+    return l;
+}
+
+static VMANode *vma_rotate_left(VMANode *n)
+{
+    VMANode *r = n->right;
+
+    n->right = r->left;
+    r->left = n;
+    vma_update(n);
+    vma_update(r);
+    return r;
+}
+
+static VMANode *vma_balance(VMANode *n)
+{
+    int bf;
+
+    vma_update(n);
+    bf = vma_height(n->left) - vma_height(n->right);
+    if (bf > 1) {
+        if (vma_height(n->left->left) < vma_height(n->left->right)) {
+            n->left = vma_rotate_left(n->left);
+        }
+        return vma_rotate_right(n);
+    }
+    if (bf < -1) {
+        if (vma_height(n->right->right) < vma_height(n->right->left)) {
+            n->right = vma_rotate_right(n->right);
+        }
+        return vma_rotate_left(n);
+    }
+    return n;
+}
+
+static VMANode *vma_insert(VMANode *t, VMANode *n)
+{
+    if (!t) {
+        vma_update(n);
+        return n;
+    }
+    if (n->start < t->start) {
+        t->left = vma_insert(t->left, n);
+    } else {
+        t->right = vma_insert(t->right, n);
+    }
+    return vma_balance(t);
+}
+
+static VMANode *vma_remove_min(VMANode *t, VMANode **min)
+{
+    if (!t->left) {
+        *min = t;
+        return t->right;
+    }
+    t->left = vma_remove_min(t->left, min);
+    return vma_balance(t);
+}
+
+/* Unlink the node starting at 'start', which must exist.  */
+static VMANode *vma_remove(VMANode *t, target_ulong start)
+{
+    VMANode *m;
+
+    if (start < t->start) {
+        t->left = vma_remove(t->left, start);
+    } else if (start > t->start) {
+        t->right = vma_remove(t->right, start);
+    } else {
+        if (!t->left || !t->right) {
+            return t->left ? t->left : t->right;
+        }
+        t->right = vma_remove_min(t->right, &m);
+        m->left = t->left;
+        m->right = t->right;
+        t = m;
+    }
+    return vma_balance(t);
+}
+
+/* Return the region containing addr, or failing that the first region
+   after it if 'next' is set.  */
+static VMANode *vma_lookup(target_ulong addr, int next)
+{
+    VMANode *n = vma_root, *best = NULL;
+
+    while (n) {
+        if (addr < n->start) {
+            best = n;
+            n = n->left;
+        } else if (addr > n->last) {
+            n = n->right;
+        } else {
+            return n;
+        }
+    }
+    return next ? best : NULL;
+}
+
+/* Copy the region containing addr into *r without taking mmap_lock.
+   Returns 0 if addr is not mapped.  Nodes are never unmapped, so a
+   reader racing with vma_set_flags can at worst follow stale links; it
+   notices from vma_seq and tries again.  Should the tree keep changing,
+   or be in the middle of a change by this very thread (a SEGV taken
+   with mmap_lock held), fall back to the lock, which nests.  */
+static int vma_lookup_unlocked(target_ulong addr, VMANode *r)
+{
+    VMANode *n;
+    unsigned int seq;
+    int i, tries, found;
+
+    for (tries = 0; tries < 16; tries++) {
+        seq = vma_seq;
+        smp_rmb();
+        if (seq & 1) {
+            continue;
+        }
+        found = 0;
+        n = vma_root;
+        /* deeper than any AVL tree over the address space: a cycle */
+        for (i = 0; n && i < 2 * TARGET_LONG_BITS; i++) {
+            if (addr < n->start) {
+                n = n->left;
+            } else if (addr > n->last) {
+                n = n->right;
+            } else {
+                r->start = n->start;
+                r->last = n->last;
+                r->flags = n->flags;
+                found = 1;
+                break;
+            }
+        }
+        smp_rmb();
+        if (vma_seq == seq && (found || !n)) {
+            return found;
+        }
+    }
+
+    mmap_lock();
+    n = vma_lookup(addr, 0);
+    if (n) {
+        *r = *n;
+    }
+    mmap_unlock();
+    return n != NULL;
+}
+
+static int vma_get_flags(target_ulong addr)
+{
+    VMANode *n = vma_lookup(addr, 0);
+
+    return n ? n->flags : 0;
+}
+
+/* Give [start, last] the protection 'flags', or no mapping at all if
+   flags is zero, splitting and merging the neighbouring regions.  */
+static void vma_set_flags(target_ulong start, target_ulong last, int flags)
+{
+    VMANode *n, *m;
+
+    vma_seq++;
+    smp_wmb();
+
+    /* punch a hole, one overlapping region at a time */
+    while ((n = vma_lookup(start, 1)) != NULL && n->start <= last) {
+        vma_root = vma_remove(vma_root, n->start);
+        if (n->start < start) {
+            m = vma_node_new(n->start, start - 1, n->flags);
+            vma_root = vma_insert(vma_root, m);
+        }
+        if (n->last > last) {
+            m = vma_node_new(last + 1, n->last, n->flags);
+            vma_root = vma_insert(vma_root, m);
+        }
+        vma_node_free(n);
+    }
+    if (flags == 0) {
+        goto out;
+    }
+
+    /* coalesce with identical neighbours */
+    if (start > 0 && (n = vma_lookup(start - 1, 0)) && n->flags == flags) {
+        start = n->start;
+        vma_root = vma_remove(vma_root, n->start);
+        vma_node_free(n);
+    }
+    if (last < (target_ulong)-1 && (n = vma_lookup(last + 1, 0)) &&
+        n->flags == flags) {
+        last = n->last;
+        vma_root = vma_remove(vma_root, n->start);
+        vma_node_free(n);
+    }
+    vma_root = vma_insert(vma_root, vma_node_new(start, last, flags));
+ out:
+    smp_wmb();
+    vma_seq++;
+}
+
+/* Find the lowest address >= min, aligned to 'align', such that the
+   'size' bytes from there are free and lie within [lo, hi].  The
+   regions of subtree n are exactly those inside [lo, hi].  */
+static int vma_find_gap(VMANode *n, target_ulong lo, target_ulong hi,
+                        target_ulong min, target_ulong size,
+                        target_ulong align, target_ulong *ret)
+{
+    target_ulong addr;
+
+    if (hi < min) {
+        return 0;
+    }
+    if (!n) {
+        addr = (MAX(lo, min) + align - 1) & ~(align - 1);
+        if (addr < lo || addr > hi || hi - addr < size - 1) {
+            return 0;
+        }
+        *ret = addr;
+        return 1;
+    }
+    if (n->max_gap < size && n->min_start - lo < size &&
+        hi - n->max_last < size) {
+        return 0;
+    }
+    if (n->start > lo &&
+        vma_find_gap(n->left, lo, n->start - 1, min, size, align, ret)) {
+        return 1;
+    }
+    if (n->last < hi &&
+        vma_find_gap(n->right, n->last + 1, hi, min, size, align, ret)) {
+        return 1;
+    }
+    return 0;
+}
+#endif
+
 #if !defined(CONFIG_USER_ONLY)
 static PhysPageDesc *phys_page_find_alloc(target_phys_addr_t index, int alloc)
 {
@@ -449,8 +796,44 @@ static void tlb_unprotect_code_phys(CPUState *env, ram_addr_t ram_addr,
                                     target_ulong vaddr);
 #define mmap_lock() do { } while(0)
 #define mmap_unlock() do { } while(0)
+#define mmap_lock_reset() do { } while(0)
 #endif
 
+/* Take tb_lock.  It nests inside mmap_lock, which tb_link_page() and
+   page_unprotect() need anyway, and may be taken recursively by the
+   same thread.  */
+void tb_lock_enter(void)
+{
+    mmap_lock();
+    if (tb_lock_count++ == 0) {
+        if (!spin_trylock(&tb_lock)) {
+            spin_lock(&tb_lock);
+            tb_lock_contended_count++;
+        }
+        tb_lock_acquire_count++;
+    }
+}
+
+void tb_lock_leave(void)
+{
+    if (--tb_lock_count == 0) {
+        spin_unlock(&tb_lock);
+    }
+    mmap_unlock();
+}
+
+/* Drop tb_lock, and the mmap_lock levels taken with it or around it,
+   if this thread still holds them after a longjmp out of the translator
+   or the invalidation code.  */
+void tb_lock_reset(void)
+{
+    if (tb_lock_count) {
+        tb_lock_count = 0;
+        spin_unlock(&tb_lock);
+    }
+    mmap_lock_reset();
+}
+
 #define DEFAULT_CODE_GEN_BUFFER_SIZE (32 * 1024 * 1024)
 
 #if defined(CONFIG_USER_ONLY)
@@ -702,6 +1085,14 @@ void tb_flush(CPUState *env1)
     if ((unsigned long)(code_gen_ptr - code_gen_buffer) > code_gen_buffer_size)
         cpu_abort(env1, "Internal error: code buffer overflow\n");
 
+#if defined(CONFIG_USER_ONLY)
+    {
+        int i;
+        for (i = 0; i < nb_tbs; i++) {
+            qemu_free(tbs[i].smc_copy);
+        }
+    }
+#endif
     nb_tbs = 0;
 
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
@@ -710,6 +1101,7 @@ void tb_flush(CPUState *env1)
 
     memset (tb_phys_hash, 0, CODE_GEN_PHYS_HASH_SIZE * sizeof (void *));
     page_flush_tb();
+    restore_cache_flush();
 
     code_gen_ptr = code_gen_buffer;
     /* XXX: flush processor icache at this point if cache flush is
@@ -838,15 +1230,16 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
               offsetof(TranslationBlock, phys_hash_next));
 
     /* remove the TB from the page list */
+    /* the code bitmaps of the pages are left alone: a stale bit only
+       sends a write to tb_invalidate_phys_page_range, which refreshes
+       the bitmap when it finds nothing to invalidate */
     if (tb->page_addr[0] != page_addr) {
         p = page_find(tb->page_addr[0] >> TARGET_PAGE_BITS);
         tb_page_remove(&p->first_tb, tb);
-        invalidate_page_bitmap(p);
     }
     if (tb->page_addr[1] != -1 && tb->page_addr[1] != page_addr) {
         p = page_find(tb->page_addr[1] >> TARGET_PAGE_BITS);
         tb_page_remove(&p->first_tb, tb);
-        invalidate_page_bitmap(p);
     }
 
     tb_invalidated_flag = 1;
@@ -879,6 +1272,50 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     tb_phys_invalidate_count++;
 }
 
+#if defined(CONFIG_USER_ONLY)
+static int tb_smc_unchanged(TranslationBlock *tb)
+{
+    /* the page the TB continues on may have been unmapped since */
+    if (tb->page_addr[1] != -1 &&
+        page_check_range((tb->pc & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE,
+                         1, PAGE_READ) < 0) {
+        return 0;
+    }
+    return memcmp(g2h(tb->pc), tb->smc_copy, tb->size) == 0;
+}
+
+/* Check that the guest code of a CF_SMC_CHECK TB is unchanged since
+   its translation.  If it was modified, the TB is invalidated and 0 is
+   returned.  */
+int tb_smc_verify(TranslationBlock *tb)
+{
+    TranslationBlock *tb1;
+    PageDesc *p;
+    unsigned int h;
+
+    if (tb_smc_unchanged(tb)) {
+        return 1;
+    }
+
+    tb_lock_enter();
+    /* another thread may have invalidated it meanwhile */
+    h = tb_phys_hash_func(tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK));
+    for (tb1 = tb_phys_hash[h]; tb1 != NULL; tb1 = tb1->phys_hash_next) {
+        if (tb1 == tb) {
+            break;
+        }
+    }
+    if (tb1 != NULL && (tb->cflags & CF_SMC_CHECK) && !tb_smc_unchanged(tb)) {
+        p = page_find(tb->page_addr[0] >> TARGET_PAGE_BITS);
+        p->smc_count++;
+        smc_invalidate_count++;
+        tb_phys_invalidate(tb, -1);
+    }
+    tb_lock_leave();
+    return 0;
+}
+#endif
+
 static inline void set_bits(uint8_t *tab, int start, int len)
 {
     int end, mask, end1;
@@ -906,9 +1343,29 @@ static inline void set_bits(uint8_t *tab, int start, int len)
     }
 }
 
+/* mark the bytes of 'tb' that lie in its n-th page */
+static void page_bitmap_add_tb(PageDesc *p, TranslationBlock *tb, int n)
+{
+    int tb_start, tb_end;
+
+    /* NOTE: this is subtle as a TB may span two physical pages */
+    if (n == 0) {
+        /* NOTE: tb_end may be after the end of the page, but
+           it is not a problem */
+        tb_start = tb->pc & ~TARGET_PAGE_MASK;
+        tb_end = tb_start + tb->size;
+        if (tb_end > TARGET_PAGE_SIZE)
+            tb_end = TARGET_PAGE_SIZE;
+    } else {
+        tb_start = 0;
+        tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
+    }
+    set_bits(p->code_bitmap, tb_start, tb_end - tb_start);
+}
+
 static void build_page_bitmap(PageDesc *p)
 {
-    int n, tb_start, tb_end;
+    int n;
     TranslationBlock *tb;
 
     p->code_bitmap = qemu_mallocz(TARGET_PAGE_SIZE / 8);
@@ -917,19 +1374,7 @@ static void build_page_bitmap(PageDesc *p)
     while (tb != NULL) {
         n = (long)tb & 3;
         tb = (TranslationBlock *)((long)tb & ~3);
-        /* NOTE: this is subtle as a TB may span two physical pages */
-        if (n == 0) {
-            /* NOTE: tb_end may be after the end of the page, but
-               it is not a problem */
-            tb_start = tb->pc & ~TARGET_PAGE_MASK;
-            tb_end = tb_start + tb->size;
-            if (tb_end > TARGET_PAGE_SIZE)
-                tb_end = TARGET_PAGE_SIZE;
-        } else {
-            tb_start = 0;
-            tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
-        }
-        set_bits(p->code_bitmap, tb_start, tb_end - tb_start);
+        page_bitmap_add_tb(p, tb, n);
         tb = tb->page_next[n];
     }
 }
@@ -943,8 +1388,17 @@ TranslationBlock *tb_gen_code(CPUState *env,
     tb_page_addr_t phys_pc, phys_page2;
     target_ulong virt_page2;
     int code_gen_size;
+#if defined(CONFIG_USER_ONLY)
+    PageDesc *p;
+#endif
 
     phys_pc = get_page_addr_code(env, pc);
+#if defined(CONFIG_USER_ONLY)
+    p = page_find(phys_pc >> TARGET_PAGE_BITS);
+    if (p && p->smc_check) {
+        cflags |= CF_SMC_CHECK;
+    }
+#endif
     tb = tb_alloc(pc);
     if (!tb) {
         /* flush must be done */
@@ -959,8 +1413,10 @@ TranslationBlock *tb_gen_code(CPUState *env,
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
+#if defined(CONFIG_USER_ONLY) && defined(TARGET_HAS_PRECISE_SMC)
+ translate:
+#endif
     cpu_gen_code(env, tb, &code_gen_size);
-    code_gen_ptr = (void *)(((unsigned long)code_gen_ptr + code_gen_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
 
     /* check next page if needed */
     virt_page2 = (pc + tb->size - 1) & TARGET_PAGE_MASK;
@@ -968,6 +1424,27 @@ TranslationBlock *tb_gen_code(CPUState *env,
     if ((pc & TARGET_PAGE_MASK) != virt_page2) {
         phys_page2 = get_page_addr_code(env, virt_page2);
     }
+#if defined(CONFIG_USER_ONLY)
+    if (phys_page2 != -1 && !(tb->cflags & CF_SMC_CHECK)) {
+        p = page_find(phys_page2 >> TARGET_PAGE_BITS);
+        if (p && p->smc_check) {
+            tb->cflags |= CF_SMC_CHECK;
+#ifdef TARGET_HAS_PRECISE_SMC
+            /* translate it again with its stores checked */
+            goto translate;
+#endif
+        }
+    }
+#endif
+    code_gen_ptr = (void *)(((unsigned long)code_gen_ptr + code_gen_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
+#if defined(CONFIG_USER_ONLY)
+    if (tb->cflags & CF_SMC_CHECK) {
+        /* a write by another thread during the translation goes unnoticed,
+           just as with the write protection set up by tb_link_page */
+        tb->smc_copy = qemu_malloc(tb->size);
+        memcpy(tb->smc_copy, g2h(pc), tb->size);
+    }
+#endif
     tb_link_page(tb, phys_pc, phys_page2);
     return tb;
 }
@@ -984,7 +1461,7 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
     CPUState *env = cpu_single_env;
     tb_page_addr_t tb_start, tb_end;
     PageDesc *p;
-    int n;
+    int n, invalidated;
 #ifdef TARGET_HAS_PRECISE_SMC
     int current_tb_not_found = is_cpu_write_access;
     TranslationBlock *current_tb = NULL;
@@ -1006,6 +1483,7 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
 
     /* we remove all the TBs in the range [start, end[ */
     /* XXX: see if in some cases it could be faster to invalidate all the code */
+    invalidated = 0;
     tb = p->first_tb;
     while (tb != NULL) {
         n = (long)tb & 3;
@@ -1054,6 +1532,7 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
                 env->current_tb = NULL;
             }
             tb_phys_invalidate(tb, -1);
+            invalidated++;
             if (env) {
                 env->current_tb = saved_tb;
                 if (env->interrupt_request && env->current_tb)
@@ -1062,6 +1541,16 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
         }
         tb = tb_next;
     }
+    if (invalidated) {
+        if (is_cpu_write_access) {
+            p->smc_count++;
+            smc_invalidate_count += invalidated;
+        }
+    } else if (p->code_bitmap) {
+        /* the write only hit code that was already invalidated */
+        invalidate_page_bitmap(p);
+        build_page_bitmap(p);
+    }
 #if !defined(CONFIG_USER_ONLY)
     /* if no code remaining, no need to continue to use slow writes */
     if (!p->first_tb) {
@@ -1111,12 +1600,13 @@ static inline void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
 }
 
 #if !defined(CONFIG_SOFTMMU)
-static void tb_invalidate_phys_page(tb_page_addr_t addr,
-                                    unsigned long pc, void *puc)
+/* invalidate all the TBs of the page and return how many there were */
+static int tb_invalidate_phys_page(tb_page_addr_t addr,
+                                   unsigned long pc, void *puc)
 {
     TranslationBlock *tb;
     PageDesc *p;
-    int n;
+    int n, count;
 #ifdef TARGET_HAS_PRECISE_SMC
     TranslationBlock *current_tb = NULL;
     CPUState *env = cpu_single_env;
@@ -1129,7 +1619,8 @@ static void tb_invalidate_phys_page(tb_page_addr_t addr,
     addr &= TARGET_PAGE_MASK;
     p = page_find(addr >> TARGET_PAGE_BITS);
     if (!p)
-        return;
+        return 0;
+    count = 0;
     tb = p->first_tb;
 #ifdef TARGET_HAS_PRECISE_SMC
     if (tb && pc != 0) {
@@ -1155,6 +1646,7 @@ static void tb_invalidate_phys_page(tb_page_addr_t addr,
         }
 #endif /* TARGET_HAS_PRECISE_SMC */
         tb_phys_invalidate(tb, addr);
+        count++;
         tb = tb->page_next[n];
     }
     p->first_tb = NULL;
@@ -1168,6 +1660,7 @@ static void tb_invalidate_phys_page(tb_page_addr_t addr,
         cpu_resume_from_signal(env, puc);
     }
 #endif
+    return count;
 }
 #endif
 
@@ -1183,12 +1676,15 @@ static inline void tb_alloc_page(TranslationBlock *tb,
     tb->page_next[n] = p->first_tb;
     last_first_tb = p->first_tb;
     p->first_tb = (TranslationBlock *)((long)tb | n);
-    invalidate_page_bitmap(p);
+    if (p->code_bitmap) {
+        page_bitmap_add_tb(p, tb, n);
+    }
 
 #if defined(TARGET_HAS_SMC) || 1
 
 #if defined(CONFIG_USER_ONLY)
-    if (p->flags & PAGE_WRITE) {
+    if (!p->write_protected && !p->smc_check &&
+        (vma_get_flags(page_addr) & PAGE_WRITE)) {
         target_ulong addr;
         PageDesc *p2;
         int prot;
@@ -1200,11 +1696,9 @@ static inline void tb_alloc_page(TranslationBlock *tb,
         for(addr = page_addr; addr < page_addr + qemu_host_page_size;
             addr += TARGET_PAGE_SIZE) {
 
-            p2 = page_find (addr >> TARGET_PAGE_BITS);
-            if (!p2)
-                continue;
-            prot |= p2->flags;
-            p2->flags &= ~PAGE_WRITE;
+            p2 = page_find_alloc(addr >> TARGET_PAGE_BITS, 1);
+            prot |= vma_get_flags(addr);
+            p2->write_protected = 1;
           }
         mprotect(g2h(page_addr), qemu_host_page_size,
                  (prot & PAGE_BITS) & ~PAGE_WRITE);
@@ -1237,6 +1731,9 @@ TranslationBlock *tb_alloc(target_ulong pc)
     tb = &tbs[nb_tbs++];
     tb->pc = pc;
     tb->cflags = 0;
+#if defined(CONFIG_USER_ONLY)
+    tb->smc_copy = NULL;
+#endif
     return tb;
 }
 
@@ -1248,6 +1745,10 @@ void tb_free(TranslationBlock *tb)
     if (nb_tbs > 0 && tb == &tbs[nb_tbs - 1]) {
         code_gen_ptr = tb->tc_ptr;
         nb_tbs--;
+#if defined(CONFIG_USER_ONLY)
+        qemu_free(tb->smc_copy);
+#endif
+        restore_cache_flush();
     }
 }
 
@@ -1262,11 +1763,6 @@ void tb_link_page(TranslationBlock *tb,
     /* Grab the mmap lock to stop another thread invalidating this TB
        before we are done.  */
     mmap_lock();
-    /* add in the physical hash table */
-    h = tb_phys_hash_func(phys_pc);
-    ptb = &tb_phys_hash[h];
-    tb->phys_hash_next = *ptb;
-    *ptb = tb;
 
     /* add in the page list */
     tb_alloc_page(tb, 0, phys_pc & TARGET_PAGE_MASK);
@@ -1285,6 +1781,14 @@ void tb_link_page(TranslationBlock *tb,
     if (tb->tb_next_offset[1] != 0xffff)
         tb_reset_jump(tb, 1);
 
+    /* add in the physical hash table last: tb_find_slow() walks it
+       without tb_lock, so the TB must be complete before it shows up */
+    h = tb_phys_hash_func(phys_pc);
+    ptb = &tb_phys_hash[h];
+    tb->phys_hash_next = *ptb;
+    smp_wmb();
+    *ptb = tb;
+
 #ifdef DEBUG_TB_CHECK
     tb_page_check();
 #endif
@@ -1373,7 +1877,9 @@ static void tb_reset_jump_recursive(TranslationBlock *tb)
 #if defined(CONFIG_USER_ONLY)
 static void breakpoint_invalidate(CPUState *env, target_ulong pc)
 {
+    tb_lock_enter();
     tb_invalidate_phys_page_range(pc, pc + 1, 0);
+    tb_lock_leave();
 }
 #else
 static void breakpoint_invalidate(CPUState *env, target_ulong pc)
@@ -1608,6 +2114,13 @@ void cpu_set_log_filename(const char *filename)
 
 static void cpu_unlink_tb(CPUState *env)
 {
+#if defined(CONFIG_USER_ONLY)
+    /* Every TB tests icount_decr on entry (see gen_icount_start()), so
+       the CPU leaves its chain at the next TB boundary.  Unchaining
+       would instead force every hot loop the guest was in to be
+       re-linked, once per delivered signal.  */
+    env->icount_decr.u16.high = 0xffff;
+#else
     /* FIXME: TB unchaining isn't SMP safe.  For now just ignore the
        problem and hope the cpu will stop of its own accord.  For userspace
        emulation this often isn't actually as bad as it sounds.  Often
@@ -1624,6 +2137,7 @@ static void cpu_unlink_tb(CPUState *env)
         tb_reset_jump_recursive(tb);
     }
     spin_unlock(&interrupt_lock);
+#endif
 }
 
 /* mask must never be zero, except for A20 change call */
@@ -2265,87 +2779,33 @@ void tlb_flush_page(CPUState *env, target_ulong addr)
  * and calls callback function 'fn' for each region.
  */
 
-struct walk_memory_regions_data
+static int walk_memory_regions_1(VMANode *n, void *priv,
+                                 walk_memory_regions_fn fn)
 {
-    walk_memory_regions_fn fn;
-    void *priv;
-    unsigned long start;
-    int prot;
-};
+    int rc;
 
-static int walk_memory_regions_end(struct walk_memory_regions_data *data,
-                                   abi_ulong end, int new_prot)
-{
-    if (data->start != -1ul) {
-        int rc = data->fn(data->priv, data->start, end, data->prot);
-        if (rc != 0) {
-            return rc;
-        }
+    if (!n) {
+        return 0;
     }
-
-    data->start = (new_prot ? end : -1ul);
-    data->prot = new_prot;
-
-    return 0;
-}
-
-static int walk_memory_regions_1(struct walk_memory_regions_data *data,
-                                 abi_ulong base, int level, void **lp)
-{
-    abi_ulong pa;
-    int i, rc;
-
-    if (*lp == NULL) {
-        return walk_memory_regions_end(data, base, 0);
+    rc = walk_memory_regions_1(n->left, priv, fn);
+    if (rc != 0) {
+        return rc;
     }
-
-    if (level == 0) {
-        PageDesc *pd = *lp;
-        for (i = 0; i < L2_SIZE; ++i) {
-            int prot = pd[i].flags;
-
-            pa = base | (i << TARGET_PAGE_BITS);
-            if (prot != data->prot) {
-                rc = walk_memory_regions_end(data, pa, prot);
-                if (rc != 0) {
-                    return rc;
-                }
-            }
-        }
-    } else {
-        void **pp = *lp;
-        for (i = 0; i < L2_SIZE; ++i) {
-            pa = base | ((abi_ulong)i <<
-                (TARGET_PAGE_BITS + L2_BITS * level));
-            rc = walk_memory_regions_1(data, pa, level - 1, pp + i);
-            if (rc != 0) {
-                return rc;
-            }
-        }
+    rc = fn(priv, n->start, n->last + 1, n->flags);
+    if (rc != 0) {
+        return rc;
     }
-
-    return 0;
+    return walk_memory_regions_1(n->right, priv, fn);
 }
 
 int walk_memory_regions(void *priv, walk_memory_regions_fn fn)
 {
-    struct walk_memory_regions_data data;
-    unsigned long i;
-
-    data.fn = fn;
-    data.priv = priv;
-    data.start = -1ul;
-    data.prot = 0;
+    int rc;
 
-    for (i = 0; i < V_L1_SIZE; i++) {
-        int rc = walk_memory_regions_1(&data, (abi_ulong)i << V_L1_SHIFT,
-                                       V_L1_SHIFT / L2_BITS - 1, l1_map + i);
-        if (rc != 0) {
-            return rc;
-        }
-    }
-
-    return walk_memory_regions_end(&data, 0, 0);
+    mmap_lock();
+    rc = walk_memory_regions_1(vma_root, priv, fn);
+    mmap_unlock();
+    return rc;
 }
 
 static int dump_region(void *priv, abi_ulong start,
@@ -2371,14 +2831,55 @@ void page_dump(FILE *f)
     walk_memory_regions(f, dump_region);
 }
 
+/* Like page_find, but when index has no PageDesc also store in *next
+   the first index past the unallocated part of l1_map around it, so
+   that callers can walk a range in time proportional to the pages that
+   actually hold code.  */
+static PageDesc *page_find_next(tb_page_addr_t index, tb_page_addr_t *next)
+{
+    PageDesc *pd;
+    void **lp;
+    int i;
+
+    lp = l1_map + ((index >> V_L1_SHIFT) & (V_L1_SIZE - 1));
+    for (i = V_L1_SHIFT / L2_BITS - 1; i > 0; i--) {
+        void **p = *lp;
+
+        if (p == NULL) {
+            *next = (index | (((tb_page_addr_t)1 << ((i + 1) * L2_BITS)) - 1))
+                    + 1;
+            return NULL;
+        }
+        lp = p + ((index >> (i * L2_BITS)) & (L2_SIZE - 1));
+    }
+
+    pd = *lp;
+    if (pd == NULL) {
+        *next = (index | (L2_SIZE - 1)) + 1;
+        return NULL;
+    }
+    return pd + (index & (L2_SIZE - 1));
+}
+
+/* Lock free: l1_map levels are never freed, and see
+   vma_lookup_unlocked for the regions.  */
 int page_get_flags(target_ulong address)
 {
+    VMANode r;
     PageDesc *p;
+    int flags;
 
-    p = page_find(address >> TARGET_PAGE_BITS);
-    if (!p)
+    if (!vma_lookup_unlocked(address, &r)) {
         return 0;
-    return p->flags;
+    }
+    flags = r.flags;
+    if (flags & PAGE_WRITE) {
+        p = page_find(address >> TARGET_PAGE_BITS);
+        if (p && p->write_protected) {
+            flags &= ~PAGE_WRITE;
+        }
+    }
+    return flags;
 }
 
 /* Modify the flags of a page and invalidate the code if necessary.
@@ -2386,7 +2887,9 @@ int page_get_flags(target_ulong address)
    on PAGE_WRITE.  The mmap_lock should already be held.  */
 void page_set_flags(target_ulong start, target_ulong end, int flags)
 {
-    target_ulong addr, len;
+    tb_page_addr_t index, next;
+    target_ulong last;
+    PageDesc *p;
 
     /* This function should never be called with addresses outside the
        guest address space.  If this assert fires, it probably indicates
@@ -2397,33 +2900,51 @@ void page_set_flags(target_ulong start, target_ulong end, int flags)
     assert(start < end);
 
     start = start & TARGET_PAGE_MASK;
-    end = TARGET_PAGE_ALIGN(end);
+    last = TARGET_PAGE_ALIGN(end) - 1;
 
     if (flags & PAGE_WRITE) {
         flags |= PAGE_WRITE_ORG;
     }
 
-    for (addr = start, len = end - start;
-         len != 0;
-         len -= TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE) {
-        PageDesc *p = page_find_alloc(addr >> TARGET_PAGE_BITS, 1);
+    vma_set_flags(start, last, flags);
 
-        /* If the write protection bit is set, then we invalidate
-           the code inside.  */
-        if (!(p->flags & PAGE_WRITE) &&
-            (flags & PAGE_WRITE) &&
-            p->first_tb) {
-            tb_invalidate_phys_page(addr, 0, NULL);
+    /* The host protection was just set from 'flags', so pages holding
+       code are no longer write protected; if they became writable, we
+       invalidate the code inside.  Self-checking pages keep their code
+       as long as it stays readable: the TBs verify themselves.  */
+    for (index = start >> TARGET_PAGE_BITS;
+         index <= (last >> TARGET_PAGE_BITS); ) {
+        p = page_find_next(index, &next);
+        if (!p) {
+            index = next;
+            continue;
+        }
+        if (p->first_tb &&
+            (!(flags & PAGE_READ) ||
+             ((flags & PAGE_WRITE) && !p->smc_check))) {
+            if ((flags & PAGE_WRITE) &&
+                ++p->smc_count >= SMC_CHECK_THRESHOLD) {
+                p->smc_check = 1;
+            }
+            tb_lock_enter();
+            smc_invalidate_count +=
+                tb_invalidate_phys_page(index << TARGET_PAGE_BITS, 0, NULL);
+            tb_lock_leave();
         }
-        p->flags = flags;
+        if (!(flags & PAGE_READ)) {
+            p->smc_check = 0;
+        }
+        p->write_protected = 0;
+        index++;
     }
 }
 
 int page_check_range(target_ulong start, target_ulong len, int flags)
 {
+    tb_page_addr_t index, next;
+    target_ulong last, addr;
+    VMANode r;
     PageDesc *p;
-    target_ulong end;
-    target_ulong addr;
 
     /* This function should never be called with addresses outside the
        guest address space.  If this assert fires, it probably indicates
@@ -2440,35 +2961,62 @@ int page_check_range(target_ulong start, target_ulong len, int flags)
         return -1;
     }
 
-    end = TARGET_PAGE_ALIGN(start+len); /* must do before we loose bits in the next step */
+    last = start + len - 1;
     start = start & TARGET_PAGE_MASK;
 
-    for (addr = start, len = end - start;
-         len != 0;
-         len -= TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE) {
-        p = page_find(addr >> TARGET_PAGE_BITS);
-        if( !p )
+    /* Lock free like page_get_flags; only page_unprotect, which takes
+       mmap_lock itself, modifies anything.  */
+    for (addr = start; ; addr = r.last + 1) {
+        if (!vma_lookup_unlocked(addr, &r) || !(r.flags & PAGE_VALID)) {
             return -1;
-        if( !(p->flags & PAGE_VALID) )
+        }
+        if ((flags & PAGE_READ) && !(r.flags & PAGE_READ)) {
             return -1;
-
-        if ((flags & PAGE_READ) && !(p->flags & PAGE_READ))
+        }
+        if ((flags & PAGE_WRITE) && !(r.flags & PAGE_WRITE_ORG)) {
             return -1;
-        if (flags & PAGE_WRITE) {
-            if (!(p->flags & PAGE_WRITE_ORG))
+        }
+        if (r.last >= last) {
+            break;
+        }
+    }
+    if (flags & PAGE_WRITE) {
+        /* unprotect the pages that were put read-only because they
+           contain translated code */
+        for (index = start >> TARGET_PAGE_BITS;
+             index <= (last >> TARGET_PAGE_BITS); ) {
+            p = page_find_next(index, &next);
+            if (!p) {
+                index = next;
+                continue;
+            }
+            if (p->write_protected &&
+                !page_unprotect(index << TARGET_PAGE_BITS, 0, NULL)) {
                 return -1;
-            /* unprotect the page if it was put read-only because it
-               contains translated code */
-            if (!(p->flags & PAGE_WRITE)) {
-                if (!page_unprotect(addr, 0, NULL))
-                    return -1;
             }
-            return 0;
+            index++;
         }
     }
     return 0;
 }
 
+/* Return the lowest address in [start, last], aligned to the host page
+   size, at which 'size' bytes are not mapped by the guest, or -1.  The
+   mmap_lock should already be held.  */
+target_ulong page_find_free(target_ulong start, target_ulong last,
+                            target_ulong size)
+{
+    target_ulong addr;
+
+    if (size == 0 ||
+        !vma_find_gap(vma_root, 0, (target_ulong)-1, start, size,
+                      qemu_host_page_size, &addr) ||
+        addr > last || last - addr < size - 1) {
+        return -1;
+    }
+    return addr;
+}
+
 /* called from signal handler: invalidate the code and unprotect the
    page. Return TRUE if the fault was successfully handled. */
 int page_unprotect(target_ulong address, unsigned long pc, void *puc)
@@ -2476,6 +3024,7 @@ int page_unprotect(target_ulong address, unsigned long pc, void *puc)
     unsigned int prot;
     PageDesc *p;
     target_ulong host_start, host_end, addr;
+    int smc_check;
 
     /* Technically this isn't safe inside a signal handler.  However we
        know this only ever happens in a synchronous SEGV handler, so in
@@ -2490,25 +3039,38 @@ int page_unprotect(target_ulong address, unsigned long pc, void *puc)
 
     /* if the page was really writable, then we change its
        protection back to writable */
-    if ((p->flags & PAGE_WRITE_ORG) && !(p->flags & PAGE_WRITE)) {
+    if (p->write_protected && (vma_get_flags(address) & PAGE_WRITE_ORG)) {
         host_start = address & qemu_host_page_mask;
         host_end = host_start + qemu_host_page_size;
 
+        /* a page that keeps getting written to while it holds code is
+           switched to self-checking TBs instead of being protected
+           again on the next translation */
+        smc_check = ++p->smc_count >= SMC_CHECK_THRESHOLD;
+
         prot = 0;
         for (addr = host_start ; addr < host_end ; addr += TARGET_PAGE_SIZE) {
             p = page_find(addr >> TARGET_PAGE_BITS);
-            p->flags |= PAGE_WRITE;
-            prot |= p->flags;
+            p->write_protected = 0;
+            p->smc_check |= smc_check;
+            prot |= vma_get_flags(addr);
+        }
+        /* unprotect before invalidating: if the store modifies its own
+           TB, the invalidation resumes from the signal and does not
+           return, and a self checking page is not protected again */
+        mprotect((void *)g2h(host_start), qemu_host_page_size,
+                 prot & PAGE_BITS);
 
+        tb_lock_enter();
+        for (addr = host_start ; addr < host_end ; addr += TARGET_PAGE_SIZE) {
             /* and since the content will be modified, we must invalidate
                the corresponding translated code. */
-            tb_invalidate_phys_page(addr, pc, puc);
+            smc_invalidate_count += tb_invalidate_phys_page(addr, pc, puc);
 #ifdef DEBUG_TB_CHECK
             tb_invalidate_check(addr);
 #endif
         }
-        mprotect((void *)g2h(host_start), qemu_host_page_size,
-                 prot & PAGE_BITS);
+        tb_lock_leave();
 
         mmap_unlock();
         return 1;
@@ -2808,6 +3370,29 @@ static ram_addr_t last_ram_offset(void)
     return last;
 }
 
+/* Resize the per-client dirty bitmaps to cover every RAM block and mark
+   the pages of new_block dirty for all clients.  */
+static void ram_list_grow_dirty_memory(RAMBlock *new_block)
+{
+    ram_addr_t old_pages = ram_list.dirty_pages;
+    ram_addr_t new_pages = last_ram_offset() >> TARGET_PAGE_BITS;
+    int i;
+
+    if (new_pages > old_pages) {
+        for (i = 0; i < DIRTY_MEMORY_NUM; i++) {
+            ram_list.dirty_memory[i] =
+                qemu_realloc(ram_list.dirty_memory[i],
+                             BITS_TO_LONGS(new_pages) * sizeof(unsigned long));
+            memset(ram_list.dirty_memory[i] + BITS_TO_LONGS(old_pages), 0,
+                   (BITS_TO_LONGS(new_pages) - BITS_TO_LONGS(old_pages)) *
+                   sizeof(unsigned long));
+        }
+        ram_list.dirty_pages = new_pages;
+    }
+    cpu_physical_memory_set_dirty_range(new_block->offset, new_block->length,
+                                        ALL_DIRTY_FLAGS);
+}
+
 ram_addr_t qemu_ram_alloc_from_ptr(DeviceState *dev, const char *name,
                         ram_addr_t size, void *host)
 {
@@ -2840,10 +3425,7 @@ ram_addr_t qemu_ram_alloc_from_ptr(DeviceState *dev, const char *name,
 
     QLIST_INSERT_HEAD(&ram_list.blocks, new_block, next);
 
-    ram_list.phys_dirty = qemu_realloc(ram_list.phys_dirty,
-                                       last_ram_offset() >> TARGET_PAGE_BITS);
-    memset(ram_list.phys_dirty + (new_block->offset >> TARGET_PAGE_BITS),
-           0xff, size >> TARGET_PAGE_BITS);
+    ram_list_grow_dirty_memory(new_block);
 
     if (kvm_enabled())
         kvm_setup_guest_memory(new_block->host, size);
@@ -2906,10 +3488,7 @@ ram_addr_t qemu_ram_alloc(DeviceState *dev, const char *name, ram_addr_t size)
 
     QLIST_INSERT_HEAD(&ram_list.blocks, new_block, next);
 
-    ram_list.phys_dirty = qemu_realloc(ram_list.phys_dirty,
-                                       last_ram_offset() >> TARGET_PAGE_BITS);
-    memset(ram_list.phys_dirty + (new_block->offset >> TARGET_PAGE_BITS),
-           0xff, size >> TARGET_PAGE_BITS);
+    ram_list_grow_dirty_memory(new_block);
 
     if (kvm_enabled())
         kvm_setup_guest_memory(new_block->host, size);
@@ -3079,11 +3658,11 @@ static void notdirty_mem_writeb(void *opaque, target_phys_addr_t ram_addr,
 #endif
     }
     stb_p(qemu_get_ram_ptr(ram_addr), val);
-    dirty_flags |= (0xff & ~CODE_DIRTY_FLAG);
-    cpu_physical_memory_set_dirty_flags(ram_addr, dirty_flags);
+    dirty_flags = cpu_physical_memory_set_dirty_flags(ram_addr,
+                      ALL_DIRTY_FLAGS & ~CODE_DIRTY_FLAG);
     /* we remove the notdirty callback only if the code has been
        flushed */
-    if (dirty_flags == 0xff)
+    if (dirty_flags == ALL_DIRTY_FLAGS)
         tlb_set_dirty(cpu_single_env, cpu_single_env->mem_io_vaddr);
 }
 
@@ -3099,11 +3678,11 @@ static void notdirty_mem_writew(void *opaque, target_phys_addr_t ram_addr,
 #endif
     }
     stw_p(qemu_get_ram_ptr(ram_addr), val);
-    dirty_flags |= (0xff & ~CODE_DIRTY_FLAG);
-    cpu_physical_memory_set_dirty_flags(ram_addr, dirty_flags);
+    dirty_flags = cpu_physical_memory_set_dirty_flags(ram_addr,
+                      ALL_DIRTY_FLAGS & ~CODE_DIRTY_FLAG);
     /* we remove the notdirty callback only if the code has been
        flushed */
-    if (dirty_flags == 0xff)
+    if (dirty_flags == ALL_DIRTY_FLAGS)
         tlb_set_dirty(cpu_single_env, cpu_single_env->mem_io_vaddr);
 }
 
@@ -3119,11 +3698,11 @@ static void notdirty_mem_writel(void *opaque, target_phys_addr_t ram_addr,
 #endif
     }
     stl_p(qemu_get_ram_ptr(ram_addr), val);
-    dirty_flags |= (0xff & ~CODE_DIRTY_FLAG);
-    cpu_physical_memory_set_dirty_flags(ram_addr, dirty_flags);
+    dirty_flags = cpu_physical_memory_set_dirty_flags(ram_addr,
+                      ALL_DIRTY_FLAGS & ~CODE_DIRTY_FLAG);
     /* we remove the notdirty callback only if the code has been
        flushed */
-    if (dirty_flags == 0xff)
+    if (dirty_flags == ALL_DIRTY_FLAGS)
         tlb_set_dirty(cpu_single_env, cpu_single_env->mem_io_vaddr);
 }
 
@@ -3540,7 +4119,7 @@ void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                     tb_invalidate_phys_page_range(addr1, addr1 + l, 0);
                     /* set dirty bit */
                     cpu_physical_memory_set_dirty_flags(
-                        addr1, (0xff & ~CODE_DIRTY_FLAG));
+                        addr1, (ALL_DIRTY_FLAGS & ~CODE_DIRTY_FLAG));
                 }
             }
         } else {
@@ -3747,7 +4326,7 @@ void cpu_physical_memory_unmap(void *buffer, target_phys_addr_t len,
                     tb_invalidate_phys_page_range(addr1, addr1 + l, 0);
                     /* set dirty bit */
                     cpu_physical_memory_set_dirty_flags(
-                        addr1, (0xff & ~CODE_DIRTY_FLAG));
+                        addr1, (ALL_DIRTY_FLAGS & ~CODE_DIRTY_FLAG));
                 }
                 addr1 += l;
                 access_len -= l;
@@ -3906,7 +4485,7 @@ void stl_phys_notdirty(target_phys_addr_t addr, uint32_t val)
                 tb_invalidate_phys_page_range(addr1, addr1 + 4, 0);
                 /* set dirty bit */
                 cpu_physical_memory_set_dirty_flags(
-                    addr1, (0xff & ~CODE_DIRTY_FLAG));
+                    addr1, (ALL_DIRTY_FLAGS & ~CODE_DIRTY_FLAG));
             }
         }
     }
@@ -3975,7 +4554,7 @@ void stl_phys(target_phys_addr_t addr, uint32_t val)
             tb_invalidate_phys_page_range(addr1, addr1 + 4, 0);
             /* set dirty bit */
             cpu_physical_memory_set_dirty_flags(addr1,
-                (0xff & ~CODE_DIRTY_FLAG));
+                (ALL_DIRTY_FLAGS & ~CODE_DIRTY_FLAG));
         }
     }
 }
@@ -4018,7 +4597,7 @@ void stw_phys(target_phys_addr_t addr, uint32_t val)
             tb_invalidate_phys_page_range(addr1, addr1 + 2, 0);
             /* set dirty bit */
             cpu_physical_memory_set_dirty_flags(addr1,
-                (0xff & ~CODE_DIRTY_FLAG));
+                (ALL_DIRTY_FLAGS & ~CODE_DIRTY_FLAG));
         }
     }
 }
@@ -4119,6 +4698,88 @@ void cpu_io_recompile(CPUState *env, void *retaddr)
     cpu_resume_from_signal(env, NULL);
 }
 
+void dump_tb_lock_info(FILE *f,
+                       int (*cpu_fprintf)(FILE *f, const char *fmt, ...))
+{
+    cpu_fprintf(f, "TB lock count       %" PRId64 " (contended %" PRId64
+                " %d%%)\n", tb_lock_acquire_count, tb_lock_contended_count,
+                tb_lock_acquire_count ?
+                (int)(tb_lock_contended_count * 100 / tb_lock_acquire_count) :
+                0);
+}
+
+#define SMC_TOP_PAGES 8
+
+typedef struct SMCPageInfo {
+    tb_page_addr_t index;
+    unsigned int count;
+} SMCPageInfo;
+
+static void smc_info_1(int level, void **lp, tb_page_addr_t index,
+                       SMCPageInfo *top, int *nb_check)
+{
+    int i, j;
+
+    if (*lp == NULL) {
+        return;
+    }
+    if (level == 0) {
+        PageDesc *pd = *lp;
+        for (i = 0; i < L2_SIZE; ++i) {
+            if (pd[i].smc_count == 0) {
+                continue;
+            }
+#if defined(CONFIG_USER_ONLY)
+            if (pd[i].smc_check) {
+                (*nb_check)++;
+            }
+#endif
+            /* insert into the list of the busiest pages */
+            for (j = SMC_TOP_PAGES; j > 0 &&
+                     top[j - 1].count < pd[i].smc_count; j--) {
+                if (j < SMC_TOP_PAGES) {
+                    top[j] = top[j - 1];
+                }
+            }
+            if (j < SMC_TOP_PAGES) {
+                top[j].index = (index << L2_BITS) + i;
+                top[j].count = pd[i].smc_count;
+            }
+        }
+    } else {
+        void **pp = *lp;
+        for (i = 0; i < L2_SIZE; ++i) {
+            smc_info_1(level - 1, pp + i, (index << L2_BITS) + i,
+                       top, nb_check);
+        }
+    }
+}
+
+/* self modifying code statistics: total code invalidations caused by
+   guest writes and the pages that suffered the most of them */
+void dump_smc_info(FILE *f,
+                   int (*cpu_fprintf)(FILE *f, const char *fmt, ...))
+{
+    SMCPageInfo top[SMC_TOP_PAGES];
+    int i, nb_check;
+
+    memset(top, 0, sizeof(top));
+    nb_check = 0;
+    mmap_lock();
+    for (i = 0; i < V_L1_SIZE; i++) {
+        smc_info_1(V_L1_SHIFT / L2_BITS - 1, l1_map + i, i, top, &nb_check);
+    }
+    mmap_unlock();
+
+    cpu_fprintf(f, "SMC invalidate count %d (self checking pages %d)\n",
+                smc_invalidate_count, nb_check);
+    for (i = 0; i < SMC_TOP_PAGES && top[i].count != 0; i++) {
+        cpu_fprintf(f, "  page %016" PRIx64 " %u writes\n",
+                    (uint64_t)top[i].index << TARGET_PAGE_BITS,
+                    top[i].count);
+    }
+}
+
 #if !defined(CONFIG_USER_ONLY)
 
 void dump_exec_info(FILE *f,
@@ -4170,6 +4831,9 @@ void dump_exec_info(FILE *f,
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tb_flush_count);
     cpu_fprintf(f, "TB invalidate count %d\n", tb_phys_invalidate_count);
+    dump_tb_lock_info(f, cpu_fprintf);
+    dump_smc_info(f, cpu_fprintf);
+    dump_restore_info(f, cpu_fprintf);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
     tcg_dump_info(f, cpu_fprintf);
 }
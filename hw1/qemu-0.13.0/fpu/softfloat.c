@@ -32,6 +32,8 @@ these four paragraphs for those parts of this code that are retained.
 
 /* FIXME: Flush-To-Zero only effects results.  Denormal inputs should also
    be flushed to zero.  */
+#include <float.h>
+#include <math.h>
 #include "softfloat.h"
 
 /*----------------------------------------------------------------------------
@@ -1738,6 +1740,90 @@ static float32 subFloat32Sigs( float32 a, float32 b, flag zSign STATUS_PARAM)
 
 }
 
+/*----------------------------------------------------------------------------
+| Host floating-point fast path.  The host FPU computes the same correctly
+| rounded results as the code below as long as it evaluates `float' and
+| `double' expressions in their own precision and the rounding mode is the
+| default one.  For zero or normal operands the only exceptions it can then
+| miss are invalid and divide-by-zero, which the callers exclude up front,
+| overflow and underflow, which are detected from the result, and inexact,
+| which is only skipped when it is already set.  All other cases use the
+| software implementation.
+*----------------------------------------------------------------------------*/
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0 && !defined(__FAST_MATH__)
+#define USE_HOST_FPU
+#endif
+
+#ifdef USE_HOST_FPU
+typedef union {
+    float32 s;
+    float h;
+} host_float32;
+
+typedef union {
+    float64 s;
+    double h;
+} host_float64;
+
+INLINE flag host_fpu_usable(float_status *status)
+{
+    return STATUS(float_rounding_mode) == float_round_nearest_even
+        && (STATUS(float_exception_flags) & float_flag_inexact);
+}
+
+INLINE flag float32_is_zero_or_normal_host(float32 a)
+{
+    int16 aExp = extractFloat32Exp( a );
+
+    return aExp ? aExp != 0xFF : extractFloat32Frac( a ) == 0;
+}
+
+INLINE flag float64_is_zero_or_normal_host(float64 a)
+{
+    int16 aExp = extractFloat64Exp( a );
+
+    return aExp ? aExp != 0x7FF : extractFloat64Frac( a ) == 0;
+}
+
+/* Results at or below the smallest normal may have underflowed, depending
+   on the tininess detection mode; infinities have overflowed.  */
+INLINE flag float32_host_result_ok(float32 z)
+{
+    int16 zExp = extractFloat32Exp( z );
+
+    return zExp != 0xFF
+        && ( zExp > 1 || ( zExp == 1 && extractFloat32Frac( z ) ) );
+}
+
+INLINE flag float64_host_result_ok(float64 z)
+{
+    int16 zExp = extractFloat64Exp( z );
+
+    return zExp != 0x7FF
+        && ( zExp > 1 || ( zExp == 1 && extractFloat64Frac( z ) ) );
+}
+
+#define HOST_FPU_OP2(bits, a, b, expr)                                      \
+    do {                                                                    \
+        host_float ## bits ua, ub, uz;                                      \
+        if ( host_fpu_usable( status ) &&                                   \
+             float ## bits ## _is_zero_or_normal_host( a ) &&               \
+             float ## bits ## _is_zero_or_normal_host( b ) ) {              \
+            ua.s = a;                                                       \
+            ub.s = b;                                                       \
+            uz.h = expr( ua.h, ub.h );                                      \
+            if ( float ## bits ## _host_result_ok( uz.s ) ) {               \
+                return uz.s;                                                \
+            }                                                               \
+        }                                                                   \
+    } while (0)
+
+#define HOST_ADD(x, y) ( (x) + (y) )
+#define HOST_SUB(x, y) ( (x) - (y) )
+#define HOST_MUL(x, y) ( (x) * (y) )
+#define HOST_DIV(x, y) ( (x) / (y) )
+#endif
+
 /*----------------------------------------------------------------------------
 | Returns the result of adding the single-precision floating-point values `a'
 | and `b'.  The operation is performed according to the IEC/IEEE Standard for
@@ -1748,6 +1834,9 @@ float32 float32_add( float32 a, float32 b STATUS_PARAM )
 {
     flag aSign, bSign;
 
+#ifdef USE_HOST_FPU
+    HOST_FPU_OP2(32, a, b, HOST_ADD);
+#endif
     aSign = extractFloat32Sign( a );
     bSign = extractFloat32Sign( b );
     if ( aSign == bSign ) {
@@ -1769,6 +1858,9 @@ float32 float32_sub( float32 a, float32 b STATUS_PARAM )
 {
     flag aSign, bSign;
 
+#ifdef USE_HOST_FPU
+    HOST_FPU_OP2(32, a, b, HOST_SUB);
+#endif
     aSign = extractFloat32Sign( a );
     bSign = extractFloat32Sign( b );
     if ( aSign == bSign ) {
@@ -1794,6 +1886,9 @@ float32 float32_mul( float32 a, float32 b STATUS_PARAM )
     bits64 zSig64;
     bits32 zSig;
 
+#ifdef USE_HOST_FPU
+    HOST_FPU_OP2(32, a, b, HOST_MUL);
+#endif
     aSig = extractFloat32Frac( a );
     aExp = extractFloat32Exp( a );
     aSign = extractFloat32Sign( a );
@@ -1852,6 +1947,11 @@ float32 float32_div( float32 a, float32 b STATUS_PARAM )
     int16 aExp, bExp, zExp;
     bits32 aSig, bSig, zSig;
 
+#ifdef USE_HOST_FPU
+    if ( extractFloat32Exp( b ) ) {
+        HOST_FPU_OP2(32, a, b, HOST_DIV);
+    }
+#endif
     aSig = extractFloat32Frac( a );
     aExp = extractFloat32Exp( a );
     aSign = extractFloat32Sign( a );
@@ -2014,6 +2114,17 @@ float32 float32_sqrt( float32 a STATUS_PARAM )
     bits32 aSig, zSig;
     bits64 rem, term;
 
+#ifdef USE_HOST_FPU
+    if ( host_fpu_usable( status ) && ! extractFloat32Sign( a ) &&
+         float32_is_zero_or_normal_host( a ) ) {
+        host_float32 ua, uz;
+
+        /* The square root of a normal number is never tiny.  */
+        ua.s = a;
+        uz.h = sqrtf( ua.h );
+        return uz.s;
+    }
+#endif
     aSig = extractFloat32Frac( a );
     aExp = extractFloat32Exp( a );
     aSign = extractFloat32Sign( a );
@@ -2972,6 +3083,9 @@ float64 float64_add( float64 a, float64 b STATUS_PARAM )
 {
     flag aSign, bSign;
 
+#ifdef USE_HOST_FPU
+    HOST_FPU_OP2(64, a, b, HOST_ADD);
+#endif
     aSign = extractFloat64Sign( a );
     bSign = extractFloat64Sign( b );
     if ( aSign == bSign ) {
@@ -2993,6 +3107,9 @@ float64 float64_sub( float64 a, float64 b STATUS_PARAM )
 {
     flag aSign, bSign;
 
+#ifdef USE_HOST_FPU
+    HOST_FPU_OP2(64, a, b, HOST_SUB);
+#endif
     aSign = extractFloat64Sign( a );
     bSign = extractFloat64Sign( b );
     if ( aSign == bSign ) {
@@ -3016,6 +3133,9 @@ float64 float64_mul( float64 a, float64 b STATUS_PARAM )
     int16 aExp, bExp, zExp;
     bits64 aSig, bSig, zSig0, zSig1;
 
+#ifdef USE_HOST_FPU
+    HOST_FPU_OP2(64, a, b, HOST_MUL);
+#endif
     aSig = extractFloat64Frac( a );
     aExp = extractFloat64Exp( a );
     aSign = extractFloat64Sign( a );
@@ -3076,6 +3196,11 @@ float64 float64_div( float64 a, float64 b STATUS_PARAM )
     bits64 rem0, rem1;
     bits64 term0, term1;
 
+#ifdef USE_HOST_FPU
+    if ( extractFloat64Exp( b ) ) {
+        HOST_FPU_OP2(64, a, b, HOST_DIV);
+    }
+#endif
     aSig = extractFloat64Frac( a );
     aExp = extractFloat64Exp( a );
     aSign = extractFloat64Sign( a );
@@ -3229,6 +3354,17 @@ float64 float64_sqrt( float64 a STATUS_PARAM )
     bits64 aSig, zSig, doubleZSig;
     bits64 rem0, rem1, term0, term1;
 
+#ifdef USE_HOST_FPU
+    if ( host_fpu_usable( status ) && ! extractFloat64Sign( a ) &&
+         float64_is_zero_or_normal_host( a ) ) {
+        host_float64 ua, uz;
+
+        /* The square root of a normal number is never tiny.  */
+        ua.s = a;
+        uz.h = sqrt( ua.h );
+        return uz.s;
+    }
+#endif
     aSig = extractFloat64Frac( a );
     aExp = extractFloat64Exp( a );
     aSign = extractFloat64Sign( a );
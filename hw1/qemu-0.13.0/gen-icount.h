@@ -9,8 +9,19 @@ static inline void gen_icount_start(void)
 {
     TCGv_i32 count;
 
-    if (!use_icount)
+    if (!use_icount) {
+#if defined(CONFIG_USER_ONLY)
+        /* cpu_exit() stops a running CPU by making icount_decr negative
+           instead of unchaining the TBs it may be looping through, so
+           every TB tests it on entry.  */
+        icount_label = gen_new_label();
+        count = tcg_temp_new_i32();
+        tcg_gen_ld_i32(count, cpu_env, offsetof(CPUState, icount_decr.u32));
+        tcg_gen_brcondi_i32(TCG_COND_LT, count, 0, icount_label);
+        tcg_temp_free_i32(count);
+#endif
         return;
+    }
 
     icount_label = gen_new_label();
     count = tcg_temp_local_new_i32();
@@ -28,9 +39,14 @@ static void gen_icount_end(TranslationBlock *tb, int num_insns)
 {
     if (use_icount) {
         *icount_arg = num_insns;
-        gen_set_label(icount_label);
-        tcg_gen_exit_tb((long)tb + 2);
     }
+#if !defined(CONFIG_USER_ONLY)
+    if (!use_icount) {
+        return;
+    }
+#endif
+    gen_set_label(icount_label);
+    tcg_gen_exit_tb((long)tb + 2);
 }
 
 static inline void gen_io_start(void)
@@ -86,14 +86,8 @@ void framebuffer_update_display(
     dest += i * dest_row_pitch;
 
     for (; i < rows; i++) {
-        target_phys_addr_t dirty_offset;
-        dirty = 0;
-        dirty_offset = 0;
-        while (addr + dirty_offset < TARGET_PAGE_ALIGN(addr + src_width)) {
-            dirty |= cpu_physical_memory_get_dirty(addr + dirty_offset,
-                                                   VGA_DIRTY_FLAG);
-            dirty_offset += TARGET_PAGE_SIZE;
-        }
+        dirty = cpu_physical_memory_get_dirty_range(addr, src_width,
+                                                    VGA_DIRTY_FLAG);
 
         if (dirty || invalidate) {
             fn(opaque, dest, src, cols, dest_col_pitch);
@@ -228,6 +228,8 @@ static void virtio_blk_handle_scsi(VirtIOBlockReq *req)
 typedef struct MultiReqBuffer {
     BlockRequest        blkreq[32];
     unsigned int        num_writes;
+    BlockRequest        read_reqs[32];
+    unsigned int        num_reads;
 } MultiReqBuffer;
 
 static void virtio_submit_multiwrite(BlockDriverState *bs, MultiReqBuffer *mrb)
@@ -250,6 +252,26 @@ static void virtio_submit_multiwrite(BlockDriverState *bs, MultiReqBuffer *mrb)
     mrb->num_writes = 0;
 }
 
+static void virtio_submit_multiread(BlockDriverState *bs, MultiReqBuffer *mrb)
+{
+    int i, ret;
+
+    if (!mrb->num_reads) {
+        return;
+    }
+
+    ret = bdrv_aio_multiread(bs, mrb->read_reqs, mrb->num_reads);
+    if (ret != 0) {
+        for (i = 0; i < mrb->num_reads; i++) {
+            if (mrb->read_reqs[i].error) {
+                virtio_blk_rw_complete(mrb->read_reqs[i].opaque, -EIO);
+            }
+        }
+    }
+
+    mrb->num_reads = 0;
+}
+
 static void virtio_blk_handle_flush(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 {
     BlockDriverAIOCB *acb;
@@ -289,21 +311,28 @@ static void virtio_blk_handle_write(VirtIOBlockReq *req, MultiReqBuffer *mrb)
     mrb->num_writes++;
 }
 
-static void virtio_blk_handle_read(VirtIOBlockReq *req)
+static void virtio_blk_handle_read(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 {
-    BlockDriverAIOCB *acb;
+    BlockRequest *blkreq;
 
     if (req->out->sector & req->dev->sector_mask) {
         virtio_blk_rw_complete(req, -EIO);
         return;
     }
 
-    acb = bdrv_aio_readv(req->dev->bs, req->out->sector, &req->qiov,
-                         req->qiov.size / BDRV_SECTOR_SIZE,
-                         virtio_blk_rw_complete, req);
-    if (!acb) {
-        virtio_blk_rw_complete(req, -EIO);
+    if (mrb->num_reads == 32) {
+        virtio_submit_multiread(req->dev->bs, mrb);
     }
+
+    blkreq = &mrb->read_reqs[mrb->num_reads];
+    blkreq->sector = req->out->sector;
+    blkreq->nb_sectors = req->qiov.size / BDRV_SECTOR_SIZE;
+    blkreq->qiov = &req->qiov;
+    blkreq->cb = virtio_blk_rw_complete;
+    blkreq->opaque = req;
+    blkreq->error = 0;
+
+    mrb->num_reads++;
 }
 
 static void virtio_blk_handle_request(VirtIOBlockReq *req,
@@ -340,7 +369,7 @@ static void virtio_blk_handle_request(VirtIOBlockReq *req,
     } else {
         qemu_iovec_init_external(&req->qiov, &req->elem.in_sg[0],
                                  req->elem.in_num - 1);
-        virtio_blk_handle_read(req);
+        virtio_blk_handle_read(req, mrb);
     }
 }
 
@@ -350,13 +379,19 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
     VirtIOBlockReq *req;
     MultiReqBuffer mrb = {
         .num_writes = 0,
+        .num_reads = 0,
     };
 
+    bdrv_io_plug(s->bs);
+
     while ((req = virtio_blk_get_request(s))) {
         virtio_blk_handle_request(req, &mrb);
     }
 
     virtio_submit_multiwrite(s->bs, &mrb);
+    virtio_submit_multiread(s->bs, &mrb);
+
+    bdrv_io_unplug(s->bs);
 
     /*
      * FIXME: Want to check for completions before returning to guest mode,
@@ -371,6 +406,7 @@ static void virtio_blk_dma_restart_bh(void *opaque)
     VirtIOBlockReq *req = s->rq;
     MultiReqBuffer mrb = {
         .num_writes = 0,
+        .num_reads = 0,
     };
 
     qemu_bh_delete(s->bh);
@@ -378,12 +414,17 @@ static void virtio_blk_dma_restart_bh(void *opaque)
 
     s->rq = NULL;
 
+    bdrv_io_plug(s->bs);
+
     while (req) {
         virtio_blk_handle_request(req, &mrb);
         req = req->next;
     }
 
     virtio_submit_multiwrite(s->bs, &mrb);
+    virtio_submit_multiread(s->bs, &mrb);
+
+    bdrv_io_unplug(s->bs);
 }
 
 static void virtio_blk_dma_restart_cb(void *opaque, int running, int reason)
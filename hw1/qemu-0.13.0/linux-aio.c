@@ -16,15 +16,31 @@
 #include <libaio.h>
 
 /*
- * Queue size (per-device).
+ * Default queue size (per-device), can be changed with -drive aio-queue-depth.
  *
- * XXX: eventually we need to communicate this to the guest and/or make it
- *      tunable by the guest.  If we get more outstanding requests at a time
- *      than this we will get EAGAIN from io_submit which is communicated to
- *      the guest as an I/O error.
+ * Requests beyond the queue size are held back in userspace and submitted
+ * as earlier ones complete, rather than failing with EAGAIN.
  */
+#define LAIO_DEFAULT_QUEUE_DEPTH 128
+
+/* Number of events reaped per io_getevents call */
 #define MAX_EVENTS 128
 
+/* Layout of the completion ring the kernel maps at the io_context_t address */
+#define AIO_RING_MAGIC 0xa10a10a1
+
+struct aio_ring {
+    unsigned id;
+    unsigned nr;
+    unsigned head;
+    unsigned tail;
+    unsigned magic;
+    unsigned compat_features;
+    unsigned incompat_features;
+    unsigned header_length;
+    struct io_event io_events[0];
+};
+
 struct qemu_laiocb {
     BlockDriverAIOCB common;
     struct qemu_laio_state *ctx;
@@ -32,16 +48,34 @@ struct qemu_laiocb {
     ssize_t ret;
     size_t nbytes;
     int async_context_id;
+    int queued;
+    int64_t submit_ns;
     QLIST_ENTRY(qemu_laiocb) node;
+    QSIMPLEQ_ENTRY(qemu_laiocb) next;
 };
 
 struct qemu_laio_state {
     io_context_t ctx;
     int efd;
-    int count;
+    int count;          /* requests not yet completed, including queued ones */
+    int max_events;
+    int poll;           /* reap completions from the ring in userspace */
+    QEMUBH *poll_bh;
+    QEMUBH *error_bh;
     QLIST_HEAD(, qemu_laiocb) completed_reqs;
+
+    /* requests not yet handed to the kernel */
+    struct {
+        QSIMPLEQ_HEAD(, qemu_laiocb) pending;
+        struct iocb **iocbs;
+        int plugged;
+        int in_queue;
+        int in_flight;
+    } io_q;
 };
 
+static void ioq_submit(struct qemu_laio_state *s);
+
 static inline ssize_t io_event_ret(struct io_event *ev)
 {
     return (ssize_t)(((uint64_t)ev->res2 << 32) | ev->res);
@@ -59,7 +93,10 @@ static void qemu_laio_process_completion(struct qemu_laio_state *s,
     s->count--;
 
     ret = laiocb->ret;
-    if (ret != -ECANCELED) {
+    if (ret == -ECANCELED) {
+        laiocb->common.bs->aio_queue_depth--;
+    } else {
+        raw_aio_account_done(laiocb->common.bs, laiocb->submit_ns, 0);
         if (ret == laiocb->nbytes)
             ret = 0;
         else if (ret >= 0)
@@ -110,30 +147,59 @@ static void qemu_laio_enqueue_completed(struct qemu_laio_state *s,
     }
 }
 
-static void qemu_laio_completion_cb(void *opaque)
+/*
+ * Copies completed events straight out of the ring shared with the kernel,
+ * which saves the io_getevents system call.  Returns -ENOSYS if the ring has
+ * a layout we do not know about.
+ */
+static int laio_ring_getevents(struct qemu_laio_state *s,
+    struct io_event *events, int max)
 {
-    struct qemu_laio_state *s = opaque;
+    struct aio_ring *ring = (struct aio_ring *)s->ctx;
+    unsigned head, tail;
+    int n = 0;
+
+    if (ring->magic != AIO_RING_MAGIC || ring->incompat_features) {
+        return -ENOSYS;
+    }
 
-    while (1) {
+    head = ring->head;
+    tail = ring->tail;
+    __sync_synchronize();
+
+    while (head != tail && n < max) {
+        events[n++] = ring->io_events[head];
+        head = (head + 1) % ring->nr;
+    }
+
+    __sync_synchronize();
+    ring->head = head;
+
+    return n;
+}
+
+/* Reaps everything that has completed so far without blocking */
+static void qemu_laio_reap(struct qemu_laio_state *s)
+{
+    while (s->io_q.in_flight > 0) {
         struct io_event events[MAX_EVENTS];
-        uint64_t val;
-        ssize_t ret;
         struct timespec ts = { 0 };
-        int nevents, i;
-
-        do {
-            ret = read(s->efd, &val, sizeof(val));
-        } while (ret == -1 && errno == EINTR);
+        int nevents = -ENOSYS, i;
 
-        if (ret == -1 && errno == EAGAIN)
-            break;
+        if (s->poll) {
+            nevents = laio_ring_getevents(s, events, MAX_EVENTS);
+        }
+        if (nevents == -ENOSYS) {
+            do {
+                nevents = io_getevents(s->ctx, 0, MAX_EVENTS, events, &ts);
+            } while (nevents == -EINTR);
+        }
 
-        if (ret != 8)
+        if (nevents <= 0) {
             break;
+        }
 
-        do {
-            nevents = io_getevents(s->ctx, val, MAX_EVENTS, events, &ts);
-        } while (nevents == -EINTR);
+        s->io_q.in_flight -= nevents;
 
         for (i = 0; i < nevents; i++) {
             struct iocb *iocb = events[i].obj;
@@ -143,6 +209,103 @@ static void qemu_laio_completion_cb(void *opaque)
             laiocb->ret = io_event_ret(&events[i]);
             qemu_laio_enqueue_completed(s, laiocb);
         }
+
+        if (nevents < MAX_EVENTS) {
+            break;
+        }
+    }
+
+    /* Completions make room in the ring for requests held back by EAGAIN */
+    if (!s->io_q.plugged && !QSIMPLEQ_EMPTY(&s->io_q.pending)) {
+        ioq_submit(s);
+    }
+}
+
+static void qemu_laio_completion_cb(void *opaque)
+{
+    struct qemu_laio_state *s = opaque;
+    uint64_t val;
+    ssize_t ret;
+
+    do {
+        ret = read(s->efd, &val, sizeof(val));
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret != 8) {
+        return;
+    }
+
+    qemu_laio_reap(s);
+}
+
+/*
+ * With aio-poll=on the ring is polled from a bottom half for as long as
+ * requests are in flight, so completions are usually picked up before the
+ * eventfd wakes up the main loop.  The eventfd stays armed for the cases in
+ * which bottom halves do not run, e.g. a nested AsyncContext.
+ */
+static void qemu_laio_poll_bh(void *opaque)
+{
+    struct qemu_laio_state *s = opaque;
+
+    qemu_laio_reap(s);
+
+    if (s->io_q.in_flight > 0) {
+        qemu_bh_schedule(s->poll_bh);
+    }
+}
+
+/* Completes requests that io_submit refused */
+static void qemu_laio_error_bh(void *opaque)
+{
+    qemu_laio_process_requests(opaque);
+}
+
+static void ioq_submit(struct qemu_laio_state *s)
+{
+    struct qemu_laiocb *laiocb;
+    int len, ret, i;
+
+    while (!QSIMPLEQ_EMPTY(&s->io_q.pending)) {
+        len = 0;
+        QSIMPLEQ_FOREACH(laiocb, &s->io_q.pending, next) {
+            if (s->io_q.in_flight + len == s->max_events) {
+                break;
+            }
+            s->io_q.iocbs[len++] = &laiocb->iocb;
+        }
+        if (len == 0) {
+            /* The ring is full, retry when something completes */
+            break;
+        }
+
+        ret = io_submit(s->ctx, len, s->io_q.iocbs);
+        if (ret == -EAGAIN && s->io_q.in_flight > 0) {
+            break;
+        }
+
+        if (ret < 0) {
+            /* The first request failed, complete it with the error */
+            laiocb = QSIMPLEQ_FIRST(&s->io_q.pending);
+            QSIMPLEQ_REMOVE_HEAD(&s->io_q.pending, next);
+            s->io_q.in_queue--;
+            laiocb->queued = 0;
+            laiocb->ret = ret;
+            QLIST_INSERT_HEAD(&s->completed_reqs, laiocb, node);
+            qemu_bh_schedule(s->error_bh);
+            continue;
+        }
+
+        for (i = 0; i < ret; i++) {
+            QSIMPLEQ_FIRST(&s->io_q.pending)->queued = 0;
+            QSIMPLEQ_REMOVE_HEAD(&s->io_q.pending, next);
+        }
+        s->io_q.in_queue -= ret;
+        s->io_q.in_flight += ret;
+
+        if (s->poll) {
+            qemu_bh_schedule(s->poll_bh);
+        }
     }
 }
 
@@ -150,6 +313,11 @@ static int qemu_laio_flush_cb(void *opaque)
 {
     struct qemu_laio_state *s = opaque;
 
+    /* Anyone waiting for completion needs plugged requests to be submitted */
+    if (!QSIMPLEQ_EMPTY(&s->io_q.pending)) {
+        ioq_submit(s);
+    }
+
     return (s->count > 0) ? 1 : 0;
 }
 
@@ -162,6 +330,15 @@ static void laio_cancel(BlockDriverAIOCB *blockacb)
     if (laiocb->ret != -EINPROGRESS)
         return;
 
+    /* Not submitted yet, simply drop it from the queue */
+    if (laiocb->queued) {
+        QSIMPLEQ_REMOVE(&laiocb->ctx->io_q.pending, laiocb, qemu_laiocb, next);
+        laiocb->ctx->io_q.in_queue--;
+        laiocb->ret = -ECANCELED;
+        qemu_laio_process_completion(laiocb->ctx, laiocb);
+        return;
+    }
+
     /*
      * Note that as of Linux 2.6.31 neither the block device code nor any
      * filesystem implements cancellation of AIO request.
@@ -181,7 +358,7 @@ static void laio_cancel(BlockDriverAIOCB *blockacb)
      * O_NONBLOCK flag.
      */
     while (laiocb->ret == -EINPROGRESS)
-        qemu_laio_completion_cb(laiocb->ctx);
+        qemu_laio_reap(laiocb->ctx);
 }
 
 static AIOPool laio_pool = {
@@ -218,36 +395,69 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
     default:
         fprintf(stderr, "%s: invalid AIO request type 0x%x.\n",
                         __func__, type);
-        goto out_free_aiocb;
+        qemu_aio_release(laiocb);
+        return NULL;
     }
     io_set_eventfd(&laiocb->iocb, s->efd);
     s->count++;
 
-    if (io_submit(s->ctx, 1, &iocbs) < 0)
-        goto out_dec_count;
+    laiocb->submit_ns = raw_aio_clock_ns();
+    raw_aio_account_submit(bs);
+
+    laiocb->queued = 1;
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.pending, laiocb, next);
+    s->io_q.in_queue++;
+    if (!s->io_q.plugged || s->io_q.in_queue >= s->max_events) {
+        ioq_submit(s);
+    }
+
     return &laiocb->common;
+}
 
-out_free_aiocb:
-    qemu_aio_release(laiocb);
-out_dec_count:
-    s->count--;
-    return NULL;
+/*
+ * While plugged, requests are only queued and go to the kernel with a single
+ * io_submit when the outermost plug is released.
+ */
+void laio_io_plug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    s->io_q.plugged++;
+}
+
+void laio_io_unplug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    assert(s->io_q.plugged > 0);
+    if (--s->io_q.plugged == 0 && !QSIMPLEQ_EMPTY(&s->io_q.pending)) {
+        ioq_submit(s);
+    }
 }
 
-void *laio_init(void)
+void *laio_init(int queue_depth, int poll)
 {
     struct qemu_laio_state *s;
 
     s = qemu_mallocz(sizeof(*s));
     QLIST_INIT(&s->completed_reqs);
+    QSIMPLEQ_INIT(&s->io_q.pending);
+    s->max_events = queue_depth > 0 ? queue_depth : LAIO_DEFAULT_QUEUE_DEPTH;
+    s->poll = poll;
     s->efd = eventfd(0, 0);
     if (s->efd == -1)
         goto out_free_state;
     fcntl(s->efd, F_SETFL, O_NONBLOCK);
 
-    if (io_setup(MAX_EVENTS, &s->ctx) != 0)
+    if (io_setup(s->max_events, &s->ctx) != 0)
         goto out_close_efd;
 
+    s->io_q.iocbs = qemu_malloc(s->max_events * sizeof(struct iocb *));
+    s->error_bh = qemu_bh_new(qemu_laio_error_bh, s);
+    if (poll) {
+        s->poll_bh = qemu_bh_new(qemu_laio_poll_bh, s);
+    }
+
     qemu_aio_set_fd_handler(s->efd, qemu_laio_completion_cb, NULL,
         qemu_laio_flush_cb, qemu_laio_process_requests, s);
 
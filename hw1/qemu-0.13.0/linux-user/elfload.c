@@ -8,13 +8,16 @@
 #include <errno.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/resource.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "qemu.h"
 #include "disas.h"
+#include "qemu-barrier.h"
 
 #ifdef _ARCH_PPC64
 #undef ARCH_DLINFO
@@ -129,6 +132,12 @@ static uint32_t get_elf_hwcap(void)
   return thread_env->cpuid_features;
 }
 
+#define DLINFO_ARCH_ITEMS 1
+#define ARCH_DLINFO                                                     \
+do {                                                                    \
+        NEW_AUX_ENT(info->vdso ? AT_SYSINFO_EHDR : AT_IGNORE, info->vdso); \
+} while (0)
+
 #ifdef TARGET_X86_64
 #define ELF_START_MMAP 0x2aaaaab000ULL
 #define elf_check_arch(x) ( ((x) == ELF_ARCH) )
@@ -1079,15 +1088,33 @@ static void padzero(abi_ulong elf_bss, abi_ulong last_bss)
 
         nbyte = elf_bss & (qemu_host_page_size-1);
         if (nbyte) {
-	    nbyte = qemu_host_page_size - nbyte;
-	    do {
-                /* FIXME - what to do if put_user() fails? */
-		put_user_u8(0, elf_bss);
-                elf_bss++;
-	    } while (--nbyte);
+            abi_ulong end_addr = elf_bss + qemu_host_page_size - nbyte;
+            void *p;
+
+            /* one target page at a time, as not all of them need to be
+               mapped */
+            while (elf_bss < end_addr) {
+                nbyte = TARGET_PAGE_ALIGN(elf_bss + 1) - elf_bss;
+                /* FIXME - what to do if lock_user() fails? */
+                p = lock_user(VERIFY_WRITE, elf_bss, nbyte, 0);
+                if (p) {
+                    memset(p, 0, nbyte);
+                    unlock_user(p, elf_bss, nbyte);
+                }
+                elf_bss += nbyte;
+            }
         }
 }
 
+/* microseconds, for the load time breakdown logged with -d */
+static int64_t load_clock(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
 
 static abi_ulong create_elf_tables(abi_ulong p, int argc, int envc,
                                    struct elfhdr * exec,
@@ -1325,59 +1352,153 @@ static abi_ulong load_elf_interp(struct elfhdr * interp_elf_ex,
 	return ((abi_ulong) interp_elf_ex->e_entry) + load_addr;
 }
 
-static int symfind(const void *s0, const void *s1)
+/* The symbol and string tables are mapped from the file, so nothing
+   is read until the first lookup_symbol() call.  That call builds a
+   compact index of the function symbols sorted by address, which all
+   threads then share, and drops the symbol table mapping.  */
+struct elf_symidx {
+    abi_ulong addr;
+    uint32_t size;
+    uint32_t name;
+};
+
+struct elf_syminfo {
+    struct syminfo s;
+    struct elf_symidx *index;
+    const struct elf_sym *syms;
+    unsigned int nsyms;
+    abi_ulong strtab_size;
+    void *symtab_map;
+    size_t symtab_len;
+    volatile int loaded;
+};
+
+static pthread_mutex_t syminfo_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int symidx_cmp(const void *s0, const void *s1)
 {
-    struct elf_sym *key = (struct elf_sym *)s0;
-    struct elf_sym *sym = (struct elf_sym *)s1;
-    int result = 0;
-    if (key->st_value < sym->st_value) {
-        result = -1;
-    } else if (key->st_value >= sym->st_value + sym->st_size) {
-        result = 1;
-    }
-    return result;
+    const struct elf_symidx *sym0 = s0;
+    const struct elf_symidx *sym1 = s1;
+    return (sym0->addr < sym1->addr)
+        ? -1
+        : ((sym0->addr > sym1->addr) ? 1 : 0);
 }
 
-static const char *lookup_symbolxx(struct syminfo *s, target_ulong orig_addr)
+/* map 'size' bytes at 'offset' of the file.  *map and *map_len
+   describe the host mapping, for munmap.  Returns NULL if the section
+   doesn't lie within the file, as touching the mapping past the end of
+   the file would raise SIGBUS.  */
+static void *map_section(int fd, abi_ulong offset, abi_ulong size,
+                         void **map, size_t *map_len)
 {
-#if ELF_CLASS == ELFCLASS32
-    struct elf_sym *syms = s->disas_symtab.elf32;
-#else
-    struct elf_sym *syms = s->disas_symtab.elf64;
-#endif
+    abi_ulong delta = offset & (qemu_real_host_page_size - 1);
+    struct stat st;
+    void *p;
 
-    // binary search
-    struct elf_sym key;
-    struct elf_sym *sym;
+    if (size == 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || offset > st.st_size ||
+        size > st.st_size - offset) {
+        return NULL;
+    }
+    p = mmap(NULL, size + delta, PROT_READ, MAP_PRIVATE, fd, offset - delta);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    *map = p;
+    *map_len = size + delta;
+    return (char *)p + delta;
+}
 
-    key.st_value = orig_addr;
+static void build_symidx(struct elf_syminfo *es)
+{
+    struct elf_sym sym;
+    struct elf_symidx *index;
+    unsigned int i, n;
 
-    sym = bsearch(&key, syms, s->disas_num_syms, sizeof(*syms), symfind);
-    if (sym != NULL) {
-        return s->disas_strtab + sym->st_name;
+    index = malloc(es->nsyms * sizeof(*index));
+    n = 0;
+    for (i = 0; index && i < es->nsyms; i++) {
+        sym = es->syms[i];
+#ifdef BSWAP_NEEDED
+        bswap_sym(&sym);
+#endif
+        /* Throw away entries which we do not need.  */
+        if (sym.st_shndx == SHN_UNDEF ||
+            sym.st_shndx >= SHN_LORESERVE ||
+            ELF_ST_TYPE(sym.st_info) != STT_FUNC ||
+            sym.st_name >= es->strtab_size) {
+            continue;
+        }
+#if defined(TARGET_ARM) || defined (TARGET_MIPS)
+        /* The bottom address bit marks a Thumb or MIPS16 symbol.  */
+        sym.st_value &= ~(target_ulong)1;
+#endif
+        index[n].addr = sym.st_value;
+        index[n].size = sym.st_size > UINT32_MAX ? UINT32_MAX : sym.st_size;
+        index[n].name = sym.st_name;
+        n++;
     }
+    munmap(es->symtab_map, es->symtab_len);
+    es->syms = NULL;
 
-    return "";
+    if (n == 0) {
+        free(index);
+        return;
+    }
+    index = realloc(index, n * sizeof(*index));
+    qsort(index, n, sizeof(*index), symidx_cmp);
+    es->index = index;
+    es->s.disas_num_syms = n;
 }
 
-/* FIXME: This should use elf_ops.h  */
-static int symcmp(const void *s0, const void *s1)
+static const char *lookup_symbolxx(struct syminfo *s, target_ulong orig_addr)
 {
-    struct elf_sym *sym0 = (struct elf_sym *)s0;
-    struct elf_sym *sym1 = (struct elf_sym *)s1;
-    return (sym0->st_value < sym1->st_value)
-        ? -1
-        : ((sym0->st_value > sym1->st_value) ? 1 : 0);
+    struct elf_syminfo *es = container_of(s, struct elf_syminfo, s);
+    struct elf_symidx *sym;
+    unsigned int lo, hi, mid;
+
+    if (!es->loaded) {
+        pthread_mutex_lock(&syminfo_lock);
+        if (!es->loaded) {
+            build_symidx(es);
+            smp_wmb();
+            es->loaded = 1;
+        }
+        pthread_mutex_unlock(&syminfo_lock);
+    }
+    /* pairs with smp_wmb() above: see the index once we see loaded */
+    smp_rmb();
+
+    /* find the last symbol starting at or below orig_addr */
+    lo = 0;
+    hi = s->disas_num_syms;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (es->index[mid].addr <= orig_addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo > 0) {
+        sym = &es->index[lo - 1];
+        if (orig_addr - sym->addr < sym->size) {
+            return s->disas_strtab + sym->name;
+        }
+    }
+    return "";
 }
 
 /* Best attempt to load symbols from this ELF object. */
 static void load_symbols(struct elfhdr *hdr, int fd)
 {
-    unsigned int i, nsyms;
+    unsigned int i;
     struct elf_shdr sechdr, symtab, strtab;
-    char *strings;
-    struct syminfo *s;
-    struct elf_sym *syms;
+    struct elf_syminfo *es;
+    void *strtab_map;
+    size_t strtab_len;
 
     lseek(fd, hdr->e_shoff, SEEK_SET);
     for (i = 0; i < hdr->e_shnum; i++) {
@@ -1402,59 +1523,28 @@ static void load_symbols(struct elfhdr *hdr, int fd)
     return; /* Shouldn't happen... */
 
  found:
-    /* Now know where the strtab and symtab are.  Snarf them. */
-    s = malloc(sizeof(*s));
-    syms = malloc(symtab.sh_size);
-    if (!syms)
-        return;
-    s->disas_strtab = strings = malloc(strtab.sh_size);
-    if (!s->disas_strtab)
+    es = calloc(1, sizeof(*es));
+    if (!es)
         return;
-
-    lseek(fd, symtab.sh_offset, SEEK_SET);
-    if (read(fd, syms, symtab.sh_size) != symtab.sh_size)
+    es->syms = map_section(fd, symtab.sh_offset, symtab.sh_size,
+                           &es->symtab_map, &es->symtab_len);
+    if (!es->syms) {
+        free(es);
         return;
-
-    nsyms = symtab.sh_size / sizeof(struct elf_sym);
-
-    i = 0;
-    while (i < nsyms) {
-#ifdef BSWAP_NEEDED
-        bswap_sym(syms + i);
-#endif
-        // Throw away entries which we do not need.
-        if (syms[i].st_shndx == SHN_UNDEF ||
-                syms[i].st_shndx >= SHN_LORESERVE ||
-                ELF_ST_TYPE(syms[i].st_info) != STT_FUNC) {
-            nsyms--;
-            if (i < nsyms) {
-                syms[i] = syms[nsyms];
-            }
-            continue;
-        }
-#if defined(TARGET_ARM) || defined (TARGET_MIPS)
-        /* The bottom address bit marks a Thumb or MIPS16 symbol.  */
-        syms[i].st_value &= ~(target_ulong)1;
-#endif
-        i++;
     }
-    syms = realloc(syms, nsyms * sizeof(*syms));
-
-    qsort(syms, nsyms, sizeof(*syms), symcmp);
-
-    lseek(fd, strtab.sh_offset, SEEK_SET);
-    if (read(fd, strings, strtab.sh_size) != strtab.sh_size)
+    /* the string table stays mapped for the lifetime of the process */
+    es->s.disas_strtab = map_section(fd, strtab.sh_offset, strtab.sh_size,
+                                     &strtab_map, &strtab_len);
+    if (!es->s.disas_strtab) {
+        munmap(es->symtab_map, es->symtab_len);
+        free(es);
         return;
-    s->disas_num_syms = nsyms;
-#if ELF_CLASS == ELFCLASS32
-    s->disas_symtab.elf32 = syms;
-    s->lookup_symbol = lookup_symbolxx;
-#else
-    s->disas_symtab.elf64 = syms;
-    s->lookup_symbol = lookup_symbolxx;
-#endif
-    s->next = syminfos;
-    syminfos = s;
+    }
+    es->nsyms = symtab.sh_size / sizeof(struct elf_sym);
+    es->strtab_size = strtab.sh_size;
+    es->s.lookup_symbol = lookup_symbolxx;
+    es->s.next = syminfos;
+    syminfos = &es->s;
 }
 
 int load_elf_binary(struct linux_binprm * bprm, struct target_pt_regs * regs,
@@ -1481,7 +1571,11 @@ int load_elf_binary(struct linux_binprm * bprm, struct target_pt_regs * regs,
     abi_ulong reloc_func_desc = 0;
     abi_ulong elf_stack;
     char passed_fileno[6];
+    int64_t t_start, t_args, t_image, t_interp, t_syms, t_end;
+    unsigned long read_bytes;
 
+    t_start = load_clock();
+    read_bytes = mmap_read_bytes;
     ibcs2_interpreter = 0;
     status = 0;
     load_addr = 0;
@@ -1767,6 +1861,7 @@ int load_elf_binary(struct linux_binprm * bprm, struct target_pt_regs * regs,
     info->rss = 0;
     bprm->p = setup_arg_pages(bprm->p, bprm, info);
     info->start_stack = bprm->p;
+    t_args = load_clock();
 
     /* Now we do a little grungy work by mmaping the ELF image into
      * the correct location in memory.  At this point, we assume that
@@ -1848,6 +1943,8 @@ int load_elf_binary(struct linux_binprm * bprm, struct target_pt_regs * regs,
         if (k > elf_brk) elf_brk = k;
     }
 
+    t_image = load_clock();
+
     elf_entry += load_bias;
     elf_bss += load_bias;
     elf_brk += load_bias;
@@ -1878,15 +1975,20 @@ int load_elf_binary(struct linux_binprm * bprm, struct target_pt_regs * regs,
     }
 
     free(elf_phdata);
+    t_interp = load_clock();
 
     if (qemu_log_enabled())
 	load_symbols(&elf_ex, bprm->fd);
+    t_syms = load_clock();
 
     if (interpreter_type != INTERPRETER_AOUT) close(bprm->fd);
     info->personality = (ibcs2_interpreter ? PER_SVR4 : PER_LINUX);
 
 #ifdef LOW_ELF_STACK
     info->start_stack = bprm->p = elf_stack - 4;
+#endif
+#ifdef TARGET_I386
+    info->vdso = vdso_setup();
 #endif
     bprm->p = create_elf_tables(bprm->p,
 		    bprm->argc,
@@ -1910,6 +2012,15 @@ int load_elf_binary(struct linux_binprm * bprm, struct target_pt_regs * regs,
 
     padzero(elf_bss, elf_brk);
 
+    t_end = load_clock();
+    qemu_log("load time   %" PRId64 " us: args+stack %" PRId64
+             " image %" PRId64 " interp %" PRId64 " symbols %" PRId64
+             " tables+bss %" PRId64 "\n",
+             t_end - t_start, t_args - t_start, t_image - t_args,
+             t_interp - t_image, t_syms - t_interp, t_end - t_syms);
+    qemu_log("load copy   %lu bytes read instead of mapped\n",
+             mmap_read_bytes - read_bytes);
+
 #if 0
     printf("(start_brk) %x\n" , info->start_brk);
     printf("(end_code) %x\n" , info->end_code);
@@ -102,14 +102,14 @@ static int pending_cpus;
 /* Make sure everything is in a consistent state for calling fork().  */
 void fork_start(void)
 {
+    /* tb_lock nests inside the mmap lock.  */
+    mmap_fork_start();
     pthread_mutex_lock(&tb_lock);
     pthread_mutex_lock(&exclusive_lock);
-    mmap_fork_start();
 }
 
 void fork_end(int child)
 {
-    mmap_fork_end(child);
     if (child) {
         /* Child processes created by fork() only have a single thread.
            Discard information about the parent threads.  */
@@ -126,6 +126,7 @@ void fork_end(int child)
         pthread_mutex_unlock(&exclusive_lock);
         pthread_mutex_unlock(&tb_lock);
     }
+    mmap_fork_end(child);
 }
 
 /* Wait for pending exclusive operations to complete.  The exclusive lock
@@ -302,6 +303,64 @@ static void set_idt(int n, unsigned int dpl)
 }
 #endif
 
+/* Run the system call the guest just made with int $0x80 or syscall.  */
+static inline abi_long x86_do_syscall(CPUX86State *env, int trapnr)
+{
+#ifndef TARGET_ABI32
+    if (trapnr == EXCP_SYSCALL) {
+        return do_syscall(env,
+                          env->regs[R_EAX],
+                          env->regs[R_EDI],
+                          env->regs[R_ESI],
+                          env->regs[R_EDX],
+                          env->regs[10],
+                          env->regs[8],
+                          env->regs[9]);
+    }
+#endif
+    return do_syscall(env,
+                      env->regs[R_EAX],
+                      env->regs[R_EBX],
+                      env->regs[R_ECX],
+                      env->regs[R_EDX],
+                      env->regs[R_ESI],
+                      env->regs[R_EDI],
+                      env->regs[R_EBP]);
+}
+
+/* Installed as cpu_x86_syscall_hook: the syscalls threaded guests make
+   most often are run straight from the helper, so they skip the
+   cpu_exec() exit, the eflags round trip and the trip through
+   cpu_loop().  Anything that may change the CPU state or the guest
+   control flow still goes the long way.  */
+static int x86_fast_syscall(CPUX86State *env, int trapnr,
+                            target_ulong next_eip)
+{
+    TaskState *ts = env->opaque;
+
+    if (env->eflags & VM_MASK) {
+        return 0;
+    }
+    switch ((int)env->regs[R_EAX]) {
+    case TARGET_NR_futex:
+    case TARGET_NR_read:
+    case TARGET_NR_write:
+    case TARGET_NR_clock_gettime:
+    case TARGET_NR_gettimeofday:
+    case TARGET_NR_sched_yield:
+        break;
+    default:
+        return 0;
+    }
+    env->eip = next_eip;
+    env->regs[R_EAX] = x86_do_syscall(env, trapnr);
+    /* let cpu_loop() deliver whatever arrived meanwhile */
+    if (ts->signal_pending) {
+        cpu_exit(env);
+    }
+    return 1;
+}
+
 void cpu_loop(CPUX86State *env)
 {
     int trapnr;
@@ -320,26 +379,12 @@ void cpu_loop(CPUX86State *env)
         switch(trapnr) {
         case 0x80:
             /* linux syscall from int $0x80 */
-            env->regs[R_EAX] = do_syscall(env,
-                                          env->regs[R_EAX],
-                                          env->regs[R_EBX],
-                                          env->regs[R_ECX],
-                                          env->regs[R_EDX],
-                                          env->regs[R_ESI],
-                                          env->regs[R_EDI],
-                                          env->regs[R_EBP]);
+            env->regs[R_EAX] = x86_do_syscall(env, trapnr);
             break;
 #ifndef TARGET_ABI32
         case EXCP_SYSCALL:
             /* linux syscall from syscall intruction */
-            env->regs[R_EAX] = do_syscall(env,
-                                          env->regs[R_EAX],
-                                          env->regs[R_EDI],
-                                          env->regs[R_ESI],
-                                          env->regs[R_EDX],
-                                          env->regs[10],
-                                          env->regs[8],
-                                          env->regs[9]);
+            env->regs[R_EAX] = x86_do_syscall(env, trapnr);
             env->eip = env->exception_next_eip;
             break;
 #endif
@@ -2617,6 +2662,8 @@ static void usage(void)
            "-E var=value      sets/modifies targets environment variable(s)\n"
            "-U var            unsets targets environment variable(s)\n"
            "-0 argv0          forces target process argv[0] to be argv0\n"
+           "-io-uring         run guest read/write/sendmsg/recvmsg through\n"
+           "                  a host io_uring with a kernel polling thread\n"
 #if defined(CONFIG_USE_GUEST_BASE)
            "-B address        set guest_base address to address\n"
            "-R size           reserve size bytes for guest virtual address space\n"
@@ -2631,6 +2678,7 @@ static void usage(void)
            "Environment variables:\n"
            "QEMU_STRACE       Print system calls and arguments similar to the\n"
            "                  'strace' program.  Enable by setting to any value.\n"
+           "QEMU_IO_URING     Same as -io-uring.  Enable by setting to any value.\n"
            "You can use -E and -U options to set/unset environment variables\n"
            "for target process.  It is possible to provide several variables\n"
            "by repeating the option.  For example:\n"
@@ -2857,6 +2905,8 @@ int main(int argc, char **argv, char **envp)
             singlestep = 1;
         } else if (!strcmp(r, "strace")) {
             do_strace = 1;
+        } else if (!strcmp(r, "io-uring")) {
+            use_io_uring = 1;
         } else
         {
             usage();
@@ -2928,6 +2978,14 @@ int main(int argc, char **argv, char **envp)
     if (getenv("QEMU_STRACE")) {
         do_strace = 1;
     }
+    if (getenv("QEMU_IO_URING")) {
+        use_io_uring = 1;
+    }
+#ifndef CONFIG_IO_URING
+    if (use_io_uring) {
+        fprintf(stderr, "qemu: io_uring support not compiled in\n");
+    }
+#endif
 
     target_environ = envlist_to_environ(envlist, NULL);
     envlist_free(envlist);
@@ -3067,6 +3125,7 @@ int main(int argc, char **argv, char **envp)
 
 #if defined(TARGET_I386)
     cpu_x86_set_cpl(env, 3);
+    cpu_x86_syscall_hook = x86_fast_syscall;
 
     env->cr[0] = CR0_PG_MASK | CR0_WP_MASK | CR0_PE_MASK;
     env->hflags |= HF_PE_MASK;
@@ -51,6 +51,16 @@ void mmap_unlock(void)
     }
 }
 
+/* Drop every level of mmap_lock this thread holds.  Used after a
+   longjmp back to cpu_exec(), which is never entered with it held.  */
+void mmap_lock_reset(void)
+{
+    if (mmap_lock_count) {
+        mmap_lock_count = 0;
+        pthread_mutex_unlock(&mmap_mutex);
+    }
+}
+
 /* Grab lock to make sure things are in a consistent state after fork().  */
 void mmap_fork_start(void)
 {
@@ -75,6 +85,10 @@ void mmap_lock(void)
 void mmap_unlock(void)
 {
 }
+
+void mmap_lock_reset(void)
+{
+}
 #endif
 
 /* NOTE: all the constants are the HOST ones, but addresses are target. */
@@ -147,6 +161,45 @@ error:
     return ret;
 }
 
+unsigned long mmap_read_bytes;
+
+/* Map the file data for [start, end) of an incomplete host page straight
+   from the file instead of reading it.  This works at the granularity of
+   the real host pages, so it is only possible when the file offset lines
+   up with the address modulo the real host page size, when no other
+   target page shares those real pages, and when the mapping does not
+   extend past the end of the file (accessing such pages would raise
+   SIGBUS).  */
+static int mmap_frag_file(abi_ulong start, abi_ulong end,
+                          int prot, int flags, int fd, abi_ulong offset)
+{
+    abi_ulong real_mask, map_start, map_end, map_offset, addr;
+    struct stat sb;
+
+    real_mask = qemu_real_host_page_size - 1;
+    if ((offset & real_mask) != (start & real_mask)) {
+        return -1;
+    }
+    map_start = start & ~real_mask;
+    map_end = (end + real_mask) & ~real_mask;
+    map_offset = offset - (start - map_start);
+    for (addr = map_start; addr < map_end; addr += TARGET_PAGE_SIZE) {
+        if ((addr < start || addr >= end) && page_get_flags(addr)) {
+            return -1;
+        }
+    }
+    if (fstat(fd, &sb) == -1 ||
+        map_offset + (map_end - map_start) >
+        ((sb.st_size + real_mask) & ~real_mask)) {
+        return -1;
+    }
+    if (mmap(g2h(map_start), map_end - map_start, prot,
+             flags | MAP_FIXED, fd, map_offset) == MAP_FAILED) {
+        return -1;
+    }
+    return 0;
+}
+
 /* map an incomplete host page */
 static int mmap_frag(abi_ulong real_start,
                      abi_ulong start, abi_ulong end,
@@ -155,13 +208,14 @@ static int mmap_frag(abi_ulong real_start,
     abi_ulong real_end, addr;
     void *host_start;
     int prot1, prot_new;
+    ssize_t ret;
 
     real_end = real_start + qemu_host_page_size;
     host_start = g2h(real_start);
 
     /* get the protection of the target pages outside the mapping */
     prot1 = 0;
-    for(addr = real_start; addr < real_end; addr++) {
+    for(addr = real_start; addr < real_end; addr += TARGET_PAGE_SIZE) {
         if (addr < start || addr >= end)
             prot1 |= page_get_flags(addr);
     }
@@ -178,6 +232,14 @@ static int mmap_frag(abi_ulong real_start,
 
     prot_new = prot | prot1;
     if (!(flags & MAP_ANONYMOUS)) {
+        /* a shared mapping must not become more accessible than asked */
+        if (((flags & MAP_TYPE) != MAP_SHARED || prot_new == prot) &&
+            mmap_frag_file(start, end, prot_new, flags, fd, offset) == 0) {
+            if (prot_new != prot1)
+                mprotect(host_start, qemu_host_page_size, prot_new);
+            return 0;
+        }
+
         /* msync() won't work here, so we return an error if write is
            possible while it is a shared mapping */
         if ((flags & MAP_TYPE) == MAP_SHARED &&
@@ -188,18 +250,28 @@ static int mmap_frag(abi_ulong real_start,
         if (!(prot1 & PROT_WRITE))
             mprotect(host_start, qemu_host_page_size, prot1 | PROT_WRITE);
 
-        /* read the corresponding file data */
-        if (pread(fd, g2h(start), end - start, offset) == -1)
+        /* read the corresponding file data; the rest of the host page
+           may hold data of an earlier mapping, so clear what lies past
+           the end of the file */
+        ret = pread(fd, g2h(start), end - start, offset);
+        if (ret == -1)
             return -1;
+        mmap_read_bytes += ret;
+        if (ret < end - start) {
+            memset(g2h(start + ret), 0, end - start - ret);
+        }
 
         /* put final protection */
         if (prot_new != (prot1 | PROT_WRITE))
             mprotect(host_start, qemu_host_page_size, prot_new);
     } else {
-        /* just update the protection */
-        if (prot_new != prot1) {
+        /* the target pages may still hold data of an earlier mapping
+           of the host page, while anonymous memory must read as zero */
+        if (!(prot1 & PROT_WRITE))
+            mprotect(host_start, qemu_host_page_size, prot1 | PROT_WRITE);
+        memset(g2h(start), 0, end - start);
+        if (prot_new != (prot1 | PROT_WRITE))
             mprotect(host_start, qemu_host_page_size, prot_new);
-        }
     }
     return 0;
 }
@@ -221,33 +293,22 @@ unsigned long last_brk;
 static abi_ulong mmap_find_vma_reserved(abi_ulong start, abi_ulong size)
 {
     abi_ulong addr;
-    abi_ulong last_addr;
-    int prot;
-    int looped = 0;
 
     if (size > RESERVED_VA) {
         return (abi_ulong)-1;
     }
 
-    last_addr = start;
-    for (addr = start; last_addr + size != addr; addr += qemu_host_page_size) {
-        if (last_addr + size >= RESERVED_VA
-            || (abi_ulong)(last_addr + size) < last_addr) {
-            if (looped) {
-                return (abi_ulong)-1;
-            }
-            last_addr = qemu_host_page_size;
-            addr = 0;
-            looped = 1;
-            continue;
-        }
-        prot = page_get_flags(addr);
-        if (prot) {
-            last_addr = addr + qemu_host_page_size;
+    /* The whole guest address space belongs to us, so the guest
+       regions are all that can be in the way.  */
+    addr = page_find_free(start, RESERVED_VA - 1, size);
+    if (addr == (abi_ulong)-1) {
+        addr = page_find_free(qemu_host_page_size, RESERVED_VA - 1, size);
+        if (addr == (abi_ulong)-1) {
+            return (abi_ulong)-1;
         }
     }
-    mmap_next_start = addr;
-    return last_addr;
+    mmap_next_start = addr + size;
+    return addr;
 }
 
 /*
@@ -275,7 +336,12 @@ abi_ulong mmap_find_vma(abi_ulong start, abi_ulong size)
         return mmap_find_vma_reserved(start, size);
     }
 
-    addr = start;
+    /* Skip the guest regions we know about; the host may still have
+       its own mappings there, which the probing below deals with.  */
+    addr = page_find_free(start, (abi_ulong)-1, size);
+    if (addr == (abi_ulong)-1) {
+        addr = start;
+    }
     wrapped = repeat = 0;
     prev = 0;
 
@@ -456,8 +522,15 @@ abi_long target_mmap(abi_ulong start, abi_ulong len, int prot,
         /* update start so that it points to the file position at 'offset' */
         host_start = (unsigned long)p;
         if (!(flags & MAP_ANONYMOUS)) {
-            p = mmap(g2h(mmap_start), len, prot, 
+            /* the file is mapped from the host page holding 'offset',
+               so the mapping must also cover the bytes before it.  Not
+               rounded up to the host page: 'len' may stop at EOF.  */
+            p = mmap(g2h(mmap_start), len + offset - host_offset, prot,
                      flags | MAP_FIXED, fd, host_offset);
+            if (p == MAP_FAILED) {
+                munmap(g2h(mmap_start), host_len);
+                goto fail;
+            }
             host_start += offset - host_offset;
         }
         start = h2g(host_start);
@@ -495,8 +568,10 @@ abi_long target_mmap(abi_ulong start, abi_ulong len, int prot,
                                   -1, 0);
             if (retaddr == -1)
                 goto fail;
-            if (pread(fd, g2h(start), len, offset) == -1)
+            ret = pread(fd, g2h(start), len, offset);
+            if (ret == -1)
                 goto fail;
+            mmap_read_bytes += ret;
             if (!(prot & PROT_WRITE)) {
                 ret = target_mprotect(start, len, prot);
                 if (ret != 0) {
@@ -526,7 +601,7 @@ abi_long target_mmap(abi_ulong start, abi_ulong len, int prot,
         /* handle the end of the mapping */
         if (end < real_end) {
             ret = mmap_frag(real_end - qemu_host_page_size,
-                            real_end - qemu_host_page_size, real_end,
+                            real_end - qemu_host_page_size, end,
                             prot, flags, fd,
                             offset + real_end - qemu_host_page_size - start);
             if (ret == -1)
@@ -658,8 +733,15 @@ int target_munmap(abi_ulong start, abi_ulong len)
         }
     }
 
-    if (ret == 0)
+    if (ret == 0) {
         page_set_flags(start, start + len, 0);
+        /* Let the next search start at the hole, as the kernel does
+           with its free_area_cache; mmap_find_vma skips whatever is
+           still mapped above it.  */
+        if (start >= TASK_UNMAPPED_BASE && start < mmap_next_start) {
+            mmap_next_start = start;
+        }
+    }
     mmap_unlock();
     return ret;
 }
@@ -703,9 +785,9 @@ abi_long target_mremap(abi_ulong old_addr, abi_ulong old_size,
         int prot = 0;
         if (RESERVED_VA && old_size < new_size) {
             abi_ulong addr;
-            for (addr = old_addr + old_size;
+            for (addr = (old_addr + old_size) & TARGET_PAGE_MASK;
                  addr < old_addr + new_size;
-                 addr++) {
+                 addr += TARGET_PAGE_SIZE) {
                 prot |= page_get_flags(addr);
             }
         }
@@ -47,6 +47,7 @@ struct image_info {
         abi_ulong       code_offset;
         abi_ulong       data_offset;
         abi_ulong       saved_auxv;
+        abi_ulong       vdso;
         abi_ulong       arg_start;
         abi_ulong       arg_end;
         char            **host_argv;
@@ -84,6 +85,7 @@ struct sigqueue {
 
 struct emulated_sigtable {
     int pending; /* true if signal is pending */
+    int deferred; /* blocked by a handler entered after it was queued */
     struct sigqueue *first;
     struct sigqueue info; /* in order to always have memory for the
                              first signal, we put it here */
@@ -125,6 +127,7 @@ typedef struct TaskState {
     struct sigqueue sigqueue_table[MAX_SIGQUEUE_SIZE]; /* siginfo queue */
     struct sigqueue *first_free; /* first free siginfo queue entry */
     int signal_pending; /* non zero if a signal may be pending */
+    int64_t signal_time; /* arrival of the last host signal, for -d exec */
 
     uint8_t stack[0];
 } __attribute__((aligned(16))) TaskState;
@@ -209,6 +212,8 @@ int host_to_target_signal(int sig);
 long do_sigreturn(CPUState *env);
 long do_rt_sigreturn(CPUState *env);
 abi_long do_sigaltstack(abi_ulong uss_addr, abi_ulong uoss_addr, abi_ulong sp);
+void dump_signal_info(FILE *f,
+                      int (*cpu_fprintf)(FILE *f, const char *fmt, ...));
 
 #ifdef TARGET_I386
 /* vm86.c */
@@ -216,6 +221,10 @@ void save_v86_state(CPUX86State *env);
 void handle_vm86_trap(CPUX86State *env, int trapno);
 void handle_vm86_fault(CPUX86State *env);
 int do_vm86(CPUX86State *env, long subfunction, abi_ulong v86_addr);
+
+/* vdso.c */
+abi_ulong vdso_setup(void);
+void vdso_sync_time(int clk, struct timespec *ts);
 #elif defined(TARGET_SPARC64)
 void sparc64_set_context(CPUSPARCState *env);
 void sparc64_get_context(CPUSPARCState *env);
@@ -231,8 +240,11 @@ abi_long target_mremap(abi_ulong old_addr, abi_ulong old_size,
                        abi_ulong new_addr);
 int target_msync(abi_ulong start, abi_ulong len, int flags);
 extern unsigned long last_brk;
+/* file data target_mmap() had to read because it could not map it */
+extern unsigned long mmap_read_bytes;
 void mmap_lock(void);
 void mmap_unlock(void);
+void mmap_lock_reset(void);
 abi_ulong mmap_find_vma(abi_ulong, abi_ulong);
 void cpu_list_lock(void);
 void cpu_list_unlock(void);
@@ -244,6 +256,20 @@ void mmap_fork_end(int child);
 /* main.c */
 extern unsigned long guest_stack_size;
 
+/* uring.c */
+struct msghdr;
+extern int use_io_uring;
+ssize_t uring_read(int fd, void *buf, size_t len);
+ssize_t uring_write(int fd, const void *buf, size_t len);
+ssize_t uring_pread64(int fd, void *buf, size_t len, off64_t off);
+ssize_t uring_pwrite64(int fd, const void *buf, size_t len, off64_t off);
+ssize_t uring_sendmsg(int fd, struct msghdr *msg, int flags);
+ssize_t uring_recvmsg(int fd, struct msghdr *msg, int flags);
+void uring_fork_child(void);
+void uring_thread_exit(void);
+void uring_fd_closed(int fd);
+void dump_io_info(FILE *f, int (*cpu_fprintf)(FILE *f, const char *fmt, ...));
+
 /* user access */
 
 #define VERIFY_READ 0
@@ -26,6 +26,7 @@
 #include <assert.h>
 #include <sys/ucontext.h>
 #include <sys/resource.h>
+#include <time.h>
 
 #include "qemu.h"
 #include "qemu-common.h"
@@ -41,6 +42,21 @@ static struct target_sigaltstack target_sigaltstack_used = {
 
 static struct target_sigaction sigact_table[TARGET_NSIG];
 
+/* Delivery statistics, only gathered with -d exec */
+static uint64_t signal_frame_count;   /* handler frames set up */
+static uint64_t signal_batch_count;   /* frames stacked on another one */
+static uint64_t signal_timed_count;
+static uint64_t signal_total_ns;      /* host signal to guest frame */
+static uint64_t signal_max_ns;
+
+static inline int64_t signal_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
 static void host_signal_handler(int host_signum, siginfo_t *info,
                                 void *puc);
 
@@ -485,13 +501,24 @@ static void host_signal_handler(int host_signum, siginfo_t *info,
 {
     int sig;
     target_siginfo_t tinfo;
+    TaskState *ts = NULL;
+
+    if (qemu_loglevel_mask(CPU_LOG_EXEC) && thread_env) {
+        ts = thread_env->opaque;
+        ts->signal_time = signal_clock();
+    }
 
     /* the CPU emulator uses some host signals to detect exceptions,
        we forward to it some signals */
     if ((host_signum == SIGSEGV || host_signum == SIGBUS)
         && info->si_code > 0) {
-        if (cpu_signal_handler(host_signum, info, puc))
+        if (cpu_signal_handler(host_signum, info, puc)) {
+            /* handled without a guest signal */
+            if (ts) {
+                ts->signal_time = 0;
+            }
             return;
+        }
     }
 
     /* get target signal number */
@@ -4733,9 +4760,12 @@ long do_rt_sigreturn(CPUState *env)
 
 #endif
 
-void process_pending_signals(CPUState *cpu_env)
+/* Deliver the pending signal 'sig'.  Return non zero and update
+   'blocked' to the host signal mask of the handler if a guest frame
+   was set up.  */
+static int handle_pending_signal(CPUState *cpu_env, int sig,
+                                 sigset_t *blocked)
 {
-    int sig;
     abi_ulong handler;
     sigset_t set, old_set;
     target_sigset_t target_old_set;
@@ -4743,26 +4773,13 @@ void process_pending_signals(CPUState *cpu_env)
     struct target_sigaction *sa;
     struct sigqueue *q;
     TaskState *ts = cpu_env->opaque;
+    int frame = 0;
 
-    if (!ts->signal_pending)
-        return;
-
-    /* FIXME: This is not threadsafe.  */
-    k = ts->sigtab;
-    for(sig = 1; sig <= TARGET_NSIG; sig++) {
-        if (k->pending)
-            goto handle_signal;
-        k++;
-    }
-    /* if no signal is pending, just return */
-    ts->signal_pending = 0;
-    return;
-
- handle_signal:
 #ifdef DEBUG_SIGNAL
     fprintf(stderr, "qemu: process signal %d\n", sig);
 #endif
     /* dequeue signal */
+    k = &ts->sigtab[sig - 1];
     q = k->first;
     k->first = q->next;
     if (!k->first)
@@ -4801,6 +4818,7 @@ void process_pending_signals(CPUState *cpu_env)
 
         /* block signals in the handler using Linux */
         sigprocmask(SIG_BLOCK, &set, &old_set);
+        sigorset(blocked, &old_set, &set);
         /* save the previous blocked signal state to restore it at the
            end of the signal execution (see do_sigreturn) */
         host_to_target_sigset_internal(&target_old_set, &old_set);
@@ -4820,7 +4838,96 @@ void process_pending_signals(CPUState *cpu_env)
             setup_frame(sig, sa, &target_old_set, cpu_env);
 	if (sa->sa_flags & TARGET_SA_RESETHAND)
             sa->_sa_handler = TARGET_SIG_DFL;
+        frame = 1;
     }
     if (q != &k->info)
         free_sigqueue(cpu_env, q);
+    return frame;
+}
+
+void process_pending_signals(CPUState *cpu_env)
+{
+    int sig, nb_sigs, nb_frames, have_mask;
+    sigset_t blocked;
+    struct emulated_sigtable *k;
+    TaskState *ts = cpu_env->opaque;
+
+    if (!ts->signal_pending)
+        return;
+
+    /* Like the kernel, deliver every pending signal that the handlers
+       already entered do not block, stacking their frames, rather than
+       one signal per exit from cpu_exec().  A signal was unblocked when
+       it was queued, so the host mask only needs checking for those a
+       handler has blocked since.  */
+    nb_sigs = 0;
+    nb_frames = 0;
+    have_mask = 0;
+    for (;;) {
+        /* FIXME: This is not threadsafe.  */
+        k = ts->sigtab;
+        for(sig = 1; sig <= TARGET_NSIG; sig++, k++) {
+            if (!k->pending)
+                continue;
+            if (!k->deferred)
+                break;
+            if (!have_mask) {
+                sigprocmask(SIG_SETMASK, NULL, &blocked);
+                have_mask = 1;
+            }
+            if (!sigismember(&blocked, target_to_host_signal(sig)))
+                break;
+        }
+        if (sig > TARGET_NSIG)
+            break;
+        k->deferred = 0;
+        if (handle_pending_signal(cpu_env, sig, &blocked)) {
+            have_mask = 1;
+            nb_frames++;
+            /* the others wait for the new handler if it blocks them */
+            k = ts->sigtab;
+            for(sig = 1; sig <= TARGET_NSIG; sig++, k++) {
+                if (k->pending &&
+                    sigismember(&blocked, target_to_host_signal(sig)))
+                    k->deferred = 1;
+            }
+        }
+        nb_sigs++;
+    }
+
+    if (qemu_loglevel_mask(CPU_LOG_EXEC) && nb_frames) {
+        signal_frame_count += nb_frames;
+        signal_batch_count += nb_frames - 1;
+        if (ts->signal_time) {
+            uint64_t ns = signal_clock() - ts->signal_time;
+            signal_timed_count++;
+            signal_total_ns += ns;
+            if (ns > signal_max_ns)
+                signal_max_ns = ns;
+        }
+    }
+    if (nb_sigs) {
+        ts->signal_time = 0;
+    }
+
+    /* keep signal_pending set while a deferred signal waits for its
+       handler mask to be lifted */
+    k = ts->sigtab;
+    for(sig = 1; sig <= TARGET_NSIG; sig++, k++) {
+        if (k->pending)
+            return;
+    }
+    ts->signal_pending = 0;
+}
+
+void dump_signal_info(FILE *f,
+                      int (*cpu_fprintf)(FILE *f, const char *fmt, ...))
+{
+    cpu_fprintf(f, "Signals delivered   %" PRIu64 " (stacked on another %"
+                PRIu64 ")\n", signal_frame_count, signal_batch_count);
+    if (signal_timed_count) {
+        cpu_fprintf(f, "Signal latency      avg %" PRIu64 " ns max %" PRIu64
+                    " ns\n", signal_total_ns / signal_timed_count,
+                    signal_max_ns);
+    }
 }
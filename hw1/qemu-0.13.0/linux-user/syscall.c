@@ -1626,9 +1626,9 @@ static abi_long do_sendrecvmsg(int fd, abi_ulong target_msg,
     if (send) {
         ret = target_to_host_cmsg(&msg, msgp);
         if (ret == 0)
-            ret = get_errno(sendmsg(fd, &msg, flags));
+            ret = get_errno(uring_sendmsg(fd, &msg, flags));
     } else {
-        ret = get_errno(recvmsg(fd, &msg, flags));
+        ret = get_errno(uring_recvmsg(fd, &msg, flags));
         if (!is_error(ret)) {
             len = ret;
             ret = host_to_target_cmsg(msgp, &msg);
@@ -3600,7 +3600,9 @@ static int do_fork(CPUState *env, unsigned int flags, abi_ulong newsp,
         new_stack = ts->stack;
         /* we create a new CPU instance. */
         new_env = cpu_copy(env);
-#if defined(TARGET_I386) || defined(TARGET_SPARC) || defined(TARGET_PPC)
+        /* Not on x86: a reset here would throw away the state copied
+           from the parent and start the thread at the reset vector.  */
+#if defined(TARGET_SPARC) || defined(TARGET_PPC)
         cpu_reset(new_env);
 #endif
         /* Init regs that differ from the parent.  */
@@ -3683,6 +3685,7 @@ static int do_fork(CPUState *env, unsigned int flags, abi_ulong newsp,
             /* Child Process.  */
             cpu_clone_regs(env, newsp);
             fork_end(1);
+            uring_fork_child();
 #if defined(CONFIG_USE_NPTL)
             /* There is a race condition here.  The parent process could
                theoretically read the TID in the child process before the child
@@ -4125,6 +4128,21 @@ static int do_futex(target_ulong uaddr, int op, int val, target_ulong timeout,
         }
         return get_errno(sys_futex(g2h(uaddr), op, tswap32(val),
                          pts, NULL, 0));
+#ifdef FUTEX_WAIT_BITSET
+    case FUTEX_WAIT_BITSET:
+        /* glibc uses this for condition variables; the timeout is
+           absolute, which needs no different conversion.  */
+        if (timeout) {
+            pts = &ts;
+            target_to_host_timespec(pts, timeout);
+        } else {
+            pts = NULL;
+        }
+        return get_errno(sys_futex(g2h(uaddr), op, tswap32(val),
+                         pts, NULL, val3));
+    case FUTEX_WAKE_BITSET:
+        return get_errno(sys_futex(g2h(uaddr), op, val, NULL, NULL, val3));
+#endif
     case FUTEX_WAKE:
         return get_errno(sys_futex(g2h(uaddr), op, val, NULL, NULL, 0));
     case FUTEX_FD:
@@ -4247,12 +4265,20 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
                         NULL, NULL, 0);
           }
           /* TODO: Free CPU state.  */
+          uring_thread_exit();
           pthread_exit(NULL);
       }
 #endif
 #ifdef TARGET_GPROF
         _mcleanup();
 #endif
+        if (qemu_loglevel_mask(CPU_LOG_EXEC)) {
+            dump_tb_lock_info(logfile, fprintf);
+            dump_smc_info(logfile, fprintf);
+            dump_restore_info(logfile, fprintf);
+            dump_io_info(logfile, fprintf);
+            dump_signal_info(logfile, fprintf);
+        }
         gdb_exit(cpu_env, arg1);
         _exit(arg1);
         ret = 0; /* avoid warning */
@@ -4263,14 +4289,14 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         else {
             if (!(p = lock_user(VERIFY_WRITE, arg2, arg3, 0)))
                 goto efault;
-            ret = get_errno(read(arg1, p, arg3));
+            ret = get_errno(uring_read(arg1, p, arg3));
             unlock_user(p, arg2, ret);
         }
         break;
     case TARGET_NR_write:
         if (!(p = lock_user(VERIFY_READ, arg2, arg3, 1)))
             goto efault;
-        ret = get_errno(write(arg1, p, arg3));
+        ret = get_errno(uring_write(arg1, p, arg3));
         unlock_user(p, arg2, 0);
         break;
     case TARGET_NR_open:
@@ -4294,6 +4320,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
 #endif
     case TARGET_NR_close:
         ret = get_errno(close(arg1));
+        uring_fd_closed(arg1);
         break;
     case TARGET_NR_brk:
         ret = do_brk(arg1);
@@ -4471,6 +4498,9 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         {
             time_t host_time;
             ret = get_errno(time(&host_time));
+#ifdef TARGET_I386
+            vdso_sync_time(CLOCK_REALTIME, NULL);
+#endif
             if (!is_error(ret)
                 && arg1
                 && put_user_sal(host_time, arg1))
@@ -4818,10 +4848,16 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         goto unimplemented;
     case TARGET_NR_dup2:
         ret = get_errno(dup2(arg1, arg2));
+        if (!is_error(ret)) {
+            uring_fd_closed(arg2);
+        }
         break;
 #if defined(CONFIG_DUP3) && defined(TARGET_NR_dup3)
     case TARGET_NR_dup3:
         ret = get_errno(dup3(arg1, arg2, arg3));
+        if (!is_error(ret)) {
+            uring_fd_closed(arg2);
+        }
         break;
 #endif
 #ifdef TARGET_NR_getppid /* not on alpha */
@@ -5247,6 +5283,9 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         {
             struct timeval tv;
             ret = get_errno(gettimeofday(&tv, NULL));
+#ifdef TARGET_I386
+            vdso_sync_time(CLOCK_REALTIME, NULL);
+#endif
             if (!is_error(ret)) {
                 if (copy_to_user_timeval(arg1, &tv))
                     goto efault;
@@ -5878,6 +5917,13 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
 #ifdef TARGET_GPROF
         _mcleanup();
 #endif
+        if (qemu_loglevel_mask(CPU_LOG_EXEC)) {
+            dump_tb_lock_info(logfile, fprintf);
+            dump_smc_info(logfile, fprintf);
+            dump_restore_info(logfile, fprintf);
+            dump_io_info(logfile, fprintf);
+            dump_signal_info(logfile, fprintf);
+        }
         gdb_exit(cpu_env, arg1);
         ret = get_errno(exit_group(arg1));
         break;
@@ -6275,13 +6321,15 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
     case TARGET_NR_pread64:
         if (!(p = lock_user(VERIFY_WRITE, arg2, arg3, 0)))
             goto efault;
-        ret = get_errno(pread64(arg1, p, arg3, target_offset64(arg4, arg5)));
+        ret = get_errno(uring_pread64(arg1, p, arg3,
+                                     target_offset64(arg4, arg5)));
         unlock_user(p, arg2, ret);
         break;
     case TARGET_NR_pwrite64:
         if (!(p = lock_user(VERIFY_READ, arg2, arg3, 1)))
             goto efault;
-        ret = get_errno(pwrite64(arg1, p, arg3, target_offset64(arg4, arg5)));
+        ret = get_errno(uring_pwrite64(arg1, p, arg3,
+                                      target_offset64(arg4, arg5)));
         unlock_user(p, arg2, 0);
         break;
 #endif
@@ -7078,6 +7126,9 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         struct timespec ts;
         ret = get_errno(clock_gettime(arg1, &ts));
         if (!is_error(ret)) {
+#ifdef TARGET_I386
+            vdso_sync_time(arg1, &ts);
+#endif
             host_to_target_timespec(arg2, &ts);
         }
         break;
@@ -0,0 +1,718 @@
+/*
+ *  Guest I/O syscalls through a host io_uring
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <alloca.h>
+
+#include "qemu.h"
+#include "qemu-barrier.h"
+#include "host-utils.h"
+
+#ifdef CONFIG_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+/* The guest's read(), write(), pread64(), pwrite64(), sendmsg() and
+   recvmsg() end up in the uring_*() functions below.  Without -io-uring
+   they simply make the host syscall.  With it, every guest thread gets
+   an io_uring whose submission queue is drained by a kernel polling
+   thread, one for the whole process, so an I/O that can complete right
+   away costs no host syscall at all: the SQE is written into the ring,
+   the poller picks it up, and we spin briefly on the completion queue.
+
+   Ring I/O is always submitted non-blocking (RWF_NOWAIT, MSG_DONTWAIT).
+   If it would block we make the plain syscall instead, which blocks,
+   fails with EAGAIN on an O_NONBLOCK fd, or is interrupted by a signal
+   exactly as the guest expects.  io_uring itself would instead park
+   the request until the fd is ready, whatever its O_NONBLOCK flag.
+
+   Guest buffers are host memory already (lock_user() hands out g2h()
+   pointers), so SQEs point straight at guest memory and nothing needs
+   to be copied or registered.
+
+   Any failure to set up a ring (old kernel, io_uring disabled, ...)
+   silently leaves the thread on plain syscalls.  */
+
+int use_io_uring;
+
+enum {
+    IO_OP_READ,
+    IO_OP_WRITE,
+    IO_OP_PREAD,
+    IO_OP_PWRITE,
+    IO_OP_SENDMSG,
+    IO_OP_RECVMSG,
+    IO_OP_NB,
+};
+
+static const char * const io_op_names[IO_OP_NB] = {
+    "read", "write", "pread64", "pwrite64", "sendmsg", "recvmsg",
+};
+
+/* The most a single read() or write() transfers */
+#define IO_MAX_RW_COUNT     (INT_MAX & TARGET_PAGE_MASK)
+
+/* Latency histogram bucket n counts calls taking [2^n, 2^(n+1)) ns */
+#define IO_HIST_BUCKETS 32
+
+typedef struct IOOpStats {
+    uint64_t count;
+    uint64_t ring;          /* completed through the ring */
+    uint64_t host_syscalls; /* host syscalls made, either way */
+    uint64_t total_ns;
+    uint64_t hist[IO_HIST_BUCKETS];
+} IOOpStats;
+
+/* Only gathered with -d exec.  The counters are not atomic; with
+   several guest threads doing I/O they are approximate.  */
+static IOOpStats io_stats[IO_OP_NB];
+
+static inline int64_t io_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void io_record(int op, int64_t start, int ring, int host_syscalls)
+{
+    IOOpStats *s = &io_stats[op];
+    uint64_t ns = io_clock() - start;
+    int b;
+
+    s->count++;
+    s->ring += ring;
+    s->host_syscalls += host_syscalls;
+    s->total_ns += ns;
+    b = ns ? 63 - clz64(ns) : 0;
+    if (b >= IO_HIST_BUCKETS) {
+        b = IO_HIST_BUCKETS - 1;
+    }
+    s->hist[b]++;
+}
+
+#ifdef CONFIG_IO_URING
+
+/* Spin iterations on the completion queue before sleeping in the
+   kernel, a few microseconds.  */
+#define IO_RING_SPIN        2000
+#define IO_RING_ENTRIES     4
+/* How long the kernel poller keeps polling an idle ring, in ms */
+#define IO_RING_SQ_IDLE     20
+
+typedef struct IORing {
+    int index;                  /* registered ring fd */
+    unsigned sq_mask, cq_mask;
+    unsigned *sq_tail, *sq_flags, *sq_array;
+    unsigned *cq_head, *cq_tail;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+} IORing;
+
+/* The rings are shared with the kernel poller, which runs on another
+   CPU.  */
+#define ring_mb()   __sync_synchronize()
+
+static inline void io_ring_relax(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    asm volatile("pause" ::: "memory");
+#else
+    barrier();
+#endif
+}
+
+static THREAD IORing *thread_ring;
+static THREAD int thread_ring_failed;
+
+/* The fd of the first ring, kept open so that the other threads' rings
+   can share its poller (IORING_SETUP_ATTACH_WQ).  The other rings are
+   only reachable through their registered index, so a guest closing
+   fds it does not know about cannot take them away.  */
+static int io_ring_wq_fd = -1;
+static pthread_mutex_t io_ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit,
+                              unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                   flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+                                 unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void io_ring_unmap(IORing *r)
+{
+    if (r->sqes) {
+        munmap(r->sqes, r->sqes_size);
+    }
+    if (r->cq_ring && r->cq_ring != r->sq_ring) {
+        munmap(r->cq_ring, r->cq_ring_size);
+    }
+    if (r->sq_ring) {
+        munmap(r->sq_ring, r->sq_ring_size);
+    }
+    qemu_free(r);
+}
+
+static IORing *io_ring_setup(void)
+{
+    struct io_uring_params p;
+    struct io_uring_rsrc_update reg;
+    IORing *r;
+    int fd;
+    char *sq, *cq;
+
+    /* The poller needs a CPU of its own; on a uniprocessor host it
+       would only compete with us and plain syscalls are cheaper.  */
+    if (sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&io_ring_lock);
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SQPOLL;
+    p.sq_thread_idle = IO_RING_SQ_IDLE;
+    fd = -1;
+    if (io_ring_wq_fd >= 0) {
+        p.flags |= IORING_SETUP_ATTACH_WQ;
+        p.wq_fd = io_ring_wq_fd;
+        fd = sys_io_uring_setup(IO_RING_ENTRIES, &p);
+        if (fd < 0) {
+            /* The guest closed or replaced the fd; start a new poller */
+            io_ring_wq_fd = -1;
+            p.flags &= ~IORING_SETUP_ATTACH_WQ;
+            p.wq_fd = 0;
+        }
+    }
+    if (fd < 0) {
+        fd = sys_io_uring_setup(IO_RING_ENTRIES, &p);
+    }
+    if (fd < 0) {
+        pthread_mutex_unlock(&io_ring_lock);
+        return NULL;
+    }
+    if (!(p.features & IORING_FEAT_SQPOLL_NONFIXED) ||
+        !(p.features & IORING_FEAT_RW_CUR_POS) ||
+        !(p.features & IORING_FEAT_NODROP)) {
+        close(fd);
+        pthread_mutex_unlock(&io_ring_lock);
+        return NULL;
+    }
+
+    r = qemu_mallocz(sizeof(*r));
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes +
+        p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size) {
+            r->sq_ring_size = r->cq_ring_size;
+        }
+        r->cq_ring_size = r->sq_ring_size;
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    sq = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        goto fail;
+    }
+    r->sq_ring = sq;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq = sq;
+    } else {
+        cq = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            goto fail;
+        }
+    }
+    r->cq_ring = cq;
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto fail;
+    }
+
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_flags = (unsigned *)(sq + p.sq_off.flags);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    memset(&reg, 0, sizeof(reg));
+    reg.offset = -1U;
+    reg.data = fd;
+    if (sys_io_uring_register(fd, IORING_REGISTER_RING_FDS, &reg, 1) != 1) {
+        goto fail;
+    }
+    r->index = reg.offset;
+    if (io_ring_wq_fd < 0) {
+        io_ring_wq_fd = fd;
+    } else {
+        close(fd);
+    }
+    pthread_mutex_unlock(&io_ring_lock);
+    return r;
+
+ fail:
+    close(fd);
+    pthread_mutex_unlock(&io_ring_lock);
+    io_ring_unmap(r);
+    return NULL;
+}
+
+static inline IORing *io_ring_get(void)
+{
+    IORing *r = thread_ring;
+
+    if (!r && use_io_uring && !thread_ring_failed) {
+        r = thread_ring = io_ring_setup();
+        thread_ring_failed = !r;
+    }
+    return r;
+}
+
+static inline int io_ring_reap(IORing *r, int *res)
+{
+    unsigned head = *r->cq_head;
+
+    if (head == *(volatile unsigned *)r->cq_tail) {
+        return 0;
+    }
+    ring_mb();
+    *res = r->cqes[head & r->cq_mask].res;
+    smp_wmb();
+    *r->cq_head = head + 1;
+    return 1;
+}
+
+/* Run one non-blocking SQE to completion and return the CQE result
+   (-errno on failure).  There is only ever one I/O in flight per ring,
+   so the next CQE is ours.  */
+static int io_ring_run(IORing *r, const struct io_uring_sqe *sqe,
+                       int *syscalls)
+{
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & r->sq_mask;
+    int i, res;
+
+    r->sqes[idx] = *sqe;
+    r->sq_array[idx] = idx;
+    smp_wmb();
+    *r->sq_tail = tail + 1;
+    /* Order the tail store against the flags load, or we could miss
+       the poller going to sleep.  */
+    ring_mb();
+    if (*(volatile unsigned *)r->sq_flags & IORING_SQ_NEED_WAKEUP) {
+        sys_io_uring_enter(r->index, 0, 0, IORING_ENTER_SQ_WAKEUP |
+                           IORING_ENTER_REGISTERED_RING);
+        (*syscalls)++;
+    }
+
+    for (i = 0; i < IO_RING_SPIN; i++) {
+        if (io_ring_reap(r, &res)) {
+            return res;
+        }
+        io_ring_relax();
+    }
+    /* The I/O itself cannot block, so this wait is short and a host
+       signal arriving meanwhile can just be left pending.  */
+    while (!io_ring_reap(r, &res)) {
+        if (sys_io_uring_enter(r->index, 0, 1, IORING_ENTER_GETEVENTS |
+                               IORING_ENTER_SQ_WAKEUP |
+                               IORING_ENTER_REGISTERED_RING) < 0 &&
+            errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            fprintf(stderr, "qemu: io_uring_enter failed: %s\n",
+                    strerror(errno));
+            abort();
+        }
+        (*syscalls)++;
+    }
+    return res;
+}
+
+/* A ring I/O that would have blocked, or that the file cannot do
+   without blocking, is retried with the plain syscall.  */
+static inline int io_ring_would_block(int res)
+{
+    return res == -EAGAIN || res == -EOPNOTSUPP;
+}
+
+/* The write happens in the kernel poller, which does not get the
+   SIGPIPE a plain write() would raise.  */
+static void io_ring_sigpipe(int res, int flags)
+{
+    if (res == -EPIPE && !(flags & MSG_NOSIGNAL)) {
+        pthread_kill(pthread_self(), SIGPIPE);
+    }
+}
+
+/* Whether each fd is a regular file, so that short reads of pipes and
+   sockets cost one fstat() per fd rather than one per read.  Forgotten
+   when the guest closes the fd or dup2()s over it.  */
+#define IO_FD_CACHE         1024
+
+enum {
+    IO_FD_UNKNOWN,
+    IO_FD_REGULAR,
+    IO_FD_OTHER,
+};
+
+static unsigned char io_fd_kind[IO_FD_CACHE];
+
+static int io_fd_is_regular(int fd, int *syscalls)
+{
+    struct stat st;
+    int kind;
+
+    if (fd >= 0 && fd < IO_FD_CACHE && io_fd_kind[fd] != IO_FD_UNKNOWN) {
+        return io_fd_kind[fd] == IO_FD_REGULAR;
+    }
+    (*syscalls)++;
+    if (fstat(fd, &st) < 0) {
+        return 0;
+    }
+    kind = S_ISREG(st.st_mode) ? IO_FD_REGULAR : IO_FD_OTHER;
+    if (fd >= 0 && fd < IO_FD_CACHE) {
+        io_fd_kind[fd] = kind;
+    }
+    return kind == IO_FD_REGULAR;
+}
+
+void uring_fd_closed(int fd)
+{
+    if (fd >= 0 && fd < IO_FD_CACHE) {
+        io_fd_kind[fd] = IO_FD_UNKNOWN;
+    }
+}
+
+/* The non-blocking sendmsg() on the ring may have sent only part of a
+   stream; a blocking one would not, so send the rest the plain way.
+   Returns the number of extra bytes sent.  */
+static ssize_t io_sendmsg_rest(int fd, const struct msghdr *msg, int flags,
+                               size_t done, int *syscalls)
+{
+    struct msghdr m;
+    struct iovec *iov;
+    size_t i, total;
+    ssize_t ret;
+
+    total = 0;
+    for (i = 0; i < msg->msg_iovlen; i++) {
+        total += msg->msg_iov[i].iov_len;
+    }
+    if (done >= total) {
+        return 0;
+    }
+    iov = alloca(msg->msg_iovlen * sizeof(*iov));
+    memcpy(iov, msg->msg_iov, msg->msg_iovlen * sizeof(*iov));
+    m = *msg;
+    m.msg_iov = iov;
+    /* The ancillary data went with the first byte */
+    m.msg_control = NULL;
+    m.msg_controllen = 0;
+    while (done >= m.msg_iov->iov_len) {
+        done -= m.msg_iov->iov_len;
+        m.msg_iov++;
+        m.msg_iovlen--;
+    }
+    m.msg_iov->iov_base = (char *)m.msg_iov->iov_base + done;
+    m.msg_iov->iov_len -= done;
+    ret = sendmsg(fd, &m, flags);
+    (*syscalls)++;
+    return ret > 0 ? ret : 0;
+}
+
+void uring_fork_child(void)
+{
+    IORing *r = thread_ring;
+
+    /* The ring and its poller belong to the parent */
+    thread_ring = NULL;
+    thread_ring_failed = 0;
+    if (r) {
+        io_ring_unmap(r);
+    }
+    if (io_ring_wq_fd >= 0) {
+        close(io_ring_wq_fd);
+        io_ring_wq_fd = -1;
+    }
+}
+
+void uring_thread_exit(void)
+{
+    IORing *r = thread_ring;
+
+    thread_ring = NULL;
+    if (r) {
+        /* The registered fd goes away with the thread */
+        io_ring_unmap(r);
+    }
+}
+
+#else
+
+void uring_fork_child(void)
+{
+}
+
+void uring_thread_exit(void)
+{
+}
+
+void uring_fd_closed(int fd)
+{
+}
+
+#endif /* CONFIG_IO_URING */
+
+static ssize_t uring_rw(int op, int fd, void *buf, size_t len, off64_t off)
+{
+    int64_t start = 0;
+    int logging = qemu_loglevel_mask(CPU_LOG_EXEC);
+    int syscalls = 0, ring = 0;
+    ssize_t ret;
+#ifdef CONFIG_IO_URING
+    IORing *r = io_ring_get();
+    struct io_uring_sqe sqe;
+    int res;
+#endif
+
+    if (logging) {
+        start = io_clock();
+    }
+    /* What the kernel's MAX_RW_COUNT allows; it also keeps len within
+       the 32-bit sqe.len */
+    if (len > IO_MAX_RW_COUNT) {
+        len = IO_MAX_RW_COUNT;
+    }
+#ifdef CONFIG_IO_URING
+    if (r) {
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = (op == IO_OP_READ || op == IO_OP_PREAD) ?
+            IORING_OP_READ : IORING_OP_WRITE;
+        sqe.fd = fd;
+        sqe.addr = (uintptr_t)buf;
+        sqe.len = len;
+        /* -1 means "at the current file position" */
+        sqe.off = (op == IO_OP_READ || op == IO_OP_WRITE) ? -1 : off;
+        sqe.rw_flags = RWF_NOWAIT;
+        res = io_ring_run(r, &sqe, &syscalls);
+        if (!io_ring_would_block(res)) {
+            if (op == IO_OP_WRITE || op == IO_OP_PWRITE) {
+                io_ring_sigpipe(res, 0);
+            }
+            if (res < 0) {
+                errno = -res;
+                ret = -1;
+            } else {
+                ret = res;
+            }
+            if ((op == IO_OP_WRITE || op == IO_OP_PWRITE) &&
+                ret > 0 && ret < len) {
+                /* A blocking write is not short; finish it the plain way */
+                ssize_t rest = op == IO_OP_WRITE ?
+                    write(fd, buf + ret, len - ret) :
+                    pwrite64(fd, buf + ret, len - ret, off + ret);
+                syscalls++;
+                if (rest > 0) {
+                    ret += rest;
+                }
+            } else if ((op == IO_OP_READ || op == IO_OP_PREAD) &&
+                       ret > 0 && ret < len &&
+                       io_fd_is_regular(fd, &syscalls)) {
+                /* Only part of the file was cached; a blocking read of a
+                   regular file stops short only at end of file */
+                ssize_t rest = op == IO_OP_READ ?
+                    read(fd, buf + ret, len - ret) :
+                    pread64(fd, buf + ret, len - ret, off + ret);
+                syscalls++;
+                if (rest > 0) {
+                    ret += rest;
+                }
+            }
+            ring = 1;
+            goto done;
+        }
+    }
+#endif
+    switch (op) {
+    case IO_OP_READ:
+        ret = read(fd, buf, len);
+        break;
+    case IO_OP_WRITE:
+        ret = write(fd, buf, len);
+        break;
+    case IO_OP_PREAD:
+        ret = pread64(fd, buf, len, off);
+        break;
+    default:
+        ret = pwrite64(fd, buf, len, off);
+        break;
+    }
+    syscalls++;
+#ifdef CONFIG_IO_URING
+ done:
+#endif
+    if (logging) {
+        io_record(op, start, ring, syscalls);
+    }
+    return ret;
+}
+
+static ssize_t uring_msg(int op, int fd, struct msghdr *msg, int flags)
+{
+    int64_t start = 0;
+    int logging = qemu_loglevel_mask(CPU_LOG_EXEC);
+    int syscalls = 0, ring = 0;
+    ssize_t ret;
+#ifdef CONFIG_IO_URING
+    IORing *r = io_ring_get();
+    struct io_uring_sqe sqe;
+    int res;
+#endif
+
+    if (logging) {
+        start = io_clock();
+    }
+#ifdef CONFIG_IO_URING
+    if (r) {
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = op == IO_OP_SENDMSG ?
+            IORING_OP_SENDMSG : IORING_OP_RECVMSG;
+        sqe.fd = fd;
+        sqe.addr = (uintptr_t)msg;
+        sqe.len = 1;
+        sqe.msg_flags = flags | MSG_DONTWAIT;
+        res = io_ring_run(r, &sqe, &syscalls);
+        if (!io_ring_would_block(res) ||
+            ((flags & MSG_DONTWAIT) && res == -EAGAIN)) {
+            if (op == IO_OP_SENDMSG) {
+                io_ring_sigpipe(res, flags);
+            }
+            if (res < 0) {
+                errno = -res;
+                ret = -1;
+            } else {
+                ret = res;
+            }
+            if (op == IO_OP_SENDMSG && ret > 0 && !(flags & MSG_DONTWAIT)) {
+                ret += io_sendmsg_rest(fd, msg, flags, ret, &syscalls);
+            }
+            ring = 1;
+            goto done;
+        }
+    }
+#endif
+    if (op == IO_OP_SENDMSG) {
+        ret = sendmsg(fd, msg, flags);
+    } else {
+        ret = recvmsg(fd, msg, flags);
+    }
+    syscalls++;
+#ifdef CONFIG_IO_URING
+ done:
+#endif
+    if (logging) {
+        io_record(op, start, ring, syscalls);
+    }
+    return ret;
+}
+
+ssize_t uring_read(int fd, void *buf, size_t len)
+{
+    return uring_rw(IO_OP_READ, fd, buf, len, 0);
+}
+
+ssize_t uring_write(int fd, const void *buf, size_t len)
+{
+    return uring_rw(IO_OP_WRITE, fd, (void *)buf, len, 0);
+}
+
+ssize_t uring_pread64(int fd, void *buf, size_t len, off64_t off)
+{
+    return uring_rw(IO_OP_PREAD, fd, buf, len, off);
+}
+
+ssize_t uring_pwrite64(int fd, const void *buf, size_t len, off64_t off)
+{
+    return uring_rw(IO_OP_PWRITE, fd, (void *)buf, len, off);
+}
+
+ssize_t uring_sendmsg(int fd, struct msghdr *msg, int flags)
+{
+    return uring_msg(IO_OP_SENDMSG, fd, msg, flags);
+}
+
+ssize_t uring_recvmsg(int fd, struct msghdr *msg, int flags)
+{
+    return uring_msg(IO_OP_RECVMSG, fd, msg, flags);
+}
+
+void dump_io_info(FILE *f, int (*cpu_fprintf)(FILE *f, const char *fmt, ...))
+{
+    IOOpStats *s;
+    int op, b;
+
+    cpu_fprintf(f, "I/O syscalls (io_uring %s)\n",
+                use_io_uring ? "on" : "off");
+    for (op = 0; op < IO_OP_NB; op++) {
+        s = &io_stats[op];
+        if (!s->count) {
+            continue;
+        }
+        cpu_fprintf(f, "  %-8s %" PRIu64 " calls, %" PRIu64 " via ring, %"
+                    PRIu64 " host syscalls, avg %" PRIu64 " ns\n",
+                    io_op_names[op], s->count, s->ring, s->host_syscalls,
+                    s->total_ns / s->count);
+        for (b = 0; b < IO_HIST_BUCKETS; b++) {
+            if (s->hist[b]) {
+                cpu_fprintf(f, "    >= %10" PRIu64 " ns %" PRIu64 "\n",
+                            (uint64_t)1 << b, s->hist[b]);
+            }
+        }
+    }
+}
@@ -0,0 +1,556 @@
+/*
+ *  Guest vDSO for the x86 linux-user targets
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "qemu.h"
+#include "qemu-timer.h"
+#include "qemu-barrier.h"
+#include "elf.h"
+
+/* The vDSO gives the guest clock_gettime(), gettimeofday() and time()
+   without a trip through do_syscall().  The image is one page of
+   hand-assembled code that reads a time page qemu keeps up to date:
+
+     ns = page->ns[clock] + (((rdtsc - page->tsc_base) * page->mult) >> 32)
+
+   Guest rdtsc is the host TSC, so this only works when the host kernel
+   itself trusts the TSC as its clocksource.  The page is refreshed by
+   the syscall fallbacks: whenever the guest cannot use it (clock other
+   than CLOCK_REALTIME/CLOCK_MONOTONIC, page not calibrated yet, TSC
+   delta beyond the window, writer active) the vDSO issues the real
+   syscall, and do_syscall() calls vdso_sync_time() on the way out.  */
+
+#if defined(__i386__) || defined(__x86_64__)
+
+struct vdso_time_page {
+    uint32_t seq;               /* odd while qemu is updating the page */
+    uint32_t valid;
+    uint64_t tsc_base;
+    uint64_t window;            /* extrapolate at most this many ticks */
+    uint64_t ns[2];             /* CLOCK_REALTIME, CLOCK_MONOTONIC */
+    uint32_t mult;              /* ns per tick, 32.32 fixed point */
+    uint32_t pad;
+};
+
+/* Shortest calibration baseline we trust, when to restart calibration,
+   and the longest window the guest may extrapolate over.  */
+#define VDSO_CALIB_MIN_NS       10000000LL
+#define VDSO_CALIB_MAX_NS       60000000000LL
+#define VDSO_WINDOW_NS          1000000000LL
+
+#ifdef TARGET_X86_64
+#define VDSO_MACHINE    EM_X86_64
+typedef Elf64_Ehdr vdso_ehdr;
+typedef Elf64_Phdr vdso_phdr;
+typedef Elf64_Sym vdso_sym;
+typedef Elf64_Dyn vdso_dyn;
+typedef uint64_t vdso_addr;
+
+/* Assembled from x86_64 code; the data slot holding the address of the
+   time page sits right in front of it.  read returns the nanoseconds
+   of clock %edi in %rax, or -1 if the guest must make the syscall.  */
+static const uint8_t vdso_code[] = {
+    /* read: */
+    0x4c, 0x8b, 0x05, 0xf1, 0xff, 0xff, 0xff,  /*   0: mov data(%rip),%r8 */
+    0x45, 0x8b, 0x08,                          /*   7: mov (%r8),%r9d */
+    0x41, 0xf7, 0xc1, 0x01, 0x00, 0x00, 0x00,  /*   a: test $0x1,%r9d */
+    0x75, 0x31,                                /*  11: jne 44 */
+    0x41, 0x83, 0x78, 0x04, 0x00,              /*  13: cmpl $0x0,0x4(%r8) */
+    0x74, 0x2a,                                /*  18: je 44 */
+    0x0f, 0x31,                                /*  1a: rdtsc */
+    0x48, 0xc1, 0xe2, 0x20,                    /*  1c: shl $0x20,%rdx */
+    0x48, 0x09, 0xd0,                          /*  20: or %rdx,%rax */
+    0x49, 0x2b, 0x40, 0x08,                    /*  23: sub 0x8(%r8),%rax */
+    0x49, 0x3b, 0x40, 0x10,                    /*  27: cmp 0x10(%r8),%rax */
+    0x73, 0x17,                                /*  2b: jae 44 */
+    0x41, 0x8b, 0x48, 0x28,                    /*  2d: mov 0x28(%r8),%ecx */
+    0x48, 0x0f, 0xaf, 0xc1,                    /*  31: imul %rcx,%rax */
+    0x48, 0xc1, 0xe8, 0x20,                    /*  35: shr $0x20,%rax */
+    0x49, 0x03, 0x44, 0xf8, 0x18,              /*  39: add 0x18(%r8,%rdi,8),%rax */
+    0x45, 0x3b, 0x08,                          /*  3e: cmp (%r8),%r9d */
+    0x75, 0xc4,                                /*  41: jne 7 */
+    0xc3,                                      /*  43: ret */
+    0x48, 0xc7, 0xc0, 0xff, 0xff, 0xff, 0xff,  /*  44: mov $0xffffffffffffffff,%rax */
+    0xc3,                                      /*  4b: ret */
+    /* clock_gettime: */
+    0x83, 0xff, 0x01,                          /*  4c: cmp $0x1,%edi */
+    0x77, 0x21,                                /*  4f: ja 72 */
+    0x89, 0xff,                                /*  51: mov %edi,%edi */
+    0xe8, 0xa8, 0xff, 0xff, 0xff,              /*  53: call read */
+    0x48, 0x83, 0xf8, 0xff,                    /*  58: cmp $0xffffffffffffffff,%rax */
+    0x74, 0x14,                                /*  5c: je 72 */
+    0x31, 0xd2,                                /*  5e: xor %edx,%edx */
+    0xb9, 0x00, 0xca, 0x9a, 0x3b,              /*  60: mov $0x3b9aca00,%ecx */
+    0x48, 0xf7, 0xf1,                          /*  65: div %rcx */
+    0x48, 0x89, 0x06,                          /*  68: mov %rax,(%rsi) */
+    0x48, 0x89, 0x56, 0x08,                    /*  6b: mov %rdx,0x8(%rsi) */
+    0x31, 0xc0,                                /*  6f: xor %eax,%eax */
+    0xc3,                                      /*  71: ret */
+    0xb8, 0xe4, 0x00, 0x00, 0x00,              /*  72: mov $0xe4,%eax */
+    0x0f, 0x05,                                /*  77: syscall */
+    0xc3,                                      /*  79: ret */
+    /* gettimeofday: */
+    0x48, 0x85, 0xf6,                          /*  7a: test %rsi,%rsi */
+    0x75, 0x39,                                /*  7d: jne b8 */
+    0x48, 0x85, 0xff,                          /*  7f: test %rdi,%rdi */
+    0x74, 0x34,                                /*  82: je b8 */
+    0x49, 0x89, 0xfa,                          /*  84: mov %rdi,%r10 */
+    0x31, 0xff,                                /*  87: xor %edi,%edi */
+    0xe8, 0x72, 0xff, 0xff, 0xff,              /*  89: call read */
+    0x4c, 0x89, 0xd7,                          /*  8e: mov %r10,%rdi */
+    0x48, 0x83, 0xf8, 0xff,                    /*  91: cmp $0xffffffffffffffff,%rax */
+    0x74, 0x21,                                /*  95: je b8 */
+    0x31, 0xd2,                                /*  97: xor %edx,%edx */
+    0xb9, 0x00, 0xca, 0x9a, 0x3b,              /*  99: mov $0x3b9aca00,%ecx */
+    0x48, 0xf7, 0xf1,                          /*  9e: div %rcx */
+    0x48, 0x89, 0x07,                          /*  a1: mov %rax,(%rdi) */
+    0x48, 0x89, 0xd0,                          /*  a4: mov %rdx,%rax */
+    0x31, 0xd2,                                /*  a7: xor %edx,%edx */
+    0xb9, 0xe8, 0x03, 0x00, 0x00,              /*  a9: mov $0x3e8,%ecx */
+    0x48, 0xf7, 0xf1,                          /*  ae: div %rcx */
+    0x48, 0x89, 0x47, 0x08,                    /*  b1: mov %rax,0x8(%rdi) */
+    0x31, 0xc0,                                /*  b5: xor %eax,%eax */
+    0xc3,                                      /*  b7: ret */
+    0xb8, 0x60, 0x00, 0x00, 0x00,              /*  b8: mov $0x60,%eax */
+    0x0f, 0x05,                                /*  bd: syscall */
+    0xc3,                                      /*  bf: ret */
+    /* time: */
+    0x49, 0x89, 0xfa,                          /*  c0: mov %rdi,%r10 */
+    0x31, 0xff,                                /*  c3: xor %edi,%edi */
+    0xe8, 0x36, 0xff, 0xff, 0xff,              /*  c5: call read */
+    0x4c, 0x89, 0xd7,                          /*  ca: mov %r10,%rdi */
+    0x48, 0x83, 0xf8, 0xff,                    /*  cd: cmp $0xffffffffffffffff,%rax */
+    0x74, 0x13,                                /*  d1: je e6 */
+    0x31, 0xd2,                                /*  d3: xor %edx,%edx */
+    0xb9, 0x00, 0xca, 0x9a, 0x3b,              /*  d5: mov $0x3b9aca00,%ecx */
+    0x48, 0xf7, 0xf1,                          /*  da: div %rcx */
+    0x48, 0x85, 0xff,                          /*  dd: test %rdi,%rdi */
+    0x74, 0x03,                                /*  e0: je e5 */
+    0x48, 0x89, 0x07,                          /*  e2: mov %rax,(%rdi) */
+    0xc3,                                      /*  e5: ret */
+    0xb8, 0xc9, 0x00, 0x00, 0x00,              /*  e6: mov $0xc9,%eax */
+    0x0f, 0x05,                                /*  eb: syscall */
+    0xc3,                                      /*  ed: ret */
+};
+enum {
+    VDSO_CLOCK_GETTIME = 0x4c,
+    VDSO_GETTIMEOFDAY = 0x7a,
+    VDSO_TIME = 0xc0,
+};
+#else
+#define VDSO_MACHINE    EM_386
+typedef Elf32_Ehdr vdso_ehdr;
+typedef Elf32_Phdr vdso_phdr;
+typedef Elf32_Sym vdso_sym;
+typedef Elf32_Dyn vdso_dyn;
+typedef uint32_t vdso_addr;
+
+/* Assembled from i386 code; the data slot holding the address of the
+   time page sits right in front of it.  read returns the nanoseconds
+   of clock %ecx in %edx:%eax, or -1 in %edx if the guest must make the
+   syscall; it clobbers %esi and %edi, which its callers save.  */
+static const uint8_t vdso_code[] = {
+    /* read: */
+    0xe8, 0x00, 0x00, 0x00, 0x00,              /*   0: call 5 */
+    0x5e,                                      /*   5: pop %esi */
+    0x8b, 0x76, 0xf7,                          /*   6: mov data-5(%esi),%esi */
+    0x8b, 0x3e,                                /*   9: mov (%esi),%edi */
+    0xf7, 0xc7, 0x01, 0x00, 0x00, 0x00,        /*   b: test $0x1,%edi */
+    0x75, 0x29,                                /*  11: jne 3c */
+    0x83, 0x7e, 0x04, 0x00,                    /*  13: cmpl $0x0,0x4(%esi) */
+    0x74, 0x23,                                /*  17: je 3c */
+    0x0f, 0x31,                                /*  19: rdtsc */
+    0x2b, 0x46, 0x08,                          /*  1b: sub 0x8(%esi),%eax */
+    0x1b, 0x56, 0x0c,                          /*  1e: sbb 0xc(%esi),%edx */
+    0x75, 0x19,                                /*  21: jne 3c */
+    0x3b, 0x46, 0x10,                          /*  23: cmp 0x10(%esi),%eax */
+    0x73, 0x14,                                /*  26: jae 3c */
+    0xf7, 0x66, 0x28,                          /*  28: mull 0x28(%esi) */
+    0x89, 0xd0,                                /*  2b: mov %edx,%eax */
+    0x31, 0xd2,                                /*  2d: xor %edx,%edx */
+    0x03, 0x44, 0xce, 0x18,                    /*  2f: add 0x18(%esi,%ecx,8),%eax */
+    0x13, 0x54, 0xce, 0x1c,                    /*  33: adc 0x1c(%esi,%ecx,8),%edx */
+    0x3b, 0x3e,                                /*  37: cmp (%esi),%edi */
+    0x75, 0xce,                                /*  39: jne 9 */
+    0xc3,                                      /*  3b: ret */
+    0xba, 0xff, 0xff, 0xff, 0xff,              /*  3c: mov $0xffffffff,%edx */
+    0xc3,                                      /*  41: ret */
+    /* clock_gettime: */
+    0x56,                                      /*  42: push %esi */
+    0x57,                                      /*  43: push %edi */
+    0x8b, 0x4c, 0x24, 0x0c,                    /*  44: mov 0xc(%esp),%ecx */
+    0x83, 0xf9, 0x01,                          /*  48: cmp $0x1,%ecx */
+    0x77, 0x1f,                                /*  4b: ja 6c */
+    0xe8, 0xae, 0xff, 0xff, 0xff,              /*  4d: call read */
+    0x83, 0xfa, 0xff,                          /*  52: cmp $0xffffffff,%edx */
+    0x74, 0x15,                                /*  55: je 6c */
+    0xb9, 0x00, 0xca, 0x9a, 0x3b,              /*  57: mov $0x3b9aca00,%ecx */
+    0xf7, 0xf1,                                /*  5c: div %ecx */
+    0x8b, 0x4c, 0x24, 0x10,                    /*  5e: mov 0x10(%esp),%ecx */
+    0x89, 0x01,                                /*  62: mov %eax,(%ecx) */
+    0x89, 0x51, 0x04,                          /*  64: mov %edx,0x4(%ecx) */
+    0x31, 0xc0,                                /*  67: xor %eax,%eax */
+    0x5f,                                      /*  69: pop %edi */
+    0x5e,                                      /*  6a: pop %esi */
+    0xc3,                                      /*  6b: ret */
+    0x5f,                                      /*  6c: pop %edi */
+    0x5e,                                      /*  6d: pop %esi */
+    0x53,                                      /*  6e: push %ebx */
+    0x8b, 0x5c, 0x24, 0x08,                    /*  6f: mov 0x8(%esp),%ebx */
+    0x8b, 0x4c, 0x24, 0x0c,                    /*  73: mov 0xc(%esp),%ecx */
+    0xb8, 0x09, 0x01, 0x00, 0x00,              /*  77: mov $0x109,%eax */
+    0xcd, 0x80,                                /*  7c: int $0x80 */
+    0x5b,                                      /*  7e: pop %ebx */
+    0xc3,                                      /*  7f: ret */
+    /* gettimeofday: */
+    0x56,                                      /*  80: push %esi */
+    0x57,                                      /*  81: push %edi */
+    0x83, 0x7c, 0x24, 0x10, 0x00,              /*  82: cmpl $0x0,0x10(%esp) */
+    0x75, 0x33,                                /*  87: jne bc */
+    0x83, 0x7c, 0x24, 0x0c, 0x00,              /*  89: cmpl $0x0,0xc(%esp) */
+    0x74, 0x2c,                                /*  8e: je bc */
+    0x31, 0xc9,                                /*  90: xor %ecx,%ecx */
+    0xe8, 0x69, 0xff, 0xff, 0xff,              /*  92: call read */
+    0x83, 0xfa, 0xff,                          /*  97: cmp $0xffffffff,%edx */
+    0x74, 0x20,                                /*  9a: je bc */
+    0xb9, 0x00, 0xca, 0x9a, 0x3b,              /*  9c: mov $0x3b9aca00,%ecx */
+    0xf7, 0xf1,                                /*  a1: div %ecx */
+    0x8b, 0x4c, 0x24, 0x0c,                    /*  a3: mov 0xc(%esp),%ecx */
+    0x89, 0x01,                                /*  a7: mov %eax,(%ecx) */
+    0x89, 0xd0,                                /*  a9: mov %edx,%eax */
+    0x31, 0xd2,                                /*  ab: xor %edx,%edx */
+    0xbe, 0xe8, 0x03, 0x00, 0x00,              /*  ad: mov $0x3e8,%esi */
+    0xf7, 0xf6,                                /*  b2: div %esi */
+    0x89, 0x41, 0x04,                          /*  b4: mov %eax,0x4(%ecx) */
+    0x31, 0xc0,                                /*  b7: xor %eax,%eax */
+    0x5f,                                      /*  b9: pop %edi */
+    0x5e,                                      /*  ba: pop %esi */
+    0xc3,                                      /*  bb: ret */
+    0x5f,                                      /*  bc: pop %edi */
+    0x5e,                                      /*  bd: pop %esi */
+    0x53,                                      /*  be: push %ebx */
+    0x8b, 0x5c, 0x24, 0x08,                    /*  bf: mov 0x8(%esp),%ebx */
+    0x8b, 0x4c, 0x24, 0x0c,                    /*  c3: mov 0xc(%esp),%ecx */
+    0xb8, 0x4e, 0x00, 0x00, 0x00,              /*  c7: mov $0x4e,%eax */
+    0xcd, 0x80,                                /*  cc: int $0x80 */
+    0x5b,                                      /*  ce: pop %ebx */
+    0xc3,                                      /*  cf: ret */
+    /* time: */
+    0x56,                                      /*  d0: push %esi */
+    0x57,                                      /*  d1: push %edi */
+    0x31, 0xc9,                                /*  d2: xor %ecx,%ecx */
+    0xe8, 0x27, 0xff, 0xff, 0xff,              /*  d4: call read */
+    0x83, 0xfa, 0xff,                          /*  d9: cmp $0xffffffff,%edx */
+    0x74, 0x14,                                /*  dc: je f2 */
+    0xb9, 0x00, 0xca, 0x9a, 0x3b,              /*  de: mov $0x3b9aca00,%ecx */
+    0xf7, 0xf1,                                /*  e3: div %ecx */
+    0x8b, 0x4c, 0x24, 0x0c,                    /*  e5: mov 0xc(%esp),%ecx */
+    0x85, 0xc9,                                /*  e9: test %ecx,%ecx */
+    0x74, 0x02,                                /*  eb: je ef */
+    0x89, 0x01,                                /*  ed: mov %eax,(%ecx) */
+    0x5f,                                      /*  ef: pop %edi */
+    0x5e,                                      /*  f0: pop %esi */
+    0xc3,                                      /*  f1: ret */
+    0x5f,                                      /*  f2: pop %edi */
+    0x5e,                                      /*  f3: pop %esi */
+    0x53,                                      /*  f4: push %ebx */
+    0x8b, 0x5c, 0x24, 0x08,                    /*  f5: mov 0x8(%esp),%ebx */
+    0xb8, 0x0d, 0x00, 0x00, 0x00,              /*  f9: mov $0xd,%eax */
+    0xcd, 0x80,                                /*  fe: int $0x80 */
+    0x5b,                                      /* 100: pop %ebx */
+    0xc3,                                      /* 101: ret */
+};
+enum {
+    VDSO_CLOCK_GETTIME = 0x42,
+    VDSO_GETTIMEOFDAY = 0x80,
+    VDSO_TIME = 0xd0,
+};
+#endif
+
+static const struct {
+    const char *name;
+    int bind;
+    unsigned int offset;
+} vdso_syms[] = {
+    { "__vdso_clock_gettime", STB_GLOBAL, VDSO_CLOCK_GETTIME },
+    { "clock_gettime", STB_WEAK, VDSO_CLOCK_GETTIME },
+    { "__vdso_gettimeofday", STB_GLOBAL, VDSO_GETTIMEOFDAY },
+    { "gettimeofday", STB_WEAK, VDSO_GETTIMEOFDAY },
+    { "__vdso_time", STB_GLOBAL, VDSO_TIME },
+    { "time", STB_WEAK, VDSO_TIME },
+};
+
+#define VDSO_NSYMS      (ARRAY_SIZE(vdso_syms) + 1)
+#define VDSO_SONAME     "linux-vdso.so.1"
+
+static struct vdso_time_page *vdso_page;
+static pthread_mutex_t vdso_lock = PTHREAD_MUTEX_INITIALIZER;
+static int64_t vdso_calib_tsc;
+static int64_t vdso_calib_ns;
+static uint32_t vdso_mult;
+static uint64_t vdso_window;
+
+static int vdso_host_ok(void)
+{
+    char buf[32];
+    FILE *f;
+    int ok;
+
+    f = fopen("/sys/devices/system/clocksource/clocksource0/"
+              "current_clocksource", "r");
+    if (!f) {
+        return 0;
+    }
+    ok = fgets(buf, sizeof(buf), f) && !strcmp(buf, "tsc\n");
+    fclose(f);
+    return ok;
+}
+
+/* Lay out a minimal ET_DYN image linked at 0: headers, DT_HASH with a
+   single bucket, the dynamic symbol and string tables, the dynamic
+   section, then the data slot and the code.  Returns its size.  */
+static size_t vdso_build_image(uint8_t *img, abi_ulong data_addr)
+{
+    vdso_ehdr *ehdr = (vdso_ehdr *)img;
+    vdso_phdr *phdr = (vdso_phdr *)(ehdr + 1);
+    uint32_t *hash = (uint32_t *)(phdr + 2);
+    vdso_sym *sym = (vdso_sym *)(hash + 2 + 1 + VDSO_NSYMS);
+    char *strtab = (char *)(sym + VDSO_NSYMS);
+    char *s = strtab;
+    vdso_dyn *dyn;
+    size_t code, size;
+    int i;
+
+    /* Symbol and string tables; every symbol chains to the one before
+       it, so lookups walk the whole (short) list.  */
+    *s++ = 0;
+    strcpy(s, VDSO_SONAME);
+    s += sizeof(VDSO_SONAME);
+    hash[0] = 1;
+    hash[1] = VDSO_NSYMS;
+    hash[2] = VDSO_NSYMS - 1;
+    hash[3] = 0;
+    for (i = 1; i < VDSO_NSYMS; i++) {
+        hash[3 + i] = i - 1;
+        sym[i].st_name = s - strtab;
+        sym[i].st_info = (vdso_syms[i - 1].bind << 4) | STT_FUNC;
+        sym[i].st_shndx = 1;
+        strcpy(s, vdso_syms[i - 1].name);
+        s += strlen(s) + 1;
+    }
+
+    dyn = (vdso_dyn *)(((uintptr_t)s + 7) & ~(uintptr_t)7);
+    dyn[0].d_tag = DT_HASH;
+    dyn[0].d_un.d_ptr = (uint8_t *)hash - img;
+    dyn[1].d_tag = DT_STRTAB;
+    dyn[1].d_un.d_ptr = (uint8_t *)strtab - img;
+    dyn[2].d_tag = DT_SYMTAB;
+    dyn[2].d_un.d_ptr = (uint8_t *)sym - img;
+    dyn[3].d_tag = DT_STRSZ;
+    dyn[3].d_un.d_val = s - strtab;
+    dyn[4].d_tag = DT_SYMENT;
+    dyn[4].d_un.d_val = sizeof(vdso_sym);
+    dyn[5].d_tag = DT_SONAME;
+    dyn[5].d_un.d_val = 1;
+    dyn[6].d_tag = DT_NULL;
+
+    code = ((uint8_t *)&dyn[7] - img + 15) & ~15;
+    *(vdso_addr *)(img + code) = data_addr;
+    code += sizeof(vdso_addr);
+    memcpy(img + code, vdso_code, sizeof(vdso_code));
+    size = code + sizeof(vdso_code);
+    for (i = 1; i < VDSO_NSYMS; i++) {
+        sym[i].st_value = code + vdso_syms[i - 1].offset;
+    }
+
+    memcpy(ehdr->e_ident, ELFMAG, SELFMAG);
+    ehdr->e_ident[EI_CLASS] = sizeof(vdso_addr) == 8 ? ELFCLASS64
+                                                     : ELFCLASS32;
+    ehdr->e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr->e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr->e_type = ET_DYN;
+    ehdr->e_machine = VDSO_MACHINE;
+    ehdr->e_version = EV_CURRENT;
+    ehdr->e_phoff = sizeof(*ehdr);
+    ehdr->e_ehsize = sizeof(*ehdr);
+    ehdr->e_phentsize = sizeof(*phdr);
+    ehdr->e_phnum = 2;
+
+    phdr[0].p_type = PT_LOAD;
+    phdr[0].p_flags = PF_R | PF_X;
+    phdr[0].p_filesz = phdr[0].p_memsz = size;
+    phdr[0].p_align = TARGET_PAGE_SIZE;
+    phdr[1].p_type = PT_DYNAMIC;
+    phdr[1].p_flags = PF_R;
+    phdr[1].p_offset = phdr[1].p_vaddr = (uint8_t *)dyn - img;
+    phdr[1].p_filesz = phdr[1].p_memsz = 7 * sizeof(vdso_dyn);
+    phdr[1].p_align = sizeof(vdso_addr);
+
+    return size;
+}
+
+/* Map the vDSO image and its time page into the guest.  Returns the
+   address of the image, or 0 if the host cannot support it.  */
+abi_ulong vdso_setup(void)
+{
+    abi_long base;
+    abi_ulong data;
+    uint8_t *p;
+    size_t size;
+
+    if (!vdso_host_ok()) {
+        return 0;
+    }
+    base = target_mmap(0, 2 * qemu_host_page_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == -1) {
+        return 0;
+    }
+    data = base + qemu_host_page_size;
+
+    p = lock_user(VERIFY_WRITE, base, TARGET_PAGE_SIZE, 0);
+    size = vdso_build_image(p, data);
+    unlock_user(p, base, TARGET_PAGE_SIZE);
+    assert(size <= TARGET_PAGE_SIZE);
+    target_mprotect(base, qemu_host_page_size, PROT_READ | PROT_EXEC);
+
+    /* The guest may only read the time page; qemu keeps writing it
+       through the host mapping.  */
+    target_mprotect(data, qemu_host_page_size, PROT_READ);
+    vdso_page = g2h(data);
+    if (mprotect(vdso_page, qemu_host_page_size, PROT_READ | PROT_WRITE)) {
+        vdso_page = NULL;
+    }
+    return base;
+}
+
+static inline int64_t timespec_to_ns(const struct timespec *ts)
+{
+    return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+/* Refresh the time page after the guest fell back to a time syscall.
+   If ts holds the host reading of clk just returned by that syscall,
+   it is replaced with the time page's own view so the guest never sees
+   CLOCK_MONOTONIC go backwards between the vDSO and the syscall.  */
+void vdso_sync_time(int clk, struct timespec *ts)
+{
+    struct vdso_time_page *d = vdso_page;
+    struct timespec mono_ts, real_ts[2];
+    int64_t tsc, mono, real, ahead, delta;
+    uint32_t mult;
+
+    /* Another thread is already refreshing the page.  */
+    if (!d || pthread_mutex_trylock(&vdso_lock)) {
+        return;
+    }
+    /* Bracket the monotonic reading with two realtime ones so that the
+       offset between the two clocks does not jitter from one refresh
+       to the next.  */
+    tsc = cpu_get_real_ticks();
+    clock_gettime(CLOCK_REALTIME, &real_ts[0]);
+    clock_gettime(CLOCK_MONOTONIC, &mono_ts);
+    clock_gettime(CLOCK_REALTIME, &real_ts[1]);
+    mono = timespec_to_ns(&mono_ts);
+    real = timespec_to_ns(&real_ts[0]) / 2 + timespec_to_ns(&real_ts[1]) / 2;
+
+    if (!vdso_calib_tsc) {
+        vdso_calib_tsc = tsc;
+        vdso_calib_ns = mono;
+        goto out;
+    }
+    if (mono - vdso_calib_ns >= VDSO_CALIB_MIN_NS) {
+        double m = (double)(mono - vdso_calib_ns) * 4294967296.0
+                   / (tsc - vdso_calib_tsc);
+
+        if (tsc <= vdso_calib_tsc || !(m >= 1.0 && m < 4294967296.0)) {
+            /* TSC below 1GHz or not moving forward: syscalls only.  */
+            d->seq++;
+            smp_wmb();
+            d->valid = 0;
+            smp_wmb();
+            d->seq++;
+            vdso_page = NULL;
+            goto out;
+        }
+        vdso_mult = m;
+        vdso_window = (uint64_t)(VDSO_WINDOW_NS * 4294967296.0 / m);
+        vdso_window = MIN(vdso_window, tsc - vdso_calib_tsc);
+        vdso_window = MIN(vdso_window, UINT32_MAX);
+        if (mono - vdso_calib_ns >= VDSO_CALIB_MAX_NS) {
+            vdso_calib_tsc = tsc;
+            vdso_calib_ns = mono;
+        }
+    }
+    if (!vdso_mult) {
+        goto out;
+    }
+
+    /* The guest may already have read a time up to the end of the old
+       window.  Start the new one no earlier than that, and run slow
+       over it until the host clock catches up.  */
+    ahead = 0;
+    mult = vdso_mult;
+    if (d->valid) {
+        delta = tsc - d->tsc_base;
+        delta = MAX(delta, 0);
+        delta = MIN(delta, (int64_t)d->window - 1);
+        ahead = d->ns[CLOCK_MONOTONIC] + ((delta * d->mult) >> 32) - mono;
+        if (ahead > 0) {
+            uint64_t slew = ahead * 4294967296.0 / vdso_window;
+            mult = slew < mult / 2 ? mult - slew : mult / 2;
+        } else {
+            ahead = 0;
+        }
+    }
+
+    d->seq++;
+    smp_wmb();
+    d->tsc_base = tsc;
+    d->window = vdso_window;
+    d->ns[CLOCK_REALTIME] = real + ahead;
+    d->ns[CLOCK_MONOTONIC] = mono + ahead;
+    d->mult = mult;
+    d->valid = 1;
+    smp_wmb();
+    d->seq++;
+
+    if (ts && (clk == CLOCK_REALTIME || clk == CLOCK_MONOTONIC)) {
+        ts->tv_sec = d->ns[clk] / 1000000000;
+        ts->tv_nsec = d->ns[clk] % 1000000000;
+    }
+out:
+    pthread_mutex_unlock(&vdso_lock);
+}
+
+#else
+
+abi_ulong vdso_setup(void)
+{
+    return 0;
+}
+
+void vdso_sync_time(int clk, struct timespec *ts)
+{
+}
+
+#endif
@@ -40,7 +40,6 @@ struct qemu_paiocb {
     int aio_niov;
     size_t aio_nbytes;
 #define aio_ioctl_cmd   aio_nbytes /* for QEMU_AIO_IOCTL */
-    int ev_signo;
     off_t aio_offset;
 
     QTAILQ_ENTRY(qemu_paiocb) node;
@@ -48,15 +47,21 @@ struct qemu_paiocb {
     ssize_t ret;
     int active;
     struct qemu_paiocb *next;
+    struct qemu_paiocb *merge_next; /* adjacent request done in one go */
+    int merged;
+    int64_t submit_ns;
 
     int async_context_id;
 };
 
 typedef struct PosixAioState {
     int rfd, wfd;
+    int notified;       /* a completion has been posted to wfd */
     struct qemu_paiocb *first_aio;
 } PosixAioState;
 
+/* upper limit for the number of requests done in one preadv/pwritev */
+#define MAX_MERGE_REQS 32
 
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
@@ -65,7 +70,11 @@ static pthread_attr_t attr;
 static int max_threads = 64;
 static int cur_threads = 0;
 static int idle_threads = 0;
+static int new_threads = 0;     /* threads that still need to be created */
+static int pending_threads = 0; /* threads created, but not running yet */
+static int queued_requests = 0;
 static QTAILQ_HEAD(, qemu_paiocb) request_list;
+static PosixAioState *posix_aio_state;
 
 #ifdef CONFIG_PREADV
 static int preadv_present = 1;
@@ -300,11 +309,138 @@ static ssize_t handle_aiocb_rw(struct qemu_paiocb *aiocb)
     return nbytes;
 }
 
-static void *aio_thread(void *unused)
+/*
+ * Does a request and the requests merged into it with a single
+ * preadv/pwritev. If that doesn't transfer everything, the requests are done
+ * one by one instead. The results of the merged requests are set here, the
+ * result of aiocb itself is returned.
+ */
+static ssize_t handle_aiocb_rw_merged(struct qemu_paiocb *aiocb)
 {
-    pid_t pid;
+    struct qemu_paiocb *acb;
+    struct iovec *iov;
+    size_t nbytes = 0;
+    ssize_t len;
+    int niov = 0;
+
+    for (acb = aiocb; acb; acb = acb->merge_next) {
+        niov += acb->aio_niov;
+    }
+    iov = qemu_malloc(niov * sizeof(*iov));
+
+    niov = 0;
+    for (acb = aiocb; acb; acb = acb->merge_next) {
+        memcpy(iov + niov, acb->aio_iov, acb->aio_niov * sizeof(*iov));
+        niov += acb->aio_niov;
+        nbytes += acb->aio_nbytes;
+    }
+
+    do {
+        if (aiocb->aio_type & QEMU_AIO_WRITE) {
+            len = qemu_pwritev(aiocb->aio_fildes, iov, niov,
+                               aiocb->aio_offset);
+        } else {
+            len = qemu_preadv(aiocb->aio_fildes, iov, niov,
+                              aiocb->aio_offset);
+        }
+    } while (len == -1 && errno == EINTR);
+
+    qemu_free(iov);
+
+    if (len != nbytes) {
+        for (acb = aiocb->merge_next; acb; acb = acb->merge_next) {
+            len = handle_aiocb_rw(acb);
+            mutex_lock(&lock);
+            acb->ret = len;
+            mutex_unlock(&lock);
+        }
+        return handle_aiocb_rw(aiocb);
+    }
+
+    mutex_lock(&lock);
+    for (acb = aiocb->merge_next; acb; acb = acb->merge_next) {
+        acb->ret = acb->aio_nbytes;
+    }
+    mutex_unlock(&lock);
+
+    return aiocb->aio_nbytes;
+}
+
+/*
+ * Takes the requests following aiocb in the queue that continue it on disk,
+ * so that all of them can be done with one system call.
+ */
+static void merge_requests(struct qemu_paiocb *aiocb)
+{
+    struct qemu_paiocb *last = aiocb, *next;
+    int niov = aiocb->aio_niov;
+    int n = 1;
+
+    aiocb->merge_next = NULL;
+    if (!preadv_present || !(aiocb->aio_type & (QEMU_AIO_READ|QEMU_AIO_WRITE))
+        || (aiocb->aio_type & QEMU_AIO_MISALIGNED)) {
+        return;
+    }
+
+    while ((next = QTAILQ_FIRST(&request_list)) != NULL &&
+           n < MAX_MERGE_REQS &&
+           next->aio_type == aiocb->aio_type &&
+           next->aio_fildes == aiocb->aio_fildes &&
+           next->aio_offset == last->aio_offset + last->aio_nbytes &&
+           niov + next->aio_niov <= IOV_MAX) {
+        QTAILQ_REMOVE(&request_list, next, node);
+        queued_requests--;
+        next->active = 1;
+        next->merged = 1;
+        next->merge_next = NULL;
+        last->merge_next = next;
+        last = next;
+        niov += next->aio_niov;
+        n++;
+    }
+}
+
+/*
+ * Wakes up the main loop for completed requests. Only the first completion
+ * after the main loop has looked at the queue needs to write the eventfd.
+ */
+static void posix_aio_notify(void)
+{
+    PosixAioState *s = posix_aio_state;
+    static const uint64_t val = 1;
+    int notify;
+    ssize_t ret;
+
+    mutex_lock(&lock);
+    notify = !s->notified;
+    s->notified = 1;
+    mutex_unlock(&lock);
 
-    pid = getpid();
+    if (!notify) {
+        return;
+    }
+
+    do {
+        ret = write(s->wfd, &val, sizeof(val));
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0 && errno != EAGAIN) {
+        die("write()");
+    }
+
+#ifndef CONFIG_IOTHREAD
+    /* the main loop may be busy running guest code, kick it out */
+    if (kill(getpid(), SIGUSR2)) die("kill failed");
+#endif
+}
+
+static void do_spawn_thread(void);
+
+static void *aio_thread(void *unused)
+{
+    mutex_lock(&lock);
+    pending_threads--;
+    do_spawn_thread();
+    mutex_unlock(&lock);
 
     while (1) {
         struct qemu_paiocb *aiocb;
@@ -328,14 +464,20 @@ static void *aio_thread(void *unused)
 
         aiocb = QTAILQ_FIRST(&request_list);
         QTAILQ_REMOVE(&request_list, aiocb, node);
+        queued_requests--;
         aiocb->active = 1;
+        merge_requests(aiocb);
         idle_threads--;
         mutex_unlock(&lock);
 
         switch (aiocb->aio_type & QEMU_AIO_TYPE_MASK) {
         case QEMU_AIO_READ:
         case QEMU_AIO_WRITE:
-            ret = handle_aiocb_rw(aiocb);
+            if (aiocb->merge_next) {
+                ret = handle_aiocb_rw_merged(aiocb);
+            } else {
+                ret = handle_aiocb_rw(aiocb);
+            }
             break;
         case QEMU_AIO_FLUSH:
             ret = handle_aiocb_flush(aiocb);
@@ -354,7 +496,7 @@ static void *aio_thread(void *unused)
         idle_threads++;
         mutex_unlock(&lock);
 
-        if (kill(pid, aiocb->ev_signo)) die("kill failed");
+        posix_aio_notify();
     }
 
     idle_threads--;
@@ -364,12 +506,21 @@ static void *aio_thread(void *unused)
     return NULL;
 }
 
-static void spawn_thread(void)
+/*
+ * Creates one of the threads requested by spawn_thread(). Each new thread
+ * creates the next one when it starts running, so that a burst of requests
+ * doesn't make the submitting thread create many threads in a row.
+ */
+static void do_spawn_thread(void)
 {
     sigset_t set, oldset;
 
-    cur_threads++;
-    idle_threads++;
+    if (!new_threads) {
+        return;
+    }
+
+    new_threads--;
+    pending_threads++;
 
     /* block all signals */
     if (sigfillset(&set)) die("sigfillset");
@@ -380,12 +531,26 @@ static void spawn_thread(void)
     if (sigprocmask(SIG_SETMASK, &oldset, NULL)) die("sigprocmask restore");
 }
 
+static void spawn_thread(void)
+{
+    cur_threads++;
+    idle_threads++;
+    new_threads++;
+
+    if (!pending_threads) {
+        do_spawn_thread();
+    }
+}
+
 static void qemu_paio_submit(struct qemu_paiocb *aiocb)
 {
     aiocb->ret = -EINPROGRESS;
     aiocb->active = 0;
+    aiocb->merged = 0;
     mutex_lock(&lock);
-    if (idle_threads == 0 && cur_threads < max_threads)
+    /* size the pool by the number of requests that wait for a thread */
+    queued_requests++;
+    if (idle_threads < queued_requests && cur_threads < max_threads)
         spawn_thread();
     QTAILQ_INSERT_TAIL(&request_list, aiocb, node);
     mutex_unlock(&lock);
@@ -440,6 +605,7 @@ static int posix_aio_process_queue(void *opaque)
             if (ret == ECANCELED) {
                 /* remove the request */
                 *pacb = acb->next;
+                acb->common.bs->aio_queue_depth--;
                 qemu_aio_release(acb);
                 result = 1;
             } else if (ret != EINPROGRESS) {
@@ -455,6 +621,8 @@ static int posix_aio_process_queue(void *opaque)
                 }
                 /* remove the request */
                 *pacb = acb->next;
+                raw_aio_account_done(acb->common.bs, acb->submit_ns,
+                                     acb->merged);
                 /* call the callback */
                 acb->common.cb(acb->common.opaque, ret);
                 qemu_aio_release(acb);
@@ -474,7 +642,7 @@ static void posix_aio_read(void *opaque)
     PosixAioState *s = opaque;
     ssize_t len;
 
-    /* read all bytes from signal pipe */
+    /* read all bytes from the eventfd (or the pipe emulating it) */
     for (;;) {
         char bytes[16];
 
@@ -486,6 +654,11 @@ static void posix_aio_read(void *opaque)
         break;
     }
 
+    /* completions from now on must write the eventfd again */
+    mutex_lock(&lock);
+    s->notified = 0;
+    mutex_unlock(&lock);
+
     posix_aio_process_queue(s);
 }
 
@@ -495,21 +668,12 @@ static int posix_aio_flush(void *opaque)
     return !!s->first_aio;
 }
 
-static PosixAioState *posix_aio_state;
-
+#ifndef CONFIG_IOTHREAD
 static void aio_signal_handler(int signum)
 {
-    if (posix_aio_state) {
-        char byte = 0;
-        ssize_t ret;
-
-        ret = write(posix_aio_state->wfd, &byte, sizeof(byte));
-        if (ret < 0 && errno != EAGAIN)
-            die("write()");
-    }
-
     qemu_service_io();
 }
+#endif
 
 static void paio_remove(struct qemu_paiocb *acb)
 {
@@ -523,6 +687,7 @@ static void paio_remove(struct qemu_paiocb *acb)
             break;
         } else if (*pacb == acb) {
             *pacb = acb->next;
+            acb->common.bs->aio_queue_depth--;
             qemu_aio_release(acb);
             break;
         }
@@ -538,6 +703,7 @@ static void paio_cancel(BlockDriverAIOCB *blockacb)
     mutex_lock(&lock);
     if (!acb->active) {
         QTAILQ_REMOVE(&request_list, acb, node);
+        queued_requests--;
         acb->ret = -ECANCELED;
     } else if (acb->ret == -EINPROGRESS) {
         active = 1;
@@ -570,7 +736,7 @@ BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
         return NULL;
     acb->aio_type = type;
     acb->aio_fildes = fd;
-    acb->ev_signo = SIGUSR2;
+    acb->submit_ns = raw_aio_clock_ns();
     acb->async_context_id = get_async_context_id();
 
     if (qiov) {
@@ -582,6 +748,7 @@ BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
 
     acb->next = posix_aio_state->first_aio;
     posix_aio_state->first_aio = acb;
+    raw_aio_account_submit(bs);
 
     qemu_paio_submit(acb);
     return &acb->common;
@@ -598,7 +765,7 @@ BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, int fd,
         return NULL;
     acb->aio_type = QEMU_AIO_IOCTL;
     acb->aio_fildes = fd;
-    acb->ev_signo = SIGUSR2;
+    acb->submit_ns = raw_aio_clock_ns();
     acb->async_context_id = get_async_context_id();
     acb->aio_offset = 0;
     acb->aio_ioctl_buf = buf;
@@ -606,6 +773,7 @@ BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, int fd,
 
     acb->next = posix_aio_state->first_aio;
     posix_aio_state->first_aio = acb;
+    raw_aio_account_submit(bs);
 
     qemu_paio_submit(acb);
     return &acb->common;
@@ -613,7 +781,9 @@ BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, int fd,
 
 int paio_init(void)
 {
+#ifndef CONFIG_IOTHREAD
     struct sigaction act;
+#endif
     PosixAioState *s;
     int fds[2];
     int ret;
@@ -623,14 +793,17 @@ int paio_init(void)
 
     s = qemu_malloc(sizeof(PosixAioState));
 
+#ifndef CONFIG_IOTHREAD
     sigfillset(&act.sa_mask);
     act.sa_flags = 0; /* do not restart syscalls to interrupt select() */
     act.sa_handler = aio_signal_handler;
     sigaction(SIGUSR2, &act, NULL);
+#endif
 
     s->first_aio = NULL;
-    if (qemu_pipe(fds) == -1) {
-        fprintf(stderr, "failed to create pipe\n");
+    s->notified = 0;
+    if (qemu_eventfd(fds) == -1) {
+        fprintf(stderr, "failed to create eventfd\n");
         return -1;
     }
 
@@ -3,6 +3,7 @@
 
 /* FIXME: arch dependant, x86 version */
 #define smp_wmb()   asm volatile("" ::: "memory")
+#define smp_rmb()   asm volatile("" ::: "memory")
 
 /* Compiler barrier */
 #define barrier()   asm volatile("" ::: "memory")
@@ -59,10 +59,26 @@ QemuOptsList qemu_drive_opts = {
             .name = "aio",
             .type = QEMU_OPT_STRING,
             .help = "host AIO implementation (threads, native)",
+        },{
+            .name = "aio-queue-depth",
+            .type = QEMU_OPT_NUMBER,
+            .help = "maximum requests in flight with aio=native",
+        },{
+            .name = "aio-poll",
+            .type = QEMU_OPT_BOOL,
+            .help = "poll for aio=native completions",
         },{
             .name = "format",
             .type = QEMU_OPT_STRING,
             .help = "disk format (raw, qcow2, ...)",
+        },{
+            .name = "l2-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "memory for the qcow2 L2 table cache (bytes)",
+        },{
+            .name = "refcount-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "memory for the qcow2 refcount block cache (bytes)",
         },{
             .name = "serial",
             .type = QEMU_OPT_STRING,
@@ -29,6 +29,8 @@
 
 #ifdef _WIN32
 #include <windows.h>
+#else
+#include <pthread.h>
 #endif
 
 typedef struct img_cmd_t {
@@ -81,6 +83,8 @@ static void help(void)
            "    name=value format. Use -o ? for an overview of the options supported by the\n"
            "    used format\n"
            "  '-c' indicates that target image must be compressed (qcow format only)\n"
+           "  '-p' displays progress and throughput while converting\n"
+           "  '-m' sets the number of chunks converted in parallel (1-64, default 8)\n"
            "  '-u' enables unsafe rebasing. It is assumed that old and new backing file\n"
            "       match exactly. The image doesn't need a working backing file before\n"
            "       rebasing in this case (useful for renaming the backing file)\n"
@@ -566,13 +570,7 @@ static int img_commit(int argc, char **argv)
 
 static int is_not_zero(const uint8_t *sector, int len)
 {
-    int i;
-    len >>= 2;
-    for(i = 0;i < len; i++) {
-        if (((uint32_t *)sector)[i] != 0)
-            return 1;
-    }
-    return 0;
+    return !buffer_is_zero(sector, len);
 }
 
 /*
@@ -617,12 +615,12 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
         return 0;
     }
 
-    res = !!memcmp(buf1, buf2, 512);
+    res = !buffer_is_equal(buf1, buf2, 512);
     for(i = 1; i < n; i++) {
         buf1 += 512;
         buf2 += 512;
 
-        if (!!memcmp(buf1, buf2, 512) != res) {
+        if ((!buffer_is_equal(buf1, buf2, 512)) != res) {
             break;
         }
     }
@@ -633,26 +631,596 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
 
 #define IO_BUF_SIZE (2 * 1024 * 1024)
 
+/* Number of chunks img_convert keeps in flight by default, and at most */
+#define CONVERT_DEFAULT_PARALLEL 8
+#define CONVERT_MAX_PARALLEL 64
+
+/*
+ * img_convert copies the image in chunks of up to IO_BUF_SIZE (one cluster
+ * when compressing).  Several chunks are read with AIO at the same time;
+ * compressed chunks are then deflated by a pool of threads.  Writes are
+ * always issued in sector order, so that the output is allocated roughly
+ * the same way as with a sequential copy.
+ */
+typedef enum ConvertChunkState {
+    CHUNK_FREE,
+    CHUNK_READING,
+    CHUNK_READ,
+    CHUNK_COMPRESSING,
+    CHUNK_COMPRESSED,
+    CHUNK_WRITING,
+} ConvertChunkState;
+
+typedef struct ImgConvertState ImgConvertState;
+
+typedef struct ConvertChunk {
+    ImgConvertState *s;
+    ConvertChunkState state;
+    int64_t sector_num;
+    int nb_sectors;
+    int pending;                /* AIO requests in flight */
+    uint8_t *buf;
+    uint8_t *out_buf;           /* compressed data */
+    int out_len;                /* 0 for an all-zero cluster */
+    QTAILQ_ENTRY(ConvertChunk) next;
+    QTAILQ_ENTRY(ConvertChunk) compress_next;
+} ConvertChunk;
+
+typedef struct ConvertRequest {
+    ConvertChunk *chunk;
+    QEMUIOVector qiov;
+    int is_write;
+} ConvertRequest;
+
+struct ImgConvertState {
+    BlockDriverState **src;
+    int src_num;
+    BlockDriverState *target;
+    int64_t total_sectors;
+    int64_t sector_num;         /* next sector to read */
+    int64_t sectors_done;       /* including unallocated sectors skipped */
+    int64_t sectors_copied;
+    int compressed;
+    int cluster_sectors;
+    int has_zero_init;
+    int target_has_backing;
+    int ret;
+    const char *error_op;
+    int in_flight;
+
+    ConvertChunk *chunks;
+    int num_chunks;
+    QTAILQ_HEAD(, ConvertChunk) order;      /* read, but not yet written */
+    QTAILQ_HEAD(, ConvertChunk) free_chunks;
+
+#ifndef _WIN32
+    pthread_t *threads;
+    int num_threads;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    QTAILQ_HEAD(, ConvertChunk) compress_queue;
+    int compressing;
+    int quit;
+    int rfd, wfd;
+#endif
+
+    int progress;
+    int last_percent;
+    struct timeval start;
+};
+
+static void convert_fail(ImgConvertState *s, int ret, const char *op)
+{
+    if (!s->ret) {
+        s->ret = ret;
+        s->error_op = op;
+    }
+}
+
+static void convert_report_progress(ImgConvertState *s, int done)
+{
+    struct timeval now;
+    double secs, percent;
+
+    if (!s->progress) {
+        return;
+    }
+
+    percent = s->total_sectors ?
+        (double)s->sectors_done * 100 / s->total_sectors : 100;
+    if (!done && (int)percent == s->last_percent) {
+        return;
+    }
+    s->last_percent = (int)percent;
+
+    gettimeofday(&now, NULL);
+    secs = (now.tv_sec - s->start.tv_sec) +
+           (now.tv_usec - s->start.tv_usec) / 1000000.0;
+    printf("    (%3.2f/100%%) %.1f MiB/s\r", percent,
+           secs > 0 ? (double)s->sectors_copied * 512 / secs / (1 << 20) : 0.0);
+    if (done) {
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+static void convert_free_chunk(ImgConvertState *s, ConvertChunk *chunk)
+{
+    s->sectors_done += chunk->nb_sectors;
+    s->sectors_copied += chunk->nb_sectors;
+    chunk->state = CHUNK_FREE;
+    QTAILQ_INSERT_TAIL(&s->free_chunks, chunk, next);
+    convert_report_progress(s, 0);
+}
+
+/* Drops a reference to the chunk, taken for each AIO request */
+static void convert_chunk_put(ConvertChunk *chunk)
+{
+    ImgConvertState *s = chunk->s;
+
+    if (--chunk->pending > 0) {
+        return;
+    }
+
+    if (chunk->state == CHUNK_READING) {
+        chunk->state = CHUNK_READ;
+    } else {
+        QTAILQ_REMOVE(&s->order, chunk, next);
+        convert_free_chunk(s, chunk);
+    }
+}
+
+static void convert_aio_cb(void *opaque, int ret)
+{
+    ConvertRequest *req = opaque;
+    ConvertChunk *chunk = req->chunk;
+
+    if (ret < 0) {
+        convert_fail(chunk->s, ret, req->is_write ? "writing" : "reading");
+    }
+
+    chunk->s->in_flight--;
+    qemu_iovec_destroy(&req->qiov);
+    qemu_free(req);
+    convert_chunk_put(chunk);
+}
+
+static void convert_submit(ConvertChunk *chunk, BlockDriverState *bs,
+    int64_t sector_num, uint8_t *buf, int nb_sectors, int is_write)
+{
+    ConvertRequest *req = qemu_malloc(sizeof(*req));
+    BlockDriverAIOCB *acb;
+
+    req->chunk = chunk;
+    req->is_write = is_write;
+    qemu_iovec_init(&req->qiov, 1);
+    qemu_iovec_add(&req->qiov, buf, nb_sectors * 512);
+
+    chunk->pending++;
+    chunk->s->in_flight++;
+    if (is_write) {
+        acb = bdrv_aio_writev(bs, sector_num, &req->qiov, nb_sectors,
+                              convert_aio_cb, req);
+    } else {
+        acb = bdrv_aio_readv(bs, sector_num, &req->qiov, nb_sectors,
+                             convert_aio_cb, req);
+    }
+    if (!acb) {
+        convert_aio_cb(req, -EIO);
+    }
+}
+
+/* Maps a sector of the concatenated input to an image and an offset in it */
+static int convert_find_source(ImgConvertState *s, int64_t sector_num,
+    int64_t *src_sector, int64_t *src_left)
+{
+    uint64_t bs_sectors;
+    int i;
+
+    for (i = 0; i < s->src_num; i++) {
+        bdrv_get_geometry(s->src[i], &bs_sectors);
+        if (sector_num < bs_sectors) {
+            *src_sector = sector_num;
+            *src_left = bs_sectors - sector_num;
+            return i;
+        }
+        sector_num -= bs_sectors;
+    }
+    abort();
+}
+
+/* Starts reading the next chunk.  Returns 0 when the input is exhausted. */
+static int convert_start_chunk(ImgConvertState *s)
+{
+    ConvertChunk *chunk;
+    int64_t src_sector, src_left, sector_num;
+    int src_i, n, n1, remainder, zero;
+    uint8_t *buf;
+
+    while (s->sector_num < s->total_sectors) {
+        zero = 0;
+        if (s->compressed) {
+            n = s->cluster_sectors;
+        } else {
+            n = IO_BUF_SIZE / 512;
+        }
+        if (n > s->total_sectors - s->sector_num) {
+            n = s->total_sectors - s->sector_num;
+        }
+
+        if (!s->compressed) {
+            src_i = convert_find_source(s, s->sector_num, &src_sector,
+                                        &src_left);
+            if (n > src_left) {
+                n = src_left;
+            }
+
+            /* If the output image is being created as a copy on write image,
+               assume that sectors which are unallocated in the input image
+               are present in both the output's and input's base images (no
+               need to copy them). */
+            if (s->has_zero_init && s->target_has_backing) {
+                if (!bdrv_is_allocated(s->src[src_i], src_sector, n, &n1)) {
+                    s->sector_num += n1;
+                    s->sectors_done += n1;
+                    continue;
+                }
+                /* The next 'n1' sectors are allocated in the input image.
+                   Copy only those as they may be followed by unallocated
+                   sectors. */
+                n = n1;
+            }
+
+            /* Sectors known to read as zeroes need not be read, and need
+               not be written either if the output starts out zeroed. */
+            if (!bdrv_has_data(s->src[src_i], src_sector, n, &n1)) {
+                if (s->has_zero_init && !s->target_has_backing) {
+                    s->sector_num += n1;
+                    s->sectors_done += n1;
+                    continue;
+                }
+                zero = 1;
+            }
+            n = n1;
+        } else {
+            /* all-zero clusters are not written to compressed images */
+            src_i = convert_find_source(s, s->sector_num, &src_sector,
+                                        &src_left);
+            if (n <= src_left &&
+                !bdrv_has_data(s->src[src_i], src_sector, n, &n1) &&
+                n1 >= n) {
+                s->sector_num += n;
+                s->sectors_done += n;
+                continue;
+            }
+        }
+
+        chunk = QTAILQ_FIRST(&s->free_chunks);
+        QTAILQ_REMOVE(&s->free_chunks, chunk, next);
+        QTAILQ_INSERT_TAIL(&s->order, chunk, next);
+        chunk->state = CHUNK_READING;
+        chunk->sector_num = s->sector_num;
+        chunk->nb_sectors = n;
+        s->sector_num += n;
+
+        if (s->compressed && n < s->cluster_sectors) {
+            memset(chunk->buf + n * 512, 0, (s->cluster_sectors - n) * 512);
+        }
+
+        /* a compressed cluster may span several input images */
+        chunk->pending = 1;
+        sector_num = chunk->sector_num;
+        buf = chunk->buf;
+        remainder = n;
+        if (zero) {
+            memset(buf, 0, n * 512);
+            remainder = 0;
+        }
+        while (remainder > 0) {
+            src_i = convert_find_source(s, sector_num, &src_sector, &src_left);
+            n1 = remainder > src_left ? src_left : remainder;
+            convert_submit(chunk, s->src[src_i], src_sector, buf, n1, 0);
+            sector_num += n1;
+            buf += n1 * 512;
+            remainder -= n1;
+        }
+        convert_chunk_put(chunk);
+        return 1;
+    }
+
+    return 0;
+}
+
+static void convert_compress(ImgConvertState *s, ConvertChunk *chunk)
+{
+    if (!is_not_zero(chunk->buf, s->cluster_sectors * 512)) {
+        chunk->out_len = 0;
+    } else {
+        chunk->out_len = bdrv_compress_cluster(s->target, chunk->buf,
+                                               chunk->out_buf);
+    }
+}
+
+#ifndef _WIN32
+static void *convert_compress_thread(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    ConvertChunk *chunk;
+    static const uint64_t val = 1;
+
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        while (QTAILQ_EMPTY(&s->compress_queue) && !s->quit) {
+            pthread_cond_wait(&s->cond, &s->lock);
+        }
+        if (s->quit) {
+            break;
+        }
+        chunk = QTAILQ_FIRST(&s->compress_queue);
+        QTAILQ_REMOVE(&s->compress_queue, chunk, compress_next);
+        pthread_mutex_unlock(&s->lock);
+
+        convert_compress(s, chunk);
+
+        pthread_mutex_lock(&s->lock);
+        chunk->state = CHUNK_COMPRESSED;
+        s->compressing--;
+        if (write(s->wfd, &val, sizeof(val)) < 0 && errno != EAGAIN) {
+            perror("write");
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return NULL;
+}
+
+static void convert_compress_read(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    char bytes[16];
+    ssize_t len;
+
+    do {
+        len = read(s->rfd, bytes, sizeof(bytes));
+    } while (len == sizeof(bytes) || (len == -1 && errno == EINTR));
+}
+
+static int convert_compress_flush(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    int ret;
+
+    pthread_mutex_lock(&s->lock);
+    ret = s->compressing > 0;
+    pthread_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+static int convert_start_threads(ImgConvertState *s, int num_threads)
+{
+    int fds[2];
+    int i;
+
+    if (qemu_eventfd(fds) == -1) {
+        return -errno;
+    }
+    s->rfd = fds[0];
+    s->wfd = fds[1];
+    fcntl(s->rfd, F_SETFL, O_NONBLOCK);
+    fcntl(s->wfd, F_SETFL, O_NONBLOCK);
+    qemu_aio_set_fd_handler(s->rfd, convert_compress_read, NULL,
+        convert_compress_flush, NULL, s);
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    QTAILQ_INIT(&s->compress_queue);
+
+    s->threads = qemu_mallocz(num_threads * sizeof(*s->threads));
+    for (i = 0; i < num_threads; i++) {
+        if (pthread_create(&s->threads[i], NULL, convert_compress_thread, s)) {
+            break;
+        }
+    }
+    s->num_threads = i;
+    return 0;
+}
+
+static void convert_stop_threads(ImgConvertState *s)
+{
+    int i;
+
+    if (!s->threads) {
+        return;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    s->quit = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+
+    for (i = 0; i < s->num_threads; i++) {
+        pthread_join(s->threads[i], NULL);
+    }
+    qemu_free(s->threads);
+
+    qemu_aio_set_fd_handler(s->rfd, NULL, NULL, NULL, NULL, NULL);
+    close(s->rfd);
+    if (s->wfd != s->rfd) {
+        close(s->wfd);
+    }
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->lock);
+}
+#endif
+
+/* Hands a chunk that has been read to a compression thread, if there is one */
+static void convert_queue_compress(ImgConvertState *s, ConvertChunk *chunk)
+{
+#ifndef _WIN32
+    if (s->num_threads) {
+        pthread_mutex_lock(&s->lock);
+        chunk->state = CHUNK_COMPRESSING;
+        s->compressing++;
+        QTAILQ_INSERT_TAIL(&s->compress_queue, chunk, compress_next);
+        pthread_cond_signal(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+#endif
+    convert_compress(s, chunk);
+    chunk->state = CHUNK_COMPRESSED;
+}
+
+static ConvertChunkState convert_chunk_state(ImgConvertState *s,
+    ConvertChunk *chunk)
+{
+    ConvertChunkState state;
+
+#ifndef _WIN32
+    if (s->num_threads) {
+        pthread_mutex_lock(&s->lock);
+        state = chunk->state;
+        pthread_mutex_unlock(&s->lock);
+        return state;
+    }
+#endif
+    state = chunk->state;
+    return state;
+}
+
+static void convert_write_compressed(ImgConvertState *s, ConvertChunk *chunk)
+{
+    int ret = 0;
+
+    if (chunk->out_len == -ENOTSUP) {
+        /* the driver can only compress and write in one go */
+        ret = bdrv_write_compressed(s->target, chunk->sector_num, chunk->buf,
+                                    s->cluster_sectors);
+    } else if (chunk->out_len == -ENOSPC) {
+        /* could not compress: write normal cluster */
+        ret = bdrv_write(s->target, chunk->sector_num, chunk->buf,
+                         s->cluster_sectors);
+    } else if (chunk->out_len > 0) {
+        ret = bdrv_write_compressed_cluster(s->target, chunk->sector_num,
+                                            s->cluster_sectors,
+                                            chunk->out_buf, chunk->out_len);
+    } else if (chunk->out_len < 0) {
+        ret = chunk->out_len;
+    }
+
+    if (ret < 0) {
+        error("error while compressing sector %" PRId64, chunk->sector_num);
+        convert_fail(s, ret, NULL);
+    }
+}
+
+static void convert_write_chunk(ImgConvertState *s, ConvertChunk *chunk)
+{
+    int64_t sector_num = chunk->sector_num;
+    uint8_t *buf = chunk->buf;
+    int n = chunk->nb_sectors;
+    int n1;
+
+    chunk->state = CHUNK_WRITING;
+    chunk->pending = 1;
+
+    while (n > 0 && !s->ret) {
+        /* If the output image is being created as a copy on write image,
+           copy all sectors even the ones containing only NUL bytes,
+           because they may differ from the sectors in the base image.
+
+           If the output is to a host device, we also write out
+           sectors that are entirely 0, since whatever data was
+           already there is garbage, not 0s. */
+        if (!s->has_zero_init || s->target_has_backing) {
+            n1 = n;
+            convert_submit(chunk, s->target, sector_num, buf, n1, 1);
+        } else if (is_allocated_sectors(buf, n, &n1)) {
+            convert_submit(chunk, s->target, sector_num, buf, n1, 1);
+        }
+        sector_num += n1;
+        n -= n1;
+        buf += n1 * 512;
+    }
+
+    convert_chunk_put(chunk);
+}
+
+/*
+ * Moves chunks on once their reads have completed: compression may happen
+ * in any order, writes are issued in sector order.  Returns 1 if anything
+ * was done.
+ */
+static int convert_process(ImgConvertState *s)
+{
+    ConvertChunk *chunk, *next;
+    ConvertChunkState state;
+    int progress = 0;
+
+    QTAILQ_FOREACH_SAFE(chunk, &s->order, next, next) {
+        if (convert_chunk_state(s, chunk) != CHUNK_READ) {
+            continue;
+        }
+        if (s->ret) {
+            QTAILQ_REMOVE(&s->order, chunk, next);
+            convert_free_chunk(s, chunk);
+            progress = 1;
+        } else if (s->compressed) {
+            convert_queue_compress(s, chunk);
+            progress = 1;
+        }
+    }
+
+    /* Completions may free chunks behind our back, so rescan after a write */
+again:
+    QTAILQ_FOREACH(chunk, &s->order, next) {
+        state = convert_chunk_state(s, chunk);
+        if (state == CHUNK_WRITING) {
+            continue;
+        }
+        if (state == CHUNK_COMPRESSED) {
+            QTAILQ_REMOVE(&s->order, chunk, next);
+            if (!s->ret) {
+                convert_write_compressed(s, chunk);
+            }
+            convert_free_chunk(s, chunk);
+        } else if (state == CHUNK_READ && !s->compressed) {
+            convert_write_chunk(s, chunk);
+        } else {
+            break;
+        }
+        progress = 1;
+        goto again;
+    }
+
+    return progress;
+}
+
 static int img_convert(int argc, char **argv)
 {
-    int c, ret = 0, n, n1, bs_n, bs_i, flags, cluster_size, cluster_sectors;
+    int c, ret = 0, i, bs_n, bs_i, flags, cluster_size, parallel, progress;
+    int buf_size;
     const char *fmt, *out_fmt, *out_baseimg, *out_filename;
     BlockDriver *drv, *proto_drv;
     BlockDriverState **bs = NULL, *out_bs = NULL;
-    int64_t total_sectors, nb_sectors, sector_num, bs_offset;
+    int64_t total_sectors;
     uint64_t bs_sectors;
-    uint8_t * buf = NULL;
-    const uint8_t *buf1;
     BlockDriverInfo bdi;
     QEMUOptionParameter *param = NULL, *create_options = NULL;
     char *options = NULL;
+    char *end;
+    ImgConvertState s;
 
+    memset(&s, 0, sizeof(s));
     fmt = NULL;
     out_fmt = "raw";
     out_baseimg = NULL;
     flags = 0;
+    parallel = CONVERT_DEFAULT_PARALLEL;
+    progress = 0;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:hce6o:");
+        c = getopt(argc, argv, "f:O:B:hce6o:m:p");
         if (c == -1)
             break;
         switch(c) {
@@ -680,6 +1248,17 @@ static int img_convert(int argc, char **argv)
         case 'o':
             options = optarg;
             break;
+        case 'm':
+            parallel = strtol(optarg, &end, 0);
+            if (*end || parallel < 1 || parallel > CONVERT_MAX_PARALLEL) {
+                error("Invalid number of parallel requests '%s' (1-%d)",
+                      optarg, CONVERT_MAX_PARALLEL);
+                return 1;
+            }
+            break;
+        case 'p':
+            progress = 1;
+            break;
         }
     }
 
@@ -790,10 +1369,16 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
-    bs_i = 0;
-    bs_offset = 0;
-    bdrv_get_geometry(bs[0], &bs_sectors);
-    buf = qemu_malloc(IO_BUF_SIZE);
+    s.src = bs;
+    s.src_num = bs_n;
+    s.target = out_bs;
+    s.total_sectors = total_sectors;
+    s.target_has_backing = out_baseimg != NULL;
+    s.has_zero_init = bdrv_has_zero_init(out_bs);
+    s.progress = progress;
+    s.last_percent = -1;
+    QTAILQ_INIT(&s.order);
+    QTAILQ_INIT(&s.free_chunks);
 
     if (flags & BLOCK_FLAG_COMPRESS) {
         ret = bdrv_get_info(out_bs, &bdi);
@@ -807,149 +1392,76 @@ static int img_convert(int argc, char **argv)
             ret = -1;
             goto out;
         }
-        cluster_sectors = cluster_size >> 9;
-        sector_num = 0;
-        for(;;) {
-            int64_t bs_num;
-            int remainder;
-            uint8_t *buf2;
-
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0)
-                break;
-            if (nb_sectors >= cluster_sectors)
-                n = cluster_sectors;
-            else
-                n = nb_sectors;
-
-            bs_num = sector_num - bs_offset;
-            assert (bs_num >= 0);
-            remainder = n;
-            buf2 = buf;
-            while (remainder > 0) {
-                int nlow;
-                while (bs_num == bs_sectors) {
-                    bs_i++;
-                    assert (bs_i < bs_n);
-                    bs_offset += bs_sectors;
-                    bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                    bs_num = 0;
-                    /* printf("changing part: sector_num=%" PRId64 ", "
-                       "bs_i=%d, bs_offset=%" PRId64 ", bs_sectors=%" PRId64
-                       "\n", sector_num, bs_i, bs_offset, bs_sectors); */
-                }
-                assert (bs_num < bs_sectors);
-
-                nlow = (remainder > bs_sectors - bs_num) ? bs_sectors - bs_num : remainder;
-
-                ret = bdrv_read(bs[bs_i], bs_num, buf2, nlow);
-                if (ret < 0) {
-                    error("error while reading");
-                    goto out;
-                }
+        s.compressed = 1;
+        s.cluster_sectors = cluster_size >> 9;
+        buf_size = cluster_size;
+    } else {
+        buf_size = IO_BUF_SIZE;
+    }
 
-                buf2 += nlow * 512;
-                bs_num += nlow;
+    s.num_chunks = parallel;
+    s.chunks = qemu_mallocz(s.num_chunks * sizeof(*s.chunks));
+    for (i = 0; i < s.num_chunks; i++) {
+        s.chunks[i].s = &s;
+        s.chunks[i].buf = qemu_blockalign(out_bs, buf_size);
+        if (s.compressed) {
+            s.chunks[i].out_buf = qemu_malloc(buf_size);
+        }
+        QTAILQ_INSERT_TAIL(&s.free_chunks, &s.chunks[i], next);
+    }
 
-                remainder -= nlow;
-            }
-            assert (remainder == 0);
-
-            if (n < cluster_sectors)
-                memset(buf + n * 512, 0, cluster_size - n * 512);
-            if (is_not_zero(buf, cluster_size)) {
-                ret = bdrv_write_compressed(out_bs, sector_num, buf,
-                                            cluster_sectors);
-                if (ret != 0) {
-                    error("error while compressing sector %" PRId64,
-                          sector_num);
-                    goto out;
-                }
-            }
-            sector_num += n;
+#ifndef _WIN32
+    if (s.compressed) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if (ncpus > 1 && convert_start_threads(&s, MIN(parallel, ncpus)) < 0) {
+            error("could not start compression threads");
+            ret = -1;
+            goto out;
         }
-        /* signal EOF to align */
-        bdrv_write_compressed(out_bs, 0, NULL, 0);
-    } else {
-        int has_zero_init = bdrv_has_zero_init(out_bs);
+    }
+#endif
 
-        sector_num = 0; // total number of sectors converted so far
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0)
+    gettimeofday(&s.start, NULL);
+    convert_report_progress(&s, 0);
+    for (;;) {
+        while (!s.ret && !QTAILQ_EMPTY(&s.free_chunks)) {
+            if (!convert_start_chunk(&s)) {
                 break;
-            if (nb_sectors >= (IO_BUF_SIZE / 512))
-                n = (IO_BUF_SIZE / 512);
-            else
-                n = nb_sectors;
-
-            while (sector_num - bs_offset >= bs_sectors) {
-                bs_i ++;
-                assert (bs_i < bs_n);
-                bs_offset += bs_sectors;
-                bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                /* printf("changing part: sector_num=%" PRId64 ", bs_i=%d, "
-                  "bs_offset=%" PRId64 ", bs_sectors=%" PRId64 "\n",
-                   sector_num, bs_i, bs_offset, bs_sectors); */
-            }
-
-            if (n > bs_offset + bs_sectors - sector_num)
-                n = bs_offset + bs_sectors - sector_num;
-
-            if (has_zero_init) {
-                /* If the output image is being created as a copy on write image,
-                   assume that sectors which are unallocated in the input image
-                   are present in both the output's and input's base images (no
-                   need to copy them). */
-                if (out_baseimg) {
-                    if (!bdrv_is_allocated(bs[bs_i], sector_num - bs_offset,
-                                           n, &n1)) {
-                        sector_num += n1;
-                        continue;
-                    }
-                    /* The next 'n1' sectors are allocated in the input image. Copy
-                       only those as they may be followed by unallocated sectors. */
-                    n = n1;
-                }
-            } else {
-                n1 = n;
             }
+        }
+        if (convert_process(&s)) {
+            continue;
+        }
+        if (s.in_flight == 0 && QTAILQ_EMPTY(&s.order)) {
+            break;
+        }
+        qemu_aio_wait();
+    }
+    convert_report_progress(&s, 1);
 
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
-            if (ret < 0) {
-                error("error while reading");
-                goto out;
-            }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                /* If the output image is being created as a copy on write image,
-                   copy all sectors even the ones containing only NUL bytes,
-                   because they may differ from the sectors in the base image.
-
-                   If the output is to a host device, we also write out
-                   sectors that are entirely 0, since whatever data was
-                   already there is garbage, not 0s. */
-                if (!has_zero_init || out_baseimg ||
-                    is_allocated_sectors(buf1, n, &n1)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
-                    if (ret < 0) {
-                        error("error while writing");
-                        goto out;
-                    }
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
+    ret = s.ret;
+    if (ret < 0) {
+        if (s.error_op) {
+            error("error while %s", s.error_op);
         }
+        goto out;
+    }
+
+    if (s.compressed) {
+        /* signal EOF to align */
+        bdrv_write_compressed(out_bs, 0, NULL, 0);
     }
 out:
+#ifndef _WIN32
+    convert_stop_threads(&s);
+#endif
+    for (i = 0; i < s.num_chunks; i++) {
+        qemu_vfree(s.chunks[i].buf);
+        qemu_free(s.chunks[i].out_buf);
+    }
+    qemu_free(s.chunks);
     free_option_parameters(create_options);
     free_option_parameters(param);
-    qemu_free(buf);
     if (out_bs) {
         bdrv_delete(out_bs);
     }
@@ -1307,7 +1819,7 @@ static int img_rebase(int argc, char **argv)
     if (!unsafe) {
         uint64_t num_sectors;
         uint64_t sector;
-        int n;
+        int n, n_old, n_new, old_data, new_data;
         uint8_t * buf_old;
         uint8_t * buf_new;
 
@@ -1331,16 +1843,32 @@ static int img_rebase(int argc, char **argv)
                 continue;
             }
 
+            /* Ranges that read as zeroes in a backing file needn't be read */
+            old_data = bdrv_has_data(bs_old_backing, sector, n, &n_old);
+            new_data = bdrv_has_data(bs_new_backing, sector, n, &n_new);
+            n = MIN(n, MIN(n_old, n_new));
+            if (!old_data && !new_data) {
+                continue;
+            }
+
             /* Read old and new backing file */
-            ret = bdrv_read(bs_old_backing, sector, buf_old, n);
-            if (ret < 0) {
-                error("error while reading from old backing file");
-                goto out;
+            if (old_data) {
+                ret = bdrv_read(bs_old_backing, sector, buf_old, n);
+                if (ret < 0) {
+                    error("error while reading from old backing file");
+                    goto out;
+                }
+            } else {
+                memset(buf_old, 0, n * 512);
             }
-            ret = bdrv_read(bs_new_backing, sector, buf_new, n);
-            if (ret < 0) {
-                error("error while reading from new backing file");
-                goto out;
+            if (new_data) {
+                ret = bdrv_read(bs_new_backing, sector, buf_new, n);
+                if (ret < 0) {
+                    error("error while reading from new backing file");
+                    goto out;
+                }
+            } else {
+                memset(buf_new, 0, n * 512);
             }
 
             /* If they differ, we need to write to the COW file */
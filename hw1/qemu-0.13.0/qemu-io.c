@@ -282,7 +282,8 @@ static void multiwrite_cb(void *opaque, int ret)
 	}
 }
 
-static int do_aio_multiwrite(BlockRequest* reqs, int num_reqs, int *total)
+static int do_aio_multireq(BlockRequest* reqs, int num_reqs, int *total,
+	int is_write)
 {
 	int i, ret;
 	struct multiwrite_async_ret async_ret = {
@@ -297,7 +298,11 @@ static int do_aio_multiwrite(BlockRequest* reqs, int num_reqs, int *total)
 		*total += reqs[i].qiov->size;
 	}
 
-	ret = bdrv_aio_multiwrite(bs, reqs, num_reqs);
+	if (is_write) {
+		ret = bdrv_aio_multiwrite(bs, reqs, num_reqs);
+	} else {
+		ret = bdrv_aio_multiread(bs, reqs, num_reqs);
+	}
 	if (ret < 0) {
 		return ret;
 	}
@@ -885,11 +890,45 @@ static const cmdinfo_t multiwrite_cmd = {
 	.help		= multiwrite_help,
 };
 
+static void
+multiread_help(void)
+{
+	printf(
+"\n"
+" reads ranges of bytes from the given offsets into multiple buffers,\n"
+" in a batch of requests that may be merged by qemu\n"
+"\n"
+" Example:\n"
+" 'multiread 512 1k 1k ; 4k 1k' \n"
+"  reads 2 kB at 512 bytes and 1 kB at 4 kB from the open file\n"
+"\n"
+" With -P, the data read is verified against the pattern, which is increased\n"
+" by one for each request contained in the multiread command, matching what\n"
+" multiwrite writes.\n"
+" -C, -- report statistics in a machine parsable format\n"
+" -P, -- use a pattern to verify read data\n"
+" -q, -- quiet mode, do not show I/O statistics\n"
+"\n");
+}
+
+static int multiread_f(int argc, char **argv);
+
+static const cmdinfo_t multiread_cmd = {
+	.name		= "multiread",
+	.cfunc		= multiread_f,
+	.argmin		= 2,
+	.argmax		= -1,
+	.args		= "[-Cq] [-P pattern ] off len [len..] [; off len [len..]..]",
+	.oneline	= "issues multiple read requests at once",
+	.help		= multiread_help,
+};
+
 static int
-multiwrite_f(int argc, char **argv)
+multireq_f(int argc, char **argv, int is_write)
 {
+	const cmdinfo_t *cmd = is_write ? &multiwrite_cmd : &multiread_cmd;
 	struct timeval t1, t2;
-	int Cflag = 0, qflag = 0;
+	int Cflag = 0, qflag = 0, Pflag = 0;
 	int c, cnt;
 	char **buf;
 	int64_t offset, first_offset = 0;
@@ -911,17 +950,18 @@ multiwrite_f(int argc, char **argv)
 			qflag = 1;
 			break;
 		case 'P':
+			Pflag = 1;
 			pattern = parse_pattern(optarg);
 			if (pattern < 0)
 				return 0;
 			break;
 		default:
-			return command_usage(&writev_cmd);
+			return command_usage(cmd);
 		}
 	}
 
 	if (optind > argc - 2)
-		return command_usage(&writev_cmd);
+		return command_usage(cmd);
 
 	nr_reqs = 1;
 	for (i = optind; i < argc; i++) {
@@ -966,7 +1006,8 @@ multiwrite_f(int argc, char **argv)
 
 		/* Build request */
 		reqs[i].qiov = &qiovs[i];
-		buf[i] = create_iovec(reqs[i].qiov, &argv[optind], nr_iov, pattern);
+		buf[i] = create_iovec(reqs[i].qiov, &argv[optind], nr_iov,
+			is_write ? pattern : 0xab);
 		reqs[i].sector = offset >> 9;
 		reqs[i].nb_sectors = reqs[i].qiov->size >> 9;
 
@@ -977,20 +1018,35 @@ multiwrite_f(int argc, char **argv)
 	}
 
 	gettimeofday(&t1, NULL);
-	cnt = do_aio_multiwrite(reqs, nr_reqs, &total);
+	cnt = do_aio_multireq(reqs, nr_reqs, &total, is_write);
 	gettimeofday(&t2, NULL);
 
 	if (cnt < 0) {
-		printf("aio_multiwrite failed: %s\n", strerror(-cnt));
+		printf("aio_%s failed: %s\n", cmd->name, strerror(-cnt));
 		goto out;
 	}
 
+	/* reqs[] may have been merged, the qiovs still describe each request */
+	if (!is_write && Pflag) {
+		pattern -= nr_reqs;
+		for (i = 0; i < nr_reqs; i++, pattern++) {
+			void *cmp_buf = malloc(qiovs[i].size);
+			memset(cmp_buf, pattern, qiovs[i].size);
+			if (memcmp(buf[i], cmp_buf, qiovs[i].size)) {
+				printf("Pattern verification failed in request %d, "
+					"%zd bytes\n", i, qiovs[i].size);
+			}
+			free(cmp_buf);
+		}
+	}
+
 	if (qflag)
 		goto out;
 
 	/* Finally, report back -- -C gives a parsable format */
 	t2 = tsub(t2, t1);
-	print_report("wrote", &t2, first_offset, total, total, cnt, Cflag);
+	print_report(is_write ? "wrote" : "read", &t2, first_offset, total, total,
+		cnt, Cflag);
 out:
 	for (i = 0; i < nr_reqs; i++) {
 		qemu_io_free(buf[i]);
@@ -1002,6 +1058,18 @@ out:
 	return 0;
 }
 
+static int
+multiwrite_f(int argc, char **argv)
+{
+	return multireq_f(argc, argv, 1);
+}
+
+static int
+multiread_f(int argc, char **argv)
+{
+	return multireq_f(argc, argv, 0);
+}
+
 struct aio_ctx {
 	QEMUIOVector qiov;
 	int64_t offset;
@@ -1276,6 +1344,411 @@ aio_write_f(int argc, char **argv)
 	return 0;
 }
 
+/*
+ * Block layer benchmark: keeps a number of AIO requests in flight and
+ * records the latency of each of them.
+ */
+struct bench_state;
+
+struct bench_req {
+	struct bench_state *s;
+	QEMUIOVector qiov;
+	struct iovec iov;
+	void *buf;
+	int64_t start_ns;
+	int is_write;
+	struct bench_req *next_free;
+};
+
+struct bench_state {
+	int64_t offset;
+	int64_t length;
+	int bsize;
+	int depth;
+	int sequential;
+	int write_pct;
+	int64_t count;		/* -1 for no limit */
+	int64_t deadline_ns;	/* 0 for no limit */
+
+	uint64_t rng;
+	int64_t next_offset;
+	int64_t submitted;
+	int64_t reads, writes;
+	int in_flight;
+	int error;
+	void *write_buf;
+	struct bench_req *reqs;
+	struct bench_req *free_reqs;
+
+	int64_t *lat;		/* latency of each request in ns */
+	int64_t nr_lat, lat_size;
+};
+
+static int64_t bench_clock_ns(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+		return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	}
+#endif
+	{
+		struct timeval tv;
+
+		gettimeofday(&tv, NULL);
+		return tv.tv_sec * 1000000000LL + tv.tv_usec * 1000;
+	}
+}
+
+/* xorshift64*, so that runs with the same parameters are repeatable */
+static uint64_t bench_rand(struct bench_state *s)
+{
+	s->rng ^= s->rng >> 12;
+	s->rng ^= s->rng << 25;
+	s->rng ^= s->rng >> 27;
+	return s->rng * 2685821657736338717ULL;
+}
+
+static void bench_cb(void *opaque, int ret)
+{
+	struct bench_req *req = opaque;
+	struct bench_state *s = req->s;
+
+	if (ret < 0 && !s->error) {
+		s->error = ret;
+	}
+
+	if (s->nr_lat == s->lat_size) {
+		s->lat_size = s->lat_size ? s->lat_size * 2 : 4096;
+		s->lat = qemu_realloc(s->lat, s->lat_size * sizeof(*s->lat));
+	}
+	s->lat[s->nr_lat++] = bench_clock_ns() - req->start_ns;
+
+	s->in_flight--;
+	req->next_free = s->free_reqs;
+	s->free_reqs = req;
+}
+
+static void bench_submit(struct bench_state *s)
+{
+	struct bench_req *req = s->free_reqs;
+	BlockDriverAIOCB *acb;
+	int64_t offset;
+
+	s->free_reqs = req->next_free;
+
+	if (s->sequential) {
+		offset = s->next_offset;
+		s->next_offset += s->bsize;
+		if (s->next_offset + s->bsize > s->offset + s->length) {
+			s->next_offset = s->offset;
+		}
+	} else {
+		offset = s->offset + (bench_rand(s) % (s->length / s->bsize)) *
+			s->bsize;
+	}
+	req->is_write = (int)(bench_rand(s) % 100) < s->write_pct;
+
+	if (req->is_write) {
+		req->iov.iov_base = s->write_buf;
+		s->writes++;
+	} else {
+		req->iov.iov_base = req->buf;
+		s->reads++;
+	}
+	req->iov.iov_len = s->bsize;
+	qemu_iovec_init_external(&req->qiov, &req->iov, 1);
+
+	s->submitted++;
+	s->in_flight++;
+	req->start_ns = bench_clock_ns();
+	if (req->is_write) {
+		acb = bdrv_aio_writev(bs, offset >> 9, &req->qiov,
+				      s->bsize >> 9, bench_cb, req);
+	} else {
+		acb = bdrv_aio_readv(bs, offset >> 9, &req->qiov,
+				     s->bsize >> 9, bench_cb, req);
+	}
+	if (!acb) {
+		bench_cb(req, -EIO);
+	}
+}
+
+static int bench_cmp_lat(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Latencies must be sorted; returns microseconds */
+static double bench_percentile(struct bench_state *s, double pct)
+{
+	int64_t i = (int64_t)(pct / 100 * s->nr_lat);
+
+	if (i >= s->nr_lat)
+		i = s->nr_lat - 1;
+	return s->lat[i] / 1000.0;
+}
+
+static void bench_histogram(struct bench_state *s)
+{
+	int64_t i, n, lo, hi;
+	int j, width;
+
+	printf("latency histogram (usec):\n");
+	for (i = 0, lo = 0, hi = 1; i < s->nr_lat; lo = hi, hi *= 2) {
+		for (n = 0; i < s->nr_lat && s->lat[i] < hi * 1000; i++) {
+			n++;
+		}
+		if (!n) {
+			continue;
+		}
+		width = (int)(n * 50 / s->nr_lat);
+		printf(" [%8" PRId64 ", %8" PRId64 ") %10" PRId64 " %6.2f%% ",
+		       lo, hi, n, n * 100.0 / s->nr_lat);
+		for (j = 0; j < width; j++)
+			printf("#");
+		printf("\n");
+	}
+}
+
+static void bench_report(struct bench_state *s, struct timeval *t, int Cflag,
+	int Hflag)
+{
+	char s1[64], s2[64], ts[64];
+	double total = (double)s->nr_lat * s->bsize, sum = 0;
+	int64_t i;
+
+	if (!s->nr_lat)
+		return;
+
+	for (i = 0; i < s->nr_lat; i++)
+		sum += s->lat[i];
+	qsort(s->lat, s->nr_lat, sizeof(*s->lat), bench_cmp_lat);
+
+	timestr(t, ts, sizeof(ts), Cflag ? VERBOSE_FIXED_TIME : 0);
+	if (!Cflag) {
+		cvtstr(total, s1, sizeof(s1));
+		cvtstr(tdiv(total, *t), s2, sizeof(s2));
+		printf("%" PRId64 " reads, %" PRId64 " writes of %d bytes, "
+		       "depth %d, %s\n", s->reads, s->writes, s->bsize,
+		       s->depth, s->sequential ? "sequential" : "random");
+		printf("%s, %" PRId64 " ops; %s (%s/sec and %.4f ops/sec)\n",
+		       s1, s->nr_lat, ts, s2, tdiv((double)s->nr_lat, *t));
+		printf("latency (usec): min %.1f, avg %.1f, max %.1f\n",
+		       s->lat[0] / 1000.0, sum / s->nr_lat / 1000.0,
+		       s->lat[s->nr_lat - 1] / 1000.0);
+		printf("latency percentiles (usec): 50th %.1f, 90th %.1f, "
+		       "99th %.1f, 99.9th %.1f\n",
+		       bench_percentile(s, 50), bench_percentile(s, 90),
+		       bench_percentile(s, 99), bench_percentile(s, 99.9));
+		if (Hflag)
+			bench_histogram(s);
+	} else {/* bytes,ops,time,bytes/sec,ops/sec,min,avg,50,90,99,99.9,max */
+		printf("%.0f,%" PRId64 ",%s,%.3f,%.3f,"
+		       "%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+		       total, s->nr_lat, ts, tdiv(total, *t),
+		       tdiv((double)s->nr_lat, *t),
+		       s->lat[0] / 1000.0, sum / s->nr_lat / 1000.0,
+		       bench_percentile(s, 50), bench_percentile(s, 90),
+		       bench_percentile(s, 99), bench_percentile(s, 99.9),
+		       s->lat[s->nr_lat - 1] / 1000.0);
+	}
+}
+
+static void
+bench_help(void)
+{
+	printf(
+"\n"
+" benchmarks the block layer with concurrent asynchronous requests\n"
+"\n"
+" Example:\n"
+" 'bench -d 32 -b 4k -w 30 -t 10' - 10 seconds of random 4k requests, 30%% of\n"
+"  them writes, with 32 requests in flight\n"
+"\n"
+" Requests go through bdrv_aio_readv/bdrv_aio_writev to the whole image, or\n"
+" to the range given by off and len.  At the end, IOPS, bandwidth and request\n"
+" latency percentiles are reported.\n"
+" -b, -- size of each request (default 4k)\n"
+" -d, -- number of requests kept in flight (default 1)\n"
+" -n, -- number of requests to issue (default 10000 unless -t is given)\n"
+" -t, -- stop issuing requests after the given number of seconds\n"
+" -s, -- access the range sequentially instead of randomly\n"
+" -w, -- percentage of requests that are writes (default 0)\n"
+" -P, -- use different pattern to fill written data (default 0xcd)\n"
+" -H, -- print a histogram of the latencies\n"
+" -C, -- report statistics in a machine parsable format\n"
+"\n");
+}
+
+static int bench_f(int argc, char **argv);
+
+static const cmdinfo_t bench_cmd = {
+	.name		= "bench",
+	.cfunc		= bench_f,
+	.argmin		= 0,
+	.argmax		= -1,
+	.args		= "[-CHs] [-b bsize] [-d depth] [-n count] "
+			  "[-t secs] [-w pct] [-P pattern] [off len]",
+	.oneline	= "benchmarks concurrent asynchronous I/O",
+	.help		= bench_help,
+};
+
+static int
+bench_f(int argc, char **argv)
+{
+	struct bench_state s;
+	struct timeval t1, t2;
+	int c, i, Cflag = 0, Hflag = 0, pattern = 0xcd;
+	int64_t n, secs = 0;
+	char *end;
+
+	memset(&s, 0, sizeof(s));
+	s.bsize = 4096;
+	s.depth = 1;
+	s.count = -1;
+	s.rng = 0x2545f4914f6cdd1dULL;
+
+	while ((c = getopt(argc, argv, "b:Cd:Hn:P:st:w:")) != EOF) {
+		switch (c) {
+		case 'b':
+			n = cvtnum(optarg);
+			if (n <= 0 || n > INT_MAX || (n & 0x1ff)) {
+				printf("block size %s is not a positive "
+				       "multiple of 512\n", optarg);
+				return 0;
+			}
+			s.bsize = n;
+			break;
+		case 'C':
+			Cflag = 1;
+			break;
+		case 'd':
+			s.depth = strtol(optarg, &end, 0);
+			if (*end || s.depth < 1 || s.depth > 1024) {
+				printf("invalid queue depth -- %s\n", optarg);
+				return 0;
+			}
+			break;
+		case 'H':
+			Hflag = 1;
+			break;
+		case 'n':
+			s.count = cvtnum(optarg);
+			if (s.count <= 0) {
+				printf("invalid request count -- %s\n", optarg);
+				return 0;
+			}
+			break;
+		case 'P':
+			pattern = parse_pattern(optarg);
+			if (pattern < 0)
+				return 0;
+			break;
+		case 's':
+			s.sequential = 1;
+			break;
+		case 't':
+			secs = strtol(optarg, &end, 0);
+			if (*end || secs <= 0) {
+				printf("invalid time limit -- %s\n", optarg);
+				return 0;
+			}
+			break;
+		case 'w':
+			s.write_pct = strtol(optarg, &end, 0);
+			if (*end || s.write_pct < 0 || s.write_pct > 100) {
+				printf("invalid write percentage -- %s\n",
+				       optarg);
+				return 0;
+			}
+			break;
+		default:
+			return command_usage(&bench_cmd);
+		}
+	}
+
+	if (optind == argc) {
+		s.offset = 0;
+		s.length = bdrv_getlength(bs);
+		if (s.length < 0) {
+			printf("getlength: %s\n", strerror(-s.length));
+			return 0;
+		}
+	} else if (optind == argc - 2) {
+		s.offset = cvtnum(argv[optind]);
+		s.length = cvtnum(argv[optind + 1]);
+		if (s.offset < 0 || s.length < 0) {
+			printf("non-numeric offset or length argument\n");
+			return 0;
+		}
+		if (s.offset & 0x1ff) {
+			printf("offset %" PRId64 " is not sector aligned\n",
+			       s.offset);
+			return 0;
+		}
+	} else {
+		return command_usage(&bench_cmd);
+	}
+
+	if (s.length < s.bsize) {
+		printf("range of %" PRId64 " bytes is smaller than the block "
+		       "size\n", s.length);
+		return 0;
+	}
+	if (s.count < 0 && !secs) {
+		s.count = 10000;
+	}
+
+	s.next_offset = s.offset;
+	s.write_buf = qemu_io_alloc(s.bsize, pattern);
+	s.reqs = qemu_mallocz(s.depth * sizeof(*s.reqs));
+	for (i = 0; i < s.depth; i++) {
+		s.reqs[i].s = &s;
+		s.reqs[i].buf = qemu_io_alloc(s.bsize, 0xab);
+		s.reqs[i].next_free = s.free_reqs;
+		s.free_reqs = &s.reqs[i];
+	}
+
+	gettimeofday(&t1, NULL);
+	if (secs) {
+		s.deadline_ns = bench_clock_ns() + secs * 1000000000LL;
+	}
+	for (;;) {
+		while (s.free_reqs && !s.error &&
+		       (s.count < 0 || s.submitted < s.count) &&
+		       (!s.deadline_ns || bench_clock_ns() < s.deadline_ns)) {
+			bench_submit(&s);
+		}
+		if (!s.in_flight) {
+			break;
+		}
+		qemu_aio_wait();
+		if (s.deadline_ns && bench_clock_ns() >= s.deadline_ns) {
+			s.count = s.submitted;
+		}
+	}
+	gettimeofday(&t2, NULL);
+
+	if (s.error) {
+		printf("bench failed: %s\n", strerror(-s.error));
+	} else {
+		t2 = tsub(t2, t1);
+		bench_report(&s, &t2, Cflag, Hflag);
+	}
+
+	for (i = 0; i < s.depth; i++) {
+		qemu_io_free(s.reqs[i].buf);
+	}
+	qemu_free(s.reqs);
+	qemu_io_free(s.write_buf);
+	qemu_free(s.lat);
+	return 0;
+}
+
 static int
 aio_flush_f(int argc, char **argv)
 {
@@ -1381,6 +1854,12 @@ info_f(int argc, char **argv)
 
 	printf("cluster size: %s\n", s1);
 	printf("vm state offset: %s\n", s2);
+	if (bdi.l2_cache_hits || bdi.l2_cache_misses) {
+		printf("l2 cache: %" PRIu64 " hits, %" PRIu64 " misses\n",
+			bdi.l2_cache_hits, bdi.l2_cache_misses);
+		printf("refcount cache: %" PRIu64 " hits, %" PRIu64 " misses\n",
+			bdi.refcount_cache_hits, bdi.refcount_cache_misses);
+	}
 
 	return 0;
 }
@@ -1675,9 +2154,11 @@ int main(int argc, char **argv)
 	add_command(&write_cmd);
 	add_command(&writev_cmd);
 	add_command(&multiwrite_cmd);
+	add_command(&multiread_cmd);
 	add_command(&aio_read_cmd);
 	add_command(&aio_write_cmd);
 	add_command(&aio_flush_cmd);
+	add_command(&bench_cmd);
 	add_command(&flush_cmd);
 	add_command(&truncate_cmd);
 	add_command(&length_cmd);
@@ -31,6 +31,11 @@
 #define spinlock_t pthread_mutex_t
 #define SPIN_LOCK_UNLOCKED PTHREAD_MUTEX_INITIALIZER
 
+static inline int spin_trylock(spinlock_t *lock)
+{
+    return pthread_mutex_trylock(lock) == 0;
+}
+
 #else
 
 #if defined(__hppa__)
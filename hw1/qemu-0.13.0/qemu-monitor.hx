@@ -1837,6 +1837,31 @@ Each json-object contain the following:
     - "wr_operations": write operations (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "rd_merged": read requests merged into an adjacent one before
+                   submission (json-int, optional)
+    - "wr_merged": write requests merged into an adjacent one before
+                   submission (json-int, optional)
+      The merge counters are only present once requests have been merged.
+    - "l2_cache_hits": L2 table cache hits (json-int, optional)
+    - "l2_cache_misses": L2 table cache misses (json-int, optional)
+    - "refcount_cache_hits": refcount block cache hits (json-int, optional)
+    - "refcount_cache_misses": refcount block cache misses (json-int,
+                               optional)
+      The cache counters are only present for formats that keep metadata
+      caches (qcow2), once the cache has been used.
+    - "aio_requests": requests completed by the host AIO queue (json-int,
+                      optional)
+    - "aio_merged": requests merged with an adjacent one into a single
+                    system call (json-int, optional)
+    - "aio_total_latency_ns": sum of the request latencies in nanoseconds
+                              (json-int, optional)
+    - "aio_max_latency_ns": highest request latency in nanoseconds
+                            (json-int, optional)
+    - "aio_queue_depth": requests currently in flight (json-int, optional)
+    - "aio_max_queue_depth": highest number of requests in flight (json-int,
+                             optional)
+      The AIO counters are only present for host files and devices
+      (usually in "parent"), once they have been used for AIO.
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
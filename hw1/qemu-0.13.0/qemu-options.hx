@@ -120,7 +120,8 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
-    "       [,readonly=on|off]\n"
+    "       [,aio-queue-depth=n][,aio-poll=on|off]\n"
+    "       [,readonly=on|off][,l2-cache-size=b][,refcount-cache-size=b]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -152,6 +153,20 @@ These options have the same definition as they have in @option{-hdachs}.
 @var{cache} is "none", "writeback", "unsafe", or "writethrough" and controls how the host cache is used to access block data.
 @item aio=@var{aio}
 @var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@item aio-queue-depth=@var{n}
+Number of requests that native Linux AIO keeps in flight, 128 by default.
+Further requests wait in QEMU until earlier ones complete.
+@item aio-poll=@var{poll}
+@var{poll} is "on" or "off".  With "on", completions of native Linux AIO
+requests are polled for while requests are in flight and read directly from
+the kernel's completion ring.  This lowers latency at high request rates at
+the cost of keeping a host CPU busy.
+@item l2-cache-size=@var{size},refcount-cache-size=@var{size}
+Amount of memory used to cache qcow2 L2 tables and refcount blocks.  Each
+table takes one cluster; the default is 16 tables of each kind.  Larger caches
+help random I/O on big images, and with @option{cache=writeback} or
+@option{cache=none} let metadata updates be batched until the guest flushes.
+Optional suffixes "k" and "M" are accepted.
 @item format=@var{format}
 Specify which disk @var{format} will be used rather than detecting
 the format.  Can be used to specifiy format=raw to avoid interpreting
@@ -35,6 +35,9 @@
 
 #define TARGET_HAS_ICE 1
 
+/* gen_pc_save() records the guest pc and cc_op */
+#define TARGET_RESTORE_WORDS 2
+
 #ifdef TARGET_X86_64
 #define ELF_MACHINE	EM_X86_64
 #else
@@ -838,6 +841,15 @@ void cpu_x86_frstor(CPUX86State *s, target_ulong ptr, int data32);
 int cpu_x86_signal_handler(int host_signum, void *pinfo,
                            void *puc);
 
+#if defined(CONFIG_USER_ONLY)
+/* The user mode emulator may install this to run frequent system calls
+   straight from the int $0x80 and syscall helpers, without leaving
+   cpu_exec().  trapnr is 0x80 or EXCP_SYSCALL.  A nonzero return means
+   the call was handled: EAX holds the result and EIP is next_eip.  */
+extern int (*cpu_x86_syscall_hook)(CPUX86State *env, int trapnr,
+                                   target_ulong next_eip);
+#endif
+
 /* cpuid.c */
 void cpu_x86_cpuid(CPUX86State *env, uint32_t index, uint32_t count,
                    uint32_t *eax, uint32_t *ebx,
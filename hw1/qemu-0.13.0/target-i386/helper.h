@@ -77,6 +77,8 @@ DEF_HELPER_1(cmpxchg8b, void, tl)
 #ifdef TARGET_X86_64
 DEF_HELPER_1(cmpxchg16b, void, tl)
 #endif
+DEF_HELPER_3(rep_movs, void, int, int, int)
+DEF_HELPER_2(rep_stos, void, int, int)
 DEF_HELPER_0(single_step, void)
 DEF_HELPER_0(cpuid, void)
 DEF_HELPER_0(rdtsc, void)
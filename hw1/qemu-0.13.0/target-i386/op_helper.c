@@ -17,6 +17,16 @@
  * License along with this library; if not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif
 #include "exec.h"
 #include "exec-all.h"
 #include "host-utils.h"
@@ -1000,6 +1010,10 @@ static void do_interrupt64(int intno, int is_int, int error_code,
 #if defined(CONFIG_USER_ONLY)
 void helper_syscall(int next_eip_addend)
 {
+    if (cpu_x86_syscall_hook &&
+        cpu_x86_syscall_hook(env, EXCP_SYSCALL, env->eip + next_eip_addend)) {
+        return;
+    }
     env->exception_index = EXCP_SYSCALL;
     env->exception_next_eip = env->eip + next_eip_addend;
     cpu_loop_exit();
@@ -1876,6 +1890,57 @@ void helper_into(int next_eip_addend)
     }
 }
 
+#if defined(CONFIG_USER_ONLY) && defined(__x86_64__)
+/* On this host the translator does the other LOCK-prefixed instructions
+   with host atomics on guest memory rather than with helper_lock (see
+   lock_is_atomic), so these must be atomic the same way.  */
+void helper_cmpxchg8b(target_ulong a0)
+{
+    uint64_t d, cmp;
+    int eflags;
+
+    eflags = helper_cc_compute_all(CC_OP);
+    cmp = ((uint64_t)EDX << 32) | (uint32_t)EAX;
+    d = __sync_val_compare_and_swap((uint64_t *)g2h(a0), cmp,
+                                    ((uint64_t)ECX << 32) | (uint32_t)EBX);
+    if (d == cmp) {
+        eflags |= CC_Z;
+    } else {
+        EDX = (uint32_t)(d >> 32);
+        EAX = (uint32_t)d;
+        eflags &= ~CC_Z;
+    }
+    CC_SRC = eflags;
+}
+
+#ifdef TARGET_X86_64
+void helper_cmpxchg16b(target_ulong a0)
+{
+    uint64_t d0, d1;
+    uint8_t ok;
+    int eflags;
+
+    if ((a0 & 0xf) != 0)
+        raise_exception(EXCP0D_GPF);
+    eflags = helper_cc_compute_all(CC_OP);
+    d0 = EAX;
+    d1 = EDX;
+    asm volatile("lock cmpxchg16b %1\n\tsete %0"
+                 : "=q" (ok), "+m" (*(uint64_t (*)[2])g2h(a0)),
+                   "+a" (d0), "+d" (d1)
+                 : "b" ((uint64_t)EBX), "c" ((uint64_t)ECX)
+                 : "memory", "cc");
+    if (ok) {
+        eflags |= CC_Z;
+    } else {
+        EDX = d1;
+        EAX = d0;
+        eflags &= ~CC_Z;
+    }
+    CC_SRC = eflags;
+}
+#endif
+#else
 void helper_cmpxchg8b(target_ulong a0)
 {
     uint64_t d;
@@ -1922,6 +1987,181 @@ void helper_cmpxchg16b(target_ulong a0)
     CC_SRC = eflags;
 }
 #endif
+#endif
+
+/* Bulk part of rep movs and rep stos.  As many whole elements as
+   possible are copied or filled with host memcpy/memset, one page
+   contiguous chunk at a time, and ECX/ESI/EDI are left as if that many
+   iterations had run.  We stop at anything the per-element path must
+   handle: DF set, a page that is not plain RAM (MMIO, watchpoints,
+   pages with translated code), an element straddling two pages, or
+   source and destination too close together.  The translated code then
+   does one element the slow way and comes back here.  */
+
+/* bound the time spent without checking for interrupts */
+#define REP_BULK_MAX (64 * TARGET_PAGE_SIZE)
+
+static target_ulong rep_bulk_linear(target_ulong reg, int aflag, int seg)
+{
+#ifdef TARGET_X86_64
+    if (aflag == 2) {
+        return seg >= 0 ? reg + env->segs[seg].base : reg;
+    }
+#endif
+    if (seg >= 0) {
+        reg += env->segs[seg].base;
+    }
+    return (uint32_t)reg;
+}
+
+static target_ulong rep_bulk_advance(target_ulong reg, int aflag,
+                                     target_ulong len)
+{
+#ifdef TARGET_X86_64
+    if (aflag == 2) {
+        return reg + len;
+    }
+#endif
+    return (uint32_t)(reg + len);
+}
+
+/* Host address of the page at addr if it is RAM that can be accessed
+   directly, otherwise NULL.  */
+static uint8_t *rep_bulk_host_addr(target_ulong addr, int is_write)
+{
+#if defined(CONFIG_USER_ONLY)
+    if (!(page_get_flags(addr) & (is_write ? PAGE_WRITE : PAGE_READ))) {
+        return NULL;
+    }
+    return g2h(addr);
+#else
+    int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    CPUTLBEntry *te = &env->tlb_table[cpu_mmu_index(env)][index];
+    target_ulong tlb_addr = is_write ? te->addr_write : te->addr_read;
+
+    /* TLB_INVALID_MASK, TLB_MMIO or TLB_NOTDIRTY all send us to the
+       slow path, which also refills the TLB on a miss */
+    if (tlb_addr != (addr & TARGET_PAGE_MASK)) {
+        return NULL;
+    }
+    return (uint8_t *)(long)(addr + te->addend);
+#endif
+}
+
+/* Length of the next chunk at src (if non-NULL) and dst.  */
+static target_ulong rep_bulk_len(int ot, target_ulong count,
+                                 target_ulong done, target_ulong *src,
+                                 target_ulong dst)
+{
+    target_ulong len;
+
+    len = REP_BULK_MAX - done;
+    if (count < (len >> ot)) {
+        len = count << ot;
+    }
+    len = MIN(len, TARGET_PAGE_SIZE - (dst & ~TARGET_PAGE_MASK));
+    if (src) {
+        len = MIN(len, TARGET_PAGE_SIZE - (*src & ~TARGET_PAGE_MASK));
+    }
+    return len & ~(target_ulong)((1 << ot) - 1);
+}
+
+void helper_rep_movs(int ot, int aflag, int override)
+{
+    target_ulong count, src, dst, len, done;
+    uint8_t *hs, *hd;
+    int seg, dseg;
+
+    if (env->df != 1) {
+        return;
+    }
+    /* same segments as gen_string_movl_A0_ESI/EDI */
+    seg = override;
+    dseg = -1;
+    if (aflag == 1 && (env->hflags & HF_ADDSEG_MASK)) {
+        if (seg < 0) {
+            seg = R_DS;
+        }
+        dseg = R_ES;
+    }
+    count = aflag == 1 ? (uint32_t)ECX : ECX;
+    for (done = 0; count != 0 && done < REP_BULK_MAX; done += len) {
+        src = rep_bulk_linear(ESI, aflag, seg);
+        dst = rep_bulk_linear(EDI, aflag, dseg);
+        len = rep_bulk_len(ot, count, done, &src, dst);
+        if (len == 0) {
+            break;
+        }
+        hs = rep_bulk_host_addr(src, 0);
+        hd = rep_bulk_host_addr(dst, 1);
+        if (!hs || !hd) {
+            break;
+        }
+        /* element by element, a destination just above the source
+           replicates the data in between; memmove would not */
+        if (hd > hs && hd - hs < len) {
+            len = (hd - hs) & ~((1 << ot) - 1);
+            if (len == 0) {
+                break;
+            }
+        }
+        memmove(hd, hs, len);
+        count -= len >> ot;
+        ECX = count;
+        ESI = rep_bulk_advance(ESI, aflag, len);
+        EDI = rep_bulk_advance(EDI, aflag, len);
+    }
+}
+
+void helper_rep_stos(int ot, int aflag)
+{
+    target_ulong count, dst, len, done, i;
+    uint8_t pat[8], *hd;
+    int dseg;
+
+    if (env->df != 1) {
+        return;
+    }
+    dseg = aflag == 1 && (env->hflags & HF_ADDSEG_MASK) ? R_ES : -1;
+    for (i = 0; i < sizeof(pat); i += 1 << ot) {
+        switch (ot) {
+        case 0:
+            stb_p(pat + i, EAX);
+            break;
+        case 1:
+            stw_p(pat + i, EAX);
+            break;
+        case 2:
+            stl_p(pat + i, EAX);
+            break;
+        default:
+            stq_p(pat + i, EAX);
+            break;
+        }
+    }
+    count = aflag == 1 ? (uint32_t)ECX : ECX;
+    for (done = 0; count != 0 && done < REP_BULK_MAX; done += len) {
+        dst = rep_bulk_linear(EDI, aflag, dseg);
+        len = rep_bulk_len(ot, count, done, NULL, dst);
+        if (len == 0) {
+            break;
+        }
+        hd = rep_bulk_host_addr(dst, 1);
+        if (!hd) {
+            break;
+        }
+        if (memcmp(pat, pat + 1, sizeof(pat) - 1) == 0) {
+            memset(hd, pat[0], len);
+        } else {
+            for (i = 0; i < len; i += sizeof(pat)) {
+                memcpy(hd + i, pat, MIN(sizeof(pat), len - i));
+            }
+        }
+        count -= len >> ot;
+        ECX = count;
+        EDI = rep_bulk_advance(EDI, aflag, len);
+    }
+}
 
 void helper_single_step(void)
 {
@@ -4712,8 +4952,19 @@ void helper_reset_rf(void)
     env->eflags &= ~RF_MASK;
 }
 
+#if defined(CONFIG_USER_ONLY)
+int (*cpu_x86_syscall_hook)(CPUX86State *env, int trapnr,
+                            target_ulong next_eip);
+#endif
+
 void helper_raise_interrupt(int intno, int next_eip_addend)
 {
+#if defined(CONFIG_USER_ONLY)
+    if (intno == 0x80 && cpu_x86_syscall_hook &&
+        cpu_x86_syscall_hook(env, intno, env->eip + next_eip_addend)) {
+        return;
+    }
+#endif
     raise_interrupt(intno, 1, 0, next_eip_addend);
 }
 
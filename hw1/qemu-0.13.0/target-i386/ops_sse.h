@@ -35,6 +35,41 @@
 #define SUFFIX _xmm
 #endif
 
+#ifdef __SSE2__
+/* Host SSE2 implementations.  MMX registers are handled in the low half
+   of a host XMM register, as the host MMX instructions would alias the
+   host x87 register stack.  */
+#if SHIFT == 0
+#define SSE_LOAD(r) _mm_loadl_epi64((__m128i *)(r))
+#define SSE_STORE(r, v) _mm_storel_epi64((__m128i *)(r), v)
+#else
+#define SSE_LOAD(r) _mm_loadu_si128((__m128i *)(r))
+#define SSE_STORE(r, v) _mm_storeu_si128((__m128i *)(r), v)
+#endif
+
+#define SSE_HELPER_HOST(name, V)\
+void glue(name, SUFFIX) (Reg *d, Reg *s)\
+{\
+    SSE_STORE(d, V(SSE_LOAD(d), SSE_LOAD(s)));\
+}
+
+/* The host shifts take their count from the low quadword of the source
+   and saturate exactly like the guest instructions do.  */
+#define SSE_HELPER_SHIFT(name, V)\
+void glue(name, SUFFIX)(Reg *d, Reg *s)\
+{\
+    SSE_STORE(d, V(SSE_LOAD(d), _mm_loadl_epi64((__m128i *)s)));\
+}
+
+SSE_HELPER_SHIFT(helper_psrlw, _mm_srl_epi16)
+SSE_HELPER_SHIFT(helper_psraw, _mm_sra_epi16)
+SSE_HELPER_SHIFT(helper_psllw, _mm_sll_epi16)
+SSE_HELPER_SHIFT(helper_psrld, _mm_srl_epi32)
+SSE_HELPER_SHIFT(helper_psrad, _mm_sra_epi32)
+SSE_HELPER_SHIFT(helper_pslld, _mm_sll_epi32)
+SSE_HELPER_SHIFT(helper_psrlq, _mm_srl_epi64)
+SSE_HELPER_SHIFT(helper_psllq, _mm_sll_epi64)
+#else
 void glue(helper_psrlw, SUFFIX)(Reg *d, Reg *s)
 {
     int shift;
@@ -196,6 +231,7 @@ void glue(helper_psllq, SUFFIX)(Reg *d, Reg *s)
 #endif
     }
 }
+#endif
 
 #if SHIFT == 1
 void glue(helper_psrldq, SUFFIX)(Reg *d, Reg *s)
@@ -283,6 +319,42 @@ void glue(name, SUFFIX) (Reg *d, Reg *s)\
     )\
 }
 
+/* Element-wise helpers with a host vector equivalent V; F is the
+   portable fallback.  */
+#ifdef __SSE2__
+#define SSE2_HELPER_B(name, F, V) SSE_HELPER_HOST(name, V)
+#define SSE2_HELPER_W(name, F, V) SSE_HELPER_HOST(name, V)
+#define SSE2_HELPER_L(name, F, V) SSE_HELPER_HOST(name, V)
+#define SSE2_HELPER_Q(name, F, V) SSE_HELPER_HOST(name, V)
+#else
+#define SSE2_HELPER_B(name, F, V) SSE_HELPER_B(name, F)
+#define SSE2_HELPER_W(name, F, V) SSE_HELPER_W(name, F)
+#define SSE2_HELPER_L(name, F, V) SSE_HELPER_L(name, F)
+#define SSE2_HELPER_Q(name, F, V) SSE_HELPER_Q(name, F)
+#endif
+#ifdef __SSSE3__
+#define SSSE3_HELPER_B(name, F, V) SSE_HELPER_HOST(name, V)
+#define SSSE3_HELPER_W(name, F, V) SSE_HELPER_HOST(name, V)
+#define SSSE3_HELPER_L(name, F, V) SSE_HELPER_HOST(name, V)
+#define SSSE3_HELPER_Q(name, F, V) SSE_HELPER_HOST(name, V)
+#else
+#define SSSE3_HELPER_B(name, F, V) SSE_HELPER_B(name, F)
+#define SSSE3_HELPER_W(name, F, V) SSE_HELPER_W(name, F)
+#define SSSE3_HELPER_L(name, F, V) SSE_HELPER_L(name, F)
+#define SSSE3_HELPER_Q(name, F, V) SSE_HELPER_Q(name, F)
+#endif
+#ifdef __SSE4_1__
+#define SSE41_HELPER_B(name, F, V) SSE_HELPER_HOST(name, V)
+#define SSE41_HELPER_W(name, F, V) SSE_HELPER_HOST(name, V)
+#define SSE41_HELPER_L(name, F, V) SSE_HELPER_HOST(name, V)
+#define SSE41_HELPER_Q(name, F, V) SSE_HELPER_HOST(name, V)
+#else
+#define SSE41_HELPER_B(name, F, V) SSE_HELPER_B(name, F)
+#define SSE41_HELPER_W(name, F, V) SSE_HELPER_W(name, F)
+#define SSE41_HELPER_L(name, F, V) SSE_HELPER_L(name, F)
+#define SSE41_HELPER_Q(name, F, V) SSE_HELPER_Q(name, F)
+#endif
+
 #if SHIFT == 0
 static inline int satub(int x)
 {
@@ -358,55 +430,70 @@ static inline int satsw(int x)
 #define FAVG(a, b) ((a) + (b) + 1) >> 1
 #endif
 
-SSE_HELPER_B(helper_paddb, FADD)
-SSE_HELPER_W(helper_paddw, FADD)
-SSE_HELPER_L(helper_paddl, FADD)
-SSE_HELPER_Q(helper_paddq, FADD)
+SSE2_HELPER_B(helper_paddb, FADD, _mm_add_epi8)
+SSE2_HELPER_W(helper_paddw, FADD, _mm_add_epi16)
+SSE2_HELPER_L(helper_paddl, FADD, _mm_add_epi32)
+SSE2_HELPER_Q(helper_paddq, FADD, _mm_add_epi64)
 
-SSE_HELPER_B(helper_psubb, FSUB)
-SSE_HELPER_W(helper_psubw, FSUB)
-SSE_HELPER_L(helper_psubl, FSUB)
-SSE_HELPER_Q(helper_psubq, FSUB)
+SSE2_HELPER_B(helper_psubb, FSUB, _mm_sub_epi8)
+SSE2_HELPER_W(helper_psubw, FSUB, _mm_sub_epi16)
+SSE2_HELPER_L(helper_psubl, FSUB, _mm_sub_epi32)
+SSE2_HELPER_Q(helper_psubq, FSUB, _mm_sub_epi64)
 
-SSE_HELPER_B(helper_paddusb, FADDUB)
-SSE_HELPER_B(helper_paddsb, FADDSB)
-SSE_HELPER_B(helper_psubusb, FSUBUB)
-SSE_HELPER_B(helper_psubsb, FSUBSB)
+SSE2_HELPER_B(helper_paddusb, FADDUB, _mm_adds_epu8)
+SSE2_HELPER_B(helper_paddsb, FADDSB, _mm_adds_epi8)
+SSE2_HELPER_B(helper_psubusb, FSUBUB, _mm_subs_epu8)
+SSE2_HELPER_B(helper_psubsb, FSUBSB, _mm_subs_epi8)
 
-SSE_HELPER_W(helper_paddusw, FADDUW)
-SSE_HELPER_W(helper_paddsw, FADDSW)
-SSE_HELPER_W(helper_psubusw, FSUBUW)
-SSE_HELPER_W(helper_psubsw, FSUBSW)
+SSE2_HELPER_W(helper_paddusw, FADDUW, _mm_adds_epu16)
+SSE2_HELPER_W(helper_paddsw, FADDSW, _mm_adds_epi16)
+SSE2_HELPER_W(helper_psubusw, FSUBUW, _mm_subs_epu16)
+SSE2_HELPER_W(helper_psubsw, FSUBSW, _mm_subs_epi16)
 
-SSE_HELPER_B(helper_pminub, FMINUB)
-SSE_HELPER_B(helper_pmaxub, FMAXUB)
+SSE2_HELPER_B(helper_pminub, FMINUB, _mm_min_epu8)
+SSE2_HELPER_B(helper_pmaxub, FMAXUB, _mm_max_epu8)
 
-SSE_HELPER_W(helper_pminsw, FMINSW)
-SSE_HELPER_W(helper_pmaxsw, FMAXSW)
+SSE2_HELPER_W(helper_pminsw, FMINSW, _mm_min_epi16)
+SSE2_HELPER_W(helper_pmaxsw, FMAXSW, _mm_max_epi16)
 
-SSE_HELPER_Q(helper_pand, FAND)
-SSE_HELPER_Q(helper_pandn, FANDN)
-SSE_HELPER_Q(helper_por, FOR)
-SSE_HELPER_Q(helper_pxor, FXOR)
+SSE2_HELPER_Q(helper_pand, FAND, _mm_and_si128)
+SSE2_HELPER_Q(helper_pandn, FANDN, _mm_andnot_si128)
+SSE2_HELPER_Q(helper_por, FOR, _mm_or_si128)
+SSE2_HELPER_Q(helper_pxor, FXOR, _mm_xor_si128)
 
-SSE_HELPER_B(helper_pcmpgtb, FCMPGTB)
-SSE_HELPER_W(helper_pcmpgtw, FCMPGTW)
-SSE_HELPER_L(helper_pcmpgtl, FCMPGTL)
+SSE2_HELPER_B(helper_pcmpgtb, FCMPGTB, _mm_cmpgt_epi8)
+SSE2_HELPER_W(helper_pcmpgtw, FCMPGTW, _mm_cmpgt_epi16)
+SSE2_HELPER_L(helper_pcmpgtl, FCMPGTL, _mm_cmpgt_epi32)
 
-SSE_HELPER_B(helper_pcmpeqb, FCMPEQ)
-SSE_HELPER_W(helper_pcmpeqw, FCMPEQ)
-SSE_HELPER_L(helper_pcmpeql, FCMPEQ)
+SSE2_HELPER_B(helper_pcmpeqb, FCMPEQ, _mm_cmpeq_epi8)
+SSE2_HELPER_W(helper_pcmpeqw, FCMPEQ, _mm_cmpeq_epi16)
+SSE2_HELPER_L(helper_pcmpeql, FCMPEQ, _mm_cmpeq_epi32)
 
-SSE_HELPER_W(helper_pmullw, FMULLW)
+SSE2_HELPER_W(helper_pmullw, FMULLW, _mm_mullo_epi16)
 #if SHIFT == 0
 SSE_HELPER_W(helper_pmulhrw, FMULHRW)
 #endif
-SSE_HELPER_W(helper_pmulhuw, FMULHUW)
-SSE_HELPER_W(helper_pmulhw, FMULHW)
+SSE2_HELPER_W(helper_pmulhuw, FMULHUW, _mm_mulhi_epu16)
+SSE2_HELPER_W(helper_pmulhw, FMULHW, _mm_mulhi_epi16)
 
-SSE_HELPER_B(helper_pavgb, FAVG)
-SSE_HELPER_W(helper_pavgw, FAVG)
+SSE2_HELPER_B(helper_pavgb, FAVG, _mm_avg_epu8)
+SSE2_HELPER_W(helper_pavgw, FAVG, _mm_avg_epu16)
 
+#if SHIFT == 0
+static inline int abs1(int a)
+{
+    if (a < 0)
+        return -a;
+    else
+        return a;
+}
+#endif
+
+#ifdef __SSE2__
+SSE_HELPER_HOST(helper_pmuludq, _mm_mul_epu32)
+SSE_HELPER_HOST(helper_pmaddwd, _mm_madd_epi16)
+SSE_HELPER_HOST(helper_psadbw, _mm_sad_epu8)
+#else
 void glue(helper_pmuludq, SUFFIX) (Reg *d, Reg *s)
 {
     d->Q(0) = (uint64_t)s->L(0) * (uint64_t)d->L(0);
@@ -425,15 +512,6 @@ void glue(helper_pmaddwd, SUFFIX) (Reg *d, Reg *s)
     }
 }
 
-#if SHIFT == 0
-static inline int abs1(int a)
-{
-    if (a < 0)
-        return -a;
-    else
-        return a;
-}
-#endif
 void glue(helper_psadbw, SUFFIX) (Reg *d, Reg *s)
 {
     unsigned int val;
@@ -461,6 +539,7 @@ void glue(helper_psadbw, SUFFIX) (Reg *d, Reg *s)
     d->Q(1) = val;
 #endif
 }
+#endif
 
 void glue(helper_maskmov, SUFFIX) (Reg *d, Reg *s, target_ulong a0)
 {
@@ -1030,6 +1109,11 @@ uint32_t glue(helper_pmovmskb, SUFFIX)(Reg *s)
     return val;
 }
 
+#if SHIFT == 1 && defined(__SSE2__)
+SSE_HELPER_HOST(helper_packsswb, _mm_packs_epi16)
+SSE_HELPER_HOST(helper_packuswb, _mm_packus_epi16)
+SSE_HELPER_HOST(helper_packssdw, _mm_packs_epi32)
+#else
 void glue(helper_packsswb, SUFFIX) (Reg *d, Reg *s)
 {
     Reg r;
@@ -1102,6 +1186,7 @@ void glue(helper_packssdw, SUFFIX) (Reg *d, Reg *s)
 #endif
     *d = r;
 }
+#endif
 
 #define UNPCK_OP(base_name, base)                               \
                                                                 \
@@ -1171,8 +1256,19 @@ void glue(helper_punpck ## base_name ## qdq, SUFFIX) (Reg *d, Reg *s)  \
 }                                                               \
 )
 
+#if SHIFT == 1 && defined(__SSE2__)
+SSE_HELPER_HOST(helper_punpcklbw, _mm_unpacklo_epi8)
+SSE_HELPER_HOST(helper_punpcklwd, _mm_unpacklo_epi16)
+SSE_HELPER_HOST(helper_punpckldq, _mm_unpacklo_epi32)
+SSE_HELPER_HOST(helper_punpcklqdq, _mm_unpacklo_epi64)
+SSE_HELPER_HOST(helper_punpckhbw, _mm_unpackhi_epi8)
+SSE_HELPER_HOST(helper_punpckhwd, _mm_unpackhi_epi16)
+SSE_HELPER_HOST(helper_punpckhdq, _mm_unpackhi_epi32)
+SSE_HELPER_HOST(helper_punpckhqdq, _mm_unpackhi_epi64)
+#else
 UNPCK_OP(l, 0)
 UNPCK_OP(h, 1)
+#endif
 
 /* 3DNow! float ops */
 #if SHIFT == 0
@@ -1306,6 +1402,12 @@ void helper_pswapd(MMXReg *d, MMXReg *s)
 #endif
 
 /* SSSE3 op helpers */
+#if SHIFT == 1 && defined(__SSSE3__)
+SSE_HELPER_HOST(helper_pshufb, _mm_shuffle_epi8)
+SSE_HELPER_HOST(helper_phaddw, _mm_hadd_epi16)
+SSE_HELPER_HOST(helper_phaddd, _mm_hadd_epi32)
+SSE_HELPER_HOST(helper_phaddsw, _mm_hadds_epi16)
+#else
 void glue(helper_pshufb, SUFFIX) (Reg *d, Reg *s)
 {
     int i;
@@ -1319,36 +1421,49 @@ void glue(helper_pshufb, SUFFIX) (Reg *d, Reg *s)
 
 void glue(helper_phaddw, SUFFIX) (Reg *d, Reg *s)
 {
-    d->W(0) = (int16_t)d->W(0) + (int16_t)d->W(1);
-    d->W(1) = (int16_t)d->W(2) + (int16_t)d->W(3);
-    XMM_ONLY(d->W(2) = (int16_t)d->W(4) + (int16_t)d->W(5));
-    XMM_ONLY(d->W(3) = (int16_t)d->W(6) + (int16_t)d->W(7));
-    d->W((2 << SHIFT) + 0) = (int16_t)s->W(0) + (int16_t)s->W(1);
-    d->W((2 << SHIFT) + 1) = (int16_t)s->W(2) + (int16_t)s->W(3);
-    XMM_ONLY(d->W(6) = (int16_t)s->W(4) + (int16_t)s->W(5));
-    XMM_ONLY(d->W(7) = (int16_t)s->W(6) + (int16_t)s->W(7));
+    Reg r;
+
+    r.W(0) = (int16_t)d->W(0) + (int16_t)d->W(1);
+    r.W(1) = (int16_t)d->W(2) + (int16_t)d->W(3);
+    XMM_ONLY(r.W(2) = (int16_t)d->W(4) + (int16_t)d->W(5));
+    XMM_ONLY(r.W(3) = (int16_t)d->W(6) + (int16_t)d->W(7));
+    r.W((2 << SHIFT) + 0) = (int16_t)s->W(0) + (int16_t)s->W(1);
+    r.W((2 << SHIFT) + 1) = (int16_t)s->W(2) + (int16_t)s->W(3);
+    XMM_ONLY(r.W(6) = (int16_t)s->W(4) + (int16_t)s->W(5));
+    XMM_ONLY(r.W(7) = (int16_t)s->W(6) + (int16_t)s->W(7));
+    *d = r;
 }
 
 void glue(helper_phaddd, SUFFIX) (Reg *d, Reg *s)
 {
-    d->L(0) = (int32_t)d->L(0) + (int32_t)d->L(1);
-    XMM_ONLY(d->L(1) = (int32_t)d->L(2) + (int32_t)d->L(3));
-    d->L((1 << SHIFT) + 0) = (int32_t)s->L(0) + (int32_t)s->L(1);
-    XMM_ONLY(d->L(3) = (int32_t)s->L(2) + (int32_t)s->L(3));
+    Reg r;
+
+    r.L(0) = (int32_t)d->L(0) + (int32_t)d->L(1);
+    XMM_ONLY(r.L(1) = (int32_t)d->L(2) + (int32_t)d->L(3));
+    r.L((1 << SHIFT) + 0) = (int32_t)s->L(0) + (int32_t)s->L(1);
+    XMM_ONLY(r.L(3) = (int32_t)s->L(2) + (int32_t)s->L(3));
+    *d = r;
 }
 
 void glue(helper_phaddsw, SUFFIX) (Reg *d, Reg *s)
 {
-    d->W(0) = satsw((int16_t)d->W(0) + (int16_t)d->W(1));
-    d->W(1) = satsw((int16_t)d->W(2) + (int16_t)d->W(3));
-    XMM_ONLY(d->W(2) = satsw((int16_t)d->W(4) + (int16_t)d->W(5)));
-    XMM_ONLY(d->W(3) = satsw((int16_t)d->W(6) + (int16_t)d->W(7)));
-    d->W((2 << SHIFT) + 0) = satsw((int16_t)s->W(0) + (int16_t)s->W(1));
-    d->W((2 << SHIFT) + 1) = satsw((int16_t)s->W(2) + (int16_t)s->W(3));
-    XMM_ONLY(d->W(6) = satsw((int16_t)s->W(4) + (int16_t)s->W(5)));
-    XMM_ONLY(d->W(7) = satsw((int16_t)s->W(6) + (int16_t)s->W(7)));
+    Reg r;
+
+    r.W(0) = satsw((int16_t)d->W(0) + (int16_t)d->W(1));
+    r.W(1) = satsw((int16_t)d->W(2) + (int16_t)d->W(3));
+    XMM_ONLY(r.W(2) = satsw((int16_t)d->W(4) + (int16_t)d->W(5)));
+    XMM_ONLY(r.W(3) = satsw((int16_t)d->W(6) + (int16_t)d->W(7)));
+    r.W((2 << SHIFT) + 0) = satsw((int16_t)s->W(0) + (int16_t)s->W(1));
+    r.W((2 << SHIFT) + 1) = satsw((int16_t)s->W(2) + (int16_t)s->W(3));
+    XMM_ONLY(r.W(6) = satsw((int16_t)s->W(4) + (int16_t)s->W(5)));
+    XMM_ONLY(r.W(7) = satsw((int16_t)s->W(6) + (int16_t)s->W(7)));
+    *d = r;
 }
+#endif
 
+#ifdef __SSSE3__
+SSE_HELPER_HOST(helper_pmaddubsw, _mm_maddubs_epi16)
+#else
 void glue(helper_pmaddubsw, SUFFIX) (Reg *d, Reg *s)
 {
     d->W(0) = satsw((int8_t)s->B( 0) * (uint8_t)d->B( 0) +
@@ -1370,55 +1485,74 @@ void glue(helper_pmaddubsw, SUFFIX) (Reg *d, Reg *s)
                     (int8_t)s->B(15) * (uint8_t)d->B(15));
 #endif
 }
+#endif
 
+#if SHIFT == 1 && defined(__SSSE3__)
+SSE_HELPER_HOST(helper_phsubw, _mm_hsub_epi16)
+SSE_HELPER_HOST(helper_phsubd, _mm_hsub_epi32)
+SSE_HELPER_HOST(helper_phsubsw, _mm_hsubs_epi16)
+#else
 void glue(helper_phsubw, SUFFIX) (Reg *d, Reg *s)
 {
-    d->W(0) = (int16_t)d->W(0) - (int16_t)d->W(1);
-    d->W(1) = (int16_t)d->W(2) - (int16_t)d->W(3);
-    XMM_ONLY(d->W(2) = (int16_t)d->W(4) - (int16_t)d->W(5));
-    XMM_ONLY(d->W(3) = (int16_t)d->W(6) - (int16_t)d->W(7));
-    d->W((2 << SHIFT) + 0) = (int16_t)s->W(0) - (int16_t)s->W(1);
-    d->W((2 << SHIFT) + 1) = (int16_t)s->W(2) - (int16_t)s->W(3);
-    XMM_ONLY(d->W(6) = (int16_t)s->W(4) - (int16_t)s->W(5));
-    XMM_ONLY(d->W(7) = (int16_t)s->W(6) - (int16_t)s->W(7));
+    Reg r;
+
+    r.W(0) = (int16_t)d->W(0) - (int16_t)d->W(1);
+    r.W(1) = (int16_t)d->W(2) - (int16_t)d->W(3);
+    XMM_ONLY(r.W(2) = (int16_t)d->W(4) - (int16_t)d->W(5));
+    XMM_ONLY(r.W(3) = (int16_t)d->W(6) - (int16_t)d->W(7));
+    r.W((2 << SHIFT) + 0) = (int16_t)s->W(0) - (int16_t)s->W(1);
+    r.W((2 << SHIFT) + 1) = (int16_t)s->W(2) - (int16_t)s->W(3);
+    XMM_ONLY(r.W(6) = (int16_t)s->W(4) - (int16_t)s->W(5));
+    XMM_ONLY(r.W(7) = (int16_t)s->W(6) - (int16_t)s->W(7));
+    *d = r;
 }
 
 void glue(helper_phsubd, SUFFIX) (Reg *d, Reg *s)
 {
-    d->L(0) = (int32_t)d->L(0) - (int32_t)d->L(1);
-    XMM_ONLY(d->L(1) = (int32_t)d->L(2) - (int32_t)d->L(3));
-    d->L((1 << SHIFT) + 0) = (int32_t)s->L(0) - (int32_t)s->L(1);
-    XMM_ONLY(d->L(3) = (int32_t)s->L(2) - (int32_t)s->L(3));
+    Reg r;
+
+    r.L(0) = (int32_t)d->L(0) - (int32_t)d->L(1);
+    XMM_ONLY(r.L(1) = (int32_t)d->L(2) - (int32_t)d->L(3));
+    r.L((1 << SHIFT) + 0) = (int32_t)s->L(0) - (int32_t)s->L(1);
+    XMM_ONLY(r.L(3) = (int32_t)s->L(2) - (int32_t)s->L(3));
+    *d = r;
 }
 
 void glue(helper_phsubsw, SUFFIX) (Reg *d, Reg *s)
 {
-    d->W(0) = satsw((int16_t)d->W(0) - (int16_t)d->W(1));
-    d->W(1) = satsw((int16_t)d->W(2) - (int16_t)d->W(3));
-    XMM_ONLY(d->W(2) = satsw((int16_t)d->W(4) - (int16_t)d->W(5)));
-    XMM_ONLY(d->W(3) = satsw((int16_t)d->W(6) - (int16_t)d->W(7)));
-    d->W((2 << SHIFT) + 0) = satsw((int16_t)s->W(0) - (int16_t)s->W(1));
-    d->W((2 << SHIFT) + 1) = satsw((int16_t)s->W(2) - (int16_t)s->W(3));
-    XMM_ONLY(d->W(6) = satsw((int16_t)s->W(4) - (int16_t)s->W(5)));
-    XMM_ONLY(d->W(7) = satsw((int16_t)s->W(6) - (int16_t)s->W(7)));
+    Reg r;
+
+    r.W(0) = satsw((int16_t)d->W(0) - (int16_t)d->W(1));
+    r.W(1) = satsw((int16_t)d->W(2) - (int16_t)d->W(3));
+    XMM_ONLY(r.W(2) = satsw((int16_t)d->W(4) - (int16_t)d->W(5)));
+    XMM_ONLY(r.W(3) = satsw((int16_t)d->W(6) - (int16_t)d->W(7)));
+    r.W((2 << SHIFT) + 0) = satsw((int16_t)s->W(0) - (int16_t)s->W(1));
+    r.W((2 << SHIFT) + 1) = satsw((int16_t)s->W(2) - (int16_t)s->W(3));
+    XMM_ONLY(r.W(6) = satsw((int16_t)s->W(4) - (int16_t)s->W(5)));
+    XMM_ONLY(r.W(7) = satsw((int16_t)s->W(6) - (int16_t)s->W(7)));
+    *d = r;
 }
+#endif
 
 #define FABSB(_, x) x > INT8_MAX  ? -(int8_t ) x : x
 #define FABSW(_, x) x > INT16_MAX ? -(int16_t) x : x
 #define FABSL(_, x) x > INT32_MAX ? -(int32_t) x : x
-SSE_HELPER_B(helper_pabsb, FABSB)
-SSE_HELPER_W(helper_pabsw, FABSW)
-SSE_HELPER_L(helper_pabsd, FABSL)
+#define VABSB(d, s) _mm_abs_epi8(s)
+#define VABSW(d, s) _mm_abs_epi16(s)
+#define VABSL(d, s) _mm_abs_epi32(s)
+SSSE3_HELPER_B(helper_pabsb, FABSB, VABSB)
+SSSE3_HELPER_W(helper_pabsw, FABSW, VABSW)
+SSSE3_HELPER_L(helper_pabsd, FABSL, VABSL)
 
 #define FMULHRSW(d, s) ((int16_t) d * (int16_t) s + 0x4000) >> 15
-SSE_HELPER_W(helper_pmulhrsw, FMULHRSW)
+SSSE3_HELPER_W(helper_pmulhrsw, FMULHRSW, _mm_mulhrs_epi16)
 
 #define FSIGNB(d, s) s <= INT8_MAX  ? s ? d : 0 : -(int8_t ) d
 #define FSIGNW(d, s) s <= INT16_MAX ? s ? d : 0 : -(int16_t) d
 #define FSIGNL(d, s) s <= INT32_MAX ? s ? d : 0 : -(int32_t) d
-SSE_HELPER_B(helper_psignb, FSIGNB)
-SSE_HELPER_W(helper_psignw, FSIGNW)
-SSE_HELPER_L(helper_psignd, FSIGNL)
+SSSE3_HELPER_B(helper_psignb, FSIGNB, _mm_sign_epi8)
+SSSE3_HELPER_W(helper_psignw, FSIGNW, _mm_sign_epi16)
+SSSE3_HELPER_L(helper_psignd, FSIGNL, _mm_sign_epi32)
 
 void glue(helper_palignr, SUFFIX) (Reg *d, Reg *s, int32_t shift)
 {
@@ -1578,17 +1712,17 @@ void glue(helper_packusdw, SUFFIX) (Reg *d, Reg *s)
 #define FMINSD(d, s) MIN((int32_t) d, (int32_t) s)
 #define FMAXSB(d, s) MAX((int8_t) d, (int8_t) s)
 #define FMAXSD(d, s) MAX((int32_t) d, (int32_t) s)
-SSE_HELPER_B(helper_pminsb, FMINSB)
-SSE_HELPER_L(helper_pminsd, FMINSD)
-SSE_HELPER_W(helper_pminuw, MIN)
-SSE_HELPER_L(helper_pminud, MIN)
-SSE_HELPER_B(helper_pmaxsb, FMAXSB)
-SSE_HELPER_L(helper_pmaxsd, FMAXSD)
-SSE_HELPER_W(helper_pmaxuw, MAX)
-SSE_HELPER_L(helper_pmaxud, MAX)
+SSE41_HELPER_B(helper_pminsb, FMINSB, _mm_min_epi8)
+SSE41_HELPER_L(helper_pminsd, FMINSD, _mm_min_epi32)
+SSE41_HELPER_W(helper_pminuw, MIN, _mm_min_epu16)
+SSE41_HELPER_L(helper_pminud, MIN, _mm_min_epu32)
+SSE41_HELPER_B(helper_pmaxsb, FMAXSB, _mm_max_epi8)
+SSE41_HELPER_L(helper_pmaxsd, FMAXSD, _mm_max_epi32)
+SSE41_HELPER_W(helper_pmaxuw, MAX, _mm_max_epu16)
+SSE41_HELPER_L(helper_pmaxud, MAX, _mm_max_epu32)
 
 #define FMULLD(d, s) (int32_t) d * (int32_t) s
-SSE_HELPER_L(helper_pmulld, FMULLD)
+SSE41_HELPER_L(helper_pmulld, FMULLD, _mm_mullo_epi32)
 
 void glue(helper_phminposuw, SUFFIX) (Reg *d, Reg *s)
 {
@@ -2065,6 +2199,24 @@ target_ulong helper_popcnt(target_ulong n, uint32_t type)
 }
 #endif
 
+#ifdef __SSE2__
+#undef SSE_LOAD
+#undef SSE_STORE
+#undef SSE_HELPER_HOST
+#undef SSE_HELPER_SHIFT
+#endif
+#undef SSE2_HELPER_B
+#undef SSE2_HELPER_W
+#undef SSE2_HELPER_L
+#undef SSE2_HELPER_Q
+#undef SSSE3_HELPER_B
+#undef SSSE3_HELPER_W
+#undef SSSE3_HELPER_L
+#undef SSSE3_HELPER_Q
+#undef SSE41_HELPER_B
+#undef SSE41_HELPER_W
+#undef SSE41_HELPER_L
+#undef SSE41_HELPER_Q
 #undef SHIFT
 #undef XMM_ONLY
 #undef Reg
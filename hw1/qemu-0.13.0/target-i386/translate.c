@@ -73,6 +73,10 @@ static TCGv_ptr cpu_ptr0, cpu_ptr1;
 static TCGv_i32 cpu_tmp2_i32, cpu_tmp3_i32;
 static TCGv_i64 cpu_tmp1_i64;
 static TCGv cpu_tmp5;
+/* self checking TB being translated, and whether it stored into itself */
+static TranslationBlock *smc_check_tb;
+static TCGv cpu_smc_hit;
+static int smc_nb_checks;
 
 static uint8_t gen_opc_cc_op[OPC_BUF_SIZE];
 
@@ -86,6 +90,7 @@ typedef struct DisasContext {
     /* current insn context */
     int override; /* -1 if no override */
     int prefix;
+    int atomic; /* LOCK prefix done with host atomics, not helper_lock */
     int aflag, dflag;
     target_ulong pc; /* pc = eip + cs_base */
     int is_jmp; /* 1 = means jump (stop translation), 2 means CPU
@@ -593,6 +598,31 @@ static inline void gen_op_ld_T1_A0(int idx)
     gen_op_ld_v(idx, cpu_T[1], cpu_A0);
 }
 
+/* Note in cpu_smc_hit if a store at a0 may have written the guest code
+   of the self checking TB.  Its size is only known once it has been
+   translated, so it is read at run time.  */
+static void gen_smc_check(TCGv a0)
+{
+    TCGv t0, t1;
+    TCGv_ptr tb;
+
+    if (!smc_check_tb)
+        return;
+    t0 = tcg_temp_new();
+    t1 = tcg_temp_new();
+    tb = tcg_const_ptr((tcg_target_long)smc_check_tb);
+    /* a store starts at most 7 bytes before the code it overlaps */
+    tcg_gen_subi_tl(t0, a0, smc_check_tb->pc - 7);
+    tcg_gen_ld16u_tl(t1, tb, offsetof(TranslationBlock, size));
+    tcg_gen_addi_tl(t1, t1, 7);
+    tcg_gen_setcond_tl(TCG_COND_LTU, t0, t0, t1);
+    tcg_gen_or_tl(cpu_smc_hit, cpu_smc_hit, t0);
+    tcg_temp_free_ptr(tb);
+    tcg_temp_free(t1);
+    tcg_temp_free(t0);
+    smc_nb_checks++;
+}
+
 static inline void gen_op_st_v(int idx, TCGv t0, TCGv a0)
 {
     int mem_index = (idx >> 2) - 1;
@@ -614,6 +644,7 @@ static inline void gen_op_st_v(int idx, TCGv t0, TCGv a0)
 #endif
         break;
     }
+    gen_smc_check(a0);
 }
 
 static inline void gen_op_st_T0_A0(int idx)
@@ -1291,8 +1322,43 @@ static inline void gen_repz_ ## op(DisasContext *s, int ot,                   \
     gen_jmp(s, cur_eip);                                                      \
 }
 
-GEN_REPZ(movs)
-GEN_REPZ(stos)
+/* rep movs and rep stos first let a helper copy or fill whatever it can
+   with host memcpy/memset; the usual one element per iteration loop then
+   only handles what it left behind (MMIO, page boundaries...).  Not with
+   16 bit addressing, single stepping or instruction counting.  */
+#define GEN_REPZ_BULK(op)                                                     \
+static inline void gen_repz_ ## op(DisasContext *s, int ot,                   \
+                                 target_ulong cur_eip, target_ulong next_eip) \
+{                                                                             \
+    int l2;\
+    gen_update_cc_op(s);                                                      \
+    l2 = gen_jz_ecx_string(s, next_eip);                                      \
+    if (s->aflag && s->jmp_opt && !use_icount) {                              \
+        gen_ ## op ## _bulk(s, ot);                                           \
+        gen_op_jz_ecx(s->aflag, l2);                                          \
+    }                                                                         \
+    gen_ ## op(s, ot);                                                        \
+    gen_op_add_reg_im(s->aflag, R_ECX, -1);                                   \
+    /* a loop would cause two single step exceptions if ECX = 1               \
+       before rep string_insn */                                              \
+    if (!s->jmp_opt)                                                          \
+        gen_op_jz_ecx(s->aflag, l2);                                          \
+    gen_jmp(s, cur_eip);                                                      \
+}
+
+static inline void gen_movs_bulk(DisasContext *s, int ot)
+{
+    gen_helper_rep_movs(tcg_const_i32(ot), tcg_const_i32(s->aflag),
+                        tcg_const_i32(s->override));
+}
+
+static inline void gen_stos_bulk(DisasContext *s, int ot)
+{
+    gen_helper_rep_stos(tcg_const_i32(ot), tcg_const_i32(s->aflag));
+}
+
+GEN_REPZ_BULK(movs)
+GEN_REPZ_BULK(stos)
 GEN_REPZ(lods)
 GEN_REPZ(ins)
 GEN_REPZ(outs)
@@ -1327,9 +1393,167 @@ static void gen_helper_fp_arith_STN_ST0(int op, int opreg)
     }
 }
 
+#ifdef TCG_HAS_QEMU_ATOMIC
+/* read-modify-write operations that only gen_op_atomic does */
+enum {
+    OP_NOTL = 8,
+    OP_NEGL,
+    OP_BTSL,
+    OP_BTRL,
+    OP_BTCL,
+};
+
+/* LOCK-prefixed "op [A0], T1" with host atomics.  add and sub are a
+   single xadd; the other operations retry a cmpxchg until the word was
+   not modified by another thread in between.  not and neg ignore T1,
+   and bts, btr and btc take the bit number in it.  The result is left
+   in T0 and the flags are set as the non atomic code does.  */
+static void gen_op_atomic(DisasContext *s1, int op, int ot)
+{
+    int label1, label2;
+    TCGv a0, t0, t1, t2, t3, t4, cf;
+
+    switch(op) {
+    case OP_ADDL:
+        tcg_gen_qemu_xadd(cpu_T[0], cpu_A0, cpu_T[1], ot);
+        gen_smc_check(cpu_A0);
+        gen_op_addl_T0_T1();
+        gen_op_update2_cc();
+        s1->cc_op = CC_OP_ADDB + ot;
+        break;
+    case OP_SUBL:
+        tcg_gen_neg_tl(cpu_tmp0, cpu_T[1]);
+        tcg_gen_qemu_xadd(cpu_T[0], cpu_A0, cpu_tmp0, ot);
+        gen_smc_check(cpu_A0);
+        tcg_gen_sub_tl(cpu_T[0], cpu_T[0], cpu_T[1]);
+        gen_op_update2_cc();
+        s1->cc_op = CC_OP_SUBB + ot;
+        break;
+    default:
+        a0 = tcg_temp_local_new();
+        t0 = tcg_temp_local_new();
+        t1 = tcg_temp_local_new();
+        t2 = tcg_temp_local_new();
+        t3 = tcg_temp_local_new();
+        t4 = tcg_temp_local_new();
+        cf = tcg_temp_local_new();
+        label1 = gen_new_label();
+        label2 = gen_new_label();
+        tcg_gen_mov_tl(a0, cpu_A0);
+        if (op != OP_NOTL && op != OP_NEGL) {
+            tcg_gen_mov_tl(t1, cpu_T[1]);
+        }
+        gen_op_ld_v(ot + s1->mem_index, t0, a0);
+        /* the operand that does not depend on the memory word */
+        switch(op) {
+        case OP_ADCL:
+        case OP_SBBL:
+            if (s1->cc_op != CC_OP_DYNAMIC)
+                gen_op_set_cc_op(s1->cc_op);
+            gen_compute_eflags_c(cpu_tmp4);
+            tcg_gen_mov_tl(cf, cpu_tmp4);
+            tcg_gen_add_tl(t4, t1, cf);
+            break;
+        case OP_BTSL:
+        case OP_BTRL:
+        case OP_BTCL:
+            tcg_gen_movi_tl(t4, 1);
+            tcg_gen_shl_tl(t4, t4, t1);
+            if (op == OP_BTRL) {
+                tcg_gen_not_tl(t4, t4);
+            }
+            break;
+        }
+        gen_set_label(label1);
+        switch(op) {
+        case OP_ANDL:
+            tcg_gen_and_tl(t2, t0, t1);
+            break;
+        case OP_ORL:
+            tcg_gen_or_tl(t2, t0, t1);
+            break;
+        case OP_XORL:
+            tcg_gen_xor_tl(t2, t0, t1);
+            break;
+        case OP_ADCL:
+            tcg_gen_add_tl(t2, t0, t4);
+            break;
+        case OP_SBBL:
+            tcg_gen_sub_tl(t2, t0, t4);
+            break;
+        case OP_NOTL:
+            tcg_gen_not_tl(t2, t0);
+            break;
+        case OP_NEGL:
+            tcg_gen_neg_tl(t2, t0);
+            break;
+        case OP_BTSL:
+            tcg_gen_or_tl(t2, t0, t4);
+            break;
+        case OP_BTRL:
+            tcg_gen_and_tl(t2, t0, t4);
+            break;
+        default:
+            tcg_gen_xor_tl(t2, t0, t4);
+            break;
+        }
+        tcg_gen_qemu_cmpxchg(t3, a0, t0, t2, ot);
+        gen_smc_check(a0);
+        tcg_gen_brcond_tl(TCG_COND_EQ, t3, t0, label2);
+        tcg_gen_mov_tl(t0, t3);
+        tcg_gen_br(label1);
+        gen_set_label(label2);
+        tcg_gen_mov_tl(cpu_T[0], t2);
+        switch(op) {
+        case OP_ADCL:
+        case OP_SBBL:
+            tcg_gen_mov_tl(cpu_cc_src, t1);
+            tcg_gen_mov_tl(cpu_cc_dst, t2);
+            tcg_gen_trunc_tl_i32(cpu_tmp2_i32, cf);
+            tcg_gen_shli_i32(cpu_tmp2_i32, cpu_tmp2_i32, 2);
+            tcg_gen_addi_i32(cpu_cc_op, cpu_tmp2_i32,
+                             (op == OP_ADCL ? CC_OP_ADDB : CC_OP_SUBB) + ot);
+            s1->cc_op = CC_OP_DYNAMIC;
+            break;
+        case OP_NOTL:
+            break;
+        case OP_NEGL:
+            gen_op_update_neg_cc();
+            s1->cc_op = CC_OP_SUBB + ot;
+            break;
+        case OP_BTSL:
+        case OP_BTRL:
+        case OP_BTCL:
+            tcg_gen_shr_tl(cpu_cc_src, t0, t1);
+            tcg_gen_movi_tl(cpu_cc_dst, 0);
+            s1->cc_op = CC_OP_SARB + ot;
+            break;
+        default:
+            gen_op_update1_cc();
+            s1->cc_op = CC_OP_LOGICB + ot;
+            break;
+        }
+        tcg_temp_free(a0);
+        tcg_temp_free(t0);
+        tcg_temp_free(t1);
+        tcg_temp_free(t2);
+        tcg_temp_free(t3);
+        tcg_temp_free(t4);
+        tcg_temp_free(cf);
+        break;
+    }
+}
+#endif
+
 /* if d == OR_TMP0, it means memory operand (address in A0) */
 static void gen_op(DisasContext *s1, int op, int ot, int d)
 {
+#ifdef TCG_HAS_QEMU_ATOMIC
+    if (s1->atomic && d == OR_TMP0) {
+        gen_op_atomic(s1, op, ot);
+        return;
+    }
+#endif
     if (d != OR_TMP0) {
         gen_op_mov_TN_reg(ot, 0, d);
     } else {
@@ -1426,10 +1650,17 @@ static void gen_op(DisasContext *s1, int op, int ot, int d)
 /* if d == OR_TMP0, it means memory operand (address in A0) */
 static void gen_inc(DisasContext *s1, int ot, int d, int c)
 {
-    if (d != OR_TMP0)
+    if (d != OR_TMP0) {
         gen_op_mov_TN_reg(ot, 0, d);
-    else
+#ifdef TCG_HAS_QEMU_ATOMIC
+    } else if (s1->atomic) {
+        tcg_gen_movi_tl(cpu_tmp0, c > 0 ? 1 : -1);
+        tcg_gen_qemu_xadd(cpu_T[0], cpu_A0, cpu_tmp0, ot);
+        gen_smc_check(cpu_A0);
+#endif
+    } else {
         gen_op_ld_T0_A0(ot + s1->mem_index);
+    }
     if (s1->cc_op != CC_OP_DYNAMIC)
         gen_op_set_cc_op(s1->cc_op);
     if (c > 0) {
@@ -1441,7 +1672,7 @@ static void gen_inc(DisasContext *s1, int ot, int d, int c)
     }
     if (d != OR_TMP0)
         gen_op_mov_reg_T0(ot, d);
-    else
+    else if (!s1->atomic)
         gen_op_st_T0_A0(ot + s1->mem_index);
     gen_compute_eflags_c(cpu_cc_src);
     tcg_gen_mov_tl(cpu_cc_dst, cpu_T[0]);
@@ -2705,6 +2936,13 @@ static void gen_interrupt(DisasContext *s, int intno,
     gen_jmp_im(cur_eip);
     gen_helper_raise_interrupt(tcg_const_i32(intno),
                                tcg_const_i32(next_eip - cur_eip));
+#if defined(CONFIG_USER_ONLY)
+    /* the helper returns if it ran the system call in place */
+    if (intno == 0x80) {
+        gen_eob(s);
+        return;
+    }
+#endif
     s->is_jmp = DISAS_TB_JUMP;
 }
 
@@ -2770,6 +3008,7 @@ static inline void gen_stq_env_A0(int idx, int offset)
     int mem_index = (idx >> 2) - 1;
     tcg_gen_ld_i64(cpu_tmp1_i64, cpu_env, offset);
     tcg_gen_qemu_st64(cpu_tmp1_i64, cpu_A0, mem_index);
+    gen_smc_check(cpu_A0);
 }
 
 static inline void gen_ldo_env_A0(int idx, int offset)
@@ -2787,9 +3026,11 @@ static inline void gen_sto_env_A0(int idx, int offset)
     int mem_index = (idx >> 2) - 1;
     tcg_gen_ld_i64(cpu_tmp1_i64, cpu_env, offset + offsetof(XMMReg, XMM_Q(0)));
     tcg_gen_qemu_st64(cpu_tmp1_i64, cpu_A0, mem_index);
+    gen_smc_check(cpu_A0);
     tcg_gen_addi_tl(cpu_tmp0, cpu_A0, 8);
     tcg_gen_ld_i64(cpu_tmp1_i64, cpu_env, offset + offsetof(XMMReg, XMM_Q(1)));
     tcg_gen_qemu_st64(cpu_tmp1_i64, cpu_tmp0, mem_index);
+    gen_smc_check(cpu_tmp0);
 }
 
 static inline void gen_op_movo(int d_offset, int s_offset)
@@ -3844,18 +4085,22 @@ static void gen_sse(DisasContext *s, int b, target_ulong pc_start, int rex_r)
                                             xmm_regs[reg].XMM_B(val & 15)));
                     if (mod == 3)
                         gen_op_mov_reg_T0(ot, rm);
-                    else
+                    else {
                         tcg_gen_qemu_st8(cpu_T[0], cpu_A0,
-                                        (s->mem_index >> 2) - 1);
+                                            (s->mem_index >> 2) - 1);
+                        gen_smc_check(cpu_A0);
+                    }
                     break;
                 case 0x15: /* pextrw */
                     tcg_gen_ld16u_tl(cpu_T[0], cpu_env, offsetof(CPUX86State,
                                             xmm_regs[reg].XMM_W(val & 7)));
                     if (mod == 3)
                         gen_op_mov_reg_T0(ot, rm);
-                    else
+                    else {
                         tcg_gen_qemu_st16(cpu_T[0], cpu_A0,
-                                        (s->mem_index >> 2) - 1);
+                                            (s->mem_index >> 2) - 1);
+                        gen_smc_check(cpu_A0);
+                    }
                     break;
                 case 0x16:
                     if (ot == OT_LONG) { /* pextrd */
@@ -3865,9 +4110,11 @@ static void gen_sse(DisasContext *s, int b, target_ulong pc_start, int rex_r)
                         tcg_gen_extu_i32_tl(cpu_T[0], cpu_tmp2_i32);
                         if (mod == 3)
                             gen_op_mov_reg_v(ot, rm, cpu_T[0]);
-                        else
+                        else {
                             tcg_gen_qemu_st32(cpu_T[0], cpu_A0,
-                                            (s->mem_index >> 2) - 1);
+                                                (s->mem_index >> 2) - 1);
+                            gen_smc_check(cpu_A0);
+                        }
                     } else { /* pextrq */
 #ifdef TARGET_X86_64
                         tcg_gen_ld_i64(cpu_tmp1_i64, cpu_env,
@@ -3875,9 +4122,11 @@ static void gen_sse(DisasContext *s, int b, target_ulong pc_start, int rex_r)
                                                 xmm_regs[reg].XMM_Q(val & 1)));
                         if (mod == 3)
                             gen_op_mov_reg_v(ot, rm, cpu_tmp1_i64);
-                        else
+                        else {
                             tcg_gen_qemu_st64(cpu_tmp1_i64, cpu_A0,
-                                            (s->mem_index >> 2) - 1);
+                                                (s->mem_index >> 2) - 1);
+                            gen_smc_check(cpu_A0);
+                        }
 #else
                         goto illegal_op;
 #endif
@@ -3888,9 +4137,11 @@ static void gen_sse(DisasContext *s, int b, target_ulong pc_start, int rex_r)
                                             xmm_regs[reg].XMM_L(val & 3)));
                     if (mod == 3)
                         gen_op_mov_reg_T0(ot, rm);
-                    else
+                    else {
                         tcg_gen_qemu_st32(cpu_T[0], cpu_A0,
-                                        (s->mem_index >> 2) - 1);
+                                            (s->mem_index >> 2) - 1);
+                        gen_smc_check(cpu_A0);
+                    }
                     break;
                 case 0x20: /* pinsrb */
                     if (mod == 3)
@@ -4103,6 +4354,57 @@ static void gen_sse(DisasContext *s, int b, target_ulong pc_start, int rex_r)
     }
 }
 
+#ifdef TCG_HAS_QEMU_ATOMIC
+/* Return nonzero if the LOCK-prefixed instruction whose opcode byte b
+   has just been read is done with host atomic operations (see
+   gen_op_atomic; cmpxchg8b/16b use them in their helpers).  That is
+   every form that may legally take the prefix, so that none of them
+   relies on the global lock, which would not exclude the others.  */
+static int lock_is_atomic(DisasContext *s, int b)
+{
+    int modrm, op;
+
+    if (b == 0x0f) {
+        b = ldub_code(s->pc) | 0x100;
+        modrm = ldub_code(s->pc + 1);
+    } else {
+        modrm = ldub_code(s->pc);
+    }
+    if (((modrm >> 6) & 3) == 3) {
+        return 0;
+    }
+    op = (modrm >> 3) & 7;
+    switch(b) {
+    case 0x00 ... 0x01: /* add Ev, Gv */
+    case 0x08 ... 0x09: /* or */
+    case 0x10 ... 0x11: /* adc */
+    case 0x18 ... 0x19: /* sbb */
+    case 0x20 ... 0x21: /* and */
+    case 0x28 ... 0x29: /* sub */
+    case 0x30 ... 0x31: /* xor */
+    case 0x86 ... 0x87: /* xchg */
+    case 0x1ab: /* bts */
+    case 0x1b3: /* btr */
+    case 0x1bb: /* btc */
+    case 0x1b0 ... 0x1b1: /* cmpxchg */
+    case 0x1c0 ... 0x1c1: /* xadd */
+        return 1;
+    case 0x80 ... 0x83: /* GRP1 */
+        return op != OP_CMPL;
+    case 0xf6 ... 0xf7: /* not, neg */
+        return op == 2 || op == 3;
+    case 0xfe ... 0xff: /* inc, dec */
+        return op == 0 || op == 1;
+    case 0x1ba: /* bts, btr, btc Ev, Ib */
+        return op >= 5;
+    case 0x1c7: /* cmpxchg8b/16b */
+        return op == 1;
+    default:
+        return 0;
+    }
+}
+#endif
+
 /* convert one instruction. s->is_jmp is set if the translation must
    be stopped. Return the next pc value */
 static target_ulong disas_insn(CPUState *env, DisasContext *s, target_ulong pc_start)
@@ -4235,8 +4537,14 @@ static target_ulong disas_insn(CPUState *env, DisasContext *s, target_ulong pc_s
     s->dflag = dflag;
 
     /* lock generation */
-    if (prefixes & PREFIX_LOCK)
-        gen_helper_lock();
+    s->atomic = 0;
+    if (prefixes & PREFIX_LOCK) {
+#ifdef TCG_HAS_QEMU_ATOMIC
+        s->atomic = lock_is_atomic(s, b);
+#endif
+        if (!s->atomic)
+            gen_helper_lock();
+    }
 
     /* now check op code */
  reswitch:
@@ -4385,6 +4693,13 @@ static target_ulong disas_insn(CPUState *env, DisasContext *s, target_ulong pc_s
             if (op == 0)
                 s->rip_offset = insn_const_size(ot);
             gen_lea_modrm(s, modrm, &reg_addr, &offset_addr);
+#ifdef TCG_HAS_QEMU_ATOMIC
+            if (s->atomic) {
+                /* not or neg, see lock_is_atomic */
+                gen_op_atomic(s, op == 2 ? OP_NOTL : OP_NEGL, ot);
+                break;
+            }
+#endif
             gen_op_ld_T0_A0(ot + s->mem_index);
         } else {
             gen_op_mov_TN_reg(ot, 0, rm);
@@ -4879,9 +5194,18 @@ static target_ulong disas_insn(CPUState *env, DisasContext *s, target_ulong pc_s
         } else {
             gen_lea_modrm(s, modrm, &reg_addr, &offset_addr);
             gen_op_mov_TN_reg(ot, 0, reg);
-            gen_op_ld_T1_A0(ot + s->mem_index);
-            gen_op_addl_T0_T1();
-            gen_op_st_T0_A0(ot + s->mem_index);
+#ifdef TCG_HAS_QEMU_ATOMIC
+            if (s->atomic) {
+                tcg_gen_qemu_xadd(cpu_T[1], cpu_A0, cpu_T[0], ot);
+                gen_smc_check(cpu_A0);
+                gen_op_addl_T0_T1();
+            } else
+#endif
+            {
+                gen_op_ld_T1_A0(ot + s->mem_index);
+                gen_op_addl_T0_T1();
+                gen_op_st_T0_A0(ot + s->mem_index);
+            }
             gen_op_mov_reg_T1(ot, reg);
         }
         gen_op_update2_cc();
@@ -4911,14 +5235,24 @@ static target_ulong disas_insn(CPUState *env, DisasContext *s, target_ulong pc_s
             } else {
                 gen_lea_modrm(s, modrm, &reg_addr, &offset_addr);
                 tcg_gen_mov_tl(a0, cpu_A0);
-                gen_op_ld_v(ot + s->mem_index, t0, a0);
+#ifdef TCG_HAS_QEMU_ATOMIC
+                if (s->atomic) {
+                    tcg_gen_qemu_cmpxchg(t0, a0, cpu_regs[R_EAX], t1, ot);
+                    gen_smc_check(a0);
+                } else
+#endif
+                    gen_op_ld_v(ot + s->mem_index, t0, a0);
                 rm = 0; /* avoid warning */
             }
             label1 = gen_new_label();
             tcg_gen_sub_tl(t2, cpu_regs[R_EAX], t0);
             gen_extu(ot, t2);
             tcg_gen_brcondi_tl(TCG_COND_EQ, t2, 0, label1);
-            if (mod == 3) {
+            if (s->atomic) {
+                /* memory already updated by the cmpxchg */
+                gen_op_mov_reg_v(ot, R_EAX, t0);
+                gen_set_label(label1);
+            } else if (mod == 3) {
                 label2 = gen_new_label();
                 gen_op_mov_reg_v(ot, R_EAX, t0);
                 tcg_gen_br(label2);
@@ -5359,6 +5693,10 @@ static target_ulong disas_insn(CPUState *env, DisasContext *s, target_ulong pc_s
         } else {
             gen_lea_modrm(s, modrm, &reg_addr, &offset_addr);
             gen_op_mov_TN_reg(ot, 0, reg);
+#ifdef TCG_HAS_QEMU_ATOMIC
+            tcg_gen_qemu_xchg(cpu_T[1], cpu_A0, cpu_T[0], ot);
+            gen_smc_check(cpu_A0);
+#else
             /* for xchg, lock is implicit */
             if (!(prefixes & PREFIX_LOCK))
                 gen_helper_lock();
@@ -5366,6 +5704,7 @@ static target_ulong disas_insn(CPUState *env, DisasContext *s, target_ulong pc_s
             gen_op_st_T0_A0(ot + s->mem_index);
             if (!(prefixes & PREFIX_LOCK))
                 gen_helper_unlock();
+#endif
             gen_op_mov_reg_T1(ot, reg);
         }
         break;
@@ -5595,6 +5934,7 @@ static target_ulong disas_insn(CPUState *env, DisasContext *s, target_ulong pc_s
                         gen_helper_fisttll_ST0(cpu_tmp1_i64);
                         tcg_gen_qemu_st64(cpu_tmp1_i64, cpu_A0,
                                           (s->mem_index >> 2) - 1);
+                        gen_smc_check(cpu_A0);
                         break;
                     case 3:
                     default:
@@ -5621,6 +5961,7 @@ static target_ulong disas_insn(CPUState *env, DisasContext *s, target_ulong pc_s
                         gen_helper_fstl_ST0(cpu_tmp1_i64);
                         tcg_gen_qemu_st64(cpu_tmp1_i64, cpu_A0,
                                           (s->mem_index >> 2) - 1);
+                        gen_smc_check(cpu_A0);
                         break;
                     case 3:
                     default:
@@ -5709,6 +6050,7 @@ static target_ulong disas_insn(CPUState *env, DisasContext *s, target_ulong pc_s
                 gen_helper_fistll_ST0(cpu_tmp1_i64);
                 tcg_gen_qemu_st64(cpu_tmp1_i64, cpu_A0,
                                   (s->mem_index >> 2) - 1);
+                gen_smc_check(cpu_A0);
                 gen_helper_fpop();
                 break;
             default:
@@ -6545,7 +6887,8 @@ static target_ulong disas_insn(CPUState *env, DisasContext *s, target_ulong pc_s
         if (mod != 3) {
             s->rip_offset = 1;
             gen_lea_modrm(s, modrm, &reg_addr, &offset_addr);
-            gen_op_ld_T0_A0(ot + s->mem_index);
+            if (!s->atomic)
+                gen_op_ld_T0_A0(ot + s->mem_index);
         } else {
             gen_op_mov_TN_reg(ot, 0, rm);
         }
@@ -6581,12 +6924,20 @@ static target_ulong disas_insn(CPUState *env, DisasContext *s, target_ulong pc_s
             tcg_gen_sari_tl(cpu_tmp0, cpu_T[1], 3 + ot);
             tcg_gen_shli_tl(cpu_tmp0, cpu_tmp0, ot);
             tcg_gen_add_tl(cpu_A0, cpu_A0, cpu_tmp0);
-            gen_op_ld_T0_A0(ot + s->mem_index);
+            if (!s->atomic)
+                gen_op_ld_T0_A0(ot + s->mem_index);
         } else {
             gen_op_mov_TN_reg(ot, 0, rm);
         }
     bt_op:
         tcg_gen_andi_tl(cpu_T[1], cpu_T[1], (1 << (3 + ot)) - 1);
+#ifdef TCG_HAS_QEMU_ATOMIC
+        if (s->atomic) {
+            /* bts, btr or btc */
+            gen_op_atomic(s, OP_BTSL + op - 1, ot);
+            break;
+        }
+#endif
         switch(op) {
         case 0:
             tcg_gen_shr_tl(cpu_cc_src, cpu_T[0], cpu_T[1]);
@@ -7690,11 +8041,11 @@ static target_ulong disas_insn(CPUState *env, DisasContext *s, target_ulong pc_s
         goto illegal_op;
     }
     /* lock generation */
-    if (s->prefix & PREFIX_LOCK)
+    if ((s->prefix & PREFIX_LOCK) && !s->atomic)
         gen_helper_unlock();
     return s->pc;
  illegal_op:
-    if (s->prefix & PREFIX_LOCK)
+    if ((s->prefix & PREFIX_LOCK) && !s->atomic)
         gen_helper_unlock();
     /* XXX: ensure that no lock was generated */
     gen_exception(s, EXCP06_ILLOP, pc_start - s->cs_base);
@@ -7792,6 +8143,8 @@ static inline void gen_intermediate_code_internal(CPUState *env,
     target_ulong cs_base;
     int num_insns;
     int max_insns;
+    uint16_t *insn_opc_ptr;
+    TCGArg *insn_opparam_ptr;
 
     /* generate intermediate code */
     pc_start = tb->pc;
@@ -7855,6 +8208,14 @@ static inline void gen_intermediate_code_internal(CPUState *env,
     cpu_ptr0 = tcg_temp_new_ptr();
     cpu_ptr1 = tcg_temp_new_ptr();
 
+    smc_check_tb = NULL;
+    if (tb->cflags & CF_SMC_CHECK) {
+        smc_check_tb = tb;
+        cpu_smc_hit = tcg_temp_local_new();
+        tcg_gen_movi_tl(cpu_smc_hit, 0);
+        smc_nb_checks = 0;
+    }
+
     gen_opc_end = gen_opc_buf + OPC_MAX_SIZE;
 
     dc->is_jmp = DISAS_NEXT;
@@ -7891,11 +8252,32 @@ static inline void gen_intermediate_code_internal(CPUState *env,
         if (num_insns + 1 == max_insns && (tb->cflags & CF_LAST_IO))
             gen_io_start();
 
+        insn_opc_ptr = gen_opc_ptr;
+        insn_opparam_ptr = gen_opparam_ptr;
         pc_ptr = disas_insn(env, dc, pc_ptr);
         num_insns++;
         /* stop translation if indicated */
         if (dc->is_jmp)
             break;
+        /* self checking TBs are only compared with the guest code on
+           entry, so one that may have stored into its own code must
+           end with that instruction */
+        if (smc_check_tb) {
+            if (tcg_ops_call_may_store(insn_opc_ptr, insn_opparam_ptr)) {
+                gen_jmp_im(pc_ptr - dc->cs_base);
+                gen_eob(dc);
+                break;
+            }
+            if (smc_nb_checks) {
+                int l1 = gen_new_label();
+                tcg_gen_brcondi_tl(TCG_COND_EQ, cpu_smc_hit, 0, l1);
+                gen_jmp_im(pc_ptr - dc->cs_base);
+                gen_eob(dc);
+                gen_set_label(l1);
+                dc->is_jmp = DISAS_NEXT;
+                smc_nb_checks = 0;
+            }
+        }
         /* if single step mode, we generate only one instruction and
            generate an exception */
         /* if irq were inhibited with HF_INHIBIT_IRQ_MASK, we clear
@@ -7968,7 +8350,8 @@ void gen_intermediate_code_pc(CPUState *env, TranslationBlock *tb)
 void gen_pc_load(CPUState *env, TranslationBlock *tb,
                 unsigned long searched_pc, int pc_pos, void *puc)
 {
-    int cc_op;
+    target_ulong data[TARGET_RESTORE_WORDS];
+
 #ifdef DEBUG_DISAS
     if (qemu_loglevel_mask(CPU_LOG_TB_OP)) {
         int i;
@@ -7983,8 +8366,23 @@ void gen_pc_load(CPUState *env, TranslationBlock *tb,
                 (uint32_t)tb->cs_base);
     }
 #endif
-    env->eip = gen_opc_pc[pc_pos] - tb->cs_base;
-    cc_op = gen_opc_cc_op[pc_pos];
+    gen_pc_save(tb, pc_pos, data);
+    gen_pc_restore(env, tb, data);
+}
+
+void gen_pc_save(TranslationBlock *tb, int pc_pos, target_ulong *data)
+{
+    data[0] = gen_opc_pc[pc_pos];
+    data[1] = gen_opc_cc_op[pc_pos];
+}
+
+void gen_pc_restore(CPUState *env, TranslationBlock *tb,
+                    const target_ulong *data)
+{
+    int cc_op;
+
+    env->eip = data[0] - tb->cs_base;
+    cc_op = data[1];
     if (cc_op != CC_OP_DYNAMIC)
         env->cc_op = cc_op;
 }
@@ -249,6 +249,7 @@ static inline int tcg_target_const_match(tcg_target_long val,
 #define OPC_ADD_GvEv	(OPC_ARITH_GvEv | (ARITH_ADD << 3))
 #define OPC_BSWAP	(0xc8 | P_EXT)
 #define OPC_CALL_Jz	(0xe8)
+#define OPC_CMPXCHG_EvGv (0xb1 | P_EXT)
 #define OPC_CMP_GvEv	(OPC_ARITH_GvEv | (ARITH_CMP << 3))
 #define OPC_DEC_r32	(0x48)
 #define OPC_IMUL_GvEv	(0xaf | P_EXT)
@@ -260,6 +261,7 @@ static inline int tcg_target_const_match(tcg_target_long val,
 #define OPC_JMP_long	(0xe9)
 #define OPC_JMP_short	(0xeb)
 #define OPC_LEA         (0x8d)
+#define OPC_LOCK	(0xf0)		/* prefix */
 #define OPC_MOVB_EvGv	(0x88)		/* stores, more or less */
 #define OPC_MOVL_EvGv	(0x89)		/* stores, more or less */
 #define OPC_MOVL_GvEv	(0x8b)		/* loads, more or less */
@@ -280,7 +282,9 @@ static inline int tcg_target_const_match(tcg_target_long val,
 #define OPC_SHIFT_Ib	(0xc1)
 #define OPC_SHIFT_cl	(0xd3)
 #define OPC_TESTL	(0x85)
+#define OPC_XADD_EvGv	(0xc1 | P_EXT)
 #define OPC_XCHG_ax_r32	(0x90)
+#define OPC_XCHG_EvGv	(0x87)
 
 #define OPC_GRP3_Ev	(0xf7)
 #define OPC_GRP5	(0xff)
@@ -1429,6 +1433,56 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
 #endif
 }
 
+#ifdef TCG_HAS_QEMU_ATOMIC
+/* Emit a locked read-modify-write of guest memory.  OPC is the Ev,Gv
+   form of xadd, xchg or cmpxchg, with DATAREG as its Gv operand.  The
+   old memory contents end up in RETREG, which is DATAREG for xadd and
+   xchg and EAX for cmpxchg.  */
+static void tcg_out_qemu_atomic(TCGContext *s, int opc, int retreg,
+                                int datareg, int addrreg, int sizeop)
+{
+    int32_t offset = GUEST_BASE;
+    int base = addrreg;
+
+    /* As for qemu_ld/st, the guest address is assumed zero extended.  */
+    if (offset != GUEST_BASE) {
+        tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_RDI, GUEST_BASE);
+        tgen_arithr(s, ARITH_ADD + P_REXW, TCG_REG_RDI, base);
+        base = TCG_REG_RDI, offset = 0;
+    }
+
+    switch (sizeop) {
+    case 0:
+        /* the byte forms are the opcode minus one */
+        opc = (opc - 1) | P_REXB_R;
+        break;
+    case 1:
+        opc |= P_DATA16;
+        break;
+    case 3:
+        opc |= P_REXW;
+        break;
+    }
+
+    /* redundant but harmless for xchg */
+    tcg_out8(s, OPC_LOCK);
+    tcg_out_modrm_offset(s, opc, datareg, base, offset);
+
+    switch (sizeop) {
+    case 0:
+        tcg_out_ext8u(s, retreg, retreg);
+        break;
+    case 1:
+        tcg_out_ext16u(s, retreg, retreg);
+        break;
+    case 2:
+        /* a successful cmpxchg leaves the upper half of RAX alone */
+        tcg_out_ext32u(s, retreg, retreg);
+        break;
+    }
+}
+#endif
+
 static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
                               const TCGArg *args, const int *const_args)
 {
@@ -1452,6 +1506,12 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
     case INDEX_op_goto_tb:
         if (s->tb_jmp_offset) {
             /* direct jump method */
+            /* keep the 32-bit displacement aligned, so that
+               tb_set_jmp_target1() patches it with one atomic store even
+               while another thread may be executing this TB */
+            while (((tcg_target_long)s->code_ptr + 1) & 3) {
+                tcg_out8(s, 0x90); /* nop */
+            }
             tcg_out8(s, OPC_JMP_long); /* jmp im */
             s->tb_jmp_offset[args[0]] = s->code_ptr - s->code_buf;
             tcg_out32(s, 0);
@@ -1676,6 +1736,21 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
         tcg_out_qemu_st(s, args, 3);
         break;
 
+#ifdef TCG_HAS_QEMU_ATOMIC
+    case INDEX_op_qemu_xadd:
+        tcg_out_qemu_atomic(s, OPC_XADD_EvGv, args[0], args[0], args[1],
+                            args[3]);
+        break;
+    case INDEX_op_qemu_xchg:
+        tcg_out_qemu_atomic(s, OPC_XCHG_EvGv, args[0], args[0], args[1],
+                            args[3]);
+        break;
+    case INDEX_op_qemu_cmpxchg:
+        tcg_out_qemu_atomic(s, OPC_CMPXCHG_EvGv, args[0], args[3], args[1],
+                            args[4]);
+        break;
+#endif
+
 #if TCG_TARGET_REG_BITS == 32
     case INDEX_op_brcond2_i32:
         tcg_out_brcond2(s, args, const_args, 0);
@@ -1869,6 +1944,12 @@ static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_qemu_st16, { "L", "L" } },
     { INDEX_op_qemu_st32, { "L", "L" } },
     { INDEX_op_qemu_st64, { "L", "L" } },
+
+#ifdef TCG_HAS_QEMU_ATOMIC
+    { INDEX_op_qemu_xadd, { "L", "L", "0" } },
+    { INDEX_op_qemu_xchg, { "L", "L", "0" } },
+    { INDEX_op_qemu_cmpxchg, { "a", "L", "0", "L" } },
+#endif
 #elif TARGET_LONG_BITS <= TCG_TARGET_REG_BITS
     { INDEX_op_qemu_ld8u, { "r", "L" } },
     { INDEX_op_qemu_ld8s, { "r", "L" } },
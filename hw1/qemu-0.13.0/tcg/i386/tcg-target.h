@@ -114,6 +114,11 @@ enum {
 
 #define TCG_TARGET_HAS_GUEST_BASE
 
+#if TCG_TARGET_REG_BITS == 64
+/* qemu_xadd, qemu_xchg and qemu_cmpxchg (user mode only) */
+#define TCG_TARGET_HAS_qemu_atomic
+#endif
+
 /* Note: must be synced with dyngen-exec.h */
 #if TCG_TARGET_REG_BITS == 64
 # define TCG_AREG0 TCG_REG_R14
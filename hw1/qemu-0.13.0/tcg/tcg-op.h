@@ -2310,6 +2310,36 @@ static inline void tcg_gen_qemu_st64(TCGv_i64 arg, TCGv addr, int mem_index)
     tcg_gen_qemu_ldst_op_i64(INDEX_op_qemu_st64, arg, addr, mem_index);
 }
 
+#ifdef TCG_HAS_QEMU_ATOMIC
+#if TARGET_LONG_BITS == 32
+#define tcg_gen_qemu_atomic_op tcg_gen_op4i_i32
+#define tcg_gen_qemu_atomic_op2 tcg_gen_op5i_i32
+#else
+#define tcg_gen_qemu_atomic_op tcg_gen_op4i_i64
+#define tcg_gen_qemu_atomic_op2 tcg_gen_op5i_i64
+#endif
+
+/* Atomically add val to the (8 << size) bit guest word at addr.  */
+static inline void tcg_gen_qemu_xadd(TCGv ret, TCGv addr, TCGv val, int size)
+{
+    tcg_gen_qemu_atomic_op(INDEX_op_qemu_xadd, ret, addr, val, size);
+}
+
+/* Atomically store val to the guest word at addr.  */
+static inline void tcg_gen_qemu_xchg(TCGv ret, TCGv addr, TCGv val, int size)
+{
+    tcg_gen_qemu_atomic_op(INDEX_op_qemu_xchg, ret, addr, val, size);
+}
+
+/* Atomically store newv to the guest word at addr if it contains cmpv.  */
+static inline void tcg_gen_qemu_cmpxchg(TCGv ret, TCGv addr, TCGv cmpv,
+                                        TCGv newv, int size)
+{
+    tcg_gen_qemu_atomic_op2(INDEX_op_qemu_cmpxchg, ret, addr, cmpv, newv,
+                            size);
+}
+#endif
+
 #define tcg_gen_ld_ptr tcg_gen_ld_i64
 #define tcg_gen_discard_ptr tcg_gen_discard_i64
 
@@ -825,6 +825,35 @@ static const char * const cond_name[] =
     [TCG_COND_GTU] = "gtu"
 };
 
+/* Returns 1 if one of the ops from opc_ptr (with its arguments at args)
+   to the current end of the op buffer calls a helper that is neither
+   pure nor const, and so may write guest memory.  */
+int tcg_ops_call_may_store(const uint16_t *opc_ptr, const TCGArg *args)
+{
+    const TCGOpDef *def;
+    TCGOpcode c;
+    int nb_oargs, nb_iargs;
+
+    while (opc_ptr < gen_opc_ptr) {
+        c = *opc_ptr++;
+        def = &tcg_op_defs[c];
+        if (c == INDEX_op_call) {
+            nb_oargs = args[0] >> 16;
+            nb_iargs = args[0] & 0xffff;
+            if (!(args[1 + nb_oargs + nb_iargs] &
+                  (TCG_CALL_PURE | TCG_CALL_CONST))) {
+                return 1;
+            }
+            args += 1 + nb_oargs + nb_iargs + def->nb_cargs;
+        } else if (c == INDEX_op_nopn) {
+            args += args[0];
+        } else {
+            args += def->nb_oargs + def->nb_iargs + def->nb_cargs;
+        }
+    }
+    return 0;
+}
+
 void tcg_dump_ops(TCGContext *s, FILE *outfile)
 {
     const uint16_t *opc_ptr;
@@ -47,6 +47,15 @@ typedef uint64_t TCGRegSet;
 #error unsupported
 #endif
 
+/* Atomic read-modify-write of guest memory needs direct access to it
+   (user mode emulation), a guest address that fits a host register and
+   guest and host agreeing on byte order.  */
+#if defined(TCG_TARGET_HAS_qemu_atomic) && !defined(CONFIG_SOFTMMU) && \
+    TARGET_LONG_BITS <= TCG_TARGET_REG_BITS && \
+    !defined(TARGET_WORDS_BIGENDIAN)
+#define TCG_HAS_QEMU_ATOMIC
+#endif
+
 typedef enum TCGOpcode {
 #define DEF(name, oargs, iargs, cargs, flags) INDEX_op_ ## name,
 #include "tcg-opc.h"
@@ -474,6 +483,7 @@ void tcg_gen_shifti_i64(TCGv_i64 ret, TCGv_i64 arg1,
 void tcg_register_helper(void *func, const char *name);
 const char *tcg_helper_get_name(TCGContext *s, void *func);
 void tcg_dump_ops(TCGContext *s, FILE *outfile);
+int tcg_ops_call_may_store(const uint16_t *opc_ptr, const TCGArg *args);
 
 void dump_ops(const uint16_t *opc_buf, const TCGArg *opparam_buf);
 TCGv_i32 tcg_const_i32(int32_t val);
@@ -100,7 +100,10 @@ int cpu_gen_code(CPUState *env, TranslationBlock *tb, int *gen_code_size_ptr)
 #endif
 
 #ifdef ENABLE_OPTIMIZATION_SHACK
-    shack_set_shadow(env, tb->pc, (unsigned long *)tb->tc_ptr);
+    /* returns must not bypass the check of self checking TBs */
+    if (!(tb->cflags & CF_SMC_CHECK)) {
+        shack_set_shadow(env, tb->pc, (unsigned long *)tb->tc_ptr);
+    }
 #endif
 
 #ifdef DEBUG_DISAS
@@ -114,22 +117,65 @@ int cpu_gen_code(CPUState *env, TranslationBlock *tb, int *gen_code_size_ptr)
     return 0;
 }
 
-/* The cpu state corresponding to 'searched_pc' is restored.
- */
-int cpu_restore_state(TranslationBlock *tb,
-                      CPUState *env, unsigned long searched_pc,
-                      void *puc)
+#ifdef TARGET_RESTORE_WORDS
+/* Retranslating a TB to find the guest state at a host PC costs as much
+   as translating it in the first place.  Guests that take faults on
+   purpose (write barriers, guard pages) hit the same few host PCs over
+   and over, so remember the result for each of them.  */
+#define RESTORE_CACHE_BITS 8
+#define RESTORE_CACHE_SIZE (1 << RESTORE_CACHE_BITS)
+
+typedef struct RestoreCacheEntry {
+    TranslationBlock *tb;
+    unsigned long searched_pc;
+    uint16_t icount;
+    target_ulong data[TARGET_RESTORE_WORDS];
+} RestoreCacheEntry;
+
+static RestoreCacheEntry restore_cache[RESTORE_CACHE_SIZE];
+static int restore_hit_count;
+static int restore_miss_count;
+
+static inline unsigned int restore_cache_hash(unsigned long searched_pc)
+{
+    return (searched_pc ^ (searched_pc >> RESTORE_CACHE_BITS))
+           & (RESTORE_CACHE_SIZE - 1);
+}
+
+/* Called whenever a TranslationBlock may be reused for other code.  */
+void restore_cache_flush(void)
+{
+    memset(restore_cache, 0, sizeof(restore_cache));
+}
+
+void dump_restore_info(FILE *f,
+                       int (*cpu_fprintf)(FILE *f, const char *fmt, ...))
+{
+    cpu_fprintf(f, "Restore cache hits  %d (misses %d)\n",
+                restore_hit_count, restore_miss_count);
+}
+#else
+void restore_cache_flush(void)
+{
+}
+
+void dump_restore_info(FILE *f,
+                       int (*cpu_fprintf)(FILE *f, const char *fmt, ...))
+{
+}
+#endif
+
+static int cpu_restore_state_slow(TranslationBlock *tb,
+                                  CPUState *env, unsigned long searched_pc,
+                                  void *puc)
 {
     TCGContext *s = &tcg_ctx;
     int j;
     unsigned long tc_ptr;
-#ifdef CONFIG_PROFILER
-    int64_t ti;
+#ifdef TARGET_RESTORE_WORDS
+    RestoreCacheEntry *e;
 #endif
 
-#ifdef CONFIG_PROFILER
-    ti = profile_getclock();
-#endif
     tcg_func_start(s);
 
     gen_intermediate_code_pc(env, tb);
@@ -162,11 +208,59 @@ int cpu_restore_state(TranslationBlock *tb,
         j--;
     env->icount_decr.u16.low -= gen_opc_icount[j];
 
+#ifdef TARGET_RESTORE_WORDS
+    e = &restore_cache[restore_cache_hash(searched_pc)];
+    e->tb = tb;
+    e->searched_pc = searched_pc;
+    e->icount = gen_opc_icount[j];
+    gen_pc_save(tb, j, e->data);
+    gen_pc_restore(env, tb, e->data);
+#else
     gen_pc_load(env, tb, searched_pc, j, puc);
+#endif
+    return 0;
+}
+
+/* The cpu state corresponding to 'searched_pc' is restored.
+ */
+int cpu_restore_state(TranslationBlock *tb,
+                      CPUState *env, unsigned long searched_pc,
+                      void *puc)
+{
+    int ret;
+#ifdef TARGET_RESTORE_WORDS
+    RestoreCacheEntry *e;
+#endif
+#ifdef CONFIG_PROFILER
+    int64_t ti;
+#endif
 
 #ifdef CONFIG_PROFILER
-    s->restore_time += profile_getclock() - ti;
-    s->restore_count++;
+    ti = profile_getclock();
 #endif
-    return 0;
+    /* tcg_ctx and the gen_opc_* arrays are shared with the translator */
+    tb_lock_enter();
+#ifdef TARGET_RESTORE_WORDS
+    e = &restore_cache[restore_cache_hash(searched_pc)];
+    if (e->tb == tb && e->searched_pc == searched_pc) {
+        if (use_icount) {
+            env->icount_decr.u16.low += tb->icount;
+            env->can_do_io = 0;
+        }
+        env->icount_decr.u16.low -= e->icount;
+        gen_pc_restore(env, tb, e->data);
+        restore_hit_count++;
+        tb_lock_leave();
+        return 0;
+    }
+    restore_miss_count++;
+#endif
+    ret = cpu_restore_state_slow(tb, env, searched_pc, puc);
+    tb_lock_leave();
+
+#ifdef CONFIG_PROFILER
+    tcg_ctx.restore_time += profile_getclock() - ti;
+    tcg_ctx.restore_count++;
+#endif
+    return ret;
 }